@@ -9,211 +9,1724 @@
 #include "PDCIImage.h"
 #include "highgui.h"
 #include "PoissonBlending.h"
-#include "retrieval_framework_2012\shared\descriptors\gist_helper.hpp"
 #include <algorithm>
 #include <cmath>
+#include <limits>
 #include <opencv2/core/core.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
 #include <iostream>
 #include <fstream>
 
-void InitFilter(std::vector<cv::Mat_<std::complex<double>>>* _filters);
 
-std::ifstream m_meanFileHandle;
-std::ifstream m_varianceFileHandle;
-std::ifstream m_fileListHandle;
+bool CPDCIImage::LoadImageFromFile(char* path)
+{
+	m_inputImage = cv::imread(path, 1 /*CV_LOAD_IMAGE_UNCHANGED*/);
+
+	if(m_inputImage.data == NULL)
+		return false;
+
+	//show input image
+	cv::namedWindow( "input image", CV_WINDOW_AUTOSIZE );
+	cv::imshow( "input image", m_inputImage );
+
+	return true;
+}
+
+//loads the mask from a file
+//note: mask file needs to have same resolution as input image
+//usage: black means, take pixels from input image, white means, 
+//		 this is the region where we want to complete the scene from other images
+bool CPDCIImage::LoadMaskFromFile(char* path)
+{
+	m_mask = cv::imread(path, CV_LOAD_IMAGE_GRAYSCALE);
+
+	if(m_mask.data == NULL)
+		return false;
+
+	//show mask
+	cv::namedWindow( "mask", CV_WINDOW_AUTOSIZE );
+	cv::imshow( "mask", m_mask);
+	//cvWaitKey(0);	//DEBUG
+
+	return true;
+}
+
+bool CPDCIImage::Cleanup()
+{	
+	m_inputImage.release();
+	m_mask.release();
+
+	//clear the similar images
+	for(vector<cv::Mat>::iterator it = m_similarImages.begin(); it != m_similarImages.end(); it++)
+	{
+		(*it).release();		
+    }
+
+	while(m_similarImages.size() != 0)
+		m_similarImages.pop_back();
+
+	//clear the output images
+	for(vector<cv::Mat>::iterator it = m_outputImages.begin(); it != m_outputImages.end(); it++)
+	{
+		(*it).release();
+    }
+
+	while(m_outputImages.size() != 0)
+		m_outputImages.pop_back();
+
+	m_GIST.clear();
+
+	return true;
+}
+
+double CPDCIImage::CalcSimilarity(GistDescriptor* descrA, GistDescriptor* descrB)
+{
+	double dissimilarity = 0.0;
+	//L1 distance
+	//loop: fr jedes tile/patch
+	for(int i=0; i<NUM_FREQS; i++)
+		for(int j=0; j<NUM_ORIENTS; j++)
+			for(int y=0; y<NUM_Y_TILES; y++)
+				for(int x=0; x<NUM_X_TILES; x++)
+				{
+					dissimilarity += m_maskOverlap[y][x]*(abs(descrA->m_mean[i][j][y][x] - descrB->m_mean[i][j][y][x])
+						+ abs(descrA->m_variance[i][j][y][x] - descrB->m_variance[i][j][y][x]));
+				}
+
+	descrA->m_dissimilarity = dissimilarity;	
+	//cout << dissimilarity << endl; //DEBUG
+
+	return dissimilarity;
+}
+
+//same L1 distance as above, for count consecutive records of a float gist db (either
+//layout), summed tile by tile in the order of m_weightedTiles, i.e. by descending mask
+//weight. tiles without weight are not read at all. after every tile the records whose
+//partial distance already reaches cutoff are abandoned, their dissimilarity is then only
+//a lower bound (>= cutoff). record layout: [tile][filter][mean, variance], see gist_db.hpp
+//uses the fastest simd kernel of the cpu, see gist_distance.hpp
+//with mirrored the records are compared as if their images were flipped horizontally
+//(the flipped input against the records, see PackInputGIST)
+//count must not exceed GIST_SCAN_BLOCK_SIZE, returns the number of floats read
+size_t CPDCIImage::CalcSimilarityByTile(size_t first, size_t count, float cutoff, bool mirrored, float* dissimilarities)
+{
+	const std::vector<float>& query = mirrored ? m_mirroredRecord : m_inputRecord;
+	const std::vector<float>& weights = mirrored ? m_mirroredWeights : m_recordWeights;
+	const std::vector<size_t>& tiles = mirrored ? m_mirroredTiles : m_weightedTiles;
+	const size_t tileFloats = m_gistDB.geometry().tile_floats();
+	const bool tileMajor = (m_gistDB.layout() == imdb::gist_db_tile_major);
+	const size_t stride = (tileMajor ? m_gistDB.tile_stride() : m_gistDB.stride())/sizeof(float);
+	float tileDissimilarities[GIST_SCAN_BLOCK_SIZE];
+	size_t floatsRead = 0;
+	size_t numAlive = count;
+
+	std::fill(dissimilarities, dissimilarities + count, 0.0f);
+	for(size_t i=0; i<tiles.size() && numAlive>0; i++)
+	{
+		size_t tile = tiles[i];
+		numAlive = 0;
+
+		//the records that are still below the cutoff, in runs of consecutive records
+		for(size_t begin=0; begin<count; )
+		{
+			if(dissimilarities[begin] >= cutoff)
+			{
+				begin++;
+				continue;
+			}
+
+			size_t end = begin + 1;
+			while(end < count && dissimilarities[end] < cutoff)
+				end++;
+
+			const float* records = tileMajor ? m_gistDB.tile(tile, first + begin) : m_gistDB.record(first + begin) + tile*tileFloats;
+			imdb::gist_weighted_l1(&query[tile*tileFloats], &weights[tile*tileFloats], records,
+				stride, tileFloats, end - begin, tileDissimilarities);
+
+			for(size_t k=begin; k<end; k++)
+			{
+				dissimilarities[k] += tileDissimilarities[k - begin];
+				if(dissimilarities[k] < cutoff)
+					numAlive++;
+			}
+
+			floatsRead += (end - begin)*tileFloats;
+			begin = end;
+		}
+	}
+
+	return floatsRead;
+}
+
+//approximate distances for a uint8 quantized gist db, computed on the codes
+void CPDCIImage::CalcSimilarityUInt8(size_t first, size_t count, float* dissimilarities)
+{
+	uint32_t sums[GIST_SCAN_BLOCK_SIZE];
+	imdb::gist_weighted_l1_u8(&m_inputCodes[0], &m_codeWeights[0], m_gistDB.codes(first), m_gistDB.stride(),
+		m_inputCodes.size(), count, sums);
+
+	for(size_t k=0; k<count; k++)
+		dissimilarities[k] = sums[k]/m_codeWeightFactor;
+}
+
+//approximate distances for a float16 gist db, a few records are decoded at a time
+void CPDCIImage::CalcSimilarityHalf(size_t first, size_t count, float* dissimilarities)
+{
+	const size_t recordFloats = 2*NUM_FREQS*NUM_ORIENTS*NUM_X_TILES*NUM_Y_TILES;
+	const size_t chunk = 8;
+	float records[chunk*recordFloats];
+
+	for(size_t i=0; i<count; i+=chunk)
+	{
+		size_t n = std::min(chunk, count - i);
+		for(size_t k=0; k<n; k++)
+			imdb::gist_decode_half(m_gistDB.codes(first + i + k), recordFloats, &records[k*recordFloats]);
+
+		imdb::gist_weighted_l1(&m_inputRecord[0], &m_recordWeights[0], records, recordFloats, recordFloats, n, &dissimilarities[i]);
+	}
+}
+
+void CPDCIImage::CloseFileHandles()
+{
+	m_fileListReader.close();
+	m_meanReader.close();
+	m_varianceReader.close();
+}
+
+//reads the next record of the descriptor files into descr, its filename is only
+//appended to m_fileNames, so a record costs no allocation
+//the files are read ahead in large blocks (see read_ahead_file.hpp), a record is
+//copied out of the blocks already read
+//returns false at the end of the files, and on a read error, which ends the scan
+bool CPDCIImage::ReadNextGistDescriptor(GistDescriptor* descr)
+{
+	try
+	{
+		int filenameLength = 0;
+		m_fileListReader.read(&filenameLength, sizeof(filenameLength));
+		if (m_fileListReader.peek() == '\0' || m_fileListReader.peek() == -1)
+		{
+			CloseFileHandles();
+			return false;
+		}
+
+		if(m_fileNameBuffer.size() < (size_t)filenameLength + 1)
+			m_fileNameBuffer.resize(filenameLength + 1);
+		m_fileListReader.read(&m_fileNameBuffer[0], filenameLength);
+		m_fileNames.push_back(&m_fileNameBuffer[0], filenameLength);
+
+		//every record starts with its number of floats (64 bit)
+		long long currentMeanDescrCount = 0;
+		long long currentVarDescrCount = 0;
+		m_meanReader.read(&currentMeanDescrCount, sizeof(currentMeanDescrCount));
+		m_varianceReader.read(&currentVarDescrCount, sizeof(currentVarDescrCount));
+
+		//if (currentMeanDescrCount != currentVarDescrCount || currentMeanDescrCount != NUM_Y_TILES * NUM_X_TILES * NUM_FREQS * NUM_ORIENTS)
+		//{
+			//CloseFileHandles();
+			//return false;
+		//}
+
+		//the floats are stored in the order of m_mean[freq][orient][y][x]
+		if(m_meanReader.read(descr->m_mean, sizeof(descr->m_mean)) != sizeof(descr->m_mean)
+			|| m_varianceReader.read(descr->m_variance, sizeof(descr->m_variance)) != sizeof(descr->m_variance))
+		{
+			CloseFileHandles();
+			return false;
+		}
+	}
+	catch(std::exception& e)
+	{
+		//the read ahead threads could not read the files (disk or network error)
+		cout << "| Scan of the descriptor files stopped: " << e.what() << endl;
+		CloseFileHandles();
+		return false;
+	}
+
+	return true;
+}
+
+void CPDCIImage::SetNumProbes(int numProbes)
+{
+	m_numProbes = numProbes;
+}
+
+void CPDCIImage::SetNumThreads(int numThreads)
+{
+	m_numThreads = numThreads;
+}
+
+void CPDCIImage::SetReadBlockSize(int readBlockSize)
+{
+	m_readBlockSize = readBlockSize;
+}
+
+void CPDCIImage::SetReadQueueDepth(int readQueueDepth)
+{
+	m_readQueueDepth = readQueueDepth;
+}
+
+void CPDCIImage::SetCascadeSize(int cascadeSize)
+{
+	m_cascadeSize = cascadeSize;
+}
+
+void CPDCIImage::SetFilterCache(const std::string& filterCache)
+{
+	m_filterCache = filterCache;
+}
+
+void CPDCIImage::SetResultPrefix(const std::string& resultPrefix)
+{
+	m_resultPrefix = resultPrefix;
+}
+
+void CPDCIImage::SetSearchBudget(int searchRecords)
+{
+	m_searchRecords = searchRecords;
+}
+
+void CPDCIImage::SetSearchDeadline(double searchSeconds)
+{
+	m_searchSeconds = searchSeconds;
+}
+
+void CPDCIImage::SetApproximateSearch(bool approximateSearch)
+{
+	m_approximateSearch = approximateSearch;
+}
+
+void CPDCIImage::SetSearchMirrored(bool searchMirrored)
+{
+	m_searchMirrored = searchMirrored;
+}
+
+void CPDCIImage::SetSearchMode(SearchMode searchMode)
+{
+	m_searchMode = searchMode;
+}
+
+void CPDCIImage::SetSearchServer(const std::string& searchServer)
+{
+	m_searchServer = searchServer;
+}
+
+void CPDCIImage::SetShortlistSize(int shortlistSize)
+{
+	m_shortlistSize = shortlistSize;
+}
+
+void CPDCIImage::SetTileDistancesFile(const std::string& tileDistancesFile)
+{
+	m_tileDistancesFile = tileDistancesFile;
+}
+
+void CPDCIImage::InitMaskWeights()
+{
+	double tileWidth = m_mask.cols/NUM_X_TILES;
+	double tileHeight = m_mask.rows/NUM_Y_TILES;
+
+	//gewichtung mit der maske!
+	for(int y=0; y<NUM_Y_TILES; y++)
+		for(int x=0; x<NUM_X_TILES; x++)
+		{
+			int pixelCount = 0;
+			for(int w=0; w<tileWidth; w++)
+				for(int h=0; h<tileHeight; h++)
+				{
+					if(m_mask.at<uchar>(y*tileHeight + h, x*tileWidth + w) < 255.0)
+						pixelCount++;
+				}
+
+			m_maskOverlap[y][x] = (double)pixelCount/(double)(tileWidth*tileHeight);
+		}
+
+}
+
+//finds images in large DB that are similar to m_inputImage
+//stores the results in m_similarImages
+//maximal number of similar images to store is: m_maxNumSimilarImages
+void CPDCIImage::FindSimilarImagesFromLargeDB()
+{
+	InitMaskWeights();
+
+	//DWORD start = ::GetTickCount();
+
+	//prefer a running gistserver, then the pq index if asked for, then the packed db,
+	//then the compressed descriptor files, fall back to the files of compute_descriptors
+	//only the scan of the packed db scores mirrored records, it tells when it cannot
+	bool mirrorHandled = false;
+	if(!m_searchServer.empty() && SearchServer())
+		;
+	else if(m_searchMode == SEARCH_PQ && OpenPQIndex())
+		ScanPQIndex();
+	else if(m_searchMode == SEARCH_CASCADE && OpenTinyDatabase())
+		ScanTinyDatabase();
+	else if(m_searchMode == SEARCH_IVF && OpenIVFIndex())
+		ScanIVFIndex();
+	else if(m_searchMode == SEARCH_PCA && OpenPCAStore())
+		ScanPCAStore();
+	else if(m_searchMode == SEARCH_HASH && OpenHashIndex())
+		ScanHashIndex();
+	else if(m_searchMode == SEARCH_PIVOT && OpenPivotTable())
+		ScanPivotTable();
+	else if(m_searchMode == SEARCH_ANYTIME && OpenGistDatabase())
+		ScanAnytime();
+	else if(OpenGistDatabase())
+	{
+		ScanGistDatabase();
+		mirrorHandled = true;
+	}
+	else if(OpenCompressedDescriptors())
+		ScanCompressedDescriptors();
+	else
+		ScanDescriptorFiles();
+
+	if(m_searchMirrored && !mirrorHandled)
+		cout << "| Mirrored search is not supported in this mode, the images were scored as they are\n";
+
+	//DWORD diff = ::GetTickCount() - start;
+
+	//cout << "time for loading files: " << diff << endl;
+
+	//cvWaitKey(0);
+
+	LoadSimilarImages();
+}
+
+//opens the packed gist db written by "gistdb pack" and the filelist it refers to
+//returns false if there is no (usable) packed db
+bool CPDCIImage::OpenGistDatabase()
+{
+	std::string gistDBName = "huge_gistdb";
+	std::string fileListName = "huge_filelist";
+
+	try
+	{
+		m_gistDB.open(gistDBName);
+		m_fileList.open(fileListName);
+	}
+	catch(std::exception& e)
+	{
+		cout << "| No packed gist db: " << e.what() << endl;
+		return false;
+	}
+
+	imdb::gist_geometry geometry(NUM_X_TILES, NUM_Y_TILES, NUM_FREQS, NUM_ORIENTS);
+	if(m_gistDB.geometry() != geometry)
+	{
+		cout << "| Packed gist db has a different tile/filter layout, ignoring it" << endl;
+		return false;
+	}
+
+	//a quantized db only gives a shortlist, it is re-ranked with the float descriptors
+	if(m_gistDB.encoding() != imdb::gist_db_float32 && !OpenRerankDescriptors())
+		return false;
+
+	return true;
+}
+
+//opens the block compressed descriptor files written by "gistdb compress"
+//and the filelist, returns false if there are none (or they do not fit)
+bool CPDCIImage::OpenCompressedDescriptors()
+{
+	try
+	{
+		m_meanBlocks.open("huge_gistzfeatures_mean");
+		m_varianceBlocks.open("huge_gistzfeatures_variance");
+		m_fileList.open("huge_filelist");
+	}
+	catch(std::exception& e)
+	{
+		cout << "| No compressed descriptor files: " << e.what() << endl;
+		return false;
+	}
+
+	imdb::gist_geometry geometry(NUM_X_TILES, NUM_Y_TILES, NUM_FREQS, NUM_ORIENTS);
+	if(m_meanBlocks.floats() != geometry.feature_size() || m_varianceBlocks.floats() != geometry.feature_size()
+		|| m_meanBlocks.size() != m_varianceBlocks.size() || m_meanBlocks.block_records() != m_varianceBlocks.block_records())
+	{
+		cout << "| Compressed descriptor files do not match each other or the gist layout, ignoring them" << endl;
+		return false;
+	}
+
+	return true;
+}
+
+//opens the pq index written by "gistdb pq", the filelist it refers to
+//and the float descriptors its shortlist is re-ranked with
+//returns false if there is no (usable) pq index
+bool CPDCIImage::OpenPQIndex()
+{
+	try
+	{
+		m_pqIndex.open("huge_gistpq");
+		m_fileList.open("huge_filelist");
+	}
+	catch(std::exception& e)
+	{
+		cout << "| No pq index: " << e.what() << endl;
+		return false;
+	}
+
+	imdb::gist_geometry geometry(NUM_X_TILES, NUM_Y_TILES, NUM_FREQS, NUM_ORIENTS);
+	if(m_pqIndex.geometry() != geometry)
+	{
+		cout << "| Pq index has a different tile/filter layout, ignoring it" << endl;
+		return false;
+	}
+
+	return OpenRerankDescriptors();
+}
+
+//opens the ivf index written by "gistdb ivf" and the filelist it refers to
+//returns false if there is no (usable) ivf index
+bool CPDCIImage::OpenIVFIndex()
+{
+	try
+	{
+		m_ivfIndex.open("huge_gistivf");
+		m_fileList.open("huge_filelist");
+	}
+	catch(std::exception& e)
+	{
+		cout << "| No ivf index: " << e.what() << endl;
+		return false;
+	}
+
+	imdb::gist_geometry geometry(NUM_X_TILES, NUM_Y_TILES, NUM_FREQS, NUM_ORIENTS);
+	if(m_ivfIndex.geometry() != geometry)
+	{
+		cout << "| Ivf index has a different tile/filter layout, ignoring it" << endl;
+		return false;
+	}
+
+	return true;
+}
+
+//opens the pca store written by "gistdb pca", the filelist it refers to
+//and the float descriptors its shortlist is re-ranked with
+//returns false if there is no (usable) pca store
+bool CPDCIImage::OpenPCAStore()
+{
+	try
+	{
+		m_pcaStore.open("huge_gistpca");
+		m_fileList.open("huge_filelist");
+	}
+	catch(std::exception& e)
+	{
+		cout << "| No pca store: " << e.what() << endl;
+		return false;
+	}
+
+	imdb::gist_geometry geometry(NUM_X_TILES, NUM_Y_TILES, NUM_FREQS, NUM_ORIENTS);
+	if(m_pcaStore.geometry() != geometry)
+	{
+		cout << "| Pca store has a different tile/filter layout, ignoring it" << endl;
+		return false;
+	}
+
+	return OpenRerankDescriptors();
+}
+
+//opens the hash file written by "gistdb hash", the filelist it refers to
+//and the float descriptors its candidates are re-ranked with
+//returns false if there is no (usable) hash file
+bool CPDCIImage::OpenHashIndex()
+{
+	try
+	{
+		m_hashIndex.open("huge_gisthash");
+		m_fileList.open("huge_filelist");
+	}
+	catch(std::exception& e)
+	{
+		cout << "| No hash file: " << e.what() << endl;
+		return false;
+	}
+
+	imdb::gist_geometry geometry(NUM_X_TILES, NUM_Y_TILES, NUM_FREQS, NUM_ORIENTS);
+	if(m_hashIndex.geometry() != geometry)
+	{
+		cout << "| Hash file has a different tile/filter layout, ignoring it" << endl;
+		return false;
+	}
+
+	return OpenRerankDescriptors();
+}
+
+//opens the pivot table written by "gistdb pivots" and the float gist db it was built from
+//returns false if there is no (usable) pivot table
+bool CPDCIImage::OpenPivotTable()
+{
+	try
+	{
+		m_pivotTable.open("huge_gistpivot");
+	}
+	catch(std::exception& e)
+	{
+		cout << "| No pivot table: " << e.what() << endl;
+		return false;
+	}
+
+	if(!OpenGistDatabase())
+		return false;
+
+	if(m_gistDB.encoding() != imdb::gist_db_float32 || m_pivotTable.geometry() != m_gistDB.geometry() || m_pivotTable.size() != m_gistDB.size())
+	{
+		cout << "| Pivot table does not belong to the packed gist db, ignoring it" << endl;
+		return false;
+	}
+
+	return true;
+}
+
+//opens the tiny db written by "gistdb tiny" and the filelist it refers to
+//the gist of the candidates comes from the float descriptors, without them
+//(or without a usable tiny db) false is returned
+bool CPDCIImage::OpenTinyDatabase()
+{
+	try
+	{
+		m_tinyDB.open("huge_tinydb");
+		m_fileList.open("huge_filelist");
+	}
+	catch(std::exception& e)
+	{
+		cout << "| No tiny db: " << e.what() << endl;
+		return false;
+	}
+
+	if(m_tinyDB.channels() != 3 || m_tinyDB.thumbnail_width() != m_tinyDB.thumbnail_height())
+	{
+		cout << "| Tiny db has an unexpected layout, ignoring it" << endl;
+		return false;
+	}
+
+	return OpenFloatDescriptors();
+}
+
+//maps the descriptor files of compute_descriptors, used for re-ranking
+bool CPDCIImage::OpenFloatDescriptors()
+{
+	try
+	{
+		m_meanFile.open("huge_gistfeatures_mean");
+		m_varianceFile.open("huge_gistfeatures_variance");
+	}
+	catch(std::exception& e)
+	{
+		cout << "| No float descriptors for re-ranking: " << e.what() << endl;
+		return false;
+	}
+
+	return true;
+}
+
+//opens the float descriptors a shortlist is re-ranked with, without them a quantized
+//search is only used if its approximate distances were asked for (--approximate 1)
+bool CPDCIImage::OpenRerankDescriptors()
+{
+	if(OpenFloatDescriptors())
+		return true;
+
+	if(m_approximateSearch)
+	{
+		cout << "| The approximate distances of the quantized search are the results\n";
+		return true;
+	}
+
+	cout << "| A quantized search needs the float descriptors (or --approximate 1), not using it\n";
+	return false;
+}
+
+//orders tiles by descending weight, given the weights of a record
+struct TileWeightGreater
+{
+	const float* weights;
+	size_t tileFloats;
+
+	TileWeightGreater(const float* w, size_t n) : weights(w), tileFloats(n) {}
+
+	bool operator()(size_t a, size_t b) const
+	{
+		return weights[a*tileFloats] > weights[b*tileFloats];
+	}
+};
+
+//converts m_inputGIST into the record layout of the packed gist db
+//and expands m_maskOverlap to one weight per float of a record
+void CPDCIImage::PackInputGIST()
+{
+	imdb::gist_geometry geometry(NUM_X_TILES, NUM_Y_TILES, NUM_FREQS, NUM_ORIENTS);
+
+	m_inputRecord.resize(geometry.record_floats());
+	imdb::gist_pack_record(geometry, &m_inputGIST->m_mean[0][0][0][0], &m_inputGIST->m_variance[0][0][0][0], &m_inputRecord[0]);
+
+	m_recordWeights.resize(geometry.record_floats());
+	m_weightedTiles.clear();
+	for(int y=0; y<NUM_Y_TILES; y++)
+		for(int x=0; x<NUM_X_TILES; x++)
+		{
+			size_t tile = y*NUM_X_TILES + x;
+			std::fill(m_recordWeights.begin() + tile*geometry.tile_floats(), m_recordWeights.begin() + (tile+1)*geometry.tile_floats(), (float)m_maskOverlap[y][x]);
+
+			if(m_maskOverlap[y][x] > 0.0)
+				m_weightedTiles.push_back(tile);
+		}
+
+	//the heaviest tiles first, they decide soonest whether a record can be abandoned
+	std::stable_sort(m_weightedTiles.begin(), m_weightedTiles.end(), TileWeightGreater(&m_recordWeights[0], geometry.tile_floats()));
+
+	//the gist of the flipped input is a permutation of the input's, comparing it with a record
+	//is comparing the input with the record of the flipped image, which needs no extra descriptors
+	if(m_searchMirrored)
+	{
+		m_mirroredRecord.resize(geometry.record_floats());
+		m_mirroredWeights.resize(geometry.record_floats());
+		imdb::gist_mirror_record(geometry, &m_inputRecord[0], &m_mirroredRecord[0]);
+		imdb::gist_mirror_record(geometry, &m_recordWeights[0], &m_mirroredWeights[0]);
+
+		m_mirroredTiles.resize(m_weightedTiles.size());
+		for(size_t i=0; i<m_weightedTiles.size(); i++)
+			m_mirroredTiles[i] = imdb::gist_mirror_tile(geometry, m_weightedTiles[i]);
+	}
+
+	if(m_gistDB.is_open() && m_gistDB.encoding() == imdb::gist_db_uint8)
+	{
+		m_inputCodes.resize(geometry.record_floats());
+		m_codeWeights.resize(geometry.record_floats());
+		m_codeWeightFactor = imdb::gist_quantize_query(m_gistDB, &m_inputRecord[0], &m_recordWeights[0], &m_inputCodes[0], &m_codeWeights[0]);
+	}
+}
+
+//scans one contiguous shard of the packed gist db (or pq index) per worker thread
+struct GistDatabaseScan
+{
+	typedef void (CPDCIImage::*ShardFunction)(size_t, size_t, imdb::top_k<float, size_t>*);
+
+	CPDCIImage* image;
+	ShardFunction scanShard;
+	std::vector<imdb::top_k<float, size_t> > results;
+
+	GistDatabaseScan(CPDCIImage* img, ShardFunction fn, size_t numShards, size_t k)
+		: image(img), scanShard(fn), results(numShards, imdb::top_k<float, size_t>(k))
+	{}
+
+	void operator()(size_t shard)
+	{
+		(image->*scanShard)(shard, results.size(), &results[shard]);
+	}
+
+	//the best k over all shards, nearest first
+	std::vector<std::pair<float, size_t> > Merge(size_t k)
+	{
+		imdb::top_k<float, size_t> best(k);
+		for(size_t i=0; i<results.size(); i++)
+			best.merge(results[i]);
+
+		return best.sorted();
+	}
+};
+
+//number of threads to scan numRecords records with
+size_t CPDCIImage::GetNumScanThreads(size_t numRecords)
+{
+	size_t numThreads = m_numThreads > 0 ? m_numThreads : imdb::hardware_threads();
+	return std::max<size_t>(1, std::min(numThreads, numRecords/GIST_SCAN_BLOCK_SIZE));
+}
+
+//compares the input against every record of the memory mapped gist db
+//the db is split into one shard per thread, each thread keeps its own
+//best m_maxNumSimilarImages, only the merged winners get a GistDescriptor
+void CPDCIImage::ScanGistDatabase()
+{
+	//a float db is ranked from the per-tile distances of the input, kept between runs
+	if(!m_tileDistancesFile.empty() && m_gistDB.encoding() == imdb::gist_db_float32)
+	{
+		if(m_searchMirrored)
+			cout << "| Mirrored search is not supported with --tiledist, scoring the records as they are\n";
+		RankTileDistances();
+		return;
+	}
+
+	PackInputGIST();
+
+	size_t numRecords = m_gistDB.size();
+	size_t numThreads = GetNumScanThreads(numRecords);
+
+	//a quantized db is scanned for a shortlist of candidates
+	bool quantized = (m_gistDB.encoding() != imdb::gist_db_float32);
+	size_t numCandidates = quantized ? std::max(m_shortlistSize, m_maxNumSimilarImages) : m_maxNumSimilarImages;
+	bool mirrored = m_searchMirrored && !quantized;
+
+	cout << "| Scanning packed gist db (" << imdb::gist_simd_name() << ", " << numThreads << " threads)\n";
+	if(mirrored)
+		cout << "| Scoring every record as is and mirrored\n";
+	else if(m_searchMirrored)
+		cout << "| Mirrored search needs a float gist db, scoring the records as they are\n";
+	if(m_gistDB.layout() == imdb::gist_db_tile_major)
+		cout << "| Tile-major db, reading at most " << m_weightedTiles.size() << " of " << NUM_X_TILES*NUM_Y_TILES << " tiles\n";
+
+	m_floatsRead.assign(numThreads, 0);
+	GistDatabaseScan scan(this, &CPDCIImage::ScanGistDatabaseShard, numThreads, numCandidates);
+	imdb::run_worker_threads(numThreads, scan);
+	std::vector<std::pair<float, size_t> > winners = scan.Merge(numCandidates);
+
+	cout << "| Read " << numRecords << " images from DB\n";
+
+	if(!quantized)
+	{
+		unsigned long long floatsRead = 0;
+		for(size_t i=0; i<m_floatsRead.size(); i++)
+			floatsRead += m_floatsRead[i];
+
+		unsigned long long floatsTotal = (unsigned long long)numRecords*m_inputRecord.size()*(mirrored ? 2 : 1);
+		cout << "| Early abandoning read " << floatsRead << " of " << floatsTotal << " floats ("
+			<< (floatsTotal > 0 ? 100.0*floatsRead/floatsTotal : 0.0) << "%)\n";
+	}
+
+	//record i was kept as numRecords + i if its mirrored score was the better one
+	std::vector<bool> winnersMirrored(winners.size(), false);
+	for(size_t i=0; i<winners.size(); i++)
+	{
+		winnersMirrored[i] = (winners[i].second >= numRecords);
+		winners[i].second = (size_t)m_gistDB.id(winners[i].second % numRecords);
+	}
+
+	if(quantized)
+		RerankShortlist(&winners);
+
+	AddSimilarImages(winners, &winnersMirrored);
+}
+
+//ranks the float gist db by the per-tile distances of the input to every record, weighted
+//with m_maskOverlap. the distances do not depend on the mask: they are loaded from
+//m_tileDistancesFile if it was written for the same input and gist db, otherwise they are computed
+//in one pass over the db and saved there. another mask on the same image then costs
+//a 16-wide dot product per record instead of a scan of the db.
+void CPDCIImage::RankTileDistances()
+{
+	PackInputGIST();
+
+	std::vector<float> tileWeights(NUM_X_TILES*NUM_Y_TILES);
+	for(int y=0; y<NUM_Y_TILES; y++)
+		for(int x=0; x<NUM_X_TILES; x++)
+			tileWeights[y*NUM_X_TILES + x] = (float)m_maskOverlap[y][x];
+
+	size_t numRecords = m_gistDB.size();
+	size_t numThreads = GetNumScanThreads(numRecords);
+
+	if(!m_tileDistances.matches(m_gistDB, &m_inputRecord[0]))
+	{
+		try
+		{
+			m_tileDistances.load(m_tileDistancesFile);
+			if(!m_tileDistances.matches(m_gistDB, &m_inputRecord[0]))
+				cout << "| The tile distances in " << m_tileDistancesFile << " are of another input or gist db\n";
+		}
+		catch(std::exception&)
+		{
+		}
+	}
+
+	if(m_tileDistances.matches(m_gistDB, &m_inputRecord[0]))
+		cout << "| Reusing the tile distances of the input from " << m_tileDistancesFile << "\n";
+	else
+	{
+		cout << "| Computing the tile distances of the input (" << imdb::gist_simd_name() << ", " << numThreads << " threads)\n";
+		m_tileDistances.compute(m_gistDB, &m_inputRecord[0], imdb::gist_db_float16, numThreads);
+
+		try
+		{
+			m_tileDistances.save(m_tileDistancesFile);
+		}
+		catch(std::exception& e)
+		{
+			cout << "| Could not keep the tile distances: " << e.what() << endl;
+		}
+	}
+
+	std::vector<std::pair<float, size_t> > winners = m_tileDistances.rank(&tileWeights[0], m_maxNumSimilarImages, numThreads);
+
+	cout << "| Ranked " << numRecords << " images by their tile distances\n";
+
+	for(size_t i=0; i<winners.size(); i++)
+		winners[i].second = (size_t)m_gistDB.id(winners[i].second);
+
+	AddSimilarImages(winners);
+}
+
+//worker of ScanGistDatabase: scores the records of the given shard
+//a block at a time and keeps the best of them in result
+void CPDCIImage::ScanGistDatabaseShard(size_t shard, size_t numShards, imdb::top_k<float, size_t>* result)
+{
+	size_t numRecords = m_gistDB.size();
+	size_t begin = numRecords*shard/numShards;
+	size_t end = numRecords*(shard+1)/numShards;
+
+	const imdb::gist_db_encoding encoding = m_gistDB.encoding();
+	size_t floatsRead = 0;
+
+	float dissimilarities[GIST_SCAN_BLOCK_SIZE];
+	float mirroredDissimilarities[GIST_SCAN_BLOCK_SIZE];
+	for(size_t first=begin; first<end; first+=GIST_SCAN_BLOCK_SIZE)
+	{
+		size_t count = std::min<size_t>(GIST_SCAN_BLOCK_SIZE, end - first);
+		if(encoding == imdb::gist_db_uint8)
+			CalcSimilarityUInt8(first, count, dissimilarities);
+		else if(encoding == imdb::gist_db_float16)
+			CalcSimilarityHalf(first, count, dissimilarities);
+		else
+		{
+			//a record that is not better than the worst kept one can be abandoned
+			float cutoff = result->full() ? result->worst() : std::numeric_limits<float>::infinity();
+			floatsRead += CalcSimilarityByTile(first, count, cutoff, false, dissimilarities);
+		}
+
+		//the same records again, as if their images were flipped, while they are in the cache.
+		//every record is kept once with the better of both scores, as numRecords + i if that
+		//is the mirrored one. an abandoned score is not below the cutoff, so the minimum is
+		//exact whenever it can be kept
+		if(m_searchMirrored && encoding == imdb::gist_db_float32)
+		{
+			float cutoff = result->full() ? result->worst() : std::numeric_limits<float>::infinity();
+			floatsRead += CalcSimilarityByTile(first, count, cutoff, true, mirroredDissimilarities);
+
+			for(size_t k=0; k<count; k++)
+			{
+				if(mirroredDissimilarities[k] < dissimilarities[k])
+					result->push(mirroredDissimilarities[k], numRecords + first + k);
+				else
+					result->push(dissimilarities[k], first + k);
+			}
+		}
+		else
+		{
+			for(size_t k=0; k<count; k++)
+				result->push(dissimilarities[k], first + k);
+		}
+	}
+
+	m_floatsRead[shard] = floatsRead;
+}
+
+//scans one contiguous shard of the packed gist db per worker thread for a
+//batch of inputs, every input keeps its own best k of every shard
+struct GistDatabaseBatchScan
+{
+	const imdb::gist_db* db;
+	const std::vector<float>* queries; //[input][float of a record]
+	const std::vector<float>* weights;
+	size_t numQueries;
+	std::vector<std::vector<imdb::top_k<float, size_t> > > results; //[shard][input]
+
+	GistDatabaseBatchScan(const imdb::gist_db* gistDB, const std::vector<float>* q, const std::vector<float>* w,
+		size_t numShards, const std::vector<size_t>& k)
+		: db(gistDB), queries(q), weights(w), numQueries(k.size()), results(numShards)
+	{
+		for(size_t shard=0; shard<numShards; shard++)
+			for(size_t i=0; i<numQueries; i++)
+				results[shard].push_back(imdb::top_k<float, size_t>(k[i]));
+	}
+
+	void operator()(size_t shard)
+	{
+		size_t numRecords = db->size();
+		size_t begin = numRecords*shard/results.size();
+		size_t end = numRecords*(shard+1)/results.size();
+		size_t dim = queries->size()/numQueries;
+
+		std::vector<float> dissimilarities(numQueries*GIST_SCAN_BLOCK_SIZE);
+		for(size_t first=begin; first<end; first+=GIST_SCAN_BLOCK_SIZE)
+		{
+			size_t count = std::min<size_t>(GIST_SCAN_BLOCK_SIZE, end - first);
+			imdb::gist_weighted_l1_batch(&queries->at(0), &weights->at(0), numQueries, db->record(first),
+				db->stride()/sizeof(float), dim, count, &dissimilarities[0]);
+
+			for(size_t i=0; i<numQueries; i++)
+				for(size_t k=0; k<count; k++)
+					results[shard][i].push(dissimilarities[i*count + k], first + k);
+		}
+	}
+
+	//the best k of input i over all shards, nearest first
+	std::vector<std::pair<float, size_t> > Merge(size_t i, size_t k)
+	{
+		imdb::top_k<float, size_t> best(k);
+		for(size_t shard=0; shard<results.size(); shard++)
+			best.merge(results[shard][i]);
+
+		return best.sorted();
+	}
+};
+
+//finds the similar images of several inputs (their gist already calculated) in
+//one pass over the packed gist db instead of one scan per input. Every input is
+//scored with its own mask weights and keeps its own m_maxNumSimilarImages.
+//needs a float, record-major db and SEARCH_EXACT, otherwise the inputs are
+//searched one at a time
+void CPDCIImage::FindSimilarImagesBatch(const std::vector<CPDCIImage*>& jobs)
+{
+	if(jobs.empty())
+		return;
+
+	bool batched = true;
+	for(size_t i=0; i<jobs.size() && batched; i++)
+		batched = jobs[i]->m_searchServer.empty() && jobs[i]->m_tileDistancesFile.empty() && !jobs[i]->m_searchMirrored && jobs[i]->m_searchMode == SEARCH_EXACT && jobs[i]->OpenGistDatabase();
+
+	const imdb::gist_db& gistDB = jobs[0]->m_gistDB;
+	if(!batched || gistDB.encoding() != imdb::gist_db_float32 || gistDB.layout() != imdb::gist_db_record_major)
+	{
+		cout << "| Batch search needs a float, record-major gist db, searching one input at a time\n";
+		for(size_t i=0; i<jobs.size(); i++)
+			jobs[i]->FindSimilarImagesFromLargeDB();
+		return;
+	}
+
+	const size_t recordFloats = gistDB.geometry().record_floats();
+	std::vector<float> queries(jobs.size()*recordFloats);
+	std::vector<float> weights(jobs.size()*recordFloats);
+	std::vector<size_t> k(jobs.size());
+	for(size_t i=0; i<jobs.size(); i++)
+	{
+		jobs[i]->InitMaskWeights();
+		jobs[i]->PackInputGIST();
+		std::copy(jobs[i]->m_inputRecord.begin(), jobs[i]->m_inputRecord.end(), queries.begin() + i*recordFloats);
+		std::copy(jobs[i]->m_recordWeights.begin(), jobs[i]->m_recordWeights.end(), weights.begin() + i*recordFloats);
+		k[i] = jobs[i]->m_maxNumSimilarImages;
+	}
+
+	size_t numRecords = gistDB.size();
+	size_t numThreads = jobs[0]->GetNumScanThreads(numRecords);
+
+	cout << "| Scanning packed gist db for " << jobs.size() << " inputs (" << imdb::gist_simd_name() << ", " << numThreads << " threads)\n";
+
+	GistDatabaseBatchScan scan(&gistDB, &queries, &weights, numThreads, k);
+	imdb::run_worker_threads(numThreads, scan);
+
+	cout << "| Read " << numRecords << " images from DB\n";
+
+	for(size_t i=0; i<jobs.size(); i++)
+	{
+		std::vector<std::pair<float, size_t> > winners = scan.Merge(i, k[i]);
+		for(size_t j=0; j<winners.size(); j++)
+			winners[j].second = (size_t)gistDB.id(winners[j].second);
+
+		jobs[i]->AddSimilarImages(winners);
+		jobs[i]->LoadSimilarImages();
+	}
+}
+
+//searches the pq index: the distances of the input to all centroids are
+//tabulated once per tile, weighted with m_maskOverlap, a record then costs
+//one table lookup per tile. The best m_shortlistSize are re-ranked exactly.
+void CPDCIImage::ScanPQIndex()
+{
+	PackInputGIST();
+
+	const imdb::gist_geometry& geometry = m_pqIndex.geometry();
+	std::vector<float> tileWeights(geometry.num_tiles());
+	for(int y=0; y<NUM_Y_TILES; y++)
+		for(int x=0; x<NUM_X_TILES; x++)
+			tileWeights[y*NUM_X_TILES + x] = (float)m_maskOverlap[y][x];
+
+	m_pqTables.resize(geometry.num_tiles()*m_pqIndex.num_centroids());
+	imdb::gist_pq_tables(m_pqIndex, &m_inputRecord[0], &tileWeights[0], &m_pqTables[0]);
+
+	size_t numRecords = m_pqIndex.size();
+	size_t numThreads = GetNumScanThreads(numRecords);
+	size_t numCandidates = std::max(m_shortlistSize, m_maxNumSimilarImages);
+
+	cout << "| Scanning pq index (" << numThreads << " threads)\n";
+
+	GistDatabaseScan scan(this, &CPDCIImage::ScanPQIndexShard, numThreads, numCandidates);
+	imdb::run_worker_threads(numThreads, scan);
+	std::vector<std::pair<float, size_t> > winners = scan.Merge(numCandidates);
+
+	cout << "| Read " << numRecords << " images from pq index\n";
+
+	for(size_t i=0; i<winners.size(); i++)
+		winners[i].second = (size_t)m_pqIndex.id(winners[i].second);
+
+	RerankShortlist(&winners);
+	AddSimilarImages(winners);
+}
+
+//searches the pca store: the input is projected like the stored records and the
+//mask weight of every tile is repeated for its components, the reduced records are
+//ranked by weighted squared L2 distance and the best m_shortlistSize re-ranked exactly
+void CPDCIImage::ScanPCAStore()
+{
+	PackInputGIST();
+
+	std::vector<float> tileWeights(NUM_X_TILES*NUM_Y_TILES);
+	for(int y=0; y<NUM_Y_TILES; y++)
+		for(int x=0; x<NUM_X_TILES; x++)
+			tileWeights[y*NUM_X_TILES + x] = (float)m_maskOverlap[y][x];
+
+	m_pcaInput.resize(m_pcaStore.dims());
+	m_pcaWeights.resize(m_pcaStore.dims());
+	m_pcaStore.project(&m_inputRecord[0], &m_pcaInput[0]);
+	imdb::gist_pca_weights(m_pcaStore, &tileWeights[0], &m_pcaWeights[0]);
+
+	size_t numRecords = m_pcaStore.size();
+	size_t numThreads = GetNumScanThreads(numRecords);
+	size_t numCandidates = std::max(m_shortlistSize, m_maxNumSimilarImages);
+
+	cout << "| Scanning pca store, " << m_pcaStore.dims() << " floats per record (" << numThreads << " threads)\n";
+
+	GistDatabaseScan scan(this, &CPDCIImage::ScanPCAStoreShard, numThreads, numCandidates);
+	imdb::run_worker_threads(numThreads, scan);
+	std::vector<std::pair<float, size_t> > winners = scan.Merge(numCandidates);
+
+	cout << "| Read " << numRecords << " images from pca store\n";
+
+	for(size_t i=0; i<winners.size(); i++)
+		winners[i].second = (size_t)m_pcaStore.id(winners[i].second);
+
+	RerankShortlist(&winners);
+	AddSimilarImages(winners);
+}
+
+//searches the hash file: the input is encoded like the stored records, the codes are
+//ranked by hamming distance with every tile weighted by its mask weight and the best
+//m_shortlistSize re-ranked exactly
+void CPDCIImage::ScanHashIndex()
+{
+	PackInputGIST();
+
+	std::vector<float> tileWeights(NUM_X_TILES*NUM_Y_TILES);
+	for(int y=0; y<NUM_Y_TILES; y++)
+		for(int x=0; x<NUM_X_TILES; x++)
+			tileWeights[y*NUM_X_TILES + x] = (float)m_maskOverlap[y][x];
+
+	m_hashInput.resize(m_hashIndex.code_bytes());
+	m_hashWeights.resize(m_hashIndex.code_bytes()*8/m_hashIndex.bits_per_tile());
+	m_hashIndex.encode(&m_inputRecord[0], &m_hashInput[0]);
+	imdb::gist_hash_weights(m_hashIndex, &tileWeights[0], &m_hashWeights[0]);
+
+	size_t numRecords = m_hashIndex.size();
+	size_t numThreads = GetNumScanThreads(numRecords);
+	size_t numCandidates = std::max(m_shortlistSize, m_maxNumSimilarImages);
+
+	cout << "| Scanning hash file, " << m_hashIndex.code_bytes() << " bytes per record (" << imdb::gist_popcount_name() << ", " << numThreads << " threads)\n";
+
+	GistDatabaseScan scan(this, &CPDCIImage::ScanHashIndexShard, numThreads, numCandidates);
+	imdb::run_worker_threads(numThreads, scan);
+	std::vector<std::pair<float, size_t> > winners = scan.Merge(numCandidates);
+
+	cout << "| Read " << numRecords << " images from hash file\n";
+
+	for(size_t i=0; i<winners.size(); i++)
+		winners[i].second = (size_t)m_hashIndex.id(winners[i].second);
+
+	RerankShortlist(&winners);
+	AddSimilarImages(winners);
+}
+
+//worker of ScanHashIndex
+void CPDCIImage::ScanHashIndexShard(size_t shard, size_t numShards, imdb::top_k<float, size_t>* result)
+{
+	size_t numRecords = m_hashIndex.size();
+	size_t begin = numRecords*shard/numShards;
+	size_t end = numRecords*(shard+1)/numShards;
+	size_t codeBytes = m_hashIndex.code_bytes();
+
+	float dissimilarities[GIST_SCAN_BLOCK_SIZE];
+	for(size_t first=begin; first<end; first+=GIST_SCAN_BLOCK_SIZE)
+	{
+		size_t count = std::min<size_t>(GIST_SCAN_BLOCK_SIZE, end - first);
+		imdb::gist_weighted_hamming(&m_hashInput[0], &m_hashWeights[0], m_hashIndex.code(first), codeBytes, codeBytes,
+			m_hashIndex.bits_per_tile(), count, dissimilarities);
+
+		for(size_t k=0; k<count; k++)
+			result->push(dissimilarities[k], first + k);
+	}
+}
+
+//exact search of the packed gist db: a lower bound of the distance of every record is
+//computed from its per-tile distances to the pivots, and only the records whose bound is
+//below the worst of the best m_maxNumSimilarImages so far are read
+void CPDCIImage::ScanPivotTable()
+{
+	PackInputGIST();
+
+	m_tileWeights.resize(NUM_X_TILES*NUM_Y_TILES);
+	for(int y=0; y<NUM_Y_TILES; y++)
+		for(int x=0; x<NUM_X_TILES; x++)
+			m_tileWeights[y*NUM_X_TILES + x] = (float)m_maskOverlap[y][x];
+
+	m_pivotDistances.resize(m_pivotTable.row_floats());
+	m_pivotTable.distances(&m_inputRecord[0], &m_pivotDistances[0]);
+
+	size_t numRecords = m_gistDB.size();
+	size_t numThreads = GetNumScanThreads(numRecords);
+
+	cout << "| Scanning packed gist db with " << m_pivotTable.num_pivots() << " pivots (" << numThreads << " threads)\n";
+
+	m_floatsRead.assign(numThreads, 0);
+	m_recordsSkipped.assign(numThreads, 0);
+	GistDatabaseScan scan(this, &CPDCIImage::ScanPivotTableShard, numThreads, m_maxNumSimilarImages);
+	imdb::run_worker_threads(numThreads, scan);
+	std::vector<std::pair<float, size_t> > winners = scan.Merge(m_maxNumSimilarImages);
+
+	unsigned long long recordsSkipped = 0;
+	for(size_t i=0; i<m_recordsSkipped.size(); i++)
+		recordsSkipped += m_recordsSkipped[i];
+
+	cout << "| Read " << numRecords << " images from DB\n";
+	cout << "| Pivot bounds skipped " << recordsSkipped << " of " << numRecords << " records ("
+		<< (numRecords > 0 ? 100.0*recordsSkipped/numRecords : 0.0) << "%)\n";
+
+	for(size_t i=0; i<winners.size(); i++)
+		winners[i].second = (size_t)m_gistDB.id(winners[i].second);
+
+	AddSimilarImages(winners);
+}
+
+//scores a block of the packed gist db for the anytime scan, like ScanGistDatabaseShard
+struct GistAnytimeScore
+{
+	CPDCIImage* image;
+	imdb::gist_db_encoding encoding;
+
+	void operator()(size_t, size_t first, size_t count, float cutoff, float* dissimilarities)
+	{
+		if(encoding == imdb::gist_db_uint8)
+			image->CalcSimilarityUInt8(first, count, dissimilarities);
+		else if(encoding == imdb::gist_db_float16)
+			image->CalcSimilarityHalf(first, count, dissimilarities);
+		else
+			image->CalcSimilarityByTile(first, count, cutoff, false, dissimilarities);
+	}
+};
+
+//anytime search of the packed gist db: its blocks are scored in a random order, fixed when
+//the scan starts, until m_searchSeconds have passed or m_searchRecords records were scored.
+//the best so far are the similar images. the scan stays in m_anytimeScan, so that
+//ContinueSimilarImageSearch can go on from where it stopped.
+void CPDCIImage::ScanAnytime()
+{
+	PackInputGIST();
+
+	size_t numRecords = m_gistDB.size();
+	size_t numThreads = GetNumScanThreads(numRecords);
+
+	//a quantized db is scanned for a shortlist of candidates
+	bool quantized = (m_gistDB.encoding() != imdb::gist_db_float32);
+	size_t numCandidates = quantized ? std::max(m_shortlistSize, m_maxNumSimilarImages) : m_maxNumSimilarImages;
 
-char* m_fileListBuffer;
-char* m_meanFileBuffer;
-char* m_varianceFileBuffer;
+	if(!m_anytimeScan.started() || m_anytimeScan.size() != numRecords || m_anytimeScan.k() != numCandidates)
+		m_anytimeScan.reset(numRecords, GIST_SCAN_BLOCK_SIZE, numCandidates, 4711);
 
-bool CPDCIImage::LoadImageFromFile(char* path)
-{
-	m_inputImage = cv::imread(path, 1 /*CV_LOAD_IMAGE_UNCHANGED*/);
+	cout << "| Scanning packed gist db in random order (" << imdb::gist_simd_name() << ", " << numThreads << " threads";
+	if(m_searchSeconds > 0)
+		cout << ", " << m_searchSeconds << "s";
+	if(m_searchRecords > 0)
+		cout << ", " << m_searchRecords << " records";
+	cout << ")\n";
 
-	if(m_inputImage.data == NULL)
-		return false;
+	GistAnytimeScore score = { this, m_gistDB.encoding() };
+	imdb::gist_anytime_progress progress = m_anytimeScan.run(score, numThreads, m_searchSeconds, (size_t)std::max(m_searchRecords, 0));
 
-	//show input image
-	cv::namedWindow( "input image", CV_WINDOW_AUTOSIZE );
-	cv::imshow( "input image", m_inputImage );
+	cout << "| Read " << progress.records_scanned << " of " << numRecords << " images from DB ("
+		<< 100.0*progress.fraction() << "%) in " << progress.seconds << "s\n";
+	if(progress.kth_distance < std::numeric_limits<float>::infinity())
+		cout << "| Worst distance kept so far: " << progress.kth_distance << "\n";
+	if(!progress.complete())
+		cout << "| The scan can be continued for more exact results\n";
 
-	return true;
+	std::vector<std::pair<float, size_t> > winners = m_anytimeScan.sorted();
+	for(size_t i=0; i<winners.size(); i++)
+		winners[i].second = (size_t)m_gistDB.id(winners[i].second);
+
+	if(quantized)
+		RerankShortlist(&winners);
+
+	AddSimilarImages(winners);
 }
 
-//loads the mask from a file
-//note: mask file needs to have same resolution as input image
-//usage: black means, take pixels from input image, white means, 
-//		 this is the region where we want to complete the scene from other images
-bool CPDCIImage::LoadMaskFromFile(char* path)
+//scans on from where the last anytime search stopped, for at most seconds or records
+//more records (<= 0: no limit), and replaces the similar images by the best found so far.
+//returns false if there is no anytime search to continue or it has scanned the whole db
+bool CPDCIImage::ContinueSimilarImageSearch(double seconds, int records)
 {
-	m_mask = cv::imread(path, CV_LOAD_IMAGE_GRAYSCALE);
-
-	if(m_mask.data == NULL)
+	if(m_searchMode != SEARCH_ANYTIME || !m_anytimeScan.started() || m_anytimeScan.complete())
 		return false;
 
-	//show mask
-	cv::namedWindow( "mask", CV_WINDOW_AUTOSIZE );
-	cv::imshow( "mask", m_mask);
-	//cvWaitKey(0);	//DEBUG
+	for(size_t i=0; i<m_GIST.size(); i++)
+		delete m_GIST[i];
+	m_GIST.clear();
 
+	for(size_t i=0; i<m_similarImages.size(); i++)
+		m_similarImages[i].release();
+	m_similarImages.clear();
+
+	m_searchSeconds = seconds;
+	m_searchRecords = records;
+	ScanAnytime();
+
+	LoadSimilarImages();
 	return true;
 }
 
-bool CPDCIImage::Cleanup()
-{	
-	m_inputImage.release();
-	m_mask.release();
-
-	//clear the similar images
-	for(vector<cv::Mat>::iterator it = m_similarImages.begin(); it != m_similarImages.end(); it++)
+//worker of ScanPivotTable
+void CPDCIImage::ScanPivotTableShard(size_t shard, size_t numShards, imdb::top_k<float, size_t>* result)
+{
+	size_t numRecords = m_gistDB.size();
+	size_t begin = numRecords*shard/numShards;
+	size_t end = numRecords*(shard+1)/numShards;
+	size_t floatsRead = 0;
+	size_t recordsSkipped = 0;
+
+	float bounds[GIST_SCAN_BLOCK_SIZE];
+	float dissimilarities[GIST_SCAN_BLOCK_SIZE];
+	vector<float> tileBounds(m_pivotTable.geometry().num_tiles());
+	for(size_t first=begin; first<end; first+=GIST_SCAN_BLOCK_SIZE)
 	{
-		(*it).release();		
-    }
+		size_t count = std::min<size_t>(GIST_SCAN_BLOCK_SIZE, end - first);
+		imdb::gist_pivot_lower_bounds(m_pivotTable, &m_pivotDistances[0], &m_tileWeights[0], first, count, bounds, &tileBounds[0]);
 
-	while(m_similarImages.size() != 0)
-		m_similarImages.pop_back();
+		//the records that can still make it into the result, in runs of consecutive records
+		for(size_t runBegin=0; runBegin<count; )
+		{
+			float cutoff = result->full() ? result->worst() : std::numeric_limits<float>::infinity();
+			if(bounds[runBegin] >= cutoff)
+			{
+				recordsSkipped++;
+				runBegin++;
+				continue;
+			}
 
-	//clear the output images
-	for(vector<cv::Mat>::iterator it = m_outputImages.begin(); it != m_outputImages.end(); it++)
-	{
-		(*it).release();
-    }
+			size_t runEnd = runBegin + 1;
+			while(runEnd < count && bounds[runEnd] < cutoff)
+				runEnd++;
 
-	while(m_outputImages.size() != 0)
-		m_outputImages.pop_back();
+			floatsRead += CalcSimilarityByTile(first + runBegin, runEnd - runBegin, cutoff, false, dissimilarities);
+			for(size_t k=runBegin; k<runEnd; k++)
+				result->push(dissimilarities[k - runBegin], first + k);
 
-	m_GIST.clear();
+			runBegin = runEnd;
+		}
+	}
 
-	return true;
+	m_floatsRead[shard] = floatsRead;
+	m_recordsSkipped[shard] = recordsSkipped;
 }
 
-double CPDCIImage::CalcSimilarity(GistDescriptor* descrA, GistDescriptor* descrB)
+//worker of ScanPCAStore
+void CPDCIImage::ScanPCAStoreShard(size_t shard, size_t numShards, imdb::top_k<float, size_t>* result)
 {
-	double dissimilarity = 0.0;
-	//L1 distance
-	//loop: fr jedes tile/patch
-	for(int i=0; i<NUM_FREQS; i++)
-		for(int j=0; j<NUM_ORIENTS; j++)
-			for(int y=0; y<NUM_Y_TILES; y++)
-				for(int x=0; x<NUM_X_TILES; x++)
-				{
-					dissimilarity += m_maskOverlap[y][x]*(abs(descrA->m_mean[i][j][y][x] - descrB->m_mean[i][j][y][x])
-						+ abs(descrA->m_variance[i][j][y][x] - descrB->m_variance[i][j][y][x]));
-				}
+	size_t numRecords = m_pcaStore.size();
+	size_t begin = numRecords*shard/numShards;
+	size_t end = numRecords*(shard+1)/numShards;
+	size_t dims = m_pcaStore.dims();
 
-	descrA->m_dissimilarity = dissimilarity;	
-	//cout << dissimilarity << endl; //DEBUG
+	float dissimilarities[GIST_SCAN_BLOCK_SIZE];
+	for(size_t first=begin; first<end; first+=GIST_SCAN_BLOCK_SIZE)
+	{
+		size_t count = std::min<size_t>(GIST_SCAN_BLOCK_SIZE, end - first);
+		imdb::gist_weighted_l2(&m_pcaInput[0], &m_pcaWeights[0], m_pcaStore.record(first), dims, dims, count, dissimilarities);
 
-	return dissimilarity;
+		for(size_t k=0; k<count; k++)
+			result->push(dissimilarities[k], first + k);
+	}
 }
 
-void CPDCIImage::CloseFileHandles()
+//worker of ScanPQIndex
+void CPDCIImage::ScanPQIndexShard(size_t shard, size_t numShards, imdb::top_k<float, size_t>* result)
 {
-	m_fileListHandle.close();
-	m_meanFileHandle.close();
-	m_varianceFileHandle.close();
+	size_t numRecords = m_pqIndex.size();
+	size_t begin = numRecords*shard/numShards;
+	size_t end = numRecords*(shard+1)/numShards;
+	size_t numTiles = m_pqIndex.geometry().num_tiles();
+
+	float dissimilarities[GIST_SCAN_BLOCK_SIZE];
+	for(size_t first=begin; first<end; first+=GIST_SCAN_BLOCK_SIZE)
+	{
+		size_t count = std::min<size_t>(GIST_SCAN_BLOCK_SIZE, end - first);
+		imdb::gist_pq_scan(&m_pqTables[0], numTiles, m_pqIndex.num_centroids(), m_pqIndex.codes(first), count, dissimilarities);
+
+		for(size_t k=0; k<count; k++)
+			result->push(dissimilarities[k], first + k);
+	}
+}
+
+//searches the ivf index: the centroids are scored with the mask weighted distance,
+//the records of the m_numProbes nearest lists get their exact distance. the more
+//lists are probed the closer the result is to the one of the full scan
+void CPDCIImage::ScanIVFIndex()
+{
+	PackInputGIST();
+
+	m_probedLists = imdb::gist_ivf_probe(m_ivfIndex, &m_inputRecord[0], &m_recordWeights[0], std::max(m_numProbes, 1));
+
+	m_probedBegin.assign(1, 0);
+	for(size_t i=0; i<m_probedLists.size(); i++)
+		m_probedBegin.push_back(m_probedBegin.back() + m_ivfIndex.list_end(m_probedLists[i]) - m_ivfIndex.list_begin(m_probedLists[i]));
+
+	size_t numRecords = m_probedBegin.back();
+	size_t numThreads = GetNumScanThreads(numRecords);
+
+	cout << "| Scanning " << m_probedLists.size() << " of " << m_ivfIndex.num_lists() << " lists of the ivf index ("
+		<< imdb::gist_simd_name() << ", " << numThreads << " threads)\n";
+
+	GistDatabaseScan scan(this, &CPDCIImage::ScanIVFIndexShard, numThreads, m_maxNumSimilarImages);
+	imdb::run_worker_threads(numThreads, scan);
+	std::vector<std::pair<float, size_t> > winners = scan.Merge(m_maxNumSimilarImages);
+
+	cout << "| Read " << numRecords << " of " << m_ivfIndex.size() << " images from ivf index\n";
+
+	for(size_t i=0; i<winners.size(); i++)
+		winners[i].second = (size_t)m_ivfIndex.id(winners[i].second);
+
+	AddSimilarImages(winners);
 }
 
-GistDescriptor* CPDCIImage::ReadNextGistDescriptor()
+//worker of ScanIVFIndex: the records of all probed lists are numbered one after
+//another, the shard is a range of those numbers, possibly spanning several lists
+void CPDCIImage::ScanIVFIndexShard(size_t shard, size_t numShards, imdb::top_k<float, size_t>* result)
 {
-	int filenameLength = ReadIntFromFile(&m_fileListHandle);
-	if (m_fileListHandle.get() == '\0')
+	size_t numRecords = m_probedBegin.back();
+	size_t begin = numRecords*shard/numShards;
+	size_t end = numRecords*(shard+1)/numShards;
+	size_t dim = m_inputRecord.size();
+
+	float dissimilarities[GIST_SCAN_BLOCK_SIZE];
+	for(size_t i=0; i<m_probedLists.size(); i++)
 	{
-		CloseFileHandles();
-		return NULL;
+		//the part of probed list i within the shard, as records of the index
+		size_t from = std::max(begin, m_probedBegin[i]);
+		size_t to = std::min(end, m_probedBegin[i+1]);
+		if(from >= to)
+			continue;
+
+		size_t listBegin = m_ivfIndex.list_begin(m_probedLists[i]);
+		from = listBegin + from - m_probedBegin[i];
+		to = listBegin + to - m_probedBegin[i];
+
+		for(size_t first=from; first<to; first+=GIST_SCAN_BLOCK_SIZE)
+		{
+			size_t count = std::min<size_t>(GIST_SCAN_BLOCK_SIZE, to - first);
+			imdb::gist_weighted_l1(&m_inputRecord[0], &m_recordWeights[0], m_ivfIndex.record(first), dim, dim, count, dissimilarities);
+
+			for(size_t k=0; k<count; k++)
+				result->push(dissimilarities[k], first + k);
+		}
 	}
-	else m_fileListHandle.unget();
+}
+
+//computes the tiny image of the input the way the tinylab generator and "gistdb tiny" do
+//(scaled BGR thumbnail, box filtered to the size of m_tinyDB) and weights its values
+//by the share of known pixels, i.e. those outside the hole of the mask
+void CPDCIImage::CalcTinyOfInput()
+{
+	const size_t thumbnailSize = m_tinyDB.thumbnail_width();
+	const size_t size = m_tinyDB.width();
+	const size_t channels = m_tinyDB.channels();
 
-	char* currentFilename = new char[filenameLength+1];
-	currentFilename[filenameLength] = '\0';
-	//m_fileListHandle.get(currentFilename, filenameLength+1);		//ifstream.get(...) reads n-1 bytes, not n ... WTF?!
-	ReadInFileNumBytes(&m_fileListHandle, currentFilename, filenameLength);
+	cv::Mat thumbnail;
+	cv::resize(m_inputImage, thumbnail, cv::Size(thumbnailSize, thumbnailSize), 0, 0, cv::INTER_AREA);
+	thumbnail.convertTo(thumbnail, CV_32FC3, 1.0/255.0);
 
-	long currentMeanDescrCount = ReadLongFromFile(&m_meanFileHandle);
-	long currentVarDescrCount = ReadLongFromFile(&m_varianceFileHandle);
+	std::vector<float> values;
+	for(int y=0; y<thumbnail.rows; y++)
+		values.insert(values.end(), thumbnail.ptr<float>(y), thumbnail.ptr<float>(y) + thumbnail.cols*channels);
 
-	//if (currentMeanDescrCount != currentVarDescrCount || currentMeanDescrCount != NUM_Y_TILES * NUM_X_TILES * NUM_FREQS * NUM_ORIENTS)
-	//{
-		//CloseFileHandles();
-		//return NULL;
-	//}
+	m_inputTiny.resize(m_tinyDB.record_size());
+	imdb::tiny_from_thumbnail(&values[0], thumbnailSize, thumbnailSize, channels, size, &m_inputTiny[0]);
 
-	GistDescriptor* retVal = new GistDescriptor();
-	retVal->m_fileName = "h:\\";
-	retVal->m_fileName += currentFilename;
+	int16_t maxWeight = imdb::tiny_max_weight(m_inputTiny.size());
+	m_tinyWeights.resize(m_inputTiny.size());
 
-	for(int i=0; i<NUM_FREQS; i++)
-		for(int j=0; j<NUM_ORIENTS; j++)
-			for(int y=0; y<NUM_Y_TILES; y++)
-				for(int x=0; x<NUM_X_TILES; x++)
+	double cellWidth = (double)m_mask.cols/size;
+	double cellHeight = (double)m_mask.rows/size;
+	for(size_t y=0; y<size; y++)
+		for(size_t x=0; x<size; x++)
+		{
+			int pixelCount = 0, knownCount = 0;
+			for(int h=(int)(y*cellHeight); h<(int)((y+1)*cellHeight); h++)
+				for(int w=(int)(x*cellWidth); w<(int)((x+1)*cellWidth); w++)
 				{
-					retVal->m_mean[i][j][y][x] = ReadFloatFromFile(&m_meanFileHandle);
-					retVal->m_variance[i][j][y][x] = ReadFloatFromFile(&m_varianceFileHandle);
+					pixelCount++;
+					if(m_mask.at<uchar>(h, w) < 255)
+						knownCount++;
 				}
 
-	return retVal;	
+			int16_t weight = pixelCount > 0 ? (int16_t)floor((double)knownCount/pixelCount*maxWeight + 0.5) : 0;
+			for(size_t c=0; c<channels; c++)
+				m_tinyWeights[(y*size + x)*channels + c] = weight;
+		}
 }
 
-void CPDCIImage::InitMaskWeights()
+//cascade search: a cheap scan over the tiny images of the db, compared on the
+//known pixels of the input only, selects m_cascadeSize candidates, only those
+//get the weighted gist distance (computed from the float descriptors)
+void CPDCIImage::ScanTinyDatabase()
 {
-	double tileWidth = m_mask.cols/NUM_X_TILES;
-	double tileHeight = m_mask.rows/NUM_Y_TILES;
+	PackInputGIST();
+	CalcTinyOfInput();
 
-	//gewichtung mit der maske!
+	size_t numRecords = m_tinyDB.size();
+	size_t numThreads = GetNumScanThreads(numRecords);
+	size_t numCandidates = std::max(m_cascadeSize, m_maxNumSimilarImages);
+
+	cout << "| Scanning tiny db (" << imdb::gist_simd_name() << ", " << numThreads << " threads)\n";
+
+	GistDatabaseScan scan(this, &CPDCIImage::ScanTinyDatabaseShard, numThreads, numCandidates);
+	imdb::run_worker_threads(numThreads, scan);
+	std::vector<std::pair<float, size_t> > winners = scan.Merge(numCandidates);
+
+	cout << "| Read " << numRecords << " images from tiny db\n";
+
+	for(size_t i=0; i<winners.size(); i++)
+		winners[i].second = (size_t)m_tinyDB.id(winners[i].second);
+
+	RerankShortlist(&winners);
+	AddSimilarImages(winners);
+}
+
+//worker of ScanTinyDatabase
+void CPDCIImage::ScanTinyDatabaseShard(size_t shard, size_t numShards, imdb::top_k<float, size_t>* result)
+{
+	size_t numRecords = m_tinyDB.size();
+	size_t begin = numRecords*shard/numShards;
+	size_t end = numRecords*(shard+1)/numShards;
+
+	uint32_t dissimilarities[GIST_SCAN_BLOCK_SIZE];
+	for(size_t first=begin; first<end; first+=GIST_SCAN_BLOCK_SIZE)
+	{
+		size_t count = std::min<size_t>(GIST_SCAN_BLOCK_SIZE, end - first);
+		imdb::gist_weighted_l2_u8(&m_inputTiny[0], &m_tinyWeights[0], m_tinyDB.record(first), m_tinyDB.stride(),
+			m_inputTiny.size(), count, dissimilarities);
+
+		for(size_t k=0; k<count; k++)
+			result->push((float)dissimilarities[k], first + k);
+	}
+}
+
+//sends the packed input and one weight per tile to the gistserver listening on
+//m_searchServer, which keeps the packed gist db mapped, and inserts its ranked
+//results into m_GIST. returns false if the server could not be asked
+bool CPDCIImage::SearchServer()
+{
+	PackInputGIST();
+
+	std::vector<float> tileWeights(NUM_X_TILES*NUM_Y_TILES);
 	for(int y=0; y<NUM_Y_TILES; y++)
 		for(int x=0; x<NUM_X_TILES; x++)
+			tileWeights[y*NUM_X_TILES + x] = (float)m_maskOverlap[y][x];
+
+	std::vector<imdb::search_result> results;
+	try
+	{
+		imdb::local_socket server;
+		server.connect(m_searchServer);
+		results = imdb::search_gist(server, &m_inputRecord[0], (uint32_t)m_inputRecord.size(), &tileWeights[0], (uint32_t)tileWeights.size(), m_maxNumSimilarImages);
+	}
+	catch(std::exception& e)
+	{
+		cout << "| No answer of the gist server, scanning the db here: " << e.what() << endl;
+		return false;
+	}
+
+	cout << "| Got " << results.size() << " images from the gist server at " << m_searchServer << "\n";
+
+	for(size_t i=0; i<results.size(); i++)
+	{
+		GistDescriptor* currGist = new GistDescriptor();
+		currGist->m_dissimilarity = results[i].distance;
+		currGist->m_id = results[i].id;
+		currGist->m_fileName = m_imageRootDir + results[i].name;
+		InsertElem(currGist);
+	}
+
+	return true;
+}
+
+//creates GistDescriptors for the (dissimilarity, filelist id) pairs and inserts them into m_GIST
+void CPDCIImage::AddSimilarImages(const std::vector<std::pair<float, size_t> >& winners, const std::vector<bool>* mirrored)
+{
+	//only now look up the filenames of the winners
+	for(size_t i=0; i<winners.size(); i++)
+	{
+		GistDescriptor* currGist = new GistDescriptor();
+		currGist->m_dissimilarity = winners[i].first;
+		currGist->m_id = winners[i].second;
+		currGist->m_mirrored = (mirrored != NULL && mirrored->at(i));
+		currGist->m_fileName = m_imageRootDir + m_fileList.string_at(winners[i].second);
+		InsertElem(currGist);
+	}
+}
+
+//replaces the approximate distances of the (dissimilarity, filelist id) candidates
+//of a quantized scan by the exact ones, computed from the float descriptors of
+//compute_descriptors, and keeps the best m_maxNumSimilarImages of them
+void CPDCIImage::RerankShortlist(std::vector<std::pair<float, size_t> >* candidates)
+{
+	//only with --approximate 1, the best candidates keep their approximate distances
+	if(!m_meanFile.is_open() || !m_varianceFile.is_open())
+	{
+		cout << "| Warning: no float descriptors, the results are approximate and not re-ranked\n";
+		if(candidates->size() > (size_t)m_maxNumSimilarImages)
+			candidates->resize(m_maxNumSimilarImages);
+		return;
+	}
+
+	imdb::gist_geometry geometry(NUM_X_TILES, NUM_Y_TILES, NUM_FREQS, NUM_ORIENTS);
+	std::vector<float> record(geometry.record_floats());
+
+	imdb::top_k<float, size_t> best(m_maxNumSimilarImages);
+	for(size_t i=0; i<candidates->size(); i++)
+	{
+		size_t id = candidates->at(i).second;
+
+		size_t numMeans = 0, numVariances = 0;
+		const float* means = m_meanFile.floats_at(id, numMeans);
+		const float* variances = m_varianceFile.floats_at(id, numVariances);
+		if(numMeans != geometry.feature_size() || numVariances != geometry.feature_size())
 		{
-			int pixelCount = 0;
-			for(int w=0; w<tileWidth; w++)
-				for(int h=0; h<tileHeight; h++)
-				{
-					if(m_mask.at<uchar>(y*tileHeight + h, x*tileWidth + w) < 255.0)
-						pixelCount++;
-				}
+			cout << "| Descriptor " << id << " has an unexpected size, not re-ranking it" << endl;
+			continue;
+		}
 
-			m_maskOverlap[y][x] = (double)pixelCount/(double)(tileWidth*tileHeight);
+		imdb::gist_pack_record(geometry, means, variances, &record[0]);
+
+		float dissimilarity;
+		imdb::gist_weighted_l1(&m_inputRecord[0], &m_recordWeights[0], &record[0], record.size(), record.size(), 1, &dissimilarity);
+		best.push(dissimilarity, id);
+	}
+
+	cout << "| Re-ranked " << candidates->size() << " candidates with the float descriptors\n";
+	*candidates = best.sorted();
+}
+
+//compares the input against the block compressed descriptor files, every thread decodes
+//the blocks of its shard and compares their records like those of a float gist db
+void CPDCIImage::ScanCompressedDescriptors()
+{
+	PackInputGIST();
+
+	size_t numRecords = m_meanBlocks.size();
+	size_t numThreads = GetNumScanThreads(numRecords);
+
+	cout << "| Scanning compressed descriptor files, " << m_meanBlocks.block_records() << " records per block ("
+		<< imdb::gist_simd_name() << ", " << numThreads << " threads)\n";
+
+	m_corruptBlocks.assign(numThreads, 0);
+	GistDatabaseScan scan(this, &CPDCIImage::ScanCompressedDescriptorsShard, numThreads, m_maxNumSimilarImages);
+	imdb::run_worker_threads(numThreads, scan);
+	std::vector<std::pair<float, size_t> > winners = scan.Merge(m_maxNumSimilarImages);
+
+	size_t corruptBlocks = 0;
+	for(size_t i=0; i<m_corruptBlocks.size(); i++)
+		corruptBlocks += m_corruptBlocks[i];
+
+	cout << "| Read " << numRecords << " images from DB\n";
+	if(corruptBlocks > 0)
+		cout << "| Skipped " << corruptBlocks << " corrupt blocks of the compressed descriptor files\n";
+
+	//the records are in the order of the filelist
+	AddSimilarImages(winners);
+}
+
+//worker of ScanCompressedDescriptors
+void CPDCIImage::ScanCompressedDescriptorsShard(size_t shard, size_t numShards, imdb::top_k<float, size_t>* result)
+{
+	imdb::gist_geometry geometry(NUM_X_TILES, NUM_Y_TILES, NUM_FREQS, NUM_ORIENTS);
+	const size_t featureSize = geometry.feature_size();
+	const size_t recordFloats = geometry.record_floats();
+	const size_t blockRecords = m_meanBlocks.block_records();
+
+	size_t numBlocks = m_meanBlocks.num_blocks();
+	size_t begin = numBlocks*shard/numShards;
+	size_t end = numBlocks*(shard+1)/numShards;
+
+	std::vector<float> means(blockRecords*featureSize);
+	std::vector<float> variances(blockRecords*featureSize);
+	std::vector<float> records(blockRecords*recordFloats);
+	std::vector<float> dissimilarities(blockRecords);
+	std::vector<uint8_t> planes;
+
+	for(size_t b=begin; b<end; b++)
+	{
+		size_t count = m_meanBlocks.block_count(b);
+		try
+		{
+			m_meanBlocks.decode(b, &means[0], planes);
+			m_varianceBlocks.decode(b, &variances[0], planes);
+		}
+		catch(std::exception&)
+		{
+			m_corruptBlocks[shard]++;
+			continue;
 		}
 
+		for(size_t j=0; j<count; j++)
+			imdb::gist_pack_record(geometry, &means[j*featureSize], &variances[j*featureSize], &records[j*recordFloats]);
+
+		imdb::gist_weighted_l1(&m_inputRecord[0], &m_recordWeights[0], &records[0], recordFloats, recordFloats, count, &dissimilarities[0]);
+
+		for(size_t j=0; j<count; j++)
+			result->push(dissimilarities[j], b*blockRecords + j);
+	}
 }
 
-//finds images in large DB that are similar to m_inputImage
-//stores the results in m_similarImages
-//maximal number of similar images to store is: m_maxNumSimilarImages
-void CPDCIImage::FindSimilarImagesFromLargeDB()
+//compares the input against the descriptor files of compute_descriptors, one by one
+//every record is read into the same GistDescriptor and only its record id is kept,
+//GistDescriptors with filenames are created for the best m_maxNumSimilarImages
+void CPDCIImage::ScanDescriptorFiles()
 {
-	OpenDescriptorFiles();
-	
-	GistDescriptor* currGist = NULL;
+	if(!OpenDescriptorFiles())
+	{
+		cout << "| Could not open the descriptor files\n";
+		return;
+	}
+	m_fileNames.clear();
 
-	InitMaskWeights();
+	cout << "| Reading the descriptor files ahead in blocks of " << m_meanReader.block_size()/1024 << " KB, "
+		<< m_meanReader.queue_depth() << " reads in flight\n";
 
-	//DWORD start = ::GetTickCount();
-	
-	unsigned int count = 0;
+	GistDescriptor currGist;
+	imdb::top_k<double, size_t> best(m_maxNumSimilarImages);
+
+	size_t count = 0;
 	//Load each image according to file(that the script produced)
-	while((currGist = ReadNextGistDescriptor()) != NULL)
+	while(ReadNextGistDescriptor(&currGist))
 	{
-		CalcSimilarity(currGist, m_inputGIST);
-		InsertElem(currGist);
+		best.push(CalcSimilarity(&currGist, m_inputGIST), count);
 		if(count++%100 == 0)
 			cout << "| Read " << count-1 << " images from DB\r";
 	}
 
 	cout << "| Read " << count << " images from DB\n";
 
-	//DWORD diff = ::GetTickCount() - start;
-
-	//cout << "time for loading files: " << diff << endl;
-
-	//cvWaitKey(0);
+	std::vector<std::pair<double, size_t> > winners = best.sorted();
+	for(size_t i=0; i<winners.size(); i++)
+	{
+		GistDescriptor* winner = new GistDescriptor();
+		winner->m_dissimilarity = winners[i].first;
+		winner->m_id = winners[i].second;
+		winner->m_fileName = m_imageRootDir + m_fileNames.string_at(winners[i].second);
+		InsertElem(winner);
+	}
+}
 
+//loads the images of the list of similar gist descriptors into m_similarImages
+void CPDCIImage::LoadSimilarImages()
+{
 	//read in images
 	for(int i=0; i<m_GIST.size(); i++)
 	{
 		const char* fileName = m_GIST.at(i)->m_fileName.c_str();
 
 		IplImage* newImage = cvLoadImage(fileName, 1);
+
+		//a winner that matched mirrored is used flipped
+		if(m_GIST.at(i)->m_mirrored)
+			cvFlip(newImage, NULL, 1);
 		
 		//if newImage doesnt have same size as our input, then resize it!
 		if((newImage->width != m_inputImage.cols) || (newImage->height != m_inputImage.rows))
@@ -229,8 +1742,8 @@ void CPDCIImage::FindSimilarImagesFromLargeDB()
 
 void CPDCIImage::InsertElem(GistDescriptor* currGist)
 {
-	static double max = numeric_limits<double>::max();
-	if(m_GIST.size() >= m_maxNumSimilarImages && currGist->m_dissimilarity > max)
+	//m_GIST is sorted by dissimilarity, the last element is the worst one kept
+	if(m_GIST.size() >= m_maxNumSimilarImages && currGist->m_dissimilarity >= m_GIST.back()->m_dissimilarity)
 	{
 		delete currGist;
 		return;
@@ -247,9 +1760,10 @@ void CPDCIImage::InsertElem(GistDescriptor* currGist)
 	m_GIST.insert(it, currGist);
 
 	if(m_GIST.size() > m_maxNumSimilarImages)
+	{
+		delete m_GIST.back();
 		m_GIST.pop_back();
-
-	max = m_GIST.back()->m_dissimilarity;
+	}
 }
 
 //creates the gist descriptor of the input image, for later comparision with other images
@@ -261,6 +1775,8 @@ void CPDCIImage::CalcGISTofInput()
     // this generator expects the image to be a CV_8UC3 with BGR channel order.
     // ------------------------------------------------------------------------
 
+	int64 start = cv::getTickCount();
+
     cv::Mat image;
 	cv::cvtColor(m_inputImage, image, CV_BGR2GRAY);
 
@@ -286,108 +1802,49 @@ void CPDCIImage::CalcGISTofInput()
     // if exists, apply prefilter on image buffer
     // for example the torralba prefilter    
 	//torralba_prefilter(_width, _height, 4.0 /* * _width / _realwidth*/);
-	
-    cv::Mat_<std::complex<double>> src(_height, _width);
-    cv::MatConstIterator_<unsigned char> sit = padded.begin();
-    cv::MatIterator_<std::complex<double>> dit = src.begin();
-
-    while (sit != padded.end())
-    {
-        *dit++ = (float) *sit++ * (1.0/255.0);
-    }
-
-    // transform image into fourier space
-    cv::Mat_<std::complex<double>> fts;
-    cv::dft(src, fts);
-
-    //std::vector<float> means;
-    //std::vector<float> sdevs;
 
     // shouldn't we better use scaled.width and scaled.height?
     int tilewidth = scaling_factor * image.size().width / NUM_X_TILES;
     int tileheight = scaling_factor * image.size().height / NUM_Y_TILES;
 
-	std::vector<cv::Mat_<std::complex<double>> > _filters;
-	InitFilter(&_filters);
-
-	m_inputGIST = new GistDescriptor();
-
-    // convolve image with each filter in fourier space
-    for (size_t i = 0; i < _filters.size(); i++)
-    {
-        // multiply sprectrums == convolve
-        cv::Mat_<std::complex<double>> ftd;
-        cv::mulSpectrums(fts, _filters[i], ftd, 0);
-
-        // transform back to image space
-        cv::Mat_<std::complex<double>> dst;
-        cv::idft(ftd, dst, cv::DFT_SCALE);
-
-        // compute the response magnitude
-        cv::Mat_<float> mag(_height, _width);
-        for (int r = 0; r < dst.rows; r++)
-			for (int c = 0; c < dst.cols; c++)
-			{
-				float real = dst(r, c).real();
-				float imag = dst(r, c).imag();
-				mag(r, c) = std::sqrt(real*real + imag*imag);
-			}
+	int64 padEnd = cv::getTickCount();
 
-        // get mean and standard deviation of tile contents
-        for (size_t y = 0; y < NUM_Y_TILES; y++)
-			for (size_t x = 0; x < NUM_X_TILES; x++)
-			{
-				cv::Mat tile = mag(cv::Rect(x * tilewidth, y * tileheight, tilewidth, tileheight));
-				cv::Scalar m, d;
-				cv::meanStdDev(tile, m, d);
+	//same filters and transforms as gist_generator of compute_descriptors, in float
+	if(m_gistEngine.empty())
+	{
+		imdb::gist_params params;
+		params.realwidth = WIDTH;
+		params.realheight = HEIGHT;
+		params.padding = PADDING;
+		params.num_x_tiles = NUM_X_TILES;
+		params.num_y_tiles = NUM_Y_TILES;
+		params.num_freqs = NUM_FREQS;
+		params.num_orients = NUM_ORIENTS;
+		params.max_peak_freq = MAX_PEAK_FREQ;
+		params.delta_freq_oct = DELTA_FREQ_OCT;
+		params.bandwidth_oct = BANDWIDTH_OCT;
+		params.angle_factor = ANGLE_FACTOR;
+		params.polar = POLAR;
+		m_gistEngine = imdb::gist_engine(params, m_filterCache); //mapped from the cache when it was built before
+	}
 
-				//means.push_back(m[0]);
-				m_inputGIST->m_mean[i/NUM_ORIENTS][i%NUM_ORIENTS][y][x] = m.val[0];
+	m_inputGIST = new GistDescriptor();
 
-				//sdevs.push_back(d[0]*d[0]);
-				m_inputGIST->m_variance[i/NUM_ORIENTS][i%NUM_ORIENTS][y][x] = d[0]*d[0];
-			}
-    }
-	int blub = 42;	//DEBUG
-}
-
-void InitFilter(std::vector<cv::Mat_<std::complex<double>>>* _filters)
-{
-    const double delta_freq = std::pow(2.0, DELTA_FREQ_OCT);
-    const double bandwidth = std::pow(2.0, BANDWIDTH_OCT);
-    const double delta_omega = (M_PI / static_cast<double>(NUM_ORIENTS));
-	unsigned int _height = HEIGHT + PADDING;
-	unsigned int _width = WIDTH + PADDING;
-    const double max_extend = std::max(_width, _height);
-    const double pad_max_peak_freq = max_extend * MAX_PEAK_FREQ / (max_extend + static_cast<double>(PADDING));
-
-    // compute gabor filter in regular formation
-    for (size_t i = 0; i < NUM_FREQS; i++)
-    {
-        for (size_t k = 0; k < NUM_ORIENTS; k++)
-        {
-            // compute params
-            const double curPeak = pad_max_peak_freq / std::pow(delta_freq, static_cast<double>(i));
-            const double curOmega = k * delta_omega;
-
-            // generate filter
-            cv::Mat_<std::complex<double>> filter(_width, _height);
-            //if (_polar)
-            //{
-                generate_polargabor_filter(filter, curPeak, bandwidth, curOmega, delta_omega * ANGLE_FACTOR);
-            //}
-            //else
-            //{
-            //    generate_gabor_filter(filter, curPeak, bandwidth, curOmega, delta_omega * _angle_factor);
-            //}
-
-            // kill dc
-            filter(0, 0) = 0;
-
-            // add
-            _filters->push_back(filter);
-        }
-    }
+	//the filters are split over the threads, which share the spectrum of the input
+	//m_mean and m_variance are laid out like features_mean and features_variance
+	size_t numThreads = std::min<size_t>(m_numThreads > 0 ? m_numThreads : imdb::hardware_threads(), NUM_FREQS*NUM_ORIENTS);
+	imdb::gist_engine_timing timing;
+	int64 gistStart = cv::getTickCount();
+	m_gistEngine.compute_parallel(padded, tilewidth, tileheight, &m_inputGIST->m_mean[0][0][0][0], &m_inputGIST->m_variance[0][0][0][0],
+		numThreads, m_gistScratch, &timing);
+	int64 end = cv::getTickCount();
+
+	//inverse and statistics are summed over the threads, so they are given per filter
+	double ms = 1000.0 / cv::getTickFrequency();
+	cout << "| Gist of the input in " << (end - start)*ms << " ms (" << numThreads << " threads): resize/pad " << (padEnd - start)*ms
+		<< " ms, forward FFT " << timing.forward*1000.0 << " ms, filters " << (end - gistStart)*ms - timing.forward*1000.0 << " ms\n";
+	cout << "| Per filter: inverse FFT " << timing.inverse*1000.0/(NUM_FREQS*NUM_ORIENTS) << " ms, statistics "
+		<< timing.statistics*1000.0/(NUM_FREQS*NUM_ORIENTS) << " ms\n";
 }
 
 //just takes all images from the small local DB
@@ -503,7 +1960,7 @@ void CPDCIImage::SaveResults()
 	int i=0;
 	for(vector<cv::Mat>::iterator it = m_outputImages.begin(); it != m_outputImages.end(); it++, i++)
 	{
-		string imageType = "result";
+		string imageType = m_resultPrefix + "result";
 		string name = imageType;
 		int length = log((double)m_maxNumSimilarImages) + 2;
 		char* number = new char[length];
@@ -523,7 +1980,7 @@ void CPDCIImage::SaveMasks()
 	int i=0;
 	for(vector<cv::Mat>::iterator it = m_similarImagesMasks.begin(); it != m_similarImagesMasks.end(); it++, i++)
 	{
-		string imageType = "mask";
+		string imageType = m_resultPrefix + "mask";
 		string name = imageType;
 		int length = log((double)m_maxNumSimilarImages) + 2;
 		char* number = new char[length];
@@ -1103,20 +2560,6 @@ bool CPDCIImage::ReadInFileAsLines(std::string filename, std::vector<char*>* buf
 	return true;
 }
 
-//returns 0 if file could not be read, 1 otherwise
-bool CPDCIImage::ReadInFileNumBytes(std::ifstream* currentFile, char* buffer, int num_bytes)
-{
-	if(!currentFile->fail())
-	{
-		//file->get(buffer, num_bytes);
-		for (int i = 0; i < num_bytes; i++) { *buffer = currentFile->get(); buffer++; }
-    } 
-	else
-       return false;
-
-	return true;
-}
-
 bool CPDCIImage::OpenDescriptorFiles()
 {
 	std::string fileListName = "huge_filelist";
@@ -1124,46 +2567,22 @@ bool CPDCIImage::OpenDescriptorFiles()
 	std::string gistlistfeature_varianceName = "huge_gistfeatures_variance";
 	//std::string gistlistparameterName = "retrieval_framework_2012\\gistlistparameter";
 
-	m_meanFileHandle.open(gistlistfeature_meanName, std::ios::in | ios::binary);
-	m_varianceFileHandle.open(gistlistfeature_varianceName, std::ios::in | ios::binary);
-	m_fileListHandle.open(fileListName, std::ios::in | ios::binary);
+	size_t blockSize = (size_t)std::max(m_readBlockSize, 4)*1024;
+	size_t queueDepth = (size_t)std::max(m_readQueueDepth, 1);
 
-	if(m_meanFileHandle.fail() || m_varianceFileHandle.fail() || m_fileListHandle.fail())
+	try
+	{
+		m_meanReader.open(gistlistfeature_meanName, blockSize, queueDepth);
+		m_varianceReader.open(gistlistfeature_varianceName, blockSize, queueDepth);
+		m_fileListReader.open(fileListName, blockSize, queueDepth);
+	}
+	catch(std::exception& e)
+	{
+		cout << "| " << e.what() << endl;
+		CloseFileHandles();
 		return false;
-	
-	m_fileListBuffer = new char[65536];
-	m_meanFileBuffer = new char[65536];
-	m_varianceFileBuffer = new char[65536];
-	
-	m_fileListHandle.rdbuf()->pubsetbuf(m_fileListBuffer, 65536);
-	m_meanFileHandle.rdbuf()->pubsetbuf(m_meanFileBuffer, 65536);
-	m_varianceFileHandle.rdbuf()->pubsetbuf(m_varianceFileBuffer, 65536);
+	}
 
 	return true;
 }
 
-float CPDCIImage::ReadFloatFromFile(std::ifstream* fileHandle)
-{
-	char buffer[4];
-	ReadInFileNumBytes(fileHandle, buffer, 4);
-
-	if ((int*) buffer == 0) return 0.0;
-	else return *(float*)buffer;
-}
-
-int CPDCIImage::ReadIntFromFile(std::ifstream* fileHandle)
-{
-	char buffer[4];
-	ReadInFileNumBytes(fileHandle, buffer, 4);
-
-	return *(unsigned int*)buffer;
-}
-
-long CPDCIImage::ReadLongFromFile(std::ifstream* fileHandle)
-{
-	char buffer[8];
-	ReadInFileNumBytes(fileHandle, buffer, 8);
-
-	return *(unsigned long*)buffer;
-}
-
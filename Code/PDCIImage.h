@@ -6,6 +6,25 @@
 
 #include "cv.h"
 #include "graphcut\graph.h"
+#include "retrieval_framework_2012\shared\property_file.hpp"
+#include "retrieval_framework_2012\shared\read_ahead_file.hpp"
+#include "retrieval_framework_2012\shared\descriptors\gist_db.hpp"
+#include "retrieval_framework_2012\shared\descriptors\gist_distance.hpp"
+#include "retrieval_framework_2012\shared\descriptors\gist_quantizer.hpp"
+#include "retrieval_framework_2012\shared\descriptors\gist_pq.hpp"
+#include "retrieval_framework_2012\shared\descriptors\gist_ivf.hpp"
+#include "retrieval_framework_2012\shared\descriptors\gist_pca.hpp"
+#include "retrieval_framework_2012\shared\descriptors\gist_hash.hpp"
+#include "retrieval_framework_2012\shared\descriptors\gist_pivot.hpp"
+#include "retrieval_framework_2012\shared\descriptors\gist_tile_distances.hpp"
+#include "retrieval_framework_2012\shared\descriptors\gist_anytime.hpp"
+#include "retrieval_framework_2012\shared\descriptors\gist_block_codec.hpp"
+#include "retrieval_framework_2012\shared\descriptors\gist_engine.hpp"
+#include "retrieval_framework_2012\shared\descriptors\tiny_db.hpp"
+#include "retrieval_framework_2012\shared\search_protocol.hpp"
+#include "retrieval_framework_2012\shared\string_table.hpp"
+#include "retrieval_framework_2012\shared\top_k.hpp"
+#include "retrieval_framework_2012\shared\worker_threads.hpp"
 
 #define NUM_X_TILES 4
 #define NUM_Y_TILES 4
@@ -20,20 +39,37 @@
 #define ANGLE_FACTOR 1.0     // circular width factor
 #define POLAR true           // use polar gabor filter construction
 #define PREFILTER "none"	 // use prefilter (none, torralba)
+#define GIST_SCAN_BLOCK_SIZE 256 // records scored per call of the distance kernel
 
 #define M_PI 3.1415926535897932384626433832795
 
+enum SearchMode
+{
+	SEARCH_EXACT,	//scan the packed gist db (or the descriptor files)
+	SEARCH_PQ,		//scan the pq index, re-rank a shortlist with the float descriptors
+	SEARCH_CASCADE,	//scan the tiny images, compare the gist of the best m_cascadeSize
+	SEARCH_IVF,		//scan the m_numProbes lists of the ivf index nearest to the input
+	SEARCH_PCA,		//scan the pca reduced records, re-rank a shortlist with the float descriptors
+	SEARCH_HASH,	//scan the binary codes by hamming distance, re-rank a shortlist with the float descriptors
+	SEARCH_PIVOT,	//scan the packed gist db exactly, skipping the records the pivot table rules out
+	SEARCH_ANYTIME	//scan the packed gist db in a random order of its blocks until a deadline or budget
+};
+
 struct GistDescriptor
 {
 	float m_mean[NUM_FREQS][NUM_ORIENTS][NUM_Y_TILES][NUM_X_TILES];
 	float m_variance[NUM_FREQS][NUM_ORIENTS][NUM_Y_TILES][NUM_X_TILES];
 	std::string m_fileName;
 	double m_dissimilarity;
+	long long m_id; //index of the image in the filelist
+	bool m_mirrored; //the image matched flipped horizontally, it is flipped on load
 
 	GistDescriptor()
 	{
 		m_dissimilarity = -1.0;
 		m_fileName = "";
+		m_id = -1;
+		m_mirrored = false;
 	};
 };
 
@@ -48,8 +84,68 @@ private:
 	vector<cv::Mat> m_outputImages;
 	std::vector<GistDescriptor*> m_GIST; //list of gist descriptors below a certain similarity boundary
 	GistDescriptor* m_inputGIST;
+	imdb::gist_engine m_gistEngine; //filter bank of the gist, built by the first CalcGISTofInput
+	std::vector<imdb::gist_engine_scratch> m_gistScratch; //transform buffers of every CalcGISTofInput thread, kept for the next input
+	std::string m_filterCache; //directory the filter bank is cached in, empty = built by every process
 	vector<CvPoint>* m_listOfBorderPoints;
 	double m_maskOverlap[NUM_Y_TILES][NUM_X_TILES];
+	imdb::gist_db m_gistDB; //memory mapped, packed gist descriptors
+	imdb::property_file m_fileList; //filenames of the images in the db
+	imdb::string_table m_fileNames; //filenames read along with the descriptor files, by record id
+	std::vector<char> m_fileNameBuffer; //the filename of the record being read
+	imdb::read_ahead_file m_meanReader; //descriptor files of compute_descriptors, read ahead while the records are compared
+	imdb::read_ahead_file m_varianceReader;
+	imdb::read_ahead_file m_fileListReader;
+	int m_readBlockSize; //kilobytes per read of the descriptor files
+	int m_readQueueDepth; //reads of every descriptor file in flight, 2 or more overlap reading and comparing
+	imdb::gist_block_file m_meanBlocks; //block compressed descriptor files, scanned when there is no gist db
+	imdb::gist_block_file m_varianceBlocks;
+	std::vector<size_t> m_corruptBlocks; //blocks of the compressed files that could not be decoded, per scan thread
+	std::vector<float> m_inputRecord; //m_inputGIST in the record layout of m_gistDB
+	std::vector<float> m_recordWeights; //m_maskOverlap expanded to one weight per float of a record
+	std::vector<size_t> m_weightedTiles; //tiles with a mask weight > 0 by descending weight, the others need not be read
+	bool m_searchMirrored; //also score every record of a float gist db as its horizontally flipped image
+	std::vector<float> m_mirroredRecord; //m_inputRecord of the flipped input, scored against the records as they are
+	std::vector<float> m_mirroredWeights; //m_recordWeights of the flipped input
+	std::vector<size_t> m_mirroredTiles; //m_weightedTiles of the flipped input
+	std::vector<size_t> m_floatsRead; //floats of the gist db read by every scan thread, counts early abandoning
+	std::string m_imageRootDir; //prefix of the filenames in the filelist
+	int m_numThreads; //threads used to scan the gist db and to compute the gist of the input, 0 = one per core
+	std::vector<unsigned char> m_inputCodes; //m_inputRecord quantized like the records of a uint8 gist db
+	std::vector<int16_t> m_codeWeights; //m_recordWeights for the uint8 codes
+	float m_codeWeightFactor; //uint8 scan distance / m_codeWeightFactor ~ float distance
+	int m_shortlistSize; //candidates of a quantized scan that are re-ranked with the float descriptors
+	bool m_approximateSearch; //a quantized scan may be used without the float descriptors, its approximate distances are then the results
+	imdb::property_file m_meanFile; //float descriptors of compute_descriptors, for re-ranking
+	imdb::property_file m_varianceFile;
+	SearchMode m_searchMode;
+	imdb::gist_pq m_pqIndex; //memory mapped pq index, for SEARCH_PQ
+	std::vector<float> m_pqTables; //weighted distances of the input to the centroids of the pq index
+	imdb::tiny_db m_tinyDB; //memory mapped tiny images, for SEARCH_CASCADE
+	std::vector<unsigned char> m_inputTiny; //tiny image of the input, like those of m_tinyDB
+	std::vector<int16_t> m_tinyWeights; //share of known pixels under each value of m_inputTiny
+	int m_cascadeSize; //candidates of the tiny image scan that are compared by gist
+	imdb::gist_ivf m_ivfIndex; //memory mapped ivf index, for SEARCH_IVF
+	int m_numProbes; //lists of the ivf index that are scanned
+	std::vector<size_t> m_probedLists; //the m_numProbes lists nearest to the input
+	std::vector<size_t> m_probedBegin; //first record of every probed list, counted over all probed lists
+	imdb::gist_pca m_pcaStore; //memory mapped pca reduced records, for SEARCH_PCA
+	std::vector<float> m_pcaInput; //m_inputRecord projected like the records of m_pcaStore
+	std::vector<float> m_pcaWeights; //m_maskOverlap expanded to one weight per float of a reduced record
+	imdb::gist_hash m_hashIndex; //memory mapped binary codes, for SEARCH_HASH
+	std::vector<unsigned char> m_hashInput; //code of m_inputRecord
+	std::vector<float> m_hashWeights; //m_maskOverlap, one weight per tile of a code
+	imdb::gist_pivot_table m_pivotTable; //per-tile distances of the records to the pivots, for SEARCH_PIVOT
+	std::vector<float> m_pivotDistances; //per-tile distances of m_inputRecord to the pivots
+	std::vector<float> m_tileWeights; //m_maskOverlap, one weight per tile
+	std::vector<size_t> m_recordsSkipped; //records ruled out by the pivot table, per scan thread
+	imdb::gist_tile_distances m_tileDistances; //per-tile distances of m_inputRecord to all records of m_gistDB
+	std::string m_tileDistancesFile; //where m_tileDistances is kept between runs, empty = not kept
+	imdb::gist_anytime_scan m_anytimeScan; //order, position and best so far of the SEARCH_ANYTIME scan
+	double m_searchSeconds; //wall clock a SEARCH_ANYTIME scan may take, <= 0 = no deadline
+	int m_searchRecords; //records a SEARCH_ANYTIME scan may score, 0 = no budget
+	std::string m_resultPrefix; //prepended to the filenames of the saved results and masks
+	std::string m_searchServer; //socket of a running gistserver, empty = scan the db in this process
 
 public: 
 	CPDCIImage()
@@ -62,13 +158,35 @@ public:
 		m_outputImages.clear();
 		m_GIST.clear();
 		m_inputGIST = NULL;
+		m_imageRootDir = "h:\\";
+		m_numThreads = 0;
+		m_codeWeightFactor = 1.0f;
+		m_shortlistSize = 500;
+		m_approximateSearch = false;
+		m_searchMode = SEARCH_EXACT;
+		m_cascadeSize = 3000;
+		m_numProbes = 16;
+		m_resultPrefix = "";
+		m_searchServer = "";
+		m_tileDistancesFile = "";
+		m_searchMirrored = false;
+		m_searchSeconds = 2.0;
+		m_searchRecords = 0;
+		m_readBlockSize = 4096;
+		m_readQueueDepth = 4;
+		m_filterCache = "";
 	};
 
 	~CPDCIImage();
 
+	void AddSimilarImages(const std::vector<std::pair<float, size_t> >& winners, const std::vector<bool>* mirrored = NULL);
 	void Blend();
 	void CalcGISTofInput();
+	void CalcTinyOfInput();
 	double CalcSimilarity(GistDescriptor* descrA, GistDescriptor* descrB);
+	size_t CalcSimilarityByTile(size_t first, size_t count, float cutoff, bool mirrored, float* dissimilarities);
+	void CalcSimilarityUInt8(size_t first, size_t count, float* dissimilarities);
+	void CalcSimilarityHalf(size_t first, size_t count, float* dissimilarities);
 	bool Cleanup();
 	cv::Mat GetBestCut(cv::Mat similarImage);
 	void GetBestCuts();
@@ -79,25 +197,72 @@ public:
 	double GetDistWeight(int x, int y);
 	bool LoadImageFromFile(char* path);
 	bool LoadMaskFromFile(char* path);
+	bool OpenCompressedDescriptors();
 	bool OpenDescriptorFiles();
 	void FillGapsInMasks();
 	void FillGapsInMask(cv::Mat* mask);
 	void FindSimilarImagesFromLargeDB();
+	static void FindSimilarImagesBatch(const std::vector<CPDCIImage*>& jobs);
 	void FindSimilarImagesFromTinyDB();
+	size_t GetNumScanThreads(size_t numRecords);
 	void InitMaskBorder();
 	void InitMaskWeights();
 	void InsertElem(GistDescriptor* currGist);
+	void LoadSimilarImages();
+	bool OpenFloatDescriptors();
+	bool OpenRerankDescriptors();
+	bool OpenGistDatabase();
+	bool OpenHashIndex();
+	bool OpenIVFIndex();
+	bool OpenPCAStore();
+	bool OpenPivotTable();
+	bool OpenPQIndex();
+	bool OpenTinyDatabase();
+	void PackInputGIST();
 	void PrintSimilarImages();
-	int ReadIntFromFile(std::ifstream* fileHandle);
-	float ReadFloatFromFile(std::ifstream* fileHandle);
-	long ReadLongFromFile(std::ifstream* fileHandle);
-	GistDescriptor* ReadNextGistDescriptor();
+	void RankTileDistances();
+	bool ReadNextGistDescriptor(GistDescriptor* descr);
 	bool ReadInFile(std::string filename, std::vector<char>* buffer);
 	bool ReadInFileAsLines(std::string filename, std::vector<char*>* buffer);
-	bool ReadInFileNumBytes(std::ifstream* file, char* buffer, int num_bytes);
 	void CloseFileHandles();
+	bool ContinueSimilarImageSearch(double seconds, int records);
 	void SaveMasks();
 	void SaveResults();
+	void RerankShortlist(std::vector<std::pair<float, size_t> >* candidates);
+	void ScanAnytime();
+	void ScanCompressedDescriptors();
+	void ScanCompressedDescriptorsShard(size_t shard, size_t numShards, imdb::top_k<float, size_t>* result);
+	void ScanDescriptorFiles();
+	void ScanGistDatabase();
+	void ScanGistDatabaseShard(size_t shard, size_t numShards, imdb::top_k<float, size_t>* result);
+	void ScanHashIndex();
+	void ScanHashIndexShard(size_t shard, size_t numShards, imdb::top_k<float, size_t>* result);
+	void ScanIVFIndex();
+	void ScanIVFIndexShard(size_t shard, size_t numShards, imdb::top_k<float, size_t>* result);
+	void ScanPCAStore();
+	void ScanPCAStoreShard(size_t shard, size_t numShards, imdb::top_k<float, size_t>* result);
+	void ScanPivotTable();
+	void ScanPivotTableShard(size_t shard, size_t numShards, imdb::top_k<float, size_t>* result);
+	void ScanPQIndex();
+	void ScanPQIndexShard(size_t shard, size_t numShards, imdb::top_k<float, size_t>* result);
+	void ScanTinyDatabase();
+	void ScanTinyDatabaseShard(size_t shard, size_t numShards, imdb::top_k<float, size_t>* result);
+	bool SearchServer();
+	void SetApproximateSearch(bool approximateSearch);
+	void SetCascadeSize(int cascadeSize);
+	void SetFilterCache(const std::string& filterCache);
+	void SetNumProbes(int numProbes);
+	void SetNumThreads(int numThreads);
+	void SetReadBlockSize(int readBlockSize);
+	void SetReadQueueDepth(int readQueueDepth);
+	void SetResultPrefix(const std::string& resultPrefix);
+	void SetSearchBudget(int searchRecords);
+	void SetSearchDeadline(double searchSeconds);
+	void SetSearchMirrored(bool searchMirrored);
+	void SetSearchMode(SearchMode searchMode);
+	void SetSearchServer(const std::string& searchServer);
+	void SetShortlistSize(int shortlistSize);
+	void SetTileDistancesFile(const std::string& tileDistancesFile);
 	void SetSourceAndSink(Graph<int,int,int>* g);
 	void ShowMasks();
 	void ShowResults();
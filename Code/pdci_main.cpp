@@ -8,11 +8,43 @@
 #include "highgui.h"
 #include "PDCIImage.h"
 #include <iostream>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <vector>
 
 using namespace std;
 
 // usage: path to image in argv[1]
 // usage: path to mask in argv[2]
+// or:    --batch in argv[1], a job list in argv[2]: one line per input, path to image and path to mask,
+//        the db is scanned once for all of them, the results of job i are saved as job<i>_result...
+// options after that: --threads <n>   number of threads for the db scan and the gist of the input (default: one per core)
+//                     --shortlist <n> candidates of a quantized db, pq index, pca store or hash file that are re-ranked (default: 500)
+//                     --search <mode> exact (default), pq, cascade, ivf, pca, hash, pivot or anytime
+//                     --cascade <n>   candidates of the tiny image scan compared by gist (default: 3000)
+//                     --nprobe <n>    lists of the ivf index that are scanned (default: 16)
+//                     --deadline <s>  seconds the anytime search may take, 0 = no deadline (default: 2)
+//                     --budget <n>    records the anytime search may score, 0 = no budget (default: 0)
+//                     --continue <s>  seconds the anytime search goes on for after its first pass, if that did
+//                                     not scan the whole db, from where it stopped (default: 0, no second pass)
+//                     --readblock <n> kilobytes per read of the descriptor files when there is no gist db (default: 4096)
+//                     --readdepth <n> reads of every descriptor file kept in flight (default: 4)
+//                     --filtercache <dir> directory the gist filter bank is kept in, later runs map it
+//                                     instead of computing it (default: none, computed every run)
+//                     --server <path> socket of a running gistserver (it keeps the gist db mapped),
+//                                     asked instead of scanning the db in this process
+//                     --tiledist <path> file that keeps the per-tile distances of the input to the
+//                                     float gist db, another mask on the same image is then ranked
+//                                     from it without scanning the db
+//                     --mirror <0|1>  also match the images of a float gist db flipped horizontally,
+//                                     mirrored winners are flipped on load (default: 0). only the exact
+//                                     scan of the packed db supports it, not the other search modes,
+//                                     --server, --tiledist or a quantized db
+//                     --approximate <0|1> use a quantized db, pq index, pca store or hash file without
+//                                     the float descriptors to re-rank with, its approximate distances
+//                                     are the results (default: 0, such a search is skipped)
 // this is the start function, it calls all necessary sub functions
 int main(int argc, char** argv)
 {
@@ -21,16 +53,101 @@ int main(int argc, char** argv)
 	//init time measurement
 	DWORD start = GetTickCount();
 
-	//create container for the image
-	CPDCIImage* imageData = new CPDCIImage();
+	//(image, mask) of every input
+	vector<std::pair<string, string> > inputs;
+	if(argc >= 3 && strcmp(argv[1], "--batch") == 0)
+	{
+		ifstream jobList(argv[2]);
+		if(!jobList.is_open())
+			cout << "| Could not open the job list " << argv[2] << endl;
+
+		string image, mask;
+		while(jobList >> image >> mask)
+			inputs.push_back(std::make_pair(image, mask));
+	}
+	else if(argc >= 3)
+		inputs.push_back(std::make_pair(string(argv[1]), string(argv[2])));
+
+	if(inputs.empty())
+	{
+		cout << "| usage: " << argv[0] << " <image> <mask> [options]" << endl;
+		cout << "|        " << argv[0] << " --batch <job list> [options]" << endl;
+		return 1;
+	}
 
 	cout << "| Loading and Preprocessing Input" << endl;
 
-	//load the input
-	imageData->LoadImageFromFile(argv[1]);
-	imageData->LoadMaskFromFile(argv[2]);
-
-	imageData->CalcGISTofInput();
+	//create a container for every image
+	vector<CPDCIImage*> jobs;
+	double continueSeconds = 0;
+	for(size_t j=0; j<inputs.size(); j++)
+	{
+		CPDCIImage* imageData = new CPDCIImage();
+
+		//load the input
+		imageData->LoadImageFromFile(&inputs[j].first[0]);
+		imageData->LoadMaskFromFile(&inputs[j].second[0]);
+
+		if(inputs.size() > 1)
+		{
+			stringstream prefix;
+			prefix << "job" << j << "_";
+			imageData->SetResultPrefix(prefix.str());
+		}
+
+		for(int i=3; i+1<argc; i+=2)
+		{
+			if(strcmp(argv[i], "--threads") == 0)
+				imageData->SetNumThreads(atoi(argv[i+1]));
+			else if(strcmp(argv[i], "--shortlist") == 0)
+				imageData->SetShortlistSize(atoi(argv[i+1]));
+			else if(strcmp(argv[i], "--search") == 0 && strcmp(argv[i+1], "pq") == 0)
+				imageData->SetSearchMode(SEARCH_PQ);
+			else if(strcmp(argv[i], "--search") == 0 && strcmp(argv[i+1], "cascade") == 0)
+				imageData->SetSearchMode(SEARCH_CASCADE);
+			else if(strcmp(argv[i], "--search") == 0 && strcmp(argv[i+1], "ivf") == 0)
+				imageData->SetSearchMode(SEARCH_IVF);
+			else if(strcmp(argv[i], "--search") == 0 && strcmp(argv[i+1], "pca") == 0)
+				imageData->SetSearchMode(SEARCH_PCA);
+			else if(strcmp(argv[i], "--search") == 0 && strcmp(argv[i+1], "hash") == 0)
+				imageData->SetSearchMode(SEARCH_HASH);
+			else if(strcmp(argv[i], "--search") == 0 && strcmp(argv[i+1], "pivot") == 0)
+				imageData->SetSearchMode(SEARCH_PIVOT);
+			else if(strcmp(argv[i], "--search") == 0 && strcmp(argv[i+1], "anytime") == 0)
+				imageData->SetSearchMode(SEARCH_ANYTIME);
+			else if(strcmp(argv[i], "--deadline") == 0)
+				imageData->SetSearchDeadline(atof(argv[i+1]));
+			else if(strcmp(argv[i], "--budget") == 0)
+				imageData->SetSearchBudget(atoi(argv[i+1]));
+			else if(strcmp(argv[i], "--continue") == 0)
+				continueSeconds = atof(argv[i+1]);
+			else if(strcmp(argv[i], "--readblock") == 0)
+				imageData->SetReadBlockSize(atoi(argv[i+1]));
+			else if(strcmp(argv[i], "--readdepth") == 0)
+				imageData->SetReadQueueDepth(atoi(argv[i+1]));
+			else if(strcmp(argv[i], "--filtercache") == 0)
+				imageData->SetFilterCache(argv[i+1]);
+			else if(strcmp(argv[i], "--search") == 0 && strcmp(argv[i+1], "exact") == 0)
+				imageData->SetSearchMode(SEARCH_EXACT);
+			else if(strcmp(argv[i], "--cascade") == 0)
+				imageData->SetCascadeSize(atoi(argv[i+1]));
+			else if(strcmp(argv[i], "--nprobe") == 0)
+				imageData->SetNumProbes(atoi(argv[i+1]));
+			else if(strcmp(argv[i], "--server") == 0)
+				imageData->SetSearchServer(argv[i+1]);
+			else if(strcmp(argv[i], "--tiledist") == 0)
+				imageData->SetTileDistancesFile(argv[i+1]);
+			else if(strcmp(argv[i], "--mirror") == 0)
+				imageData->SetSearchMirrored(atoi(argv[i+1]) != 0);
+			else if(strcmp(argv[i], "--approximate") == 0)
+				imageData->SetApproximateSearch(atoi(argv[i+1]) != 0);
+			else if(j == 0)
+				cout << "| Ignoring unknown option " << argv[i] << endl;
+		}
+
+		imageData->CalcGISTofInput();
+		jobs.push_back(imageData);
+	}
 
 	cout << "|===========================================|" <<endl;
 	double deltaInS = (GetTickCount() - start) / 1000.0;
@@ -40,49 +157,66 @@ int main(int argc, char** argv)
 	cout << "| Search for Similar Images in DB" << endl;
 
 	//find similar images in large db
-	imageData->FindSimilarImagesFromLargeDB(); //this is for the large image db
-	//imageData->FindSimilarImagesFromTinyDB();
+	if(jobs.size() > 1)
+		CPDCIImage::FindSimilarImagesBatch(jobs); //one scan of the large image db for all inputs
+	else
+		jobs[0]->FindSimilarImagesFromLargeDB(); //this is for the large image db
+	//jobs[0]->FindSimilarImagesFromTinyDB();
+
+	//a second pass of the anytime search, the similar images become the best found after it
+	if(continueSeconds > 0)
+	{
+		if(jobs.size() == 1 && jobs[0]->ContinueSimilarImageSearch(continueSeconds, 0))
+			cout << "| Continued the anytime search for " << continueSeconds << "s" << endl;
+		else
+			cout << "| Nothing to continue: not a single anytime search, or it scanned the whole db" << endl;
+	}
 
 	cout << "|===========================================|" <<endl;
 	deltaInS = (GetTickCount() - start) / 1000.0;
 	cout << "| " << deltaInS << " seconds passed since program start" << endl;
 	cout << "|===========================================|" <<endl;
 
-	//debug: show the similar images found
-	//imageData->PrintSimilarImages();
+	for(size_t j=0; j<jobs.size(); j++)
+	{
+		CPDCIImage* imageData = jobs[j];
 
-	cout << "| Calc Best Cuts" << endl;
+		//debug: show the similar images found
+		//imageData->PrintSimilarImages();
 
-	//test all results with input image and mask:
-	imageData->GetBestCuts();
+		cout << "| Calc Best Cuts" << endl;
 
-	cout << "|===========================================|" <<endl;
-	deltaInS = (GetTickCount() - start) / 1000.0;
-	cout << "| " << deltaInS << " seconds passed since program start" << endl;
-	cout << "|===========================================|" <<endl;
+		//test all results with input image and mask:
+		imageData->GetBestCuts();
 
-	//imageData->ShowMasks();
-	imageData->SaveMasks();
-	//cvWaitKey(0);
+		cout << "|===========================================|" <<endl;
+		deltaInS = (GetTickCount() - start) / 1000.0;
+		cout << "| " << deltaInS << " seconds passed since program start" << endl;
+		cout << "|===========================================|" <<endl;
 
-	cout << "| Poisson Blend Images" << endl;
+		//imageData->ShowMasks();
+		imageData->SaveMasks();
+		//cvWaitKey(0);
 
-	//poison blend images
-	imageData->Blend();
+		cout << "| Poisson Blend Images" << endl;
 
-	cout << "|===========================================|" <<endl;
-	deltaInS = (GetTickCount() - start) / 1000.0;
-	cout << "| " << deltaInS << " seconds passed since program start" << endl;
-	cout << "|===================END=====================|" <<endl;
+		//poison blend images
+		imageData->Blend();
+
+		cout << "|===========================================|" <<endl;
+		deltaInS = (GetTickCount() - start) / 1000.0;
+		cout << "| " << deltaInS << " seconds passed since program start" << endl;
+		cout << "|===================END=====================|" <<endl;
 
-	//debug: show output images on screen
-	imageData->ShowResults();
+		//debug: show output images on screen
+		imageData->ShowResults();
 
-	//save images to disk
-	imageData->SaveResults();
+		//save images to disk
+		imageData->SaveResults();
 
-	//cvWaitKey(0);		//DEBUG for batch processing
+		//cvWaitKey(0);		//DEBUG for batch processing
 
-	//cleanup data to avoid memory leaks
-	imageData->Cleanup();
+		//cleanup data to avoid memory leaks
+		imageData->Cleanup();
+	}
 }
@@ -24,4 +24,7 @@ HEADERS += types.hpp \
     imagefiles.h \
     descriptors/tinylab.hpp \
     descriptors/gist.hpp \
-    descriptors/utilities.hpp
+    descriptors/gist_engine.hpp \
+    descriptors/gist_filter_bank.hpp \
+    descriptors/utilities.hpp \
+    worker_threads.hpp
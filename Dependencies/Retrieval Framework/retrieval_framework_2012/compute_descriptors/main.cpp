@@ -7,6 +7,7 @@
 #include <vector>
 #include <algorithm>
 #include <cstdlib>
+#include <cmath>
 #include <map>
 #include <queue>
 #include <stdexcept>
@@ -24,6 +25,7 @@
 #include <generator.hpp>
 #include <cmdline.hpp>
 #include <imagefiles.h>
+#include <descriptors/gist.hpp>
 
 #include <opencv2/highgui/highgui.hpp>
 
@@ -368,6 +370,24 @@ void print_available_generators()
     }
 }
 
+// puts the name=value pairs of the -p option into params
+bool parse_generator_params(const std::vector<std::string>& in_params, ptree& params)
+{
+    for (size_t i = 0; i < in_params.size(); i++)
+    {
+        std::vector<std::string> pv;
+        boost::algorithm::split(pv, in_params[i], boost::algorithm::is_any_of("="));
+
+        if (pv.size() != 1 && pv.size() != 2)
+        {
+            std::cerr << "cannot parse parameter: " << in_params[i] << std::endl;
+            return false;
+        }
+        params.put(pv[0], (pv.size() == 2) ? pv[1] : "");
+    }
+    return true;
+}
+
 class command_compute : public Command
 {
 public:
@@ -439,19 +459,7 @@ public:
 
         _co_params.parse_multiple<std::string>(args, in_params);
 
-
-        for (size_t i = 0; i < in_params.size(); i++)
-        {
-            std::vector<std::string> pv;
-            boost::algorithm::split(pv, in_params[i], boost::algorithm::is_any_of("="));
-
-            if (pv.size() != 1 && pv.size() != 2)
-            {
-                std::cerr << "cannot parse parameter: " << in_params[i] << std::endl;
-                return false;
-            }
-            params.put(pv[0], (pv.size() == 2) ? pv[1] : "");
-        }
+        if (!parse_generator_params(in_params, params)) return false;
 
         ImageFiles files(in_rootdir);
         if (!_co_filelist.parse_single<std::string>(args, in_filelist))
@@ -518,6 +526,143 @@ private:
     CmdOption _co_numthreads;
 };
 
+// Largest difference of a and b, features of num_tiles values per filter,
+// relative to the largest value of b of the same filter.
+double max_relative_error(const vec_f32_t& a, const vec_f32_t& b, size_t num_tiles)
+{
+    double error = 0.0;
+    for (size_t first = 0; first + num_tiles <= b.size(); first += num_tiles)
+    {
+        const double largest = std::fabs(*std::max_element(b.begin() + first, b.begin() + first + num_tiles));
+        if (largest == 0.0) continue;
+
+        for (size_t t = first; t < first + num_tiles; t++) error = std::max(error, std::fabs(a[t] - b[t]) / largest);
+    }
+    return error;
+}
+
+class command_gistcheck : public Command
+{
+public:
+
+    command_gistcheck()
+        : Command("gistcheck [options]")
+        , _co_rootdir ("rootdir"   , "r", "root directory of the images [required]")
+        , _co_filelist("filelist"  , "f", "file that contains filenames of the images [required]")
+        , _co_params  ("parameters", "p", "parameters of the gist generator [optional] (default: params defined in generator)")
+        , _co_sample  ("sample"    , "n", "number of images, a random sample of the file list [optional] (default: 100)")
+        , _co_compare ("compare"   , "c", "decimate: decimated against full inverse transforms, reference: the engine against double precision [optional] (default: decimate)")
+    {
+        add(_co_rootdir);
+        add(_co_filelist);
+        add(_co_params);
+        add(_co_sample);
+        add(_co_compare);
+    }
+
+    // Computes the gist of a sample of images two ways and prints the
+    // largest errors of the means and variances, against the tolerances of
+    // gist_engine.hpp: decimated against full inverse transforms, or the
+    // engine against gist_engine::compute_reference.
+    bool run(const std::vector<std::string>& args)
+    {
+        warn_for_unknown_option(args);
+
+        std::string in_rootdir;
+        std::string in_filelist;
+        std::vector<std::string> in_params;
+        size_t in_sample = 100;
+        std::string in_compare = "decimate";
+
+        if (!_co_rootdir.parse_single<std::string>(args, in_rootdir)
+                || !_co_filelist.parse_single<std::string>(args, in_filelist))
+        {
+            print();
+            return false;
+        }
+
+        _co_params.parse_multiple<std::string>(args, in_params);
+        _co_sample.parse_single<size_t>(args, in_sample);
+        _co_compare.parse_single<std::string>(args, in_compare);
+
+        if (in_compare != "decimate" && in_compare != "reference")
+        {
+            print();
+            return false;
+        }
+        const bool reference = (in_compare == "reference");
+
+        ptree params;
+        if (!parse_generator_params(in_params, params)) return false;
+
+        ImageFiles files(in_rootdir);
+        files.load(in_filelist);
+        if (files.size() > in_sample) files.random_sample(in_sample, 0);
+
+        ptree full_params(params);
+        ptree decimated_params(params);
+        full_params.put("params.decimate", false);
+        decimated_params.put("params.decimate", true);
+
+        gist_generator full(full_params);
+        gist_generator decimated(decimated_params);
+
+        const ptree& p = decimated.parameters();
+        const size_t num_tiles = p.get<size_t>("params.num_x_tiles") * p.get<size_t>("params.num_y_tiles");
+        const double mean_tolerance = reference ? gist_engine_tolerance : p.get<double>("params.decimate_mean_tolerance");
+        const double variance_tolerance = reference ? gist_engine_tolerance : p.get<double>("params.decimate_variance_tolerance");
+
+        image_loader loader(files);
+        double mean_error = 0.0;
+        double variance_error = 0.0;
+        for (size_t i = 0; i < loader.size(); i++)
+        {
+            // the error is that of checked, relative to truth
+            anymap_t checked;
+            loader.get(i, checked);
+            anymap_t truth(checked);
+
+            if (reference)
+            {
+                full.compute(checked);
+                full.compute_reference(truth);
+            }
+            else
+            {
+                decimated.compute(checked);
+                full.compute(truth);
+            }
+
+            mean_error = std::max(mean_error, max_relative_error(get<vec_f32_t>(checked, "features_mean"), get<vec_f32_t>(truth, "features_mean"), num_tiles));
+            variance_error = std::max(variance_error, max_relative_error(get<vec_f32_t>(checked, "features_variance"), get<vec_f32_t>(truth, "features_variance"), num_tiles));
+
+            std::cout << "gistcheck: " << i + 1 << "/" << loader.size() << '\r' << std::flush;
+        }
+
+        std::cout << "gistcheck: " << loader.size() << " images, "
+                  << (reference ? "engine against double precision," : "decimated against full inverse transforms,") << std::endl;
+        std::cout << "gistcheck: error relative to the largest value of the filter" << std::endl;
+        std::cout << "gistcheck: mean     " << mean_error << " (tolerance " << mean_tolerance << ")" << std::endl;
+        std::cout << "gistcheck: variance " << variance_error << " (tolerance " << variance_tolerance << ")" << std::endl;
+
+        if (mean_error > mean_tolerance || variance_error > variance_tolerance)
+        {
+            std::cerr << "gistcheck: descriptors are not within the tolerance" << std::endl;
+            return false;
+        }
+
+        return true;
+    }
+
+private:
+
+    CmdOption _co_rootdir;
+    CmdOption _co_filelist;
+    CmdOption _co_params;
+    CmdOption _co_sample;
+    CmdOption _co_compare;
+};
+
 class command_info : public Command
 {
 public:
@@ -607,6 +752,7 @@ int main(int argc, char *argv[])
     cmd_map_t cmd_desc;
     cmd_desc["compute"]    = std::make_pair(boost::make_shared<command_compute>()   , "compute descriptors");
     cmd_desc["info"]       = std::make_pair(boost::make_shared<command_info>()      , "print informations of specific generator");
+    cmd_desc["gistcheck"]  = std::make_pair(boost::make_shared<command_gistcheck>() , "measure the error of the gist engine on sample images");
     cmd_desc["list"]       = std::make_pair(boost::make_shared<command_list>()      , "print list of available generators");
     //cmd_desc["convert"]    = std::make_pair(boost::make_shared<command_convert>()   , "convert old property file to new one");
 
@@ -0,0 +1,31 @@
+TARGET = gistdb
+include(../common.pri)
+
+CONFIG += console
+
+TEMPLATE = app
+
+LIBS += -lopencv_core
+
+SOURCES += main.cpp
+
+HEADERS += types.hpp \
+    io.hpp \
+    property.hpp \
+    cmdline.hpp \
+    mapped_file.hpp \
+    property_file.hpp \
+    read_ahead_file.hpp \
+    descriptors/gist_db.hpp \
+    descriptors/gist_quantizer.hpp \
+    descriptors/gist_distance.hpp \
+    descriptors/gist_pq.hpp \
+    descriptors/gist_ivf.hpp \
+    descriptors/gist_pca.hpp \
+    descriptors/gist_hash.hpp \
+    descriptors/gist_pivot.hpp \
+    descriptors/gist_anytime.hpp \
+    descriptors/gist_block_codec.hpp \
+    descriptors/tiny_db.hpp \
+    top_k.hpp \
+    worker_threads.hpp
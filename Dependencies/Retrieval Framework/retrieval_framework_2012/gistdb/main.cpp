@@ -0,0 +1,1830 @@
+#include <string>
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <map>
+#include <stdexcept>
+#include <cstdio>
+#include <ctime>
+#include <algorithm>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include <boost/property_tree/json_parser.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+#include <types.hpp>
+#include <property.hpp>
+#include <cmdline.hpp>
+#include <descriptors/gist_db.hpp>
+#include <descriptors/gist_quantizer.hpp>
+#include <descriptors/gist_pq.hpp>
+#include <descriptors/gist_ivf.hpp>
+#include <descriptors/gist_pca.hpp>
+#include <descriptors/gist_hash.hpp>
+#include <descriptors/gist_pivot.hpp>
+#include <descriptors/gist_anytime.hpp>
+#include <descriptors/gist_block_codec.hpp>
+#include <descriptors/tiny_db.hpp>
+#include <top_k.hpp>
+#include <read_ahead_file.hpp>
+
+// ------------------------------------------------------------
+// Tools that turn the output of compute_descriptors into the
+// search structures used by the scene completion (PDCI).
+//
+// a) pack the gist descriptors into a single file that can be
+//    memory mapped and scanned in place:
+//
+//    gistdb pack -i huge_gist -o huge_gistdb
+//
+//    reads huge_gistfeatures_mean, huge_gistfeatures_variance
+//    and (if present) huge_gistparameters.
+//
+//    with -l tile the db is written tile-major, which lets a query
+//    skip the tiles its mask does not weight:
+//
+//    gistdb pack -i huge_gist -o huge_gistdb -l tile
+//
+// b) quantize a packed gist db to uint8 codes (or half floats),
+//    the scan then re-ranks a shortlist with the float descriptors:
+//
+//    gistdb quantize -i huge_gistdb_f32 -o huge_gistdb -e uint8
+//
+// c) train and write a product quantization index (one sub-quantizer
+//    per tile), and measure its recall against the exact scan:
+//
+//    gistdb pq -i huge_gistdb -o huge_gistpq
+//    gistdb pqrecall -i huge_gistdb -p huge_gistpq
+//
+// d) pack the tinylab descriptors into a tiny db for the cascade search,
+//    downsampled to 8x8 pixels and one byte per channel:
+//
+//    gistdb tiny -i huge_tinylab -o huge_tinydb
+//
+// e) cluster the records into an inverted file (ivf) index, whose
+//    lists are searched instead of the whole db, and measure its
+//    recall for different numbers of probed lists:
+//
+//    gistdb ivf -i huge_gistdb -o huge_gistivf -l 1024
+//    gistdb ivfrecall -i huge_gistdb -v huge_gistivf
+//
+// f) project every tile onto its principal components and write the
+//    reduced records, scanned before re-ranking a shortlist exactly:
+//
+//    gistdb pca -i huge_gistdb -o huge_gistpca -d 6
+//    gistdb pcarecall -i huge_gistdb -c huge_gistpca
+//
+// g) encode every record as a binary code (16 bits per tile), whose
+//    weighted Hamming distances pick the candidates re-ranked exactly:
+//
+//    gistdb hash -i huge_gistdb -o huge_gisthash -b 16
+//    gistdb hashrecall -i huge_gistdb -a huge_gisthash
+//
+// h) pick a few pivot descriptors and tabulate the per-tile distance of
+//    every record to them, the exact scan then skips the records whose
+//    lower bound shows they cannot make it into the result:
+//
+//    gistdb pivots -i huge_gistdb -o huge_gistpivot -p 8
+//    gistdb pivotprune -i huge_gistdb -t huge_gistpivot
+//
+// i) measure how close the anytime scan (blocks in random order, stopped
+//    early) gets to the exact result after every tenth of the db:
+//
+//    gistdb anytime -i huge_gistdb -s 10
+//
+// j) write a block compressed copy of the descriptor files, which PDCI
+//    scans when there is no packed gist db:
+//
+//    gistdb compress -i huge_gist -o huge_gistz -b 64
+//
+//    writes huge_gistzfeatures_mean and huge_gistzfeatures_variance.
+//
+//    the size and decode speed of every code, and the read speed of
+//    the descriptor files to hold them against, for a sample:
+//
+//    gistdb compressstats -i huge_gist -n 100000
+//
+// k) check that the read ahead reader of PDCI returns a file byte for
+//    byte, for block sizes from 4 KB to 16 MB and queue depths 1 to 7
+//    (built with -fsanitize=thread this also checks its threads):
+//
+//    gistdb readcheck -i huge_gistfeatures_mean
+// ------------------------------------------------------------
+
+using namespace imdb;
+
+// reads the tile/filter layout from the parameters file written by
+// compute_descriptors, falls back to the gist generator defaults
+gist_geometry read_geometry(const std::string& filename)
+{
+    gist_geometry geometry;
+
+    std::ifstream ifs(filename.c_str());
+    if (!ifs.is_open())
+    {
+        std::cout << "gistdb: no parameters file " << filename << ", assuming default gist layout" << std::endl;
+        return geometry;
+    }
+
+    ptree params;
+    boost::property_tree::read_json(ifs, params);
+
+    geometry.num_x_tiles = params.get<uint32_t>("params.num_x_tiles", geometry.num_x_tiles);
+    geometry.num_y_tiles = params.get<uint32_t>("params.num_y_tiles", geometry.num_y_tiles);
+    geometry.num_freqs   = params.get<uint32_t>("params.num_freqs"  , geometry.num_freqs);
+    geometry.num_orients = params.get<uint32_t>("params.num_orients", geometry.num_orients);
+
+    return geometry;
+}
+
+void progress_records(size_t index, size_t size)
+{
+    static const size_t ival = 10000;
+    if (index % ival == 0) std::cout << "gistdb: " << index << "/" << size << '\r' << std::flush;
+}
+
+// Queries of the recall and pruning measurements: random records of a
+// float, record-major gist db with random tile weights, a third of the
+// tiles without weight, like a query with a hole. next() picks one and
+// scans the db for its exact k nearest records, the commands then count
+// how many of them their search finds.
+class recall_queries
+{
+public:
+
+    recall_queries(const gist_db& db, size_t k)
+        : _db(db)
+        , _k(k)
+        , _rng(4711)
+        , _query(0)
+        , _weights(db.geometry().record_floats())
+        , _tile_weights(db.geometry().num_tiles())
+        , _distances(db.size())
+        , _time_exact(0)
+    {}
+
+    void next()
+    {
+        const gist_geometry& g = _db.geometry();
+        const size_t dim = g.record_floats();
+        const size_t n = _db.size();
+
+        _query = _db.record(_rng() % n);
+        for (size_t t = 0; t < g.num_tiles(); t++)
+        {
+            _tile_weights[t] = (_rng() % 3 == 0) ? 0.0f : (_rng() % 1000) / 1000.0f;
+            std::fill(_weights.begin() + t * g.tile_floats(), _weights.begin() + (t + 1) * g.tile_floats(), _tile_weights[t]);
+        }
+
+        std::clock_t start = std::clock();
+        gist_weighted_l1(_query, &_weights[0], _db.record(0), _db.stride() / sizeof(float), dim, n, &_distances[0]);
+        top_k<float, size_t> exact(_k);
+        for (size_t i = 0; i < n; i++) exact.push(_distances[i], i);
+        _time_exact += double(std::clock() - start) / CLOCKS_PER_SEC;
+
+        _truth = exact.sorted();
+    }
+
+    const float* query() const { return _query; }
+
+    // weight of every float of a record, and of every tile
+    const float* weights() const { return &_weights[0]; }
+    const float* tile_weights() const { return &_tile_weights[0]; }
+
+    // exact nearest records of the query, (distance, record index)
+    const std::vector<std::pair<float, size_t> >& truth() const { return _truth; }
+
+    // seconds of the exact scans so far
+    double time_exact() const { return _time_exact; }
+
+    // db.size() floats the commands may use for their own distances
+    float* distances() { return &_distances[0]; }
+
+    uint32_t random() { return _rng(); }
+
+    // how many of the exact neighbors are in result, of record indices or, with by_id, of db ids
+    template <class T>
+    size_t hits(const std::vector<std::pair<float, T> >& result, bool by_id = false) const
+    {
+        size_t found = 0;
+        for (size_t a = 0; a < _truth.size(); a++)
+        {
+            const int64_t wanted = by_id ? _db.id(_truth[a].second) : static_cast<int64_t>(_truth[a].second);
+            for (size_t b = 0; b < result.size(); b++)
+            {
+                if (static_cast<int64_t>(result[b].second) == wanted) { found++; break; }
+            }
+        }
+        return found;
+    }
+
+    // the hits of the first shortlist candidates (record indices) re-ranked exactly
+    size_t rerank_hits(const std::vector<std::pair<float, size_t> >& candidates, size_t shortlist) const
+    {
+        const size_t dim = _db.geometry().record_floats();
+        top_k<float, size_t> reranked(_k);
+        for (size_t c = 0; c < std::min(shortlist, candidates.size()); c++)
+        {
+            float d;
+            gist_weighted_l1(_query, &_weights[0], _db.record(candidates[c].second), dim, dim, 1, &d);
+            reranked.push(d, candidates[c].second);
+        }
+        return hits(reranked.sorted());
+    }
+
+private:
+
+    const gist_db&      _db;
+    const size_t        _k;
+    detail::xorshift32  _rng;
+    const float*        _query;
+    std::vector<float>  _weights;
+    std::vector<float>  _tile_weights;
+    std::vector<float>  _distances;
+    double              _time_exact;
+    std::vector<std::pair<float, size_t> > _truth;
+};
+
+class command_pack : public Command
+{
+public:
+
+    command_pack()
+        : Command("pack [options]")
+        , _co_input ("input" , "i", "prefix of the gist descriptor files written by compute_descriptors [required]")
+        , _co_output("output", "o", "filename of the packed gist db [required]")
+        , _co_layout("layout", "l", "record (default) or tile: store the descriptors record-major or tile-major")
+    {
+        add(_co_input);
+        add(_co_output);
+        add(_co_layout);
+    }
+
+    bool run(const std::vector<std::string>& args)
+    {
+        warn_for_unknown_option(args);
+
+        std::string in_input;
+        std::string in_output;
+
+        if (!_co_input.parse_single<std::string>(args, in_input)
+                || !_co_output.parse_single<std::string>(args, in_output))
+        {
+            print();
+            return false;
+        }
+
+        std::string in_layout = "record";
+        _co_layout.parse_single<std::string>(args, in_layout);
+        if (in_layout != "record" && in_layout != "tile")
+        {
+            std::cerr << "gistdb: unknown layout " << in_layout << std::endl;
+            return false;
+        }
+
+        // the tile-major db is transposed from a record-major one
+        const bool tile_major = (in_layout == "tile");
+        const std::string packed = tile_major ? in_output + ".tmp" : in_output;
+
+        gist_geometry geometry = read_geometry(in_input + "parameters");
+
+        shared_ptr<PropertyReaderT<vec_f32_t> > means = PropertyT<vec_f32_t>().create_reader(in_input + "features_mean");
+        shared_ptr<PropertyReaderT<vec_f32_t> > variances = PropertyT<vec_f32_t>().create_reader(in_input + "features_variance");
+
+        if (means->size() != variances->size())
+        {
+            std::cerr << "gistdb: number of means and variances differ" << std::endl;
+            return false;
+        }
+
+        gist_db_writer writer(packed, geometry);
+
+        vec_f32_t mean;
+        vec_f32_t variance;
+        for (index_t i = 0; i < means->size(); i++)
+        {
+            means->get(mean, i);
+            variances->get(variance, i);
+
+            if (mean.size() != geometry.feature_size() || variance.size() != geometry.feature_size())
+            {
+                std::cerr << "gistdb: descriptor " << i << " has unexpected size " << mean.size() << std::endl;
+                return false;
+            }
+
+            writer.push_back(&mean[0], &variance[0], i);
+            progress_records(i, means->size());
+        }
+
+        writer.close();
+
+        if (tile_major)
+        {
+            {
+                gist_db db(packed);
+                gist_db_write_tile_major(db, in_output);
+            }
+            std::remove(packed.c_str());
+        }
+
+        std::cout << "gistdb: packed " << writer.size() << " descriptors into " << in_output << " (" << in_layout << "-major)" << std::endl;
+
+        return true;
+    }
+
+private:
+
+    CmdOption _co_input;
+    CmdOption _co_output;
+    CmdOption _co_layout;
+};
+
+class command_quantize : public Command
+{
+public:
+
+    command_quantize()
+        : Command("quantize [options]")
+        , _co_input   ("input"   , "i", "float, record-major gist db written by gistdb pack [required]")
+        , _co_output  ("output"  , "o", "filename of the quantized gist db [required]")
+        , _co_encoding("encoding", "e", "uint8 (default) or fp16")
+    {
+        add(_co_input);
+        add(_co_output);
+        add(_co_encoding);
+    }
+
+    bool run(const std::vector<std::string>& args)
+    {
+        warn_for_unknown_option(args);
+
+        std::string in_input;
+        std::string in_output;
+        std::string in_encoding = "uint8";
+
+        if (!_co_input.parse_single<std::string>(args, in_input)
+                || !_co_output.parse_single<std::string>(args, in_output))
+        {
+            print();
+            return false;
+        }
+
+        _co_encoding.parse_single<std::string>(args, in_encoding);
+        if (in_encoding != "uint8" && in_encoding != "fp16")
+        {
+            std::cerr << "gistdb: unknown encoding " << in_encoding << std::endl;
+            return false;
+        }
+
+        gist_db db(in_input);
+        gist_db_write_quantized(db, in_output, in_encoding == "uint8" ? gist_db_uint8 : gist_db_float16);
+
+        std::cout << "gistdb: quantized " << db.size() << " descriptors into " << in_output << " (" << in_encoding << ")" << std::endl;
+
+        return true;
+    }
+
+private:
+
+    CmdOption _co_input;
+    CmdOption _co_output;
+    CmdOption _co_encoding;
+};
+
+class command_pq : public Command
+{
+public:
+
+    command_pq()
+        : Command("pq [options]")
+        , _co_input     ("input"     , "i", "float, record-major gist db written by gistdb pack [required]")
+        , _co_output    ("output"    , "o", "filename of the pq index [required]")
+        , _co_samples   ("samples"   , "s", "number of records the quantizers are trained on [default: 20000]")
+        , _co_iterations("iterations", "n", "number of k-medians iterations [default: 10]")
+        , _co_seed      ("seed"      , "r", "seed for drawing the training records [default: 1]")
+    {
+        add(_co_input);
+        add(_co_output);
+        add(_co_samples);
+        add(_co_iterations);
+        add(_co_seed);
+    }
+
+    bool run(const std::vector<std::string>& args)
+    {
+        warn_for_unknown_option(args);
+
+        std::string in_input;
+        std::string in_output;
+        size_t in_samples = 20000;
+        size_t in_iterations = 10;
+        uint32_t in_seed = 1;
+
+        if (!_co_input.parse_single<std::string>(args, in_input)
+                || !_co_output.parse_single<std::string>(args, in_output))
+        {
+            print();
+            return false;
+        }
+
+        _co_samples.parse_single<size_t>(args, in_samples);
+        _co_iterations.parse_single<size_t>(args, in_iterations);
+        _co_seed.parse_single<uint32_t>(args, in_seed);
+
+        gist_db db(in_input);
+
+        std::cout << "gistdb: training " << db.geometry().num_tiles() << " quantizers on " << in_samples << " records" << std::endl;
+        std::vector<float> codebooks = gist_pq_train(db, in_samples, in_iterations, in_seed);
+
+        std::cout << "gistdb: encoding " << db.size() << " records" << std::endl;
+        gist_pq_write(db, codebooks, in_output);
+
+        std::cout << "gistdb: wrote pq index " << in_output << std::endl;
+
+        return true;
+    }
+
+private:
+
+    CmdOption _co_input;
+    CmdOption _co_output;
+    CmdOption _co_samples;
+    CmdOption _co_iterations;
+    CmdOption _co_seed;
+};
+
+class command_pqrecall : public Command
+{
+public:
+
+    command_pqrecall()
+        : Command("pqrecall [options]")
+        , _co_input    ("input"    , "i", "float, record-major gist db the index was built from [required]")
+        , _co_pq       ("pq"       , "p", "pq index written by gistdb pq [required]")
+        , _co_queries  ("queries"  , "q", "number of queries [default: 100]")
+        , _co_k        ("k"        , "k", "number of nearest neighbors [default: 15]")
+        , _co_shortlist("shortlist", "s", "shortlist sizes that are re-ranked exactly [default: 15 100 500 1000]")
+    {
+        add(_co_input);
+        add(_co_pq);
+        add(_co_queries);
+        add(_co_k);
+        add(_co_shortlist);
+    }
+
+    // recall of the pq scan with the shortlists re-ranked, queries of recall_queries
+    bool run(const std::vector<std::string>& args)
+    {
+        warn_for_unknown_option(args);
+
+        std::string in_input;
+        std::string in_pq;
+        size_t in_queries = 100;
+        size_t in_k = 15;
+        std::vector<size_t> in_shortlist;
+
+        if (!_co_input.parse_single<std::string>(args, in_input)
+                || !_co_pq.parse_single<std::string>(args, in_pq))
+        {
+            print();
+            return false;
+        }
+
+        _co_queries.parse_single<size_t>(args, in_queries);
+        _co_k.parse_single<size_t>(args, in_k);
+        if (!_co_shortlist.parse_multiple<size_t>(args, in_shortlist))
+        {
+            in_shortlist.push_back(15);
+            in_shortlist.push_back(100);
+            in_shortlist.push_back(500);
+            in_shortlist.push_back(1000);
+        }
+        std::sort(in_shortlist.begin(), in_shortlist.end());
+
+        gist_db db(in_input);
+        gist_pq pq(in_pq);
+
+        if (db.geometry() != pq.geometry() || db.size() != pq.size())
+        {
+            std::cerr << "gistdb: pq index does not belong to the gist db" << std::endl;
+            return false;
+        }
+
+        const gist_geometry& g = db.geometry();
+        const size_t n = db.size();
+
+        std::vector<float> tables(g.num_tiles() * pq.num_centroids());
+        std::vector<size_t> hits(in_shortlist.size(), 0);
+        double time_pq = 0;
+
+        recall_queries queries(db, in_k);
+        for (size_t qi = 0; qi < in_queries; qi++)
+        {
+            queries.next();
+            float* distances = queries.distances();
+
+            std::clock_t start = std::clock();
+            gist_pq_tables(pq, queries.query(), queries.tile_weights(), &tables[0]);
+            gist_pq_scan(&tables[0], g.num_tiles(), pq.num_centroids(), pq.codes(0), n, distances);
+            top_k<float, size_t> approx(in_shortlist.back());
+            for (size_t i = 0; i < n; i++) approx.push(distances[i], i);
+            time_pq += double(std::clock() - start) / CLOCKS_PER_SEC;
+
+            std::vector<std::pair<float, size_t> > candidates = approx.sorted();
+            for (size_t si = 0; si < in_shortlist.size(); si++) hits[si] += queries.rerank_hits(candidates, in_shortlist[si]);
+        }
+
+        std::cout << "gistdb: " << in_queries << " queries, " << n << " records" << std::endl;
+        std::cout << "gistdb: exact scan " << queries.time_exact() / in_queries << "s, pq scan " << time_pq / in_queries << "s per query" << std::endl;
+        for (size_t si = 0; si < in_shortlist.size(); si++)
+        {
+            std::cout << "gistdb: recall@" << in_k << " re-ranking " << in_shortlist[si] << " candidates: "
+                      << double(hits[si]) / (in_queries * in_k) << std::endl;
+        }
+
+        return true;
+    }
+
+private:
+
+    CmdOption _co_input;
+    CmdOption _co_pq;
+    CmdOption _co_queries;
+    CmdOption _co_k;
+    CmdOption _co_shortlist;
+};
+
+class command_ivf : public Command
+{
+public:
+
+    command_ivf()
+        : Command("ivf [options]")
+        , _co_input     ("input"     , "i", "float, record-major gist db written by gistdb pack [required]")
+        , _co_output    ("output"    , "o", "filename of the ivf index [required]")
+        , _co_lists     ("lists"     , "l", "number of lists (clusters) [default: 1024]")
+        , _co_samples   ("samples"   , "s", "number of records the centroids are trained on [default: 50000]")
+        , _co_iterations("iterations", "n", "number of k-medians iterations [default: 10]")
+        , _co_seed      ("seed"      , "r", "seed for drawing the training records [default: 1]")
+    {
+        add(_co_input);
+        add(_co_output);
+        add(_co_lists);
+        add(_co_samples);
+        add(_co_iterations);
+        add(_co_seed);
+    }
+
+    bool run(const std::vector<std::string>& args)
+    {
+        warn_for_unknown_option(args);
+
+        std::string in_input;
+        std::string in_output;
+        size_t in_lists = 1024;
+        size_t in_samples = 50000;
+        size_t in_iterations = 10;
+        uint32_t in_seed = 1;
+
+        if (!_co_input.parse_single<std::string>(args, in_input)
+                || !_co_output.parse_single<std::string>(args, in_output))
+        {
+            print();
+            return false;
+        }
+
+        _co_lists.parse_single<size_t>(args, in_lists);
+        _co_samples.parse_single<size_t>(args, in_samples);
+        _co_iterations.parse_single<size_t>(args, in_iterations);
+        _co_seed.parse_single<uint32_t>(args, in_seed);
+
+        gist_db db(in_input);
+
+        std::cout << "gistdb: training " << in_lists << " centroids on " << in_samples << " records" << std::endl;
+        std::vector<float> centroids = gist_ivf_train(db, in_lists, in_samples, in_iterations, in_seed);
+
+        std::cout << "gistdb: assigning " << db.size() << " records" << std::endl;
+        gist_ivf_write(db, centroids, in_output);
+
+        gist_ivf ivf(in_output);
+        size_t largest = 0;
+        for (size_t l = 0; l < ivf.num_lists(); l++) largest = std::max(largest, ivf.list_end(l) - ivf.list_begin(l));
+
+        std::cout << "gistdb: wrote ivf index " << in_output << ", largest list has " << largest << " records" << std::endl;
+
+        return true;
+    }
+
+private:
+
+    CmdOption _co_input;
+    CmdOption _co_output;
+    CmdOption _co_lists;
+    CmdOption _co_samples;
+    CmdOption _co_iterations;
+    CmdOption _co_seed;
+};
+
+class command_ivfrecall : public Command
+{
+public:
+
+    command_ivfrecall()
+        : Command("ivfrecall [options]")
+        , _co_input  ("input"  , "i", "float, record-major gist db the index was built from [required]")
+        , _co_ivf    ("ivf"    , "v", "ivf index written by gistdb ivf [required]")
+        , _co_queries("queries", "q", "number of queries [default: 100]")
+        , _co_k      ("k"      , "k", "number of nearest neighbors [default: 15]")
+        , _co_nprobe ("nprobe" , "p", "numbers of probed lists [default: 1 4 16 64]")
+    {
+        add(_co_input);
+        add(_co_ivf);
+        add(_co_queries);
+        add(_co_k);
+        add(_co_nprobe);
+    }
+
+    // recall of the ivf search for every nprobe, queries of recall_queries
+    bool run(const std::vector<std::string>& args)
+    {
+        warn_for_unknown_option(args);
+
+        std::string in_input;
+        std::string in_ivf;
+        size_t in_queries = 100;
+        size_t in_k = 15;
+        std::vector<size_t> in_nprobe;
+
+        if (!_co_input.parse_single<std::string>(args, in_input)
+                || !_co_ivf.parse_single<std::string>(args, in_ivf))
+        {
+            print();
+            return false;
+        }
+
+        _co_queries.parse_single<size_t>(args, in_queries);
+        _co_k.parse_single<size_t>(args, in_k);
+        if (!_co_nprobe.parse_multiple<size_t>(args, in_nprobe))
+        {
+            in_nprobe.push_back(1);
+            in_nprobe.push_back(4);
+            in_nprobe.push_back(16);
+            in_nprobe.push_back(64);
+        }
+        std::sort(in_nprobe.begin(), in_nprobe.end());
+
+        gist_db db(in_input);
+        gist_ivf ivf(in_ivf);
+
+        if (db.geometry() != ivf.geometry() || db.size() != ivf.size())
+        {
+            std::cerr << "gistdb: ivf index does not belong to the gist db" << std::endl;
+            return false;
+        }
+
+        const gist_geometry& g = db.geometry();
+        const size_t dim = g.record_floats();
+        const size_t n = db.size();
+
+        std::vector<size_t> hits(in_nprobe.size(), 0);
+        std::vector<size_t> scanned(in_nprobe.size(), 0);
+        std::vector<double> time_ivf(in_nprobe.size(), 0);
+
+        recall_queries queries(db, in_k);
+        for (size_t qi = 0; qi < in_queries; qi++)
+        {
+            queries.next();
+            float* distances = queries.distances();
+
+            for (size_t pi = 0; pi < in_nprobe.size(); pi++)
+            {
+                std::clock_t start = std::clock();
+                std::vector<size_t> lists = gist_ivf_probe(ivf, queries.query(), queries.weights(), in_nprobe[pi]);
+                top_k<float, int64_t> approx(in_k);
+                for (size_t l = 0; l < lists.size(); l++)
+                {
+                    const size_t begin = ivf.list_begin(lists[l]);
+                    const size_t count = ivf.list_end(lists[l]) - begin;
+                    gist_weighted_l1(queries.query(), queries.weights(), ivf.record(begin), dim, dim, count, distances);
+                    for (size_t i = 0; i < count; i++) approx.push(distances[i], ivf.id(begin + i));
+                    scanned[pi] += count;
+                }
+                time_ivf[pi] += double(std::clock() - start) / CLOCKS_PER_SEC;
+
+                hits[pi] += queries.hits(approx.sorted(), true);
+            }
+        }
+
+        std::cout << "gistdb: " << in_queries << " queries, " << n << " records in " << ivf.num_lists() << " lists" << std::endl;
+        std::cout << "gistdb: exact scan " << queries.time_exact() / in_queries << "s per query" << std::endl;
+        for (size_t pi = 0; pi < in_nprobe.size(); pi++)
+        {
+            std::cout << "gistdb: nprobe " << in_nprobe[pi] << ": recall@" << in_k << " " << double(hits[pi]) / (in_queries * in_k)
+                      << ", " << double(scanned[pi]) / in_queries << " records and " << time_ivf[pi] / in_queries << "s per query" << std::endl;
+        }
+
+        return true;
+    }
+
+private:
+
+    CmdOption _co_input;
+    CmdOption _co_ivf;
+    CmdOption _co_queries;
+    CmdOption _co_k;
+    CmdOption _co_nprobe;
+};
+
+class command_pca : public Command
+{
+public:
+
+    command_pca()
+        : Command("pca [options]")
+        , _co_input  ("input"  , "i", "float, record-major gist db written by gistdb pack [required]")
+        , _co_output ("output" , "o", "filename of the pca reduced store [required]")
+        , _co_dims   ("dims"   , "d", "principal components kept per tile [default: 6]")
+        , _co_samples("samples", "s", "number of records the components are learned from [default: 50000]")
+        , _co_seed   ("seed"   , "r", "seed for drawing the training records [default: 1]")
+    {
+        add(_co_input);
+        add(_co_output);
+        add(_co_dims);
+        add(_co_samples);
+        add(_co_seed);
+    }
+
+    bool run(const std::vector<std::string>& args)
+    {
+        warn_for_unknown_option(args);
+
+        std::string in_input;
+        std::string in_output;
+        size_t in_dims = 6;
+        size_t in_samples = 50000;
+        uint32_t in_seed = 1;
+
+        if (!_co_input.parse_single<std::string>(args, in_input)
+                || !_co_output.parse_single<std::string>(args, in_output))
+        {
+            print();
+            return false;
+        }
+
+        _co_dims.parse_single<size_t>(args, in_dims);
+        _co_samples.parse_single<size_t>(args, in_samples);
+        _co_seed.parse_single<uint32_t>(args, in_seed);
+
+        gist_db db(in_input);
+        const gist_geometry& g = db.geometry();
+
+        std::cout << "gistdb: learning " << in_dims << " components for each of " << g.num_tiles() << " tiles from " << in_samples << " records" << std::endl;
+        gist_pca_basis basis = gist_pca_train(db, in_dims, in_samples, in_seed);
+
+        double kept = 0, total = 0;
+        for (size_t i = 0; i < basis.variances.size(); i++) kept += basis.variances[i];
+        for (size_t t = 0; t < basis.total_variances.size(); t++) total += basis.total_variances[t];
+        std::cout << "gistdb: the components explain " << (total > 0 ? 100 * kept / total : 0) << "% of the variance" << std::endl;
+
+        std::cout << "gistdb: projecting " << db.size() << " records to " << g.num_tiles() * in_dims << " floats" << std::endl;
+        gist_pca_write(db, basis, in_output);
+
+        std::cout << "gistdb: wrote pca store " << in_output << std::endl;
+
+        return true;
+    }
+
+private:
+
+    CmdOption _co_input;
+    CmdOption _co_output;
+    CmdOption _co_dims;
+    CmdOption _co_samples;
+    CmdOption _co_seed;
+};
+
+class command_pcarecall : public Command
+{
+public:
+
+    command_pcarecall()
+        : Command("pcarecall [options]")
+        , _co_input    ("input"    , "i", "float, record-major gist db the store was built from [required]")
+        , _co_pca      ("pca"      , "c", "pca store written by gistdb pca [required]")
+        , _co_queries  ("queries"  , "q", "number of queries [default: 100]")
+        , _co_k        ("k"        , "k", "number of nearest neighbors [default: 15]")
+        , _co_shortlist("shortlist", "s", "shortlist sizes that are re-ranked exactly [default: 15 100 500 1000]")
+    {
+        add(_co_input);
+        add(_co_pca);
+        add(_co_queries);
+        add(_co_k);
+        add(_co_shortlist);
+    }
+
+    // recall of the pca scan with the shortlists re-ranked, queries of recall_queries
+    bool run(const std::vector<std::string>& args)
+    {
+        warn_for_unknown_option(args);
+
+        std::string in_input;
+        std::string in_pca;
+        size_t in_queries = 100;
+        size_t in_k = 15;
+        std::vector<size_t> in_shortlist;
+
+        if (!_co_input.parse_single<std::string>(args, in_input)
+                || !_co_pca.parse_single<std::string>(args, in_pca))
+        {
+            print();
+            return false;
+        }
+
+        _co_queries.parse_single<size_t>(args, in_queries);
+        _co_k.parse_single<size_t>(args, in_k);
+        if (!_co_shortlist.parse_multiple<size_t>(args, in_shortlist))
+        {
+            in_shortlist.push_back(15);
+            in_shortlist.push_back(100);
+            in_shortlist.push_back(500);
+            in_shortlist.push_back(1000);
+        }
+        std::sort(in_shortlist.begin(), in_shortlist.end());
+
+        gist_db db(in_input);
+        gist_pca pca(in_pca);
+
+        if (db.geometry() != pca.geometry() || db.size() != pca.size())
+        {
+            std::cerr << "gistdb: pca store does not belong to the gist db" << std::endl;
+            return false;
+        }
+
+        const size_t n = db.size();
+
+        std::vector<float> reduced_query(pca.dims());
+        std::vector<float> reduced_weights(pca.dims());
+        std::vector<size_t> hits(in_shortlist.size(), 0);
+        double time_pca = 0;
+
+        recall_queries queries(db, in_k);
+        for (size_t qi = 0; qi < in_queries; qi++)
+        {
+            queries.next();
+            float* distances = queries.distances();
+
+            std::clock_t start = std::clock();
+            pca.project(queries.query(), &reduced_query[0]);
+            gist_pca_weights(pca, queries.tile_weights(), &reduced_weights[0]);
+            gist_weighted_l2(&reduced_query[0], &reduced_weights[0], pca.record(0), pca.dims(), pca.dims(), n, distances);
+            top_k<float, size_t> approx(in_shortlist.back());
+            for (size_t i = 0; i < n; i++) approx.push(distances[i], i);
+            time_pca += double(std::clock() - start) / CLOCKS_PER_SEC;
+
+            std::vector<std::pair<float, size_t> > candidates = approx.sorted();
+            for (size_t si = 0; si < in_shortlist.size(); si++) hits[si] += queries.rerank_hits(candidates, in_shortlist[si]);
+        }
+
+        std::cout << "gistdb: " << in_queries << " queries, " << n << " records of " << pca.dims() << " floats" << std::endl;
+        std::cout << "gistdb: exact scan " << queries.time_exact() / in_queries << "s, pca scan " << time_pca / in_queries << "s per query" << std::endl;
+        for (size_t si = 0; si < in_shortlist.size(); si++)
+        {
+            std::cout << "gistdb: recall@" << in_k << " re-ranking " << in_shortlist[si] << " candidates: "
+                      << double(hits[si]) / (in_queries * in_k) << std::endl;
+        }
+
+        return true;
+    }
+
+private:
+
+    CmdOption _co_input;
+    CmdOption _co_pca;
+    CmdOption _co_queries;
+    CmdOption _co_k;
+    CmdOption _co_shortlist;
+};
+
+class command_hash : public Command
+{
+public:
+
+    command_hash()
+        : Command("hash [options]")
+        , _co_input  ("input"  , "i", "float, record-major gist db written by gistdb pack [required]")
+        , _co_output ("output" , "o", "filename of the hash file [required]")
+        , _co_bits   ("bits"   , "b", "bits per tile: 8, 16, 32 or 64 [default: 16]")
+        , _co_samples("samples", "s", "number of records the thresholds are learned from [default: 50000]")
+        , _co_seed   ("seed"   , "r", "seed for the random planes and the training records [default: 1]")
+    {
+        add(_co_input);
+        add(_co_output);
+        add(_co_bits);
+        add(_co_samples);
+        add(_co_seed);
+    }
+
+    bool run(const std::vector<std::string>& args)
+    {
+        warn_for_unknown_option(args);
+
+        std::string in_input;
+        std::string in_output;
+        size_t in_bits = 16;
+        size_t in_samples = 50000;
+        uint32_t in_seed = 1;
+
+        if (!_co_input.parse_single<std::string>(args, in_input)
+                || !_co_output.parse_single<std::string>(args, in_output))
+        {
+            print();
+            return false;
+        }
+
+        _co_bits.parse_single<size_t>(args, in_bits);
+        _co_samples.parse_single<size_t>(args, in_samples);
+        _co_seed.parse_single<uint32_t>(args, in_seed);
+
+        gist_db db(in_input);
+        const gist_geometry& g = db.geometry();
+
+        std::cout << "gistdb: learning " << in_bits << " planes for each of " << g.num_tiles() << " tiles from " << in_samples << " records" << std::endl;
+        gist_hash_planes hash = gist_hash_train(db, in_bits, in_samples, in_seed);
+
+        std::cout << "gistdb: encoding " << db.size() << " records to " << gist_hash_code_bytes(g, in_bits) << " bytes" << std::endl;
+        gist_hash_write(db, hash, in_output);
+
+        std::cout << "gistdb: wrote hash file " << in_output << std::endl;
+
+        return true;
+    }
+
+private:
+
+    CmdOption _co_input;
+    CmdOption _co_output;
+    CmdOption _co_bits;
+    CmdOption _co_samples;
+    CmdOption _co_seed;
+};
+
+class command_hashrecall : public Command
+{
+public:
+
+    command_hashrecall()
+        : Command("hashrecall [options]")
+        , _co_input    ("input"    , "i", "float, record-major gist db the hash file was built from [required]")
+        , _co_hash     ("hash"     , "a", "hash file written by gistdb hash [required]")
+        , _co_queries  ("queries"  , "q", "number of queries [default: 100]")
+        , _co_k        ("k"        , "k", "number of nearest neighbors [default: 15]")
+        , _co_shortlist("shortlist", "s", "candidate pool sizes that are re-ranked exactly [default: 100 1000 5000 20000]")
+    {
+        add(_co_input);
+        add(_co_hash);
+        add(_co_queries);
+        add(_co_k);
+        add(_co_shortlist);
+    }
+
+    // recall of the hamming scan with the candidate pools re-ranked, queries of recall_queries
+    bool run(const std::vector<std::string>& args)
+    {
+        warn_for_unknown_option(args);
+
+        std::string in_input;
+        std::string in_hash;
+        size_t in_queries = 100;
+        size_t in_k = 15;
+        std::vector<size_t> in_shortlist;
+
+        if (!_co_input.parse_single<std::string>(args, in_input)
+                || !_co_hash.parse_single<std::string>(args, in_hash))
+        {
+            print();
+            return false;
+        }
+
+        _co_queries.parse_single<size_t>(args, in_queries);
+        _co_k.parse_single<size_t>(args, in_k);
+        if (!_co_shortlist.parse_multiple<size_t>(args, in_shortlist))
+        {
+            in_shortlist.push_back(100);
+            in_shortlist.push_back(1000);
+            in_shortlist.push_back(5000);
+            in_shortlist.push_back(20000);
+        }
+        std::sort(in_shortlist.begin(), in_shortlist.end());
+
+        gist_db db(in_input);
+        gist_hash hash(in_hash);
+
+        if (db.geometry() != hash.geometry() || db.size() != hash.size())
+        {
+            std::cerr << "gistdb: hash file does not belong to the gist db" << std::endl;
+            return false;
+        }
+
+        const size_t n = db.size();
+
+        std::vector<unsigned char> query_code(hash.code_bytes());
+        std::vector<float> field_weights(hash.code_bytes() * 8 / hash.bits_per_tile());
+        std::vector<size_t> hits(in_shortlist.size(), 0);
+        double time_hash = 0;
+
+        recall_queries queries(db, in_k);
+        for (size_t qi = 0; qi < in_queries; qi++)
+        {
+            queries.next();
+            float* distances = queries.distances();
+
+            std::clock_t start = std::clock();
+            hash.encode(queries.query(), &query_code[0]);
+            gist_hash_weights(hash, queries.tile_weights(), &field_weights[0]);
+            gist_weighted_hamming(&query_code[0], &field_weights[0], hash.code(0), hash.code_bytes(), hash.code_bytes(), hash.bits_per_tile(), n, distances);
+            top_k<float, size_t> approx(in_shortlist.back());
+            for (size_t i = 0; i < n; i++) approx.push(distances[i], i);
+            time_hash += double(std::clock() - start) / CLOCKS_PER_SEC;
+
+            std::vector<std::pair<float, size_t> > candidates = approx.sorted();
+            for (size_t si = 0; si < in_shortlist.size(); si++) hits[si] += queries.rerank_hits(candidates, in_shortlist[si]);
+        }
+
+        std::cout << "gistdb: " << in_queries << " queries, " << n << " codes of " << hash.code_bytes() << " bytes ("
+                  << gist_popcount_name() << " popcount)" << std::endl;
+        std::cout << "gistdb: exact scan " << queries.time_exact() / in_queries << "s, hash scan " << time_hash / in_queries << "s per query" << std::endl;
+        for (size_t si = 0; si < in_shortlist.size(); si++)
+        {
+            std::cout << "gistdb: recall@" << in_k << " re-ranking " << in_shortlist[si] << " candidates: "
+                      << double(hits[si]) / (in_queries * in_k) << std::endl;
+        }
+
+        return true;
+    }
+
+private:
+
+    CmdOption _co_input;
+    CmdOption _co_hash;
+    CmdOption _co_queries;
+    CmdOption _co_k;
+    CmdOption _co_shortlist;
+};
+
+class command_pivots : public Command
+{
+public:
+
+    command_pivots()
+        : Command("pivots [options]")
+        , _co_input  ("input"  , "i", "float, record-major gist db written by gistdb pack [required]")
+        , _co_output ("output" , "o", "filename of the pivot table [required]")
+        , _co_pivots ("pivots" , "p", "number of pivots [default: 8]")
+        , _co_samples("samples", "s", "number of records the pivots are picked from [default: 10000]")
+        , _co_seed   ("seed"   , "r", "seed for drawing the records [default: 1]")
+    {
+        add(_co_input);
+        add(_co_output);
+        add(_co_pivots);
+        add(_co_samples);
+        add(_co_seed);
+    }
+
+    bool run(const std::vector<std::string>& args)
+    {
+        warn_for_unknown_option(args);
+
+        std::string in_input;
+        std::string in_output;
+        size_t in_pivots = 8;
+        size_t in_samples = 10000;
+        uint32_t in_seed = 1;
+
+        if (!_co_input.parse_single<std::string>(args, in_input)
+                || !_co_output.parse_single<std::string>(args, in_output))
+        {
+            print();
+            return false;
+        }
+
+        _co_pivots.parse_single<size_t>(args, in_pivots);
+        _co_samples.parse_single<size_t>(args, in_samples);
+        _co_seed.parse_single<uint32_t>(args, in_seed);
+
+        gist_db db(in_input);
+        const gist_geometry& g = db.geometry();
+
+        std::cout << "gistdb: picking " << in_pivots << " pivots from " << in_samples << " records" << std::endl;
+        std::vector<float> pivots = gist_pivot_select(db, in_pivots, in_samples, in_seed);
+
+        std::cout << "gistdb: tabulating " << db.size() << " records, " << in_pivots * g.num_tiles() << " floats each" << std::endl;
+        gist_pivot_write(db, pivots, in_output);
+
+        std::cout << "gistdb: wrote pivot table " << in_output << std::endl;
+
+        return true;
+    }
+
+private:
+
+    CmdOption _co_input;
+    CmdOption _co_output;
+    CmdOption _co_pivots;
+    CmdOption _co_samples;
+    CmdOption _co_seed;
+};
+
+class command_pivotprune : public Command
+{
+public:
+
+    command_pivotprune()
+        : Command("pivotprune [options]")
+        , _co_input  ("input"  , "i", "float, record-major gist db the table was built from [required]")
+        , _co_table  ("table"  , "t", "pivot table written by gistdb pivots [required]")
+        , _co_queries("queries", "q", "number of queries [default: 100]")
+        , _co_k      ("k"      , "k", "number of nearest neighbors [default: 15]")
+    {
+        add(_co_input);
+        add(_co_table);
+        add(_co_queries);
+        add(_co_k);
+    }
+
+    // Queries of recall_queries. Reports the share of records whose
+    // descriptor had to be read and checks that the pruned scan finds the
+    // same neighbors.
+    bool run(const std::vector<std::string>& args)
+    {
+        warn_for_unknown_option(args);
+
+        std::string in_input;
+        std::string in_table;
+        size_t in_queries = 100;
+        size_t in_k = 15;
+
+        if (!_co_input.parse_single<std::string>(args, in_input)
+                || !_co_table.parse_single<std::string>(args, in_table))
+        {
+            print();
+            return false;
+        }
+
+        _co_queries.parse_single<size_t>(args, in_queries);
+        _co_k.parse_single<size_t>(args, in_k);
+
+        gist_db db(in_input);
+        gist_pivot_table table(in_table);
+
+        if (db.geometry() != table.geometry() || db.size() != table.size())
+        {
+            std::cerr << "gistdb: pivot table does not belong to the gist db" << std::endl;
+            return false;
+        }
+
+        const gist_geometry& g = db.geometry();
+        const size_t dim = g.record_floats();
+        const size_t n = db.size();
+        const size_t block = 256;
+
+        std::vector<float> query_distances(table.row_floats());
+        std::vector<float> bounds(block);
+        std::vector<float> tile_bounds(g.num_tiles());
+
+        double time_pruned = 0;
+        unsigned long long records_read = 0;
+        size_t mismatches = 0;
+
+        recall_queries queries(db, in_k);
+        for (size_t qi = 0; qi < in_queries; qi++)
+        {
+            queries.next();
+
+            std::clock_t start = std::clock();
+            table.distances(queries.query(), &query_distances[0]);
+            top_k<float, size_t> pruned(in_k);
+            for (size_t first = 0; first < n; first += block)
+            {
+                const size_t count = std::min(block, n - first);
+                gist_pivot_lower_bounds(table, &query_distances[0], queries.tile_weights(), first, count, &bounds[0], &tile_bounds[0]);
+
+                for (size_t j = 0; j < count; j++)
+                {
+                    if (pruned.full() && bounds[j] >= pruned.worst()) continue;
+
+                    float d;
+                    gist_weighted_l1(queries.query(), queries.weights(), db.record(first + j), dim, dim, 1, &d);
+                    pruned.push(d, first + j);
+                    records_read++;
+                }
+            }
+            time_pruned += double(std::clock() - start) / CLOCKS_PER_SEC;
+
+            // the kernel rounds differently for single records, so compare the neighbors, not the distances
+            mismatches += queries.truth().size() - queries.hits(pruned.sorted());
+        }
+
+        std::cout << "gistdb: " << in_queries << " queries, " << n << " records, " << table.num_pivots() << " pivots" << std::endl;
+        std::cout << "gistdb: exact scan " << queries.time_exact() / in_queries << "s, pruned scan " << time_pruned / in_queries << "s per query" << std::endl;
+        std::cout << "gistdb: the pruned scan read " << 100.0 * records_read / (double(n) * in_queries) << "% of the records" << std::endl;
+        if (mismatches > 0) std::cout << "gistdb: " << mismatches << " neighbors differ from the exact scan" << std::endl;
+
+        return true;
+    }
+
+private:
+
+    CmdOption _co_input;
+    CmdOption _co_table;
+    CmdOption _co_queries;
+    CmdOption _co_k;
+};
+
+// weighted L1 distance of one query to blocks of a float, record-major gist db
+struct anytime_score
+{
+    const gist_db* db;
+    const float* query;
+    const float* weights;
+
+    void operator()(size_t, size_t first, size_t count, float, float* out)
+    {
+        const size_t dim = db->geometry().record_floats();
+        gist_weighted_l1(query, weights, db->record(first), db->stride() / sizeof(float), dim, count, out);
+    }
+};
+
+class command_anytime : public Command
+{
+public:
+
+    command_anytime()
+        : Command("anytime [options]")
+        , _co_input  ("input"  , "i", "float, record-major gist db [required]")
+        , _co_steps  ("steps"  , "s", "number of equal record budgets the scan is continued with [default: 10]")
+        , _co_queries("queries", "q", "number of queries [default: 20]")
+        , _co_k      ("k"      , "k", "number of nearest neighbors [default: 15]")
+    {
+        add(_co_input);
+        add(_co_steps);
+        add(_co_queries);
+        add(_co_k);
+    }
+
+    // Queries of recall_queries. Every query is scanned in steps of an
+    // equal record budget, each continuing the last; after every step the
+    // best so far are compared with the exact result.
+    bool run(const std::vector<std::string>& args)
+    {
+        warn_for_unknown_option(args);
+
+        std::string in_input;
+        size_t in_steps = 10;
+        size_t in_queries = 20;
+        size_t in_k = 15;
+
+        if (!_co_input.parse_single<std::string>(args, in_input))
+        {
+            print();
+            return false;
+        }
+
+        _co_steps.parse_single<size_t>(args, in_steps);
+        _co_queries.parse_single<size_t>(args, in_queries);
+        _co_k.parse_single<size_t>(args, in_k);
+        in_steps = std::max<size_t>(1, in_steps);
+
+        gist_db db(in_input);
+
+        if (db.encoding() != gist_db_float32 || db.layout() != gist_db_record_major)
+        {
+            std::cerr << "gistdb: the anytime scan is measured on a float, record-major gist db" << std::endl;
+            return false;
+        }
+
+        const size_t n = db.size();
+        const size_t block = 256;
+
+        // summed over the queries, per step
+        std::vector<double> fraction(in_steps, 0);
+        std::vector<double> recall(in_steps, 0);
+        std::vector<double> kth_ratio(in_steps, 0);
+
+        recall_queries queries(db, in_k);
+        for (size_t qi = 0; qi < in_queries; qi++)
+        {
+            queries.next();
+            const std::vector<std::pair<float, size_t> >& truth = queries.truth();
+
+            anytime_score score = { &db, queries.query(), queries.weights() };
+            gist_anytime_scan scan;
+            scan.reset(n, block, in_k, queries.random());
+
+            for (size_t s = 0; s < in_steps; s++)
+            {
+                gist_anytime_progress progress = scan.run(score, 1, 0, (n + in_steps - 1) / in_steps);
+
+                fraction[s] += progress.fraction();
+                recall[s] += truth.empty() ? 1.0 : double(queries.hits(scan.sorted())) / truth.size();
+                if (progress.kth_distance != std::numeric_limits<float>::infinity() && !truth.empty() && truth.back().first > 0)
+                {
+                    kth_ratio[s] += progress.kth_distance / truth.back().first;
+                }
+            }
+        }
+
+        std::cout << "gistdb: " << in_queries << " queries, " << n << " records, k = " << in_k << std::endl;
+        for (size_t s = 0; s < in_steps; s++)
+        {
+            std::cout << "gistdb: scanned " << 100.0 * fraction[s] / in_queries << "%, recall " << 100.0 * recall[s] / in_queries
+                      << "%, k-th distance / exact " << kth_ratio[s] / in_queries << std::endl;
+        }
+
+        return true;
+    }
+
+private:
+
+    CmdOption _co_input;
+    CmdOption _co_steps;
+    CmdOption _co_queries;
+    CmdOption _co_k;
+};
+
+class command_compress : public Command
+{
+public:
+
+    command_compress()
+        : Command("compress [options]")
+        , _co_input ("input" , "i", "prefix of the gist descriptor files written by compute_descriptors [required]")
+        , _co_output("output", "o", "prefix of the compressed descriptor files [required]")
+        , _co_block ("block" , "b", "records per block, the unit of random access [default: 64]")
+    {
+        add(_co_input);
+        add(_co_output);
+        add(_co_block);
+    }
+
+    bool run(const std::vector<std::string>& args)
+    {
+        warn_for_unknown_option(args);
+
+        std::string in_input;
+        std::string in_output;
+        size_t in_block = gist_block_default_records;
+
+        if (!_co_input.parse_single<std::string>(args, in_input)
+                || !_co_output.parse_single<std::string>(args, in_output))
+        {
+            print();
+            return false;
+        }
+
+        _co_block.parse_single<size_t>(args, in_block);
+        in_block = std::max<size_t>(1, in_block);
+
+        const char* names[] = { "features_mean", "features_variance" };
+        for (size_t f = 0; f < 2; f++)
+        {
+            if (!compress(in_input + names[f], in_output + names[f], in_block)) return false;
+        }
+
+        return true;
+    }
+
+private:
+
+    bool compress(const std::string& input, const std::string& output, size_t block)
+    {
+        shared_ptr<PropertyReaderT<vec_f32_t> > features = PropertyT<vec_f32_t>().create_reader(input);
+        const size_t n = features->size();
+
+        vec_f32_t feature;
+        size_t floats = 0;
+        if (n > 0)
+        {
+            features->get(feature, 0);
+            floats = feature.size();
+        }
+
+        unsigned long long raw_bytes = 0;
+        unsigned long long compressed_bytes = 0;
+        {
+            PropertyT<vec_u8_t>::writer writer(output);
+            writer.insert_map_entry("gist_block_records", boost::lexical_cast<std::string>(block));
+            writer.insert_map_entry("gist_block_floats", boost::lexical_cast<std::string>(floats));
+            writer.insert_map_entry("gist_block_count", boost::lexical_cast<std::string>(n));
+
+            std::vector<float> records;
+            vec_u8_t code;
+            for (size_t first = 0; first < n; first += block)
+            {
+                const size_t count = std::min(block, n - first);
+                records.resize(count * floats);
+                for (size_t j = 0; j < count; j++)
+                {
+                    features->get(feature, first + j);
+                    if (feature.size() != floats)
+                    {
+                        std::cerr << "gistdb: descriptor " << first + j << " has unexpected size " << feature.size() << std::endl;
+                        return false;
+                    }
+                    std::copy(feature.begin(), feature.end(), records.begin() + j * floats);
+                }
+
+                code.clear();
+                gist_block_encode(&records[0], count, floats, code);
+                writer.push_back(code);
+
+                raw_bytes += count * (sizeof(int64_t) + floats * sizeof(float));
+                compressed_bytes += code.size() + sizeof(int64_t);
+                progress_records(first, n);
+            }
+        }
+
+        // decode everything once, to check the file and to time the decoder
+        gist_block_file file(output);
+        std::vector<float> decoded(block * floats);
+        std::vector<uint8_t> planes;
+        size_t mismatches = 0;
+
+        std::clock_t start = std::clock();
+        for (size_t b = 0; b < file.num_blocks(); b++) file.decode(b, &decoded[0], planes);
+        double seconds = double(std::clock() - start) / CLOCKS_PER_SEC;
+
+        for (size_t b = 0; b < file.num_blocks(); b++)
+        {
+            file.decode(b, &decoded[0], planes);
+            for (size_t j = 0; j < file.block_count(b); j++)
+            {
+                features->get(feature, b * block + j);
+                if (!std::equal(feature.begin(), feature.end(), decoded.begin() + j * floats)) mismatches++;
+            }
+        }
+
+        std::cout << "gistdb: compressed " << n << " descriptors of " << input << " to "
+                  << (raw_bytes > 0 ? 100.0 * compressed_bytes / raw_bytes : 0.0) << "% (" << output << ")" << std::endl;
+        std::cout << "gistdb: decoded at " << (seconds > 0 ? n * floats * sizeof(float) / seconds / (1 << 20) : 0.0) << " MB/s" << std::endl;
+
+        if (mismatches > 0)
+        {
+            std::cerr << "gistdb: " << mismatches << " descriptors do not decode to the original" << std::endl;
+            return false;
+        }
+
+        return true;
+    }
+
+    CmdOption _co_input;
+    CmdOption _co_output;
+    CmdOption _co_block;
+};
+
+class command_compressstats : public Command
+{
+public:
+
+    command_compressstats()
+        : Command("compressstats [options]")
+        , _co_input ("input" , "i", "prefix of the gist descriptor files written by compute_descriptors [required]")
+        , _co_sample("sample", "n", "number of descriptors to compress, from the start of the files [default: 100000]")
+        , _co_block ("block" , "b", "records per block [default: 64]")
+    {
+        add(_co_input);
+        add(_co_sample);
+        add(_co_block);
+    }
+
+    bool run(const std::vector<std::string>& args)
+    {
+        warn_for_unknown_option(args);
+
+        std::string in_input;
+        size_t in_sample = 100000;
+        size_t in_block = gist_block_default_records;
+
+        if (!_co_input.parse_single<std::string>(args, in_input))
+        {
+            print();
+            return false;
+        }
+
+        _co_sample.parse_single<size_t>(args, in_sample);
+        _co_block.parse_single<size_t>(args, in_block);
+        in_block = std::max<size_t>(1, in_block);
+
+        const char* names[] = { "features_mean", "features_variance" };
+        for (size_t f = 0; f < 2; f++)
+        {
+            if (!measure(in_input + names[f], in_sample, in_block)) return false;
+        }
+
+        return true;
+    }
+
+private:
+
+    bool measure(const std::string& input, size_t sample, size_t block)
+    {
+        // wall clock time to read the file sequentially, a file in the page cache reads at memory speed
+        double read_mb_per_s = 0.0;
+        {
+            std::ifstream ifs(input.c_str(), std::ifstream::binary);
+            std::vector<char> buffer(1 << 22);
+            unsigned long long bytes = 0;
+            const boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+            while (ifs.read(&buffer[0], buffer.size()) || ifs.gcount() > 0) bytes += ifs.gcount();
+            const double seconds = (boost::posix_time::microsec_clock::universal_time() - start).total_microseconds() * 1e-6;
+            if (seconds > 0) read_mb_per_s = bytes / seconds / (1 << 20);
+        }
+
+        shared_ptr<PropertyReaderT<vec_f32_t> > features = PropertyT<vec_f32_t>().create_reader(input);
+        const size_t n = std::min<size_t>(sample, features->size());
+        if (n == 0)
+        {
+            std::cerr << "gistdb: no descriptors in " << input << std::endl;
+            return false;
+        }
+
+        vec_f32_t feature;
+        features->get(feature, 0);
+        const size_t floats = feature.size();
+
+        std::vector<float> records(n * floats);
+        for (size_t i = 0; i < n; i++)
+        {
+            features->get(feature, i);
+            if (feature.size() != floats)
+            {
+                std::cerr << "gistdb: descriptor " << i << " has unexpected size " << feature.size() << std::endl;
+                return false;
+            }
+            std::copy(feature.begin(), feature.end(), records.begin() + i * floats);
+        }
+
+        std::cout << "gistdb: " << input << ", " << n << " descriptors of " << floats << " floats, blocks of " << block << std::endl;
+        std::cout << "gistdb:   read at " << read_mb_per_s << " MB/s" << std::endl;
+
+        const unsigned coders[] = { gist_block_frame, gist_block_delta, gist_block_all };
+        const char* coder_names[] = { "frame of reference", "delta", "frame of reference or delta" };
+        for (size_t c = 0; c < 3; c++)
+        {
+            gist_block_stats stats;
+            std::vector<std::vector<uint8_t> > codes((n + block - 1) / block);
+            for (size_t b = 0; b < codes.size(); b++)
+            {
+                gist_block_encode(&records[b * block * floats], std::min(block, n - b * block), floats, codes[b], coders[c], &stats);
+            }
+
+            std::vector<float> decoded(block * floats);
+            std::vector<uint8_t> planes;
+            size_t mismatches = 0;
+
+            std::clock_t start = std::clock();
+            for (size_t b = 0; b < codes.size(); b++)
+            {
+                const size_t count = std::min(block, n - b * block);
+                if (!gist_block_decode(&codes[b][0], codes[b].size(), count, floats, &decoded[0], planes)) mismatches++;
+            }
+            const double seconds = double(std::clock() - start) / CLOCKS_PER_SEC;
+
+            for (size_t b = 0; b < codes.size(); b++)
+            {
+                const size_t count = std::min(block, n - b * block);
+                gist_block_decode(&codes[b][0], codes[b].size(), count, floats, &decoded[0], planes);
+                if (!std::equal(decoded.begin(), decoded.begin() + count * floats, records.begin() + b * block * floats)) mismatches++;
+            }
+
+            unsigned long long raw_bytes = 0;
+            unsigned long long coded_bytes = codes.size() * gist_block_header_bytes;
+            for (size_t k = 0; k < 4; k++)
+            {
+                raw_bytes += stats.raw_bytes[k];
+                coded_bytes += stats.coded_bytes[k];
+            }
+
+            std::cout << "gistdb:   " << coder_names[c] << ": " << 100.0 * coded_bytes / raw_bytes << "% of raw, decoded at "
+                      << (seconds > 0 ? raw_bytes / seconds / (1 << 20) : 0.0) << " MB/s" << std::endl;
+            for (size_t k = 0; k < 4; k++)
+            {
+                const unsigned long long dims = stats.frame_dims[k] + stats.delta_dims[k];
+                std::cout << "gistdb:     byte " << k << ": " << 100.0 * stats.coded_bytes[k] / stats.raw_bytes[k] << "%, "
+                          << 100.0 * stats.raw_planes[k] / codes.size() << "% of blocks raw, "
+                          << (dims > 0 ? 100.0 * stats.delta_dims[k] / dims : 0.0) << "% of packed dimensions delta coded" << std::endl;
+            }
+
+            if (mismatches > 0)
+            {
+                std::cerr << "gistdb: " << mismatches << " blocks do not decode to the original" << std::endl;
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    CmdOption _co_input;
+    CmdOption _co_sample;
+    CmdOption _co_block;
+};
+
+class command_readcheck : public Command
+{
+public:
+
+    command_readcheck()
+        : Command("readcheck [options]")
+        , _co_input("input", "i", "file to read, a descriptor file for example [required]")
+    {
+        add(_co_input);
+    }
+
+    bool run(const std::vector<std::string>& args)
+    {
+        warn_for_unknown_option(args);
+
+        std::string in_input;
+        if (!_co_input.parse_single<std::string>(args, in_input))
+        {
+            print();
+            return false;
+        }
+
+        // read sizes that cross the block boundaries at different offsets
+        const size_t read_sizes[] = { 1, 7, 4096, 100003 };
+        const size_t max_read = 100003;
+
+        bool okay = true;
+        for (size_t block = 4 << 10; block <= (16 << 20); block *= 4)
+        {
+            for (size_t depth = 1; depth <= 7; depth++)
+            {
+                std::ifstream expected(in_input.c_str(), std::ifstream::binary);
+                read_ahead_file file;
+                file.open(in_input, block, depth);
+
+                std::vector<char> a(max_read), b(max_read);
+                unsigned long long bytes = 0;
+                bool same = true;
+                for (size_t i = 0; same; i++)
+                {
+                    const size_t n = read_sizes[i % 4];
+                    expected.read(&a[0], n);
+                    const size_t got = file.read(&b[0], n);
+
+                    same = got == static_cast<size_t>(expected.gcount()) && std::equal(a.begin(), a.begin() + got, b.begin());
+                    bytes += got;
+                    if (got < n) break;
+                }
+
+                same = same && bytes == file.size();
+                okay = okay && same;
+                std::cout << "gistdb: blocks of " << (block >> 10) << " KB, depth " << depth << ": "
+                          << (same ? "same" : "DIFFERENT") << " (" << bytes << " bytes)" << std::endl;
+            }
+        }
+
+        if (!okay) std::cerr << "gistdb: the read ahead reader does not return " << in_input << " as it is" << std::endl;
+        return okay;
+    }
+
+private:
+
+    CmdOption _co_input;
+};
+
+class command_tiny : public Command
+{
+public:
+
+    command_tiny()
+        : Command("tiny [options]")
+        , _co_input ("input" , "i", "prefix of the tinylab descriptor files written by compute_descriptors [required]")
+        , _co_output("output", "o", "filename of the tiny db [required]")
+        , _co_size  ("size"  , "s", "width and height of the stored tiny images, must divide the thumbnail size [default: 8]")
+    {
+        add(_co_input);
+        add(_co_output);
+        add(_co_size);
+    }
+
+    bool run(const std::vector<std::string>& args)
+    {
+        warn_for_unknown_option(args);
+
+        std::string in_input;
+        std::string in_output;
+        size_t in_size = 8;
+
+        if (!_co_input.parse_single<std::string>(args, in_input)
+                || !_co_output.parse_single<std::string>(args, in_output))
+        {
+            print();
+            return false;
+        }
+
+        _co_size.parse_single<size_t>(args, in_size);
+
+        // thumbnail size of the tinylab generator
+        size_t width = 16;
+        size_t height = 16;
+        std::ifstream ifs((in_input + "parameters").c_str());
+        if (ifs.is_open())
+        {
+            ptree params;
+            boost::property_tree::read_json(ifs, params);
+            width = params.get<size_t>("params.width", width);
+            height = params.get<size_t>("params.height", height);
+        }
+
+        if (in_size == 0 || width % in_size != 0 || height % in_size != 0)
+        {
+            std::cerr << "gistdb: size " << in_size << " does not divide the thumbnail size " << width << "x" << height << std::endl;
+            return false;
+        }
+
+        const size_t channels = 3;
+        shared_ptr<PropertyReaderT<vec_f32_t> > features = PropertyT<vec_f32_t>().create_reader(in_input + "features");
+
+        tiny_db_writer writer(in_output, width, height, in_size, channels);
+
+        vec_f32_t feature;
+        for (index_t i = 0; i < features->size(); i++)
+        {
+            features->get(feature, i);
+            if (feature.size() != width * height * channels)
+            {
+                std::cerr << "gistdb: descriptor " << i << " has unexpected size " << feature.size() << std::endl;
+                return false;
+            }
+
+            writer.push_back(&feature[0], i);
+            progress_records(i, features->size());
+        }
+
+        writer.close();
+        std::cout << "gistdb: packed " << writer.size() << " tiny images into " << in_output << std::endl;
+
+        return true;
+    }
+
+private:
+
+    CmdOption _co_input;
+    CmdOption _co_output;
+    CmdOption _co_size;
+};
+
+
+int main(int argc, char *argv[])
+{
+    typedef std::map<std::string, std::pair<boost::shared_ptr<Command>, std::string> > cmd_map_t;
+    cmd_map_t cmd_desc;
+    cmd_desc["pack"] = std::make_pair(boost::make_shared<command_pack>(), "pack gist descriptors into a memory mappable gist db");
+    cmd_desc["quantize"] = std::make_pair(boost::make_shared<command_quantize>(), "write a uint8 or fp16 quantized copy of a gist db");
+    cmd_desc["pq"] = std::make_pair(boost::make_shared<command_pq>(), "train and write a product quantization index");
+    cmd_desc["pqrecall"] = std::make_pair(boost::make_shared<command_pqrecall>(), "measure the recall of a pq index against the exact scan");
+    cmd_desc["ivf"] = std::make_pair(boost::make_shared<command_ivf>(), "cluster a gist db into an inverted file index");
+    cmd_desc["ivfrecall"] = std::make_pair(boost::make_shared<command_ivfrecall>(), "measure the recall of an ivf index against the exact scan");
+    cmd_desc["pca"] = std::make_pair(boost::make_shared<command_pca>(), "write a pca reduced copy of a gist db");
+    cmd_desc["pcarecall"] = std::make_pair(boost::make_shared<command_pcarecall>(), "measure the recall of a pca store against the exact scan");
+    cmd_desc["hash"] = std::make_pair(boost::make_shared<command_hash>(), "encode a gist db as binary codes for a hamming scan");
+    cmd_desc["hashrecall"] = std::make_pair(boost::make_shared<command_hashrecall>(), "measure the recall of a hash file against the exact scan");
+    cmd_desc["pivots"] = std::make_pair(boost::make_shared<command_pivots>(), "tabulate per-tile distances to pivots for the pruned exact scan");
+    cmd_desc["pivotprune"] = std::make_pair(boost::make_shared<command_pivotprune>(), "measure how many records the pivot bounds let the scan skip");
+    cmd_desc["anytime"] = std::make_pair(boost::make_shared<command_anytime>(), "measure the recall of the anytime scan after every share of the db");
+    cmd_desc["compress"] = std::make_pair(boost::make_shared<command_compress>(), "write block compressed copies of the gist descriptor files");
+    cmd_desc["compressstats"] = std::make_pair(boost::make_shared<command_compressstats>(), "measure the block codes and the decode speed against the read speed");
+    cmd_desc["readcheck"] = std::make_pair(boost::make_shared<command_readcheck>(), "check that the read ahead reader returns a file byte for byte");
+    cmd_desc["tiny"] = std::make_pair(boost::make_shared<command_tiny>(), "pack tinylab descriptors into a tiny db for the cascade search");
+
+    if (argc <= 1 || !cmd_desc.count(argv[1]))
+    {
+        std::cout << "usage: " << (argc > 0 ? argv[0]:"gistdb") << " <command> ..." << std::endl;
+        std::cout << " commands:" << std::endl;
+
+        const int c0 = 20;
+        cmd_map_t::const_iterator it;
+        for (it = cmd_desc.begin(); it != cmd_desc.end(); ++it)
+        {
+            std::cout << " * " << it->first;
+            for (int k = 0; k < c0 - (int)it->first.length(); k++) std::cout << ' ';
+            std::cout << " : " << it->second.second << std::endl;
+        }
+
+        return 1;
+    }
+
+    try
+    {
+        return cmd_desc[argv[1]].first->run(argv_to_strings(argc-2, &argv[2])) ? 0:1;
+    }
+    catch (std::exception& e)
+    {
+        std::cerr << "gistdb: " << e.what() << std::endl;
+        return 1;
+    }
+}
@@ -0,0 +1,29 @@
+TARGET = gistserver
+include(../common.pri)
+
+CONFIG += console
+
+TEMPLATE = app
+
+LIBS += -lopencv_highgui \
+        -lopencv_core \
+        -lopencv_imgproc
+
+SOURCES += main.cpp \
+    descriptors/gist.cpp \
+    descriptors/utilities.cpp
+
+HEADERS += types.hpp \
+    generator.hpp \
+    cmdline.hpp \
+    mapped_file.hpp \
+    property_file.hpp \
+    search_protocol.hpp \
+    top_k.hpp \
+    worker_threads.hpp \
+    descriptors/gist.hpp \
+    descriptors/gist_db.hpp \
+    descriptors/gist_distance.hpp \
+    descriptors/gist_quantizer.hpp \
+    descriptors/gist_tile_distances.hpp \
+    descriptors/utilities.hpp
@@ -0,0 +1,417 @@
+#include <string>
+#include <iostream>
+#include <vector>
+#include <map>
+#include <stdexcept>
+#include <ctime>
+#include <algorithm>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/make_shared.hpp>
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/highgui/highgui.hpp>
+
+#include <types.hpp>
+#include <generator.hpp>
+#include <cmdline.hpp>
+#include <property_file.hpp>
+#include <search_protocol.hpp>
+#include <top_k.hpp>
+#include <worker_threads.hpp>
+#include <descriptors/gist_db.hpp>
+#include <descriptors/gist_distance.hpp>
+#include <descriptors/gist_tile_distances.hpp>
+
+// ------------------------------------------------------------
+// Resident gist search server: maps (and pre-faults) a packed
+// gist db once and answers queries over a local socket, see
+// search_protocol.hpp. Repeated queries then cost only the scan.
+//
+//    gistserver serve -d huge_gistdb -f huge_filelist -s /tmp/gistserver.sock
+//
+// queries either carry a packed gist record with one weight per
+// tile (PDCI, --server), or an image and a mask path, whose gist is
+// computed here with the parameters the db was computed with:
+//
+//    gistserver serve ... -p huge_gistparameters
+//    gistserver query -s /tmp/gistserver.sock -i image.jpg -m mask.png
+//
+// white pixels of the mask (255) are the hole, a tile is weighted
+// with the share of its pixels outside of it, as in PDCI.
+//
+// with -c the server keeps the per-tile distances of the last query
+// to every record (float or half). Another mask on the same image is
+// then ranked from them without scanning the db:
+//
+//    gistserver serve ... -c half
+// ------------------------------------------------------------
+
+using namespace imdb;
+
+// records scored per call of the distance kernel
+static const size_t scan_block_size = 256;
+
+// scans one contiguous shard of the db per worker thread
+struct gist_scan
+{
+    const gist_db& db;
+    const float* query;
+    const float* weights;
+    std::vector<top_k<float, size_t> > results;
+
+    gist_scan(const gist_db& gdb, const float* q, const float* w, size_t num_shards, size_t k)
+        : db(gdb), query(q), weights(w), results(num_shards, top_k<float, size_t>(k))
+    {}
+
+    void operator()(size_t shard)
+    {
+        const size_t begin = db.size() * shard / results.size();
+        const size_t end = db.size() * (shard + 1) / results.size();
+        const size_t dim = db.geometry().record_floats();
+
+        float distances[scan_block_size];
+        for (size_t first = begin; first < end; first += scan_block_size)
+        {
+            const size_t count = std::min(scan_block_size, end - first);
+            gist_weighted_l1(query, weights, db.record(first), db.stride() / sizeof(float), dim, count, distances);
+            for (size_t j = 0; j < count; j++) results[shard].push(distances[j], first + j);
+        }
+    }
+};
+
+class gist_server
+{
+public:
+
+    gist_server(const std::string& db, const std::string& filelist, const std::string& parameters, size_t num_threads,
+                const std::string& cache)
+        : _db(db)
+        , _filelist(filelist)
+        , _num_threads(num_threads > 0 ? num_threads : hardware_threads())
+        , _cache(!cache.empty() && cache != "none")
+        , _cache_encoding(cache == "half" ? gist_db_float16 : gist_db_float32)
+    {
+        if (_cache && cache != "float" && cache != "half") throw std::runtime_error("tile distance cache must be none, float or half");
+
+        if (_db.encoding() != gist_db_float32 || _db.layout() != gist_db_record_major)
+        {
+            throw std::runtime_error("gistserver needs a float, record-major gist db");
+        }
+
+        if (!parameters.empty()) _generator = Generator::from_parameters_file(parameters);
+
+        clock_t start = clock();
+        _db.prefault();
+        std::cout << "gistserver: mapped " << _db.size() << " descriptors (" << gist_simd_name() << ", "
+                  << _num_threads << " threads), pre-faulted in " << double(clock() - start) / CLOCKS_PER_SEC << "s" << std::endl;
+    }
+
+    void serve(const std::string& socket_path)
+    {
+        local_socket listener;
+        listener.listen(socket_path);
+        std::cout << "gistserver: listening on " << socket_path << std::endl;
+
+        for (;;)
+        {
+            local_socket client;
+            listener.accept(client);
+
+            try
+            {
+                handle(client);
+            }
+            catch (std::exception& e)
+            {
+                std::cerr << "gistserver: " << e.what() << std::endl;
+            }
+        }
+    }
+
+private:
+
+    void handle(local_socket& client)
+    {
+        search_request_header header;
+        client.read_all(&header, sizeof(header));
+        if (std::memcmp(header.magic, search_request_magic, sizeof(header.magic)) != 0 || header.version != search_protocol_version)
+        {
+            write_search_error(client, "unknown request");
+            return;
+        }
+
+        const gist_geometry& g = _db.geometry();
+        std::vector<float> query(g.record_floats());
+        std::vector<float> tile_weights(g.num_tiles());
+
+        if (header.type == search_query_gist)
+        {
+            if (header.record_floats != g.record_floats() || header.num_tiles != g.num_tiles())
+            {
+                write_search_error(client, "query does not match the tile/filter layout of the db");
+                return;
+            }
+            client.read_all(&query[0], query.size() * sizeof(float));
+            client.read_all(&tile_weights[0], tile_weights.size() * sizeof(float));
+        }
+        else if (header.type == search_query_image)
+        {
+            std::string image_path(header.image_path_bytes, '\0');
+            std::string mask_path(header.mask_path_bytes, '\0');
+            if (!image_path.empty()) client.read_all(&image_path[0], image_path.size());
+            if (!mask_path.empty()) client.read_all(&mask_path[0], mask_path.size());
+
+            std::string message = compute_query(image_path, mask_path, query, tile_weights);
+            if (!message.empty())
+            {
+                write_search_error(client, message);
+                return;
+            }
+        }
+        else
+        {
+            write_search_error(client, "unknown query type");
+            return;
+        }
+
+        clock_t start = clock();
+        const size_t k = std::max<size_t>(1, std::min<size_t>(header.k, _db.size()));
+        std::vector<std::pair<float, size_t> > winners;
+        if (_cache)
+        {
+            const bool hit = _tile_distances.matches(_db, &query[0]);
+            if (!hit) _tile_distances.compute(_db, &query[0], _cache_encoding, _num_threads);
+            winners = _tile_distances.rank(&tile_weights[0], k, _num_threads);
+
+            std::cout << "gistserver: " << (hit ? "ranked from the cached" : "computed the") << " tile distances of the query ("
+                      << _tile_distances.bytes() / (1024 * 1024) << " MB)" << std::endl;
+        }
+        else
+        {
+            winners = scan(query, tile_weights, k);
+        }
+
+        std::vector<search_result> results(winners.size());
+        for (size_t i = 0; i < winners.size(); i++)
+        {
+            results[i].distance = winners[i].first;
+            results[i].id = _db.id(winners[i].second);
+            results[i].name = _filelist.string_at(static_cast<size_t>(results[i].id));
+        }
+        write_search_response(client, results);
+
+        std::cout << "gistserver: answered a query for " << k << " images in " << double(clock() - start) / CLOCKS_PER_SEC << "s cpu" << std::endl;
+    }
+
+    // gist and tile weights of an image query, returns an error message on failure
+    std::string compute_query(const std::string& image_path, const std::string& mask_path,
+                              std::vector<float>& query, std::vector<float>& tile_weights)
+    {
+        if (!_generator) return "image queries need the gist parameters file (-p)";
+
+        cv::Mat image = cv::imread(image_path, 1);
+        cv::Mat mask = cv::imread(mask_path, 0);
+        if (image.empty()) return "could not read image " + image_path;
+        if (mask.empty() || mask.rows != image.rows || mask.cols != image.cols) return "could not read mask " + mask_path + " (of the size of the image)";
+
+        anymap_t data;
+        data["image"] = mat_8uc3_t(image);
+        _generator->compute(data);
+
+        const vec_f32_t& means = get<vec_f32_t>(data, "features_mean");
+        const vec_f32_t& variances = get<vec_f32_t>(data, "features_variance");
+
+        const gist_geometry& g = _db.geometry();
+        if (means.size() != g.feature_size() || variances.size() != g.feature_size()) return "gist parameters do not match the db";
+        gist_pack_record(g, &means[0], &variances[0], &query[0]);
+
+        const int tile_width = mask.cols / g.num_x_tiles;
+        const int tile_height = mask.rows / g.num_y_tiles;
+        for (uint32_t y = 0; y < g.num_y_tiles; y++)
+        for (uint32_t x = 0; x < g.num_x_tiles; x++)
+        {
+            cv::Mat tile = mask(cv::Rect(x * tile_width, y * tile_height, tile_width, tile_height));
+            const int known = tile_width * tile_height - cv::countNonZero(tile == 255);
+            tile_weights[y * g.num_x_tiles + x] = float(known) / float(tile_width * tile_height);
+        }
+
+        return "";
+    }
+
+    std::vector<std::pair<float, size_t> > scan(const std::vector<float>& query, const std::vector<float>& tile_weights, size_t k)
+    {
+        const size_t tile_floats = _db.geometry().tile_floats();
+        std::vector<float> weights(query.size());
+        for (size_t t = 0; t < tile_weights.size(); t++)
+        {
+            std::fill(weights.begin() + t * tile_floats, weights.begin() + (t + 1) * tile_floats, tile_weights[t]);
+        }
+
+        const size_t num_threads = std::max<size_t>(1, std::min(_num_threads, _db.size() / scan_block_size));
+        gist_scan task(_db, &query[0], &weights[0], num_threads, k);
+        run_worker_threads(num_threads, task);
+
+        top_k<float, size_t> best(k);
+        for (size_t i = 0; i < task.results.size(); i++) best.merge(task.results[i]);
+        return best.sorted();
+    }
+
+    gist_db                     _db;
+    property_file               _filelist;
+    boost::shared_ptr<Generator> _generator;
+    size_t                      _num_threads;
+    bool                        _cache;
+    gist_db_encoding            _cache_encoding;
+    gist_tile_distances         _tile_distances;  // of the last query, if _cache
+};
+
+class command_serve : public Command
+{
+public:
+
+    command_serve()
+        : Command("serve [options]")
+        , _co_db        ("db"        , "d", "packed gist db written by \"gistdb pack\" [required]")
+        , _co_filelist  ("filelist"  , "f", "filelist the db refers to [required]")
+        , _co_socket    ("socket"    , "s", "path of the local socket to listen on [required]")
+        , _co_parameters("parameters", "p", "gist parameters file of compute_descriptors, enables image queries [optional]")
+        , _co_threads   ("threads"   , "t", "threads per scan [default: one per core]")
+        , _co_cache     ("cache"     , "c", "keep the tile distances of the last query: none, float or half [default: none]")
+    {
+        add(_co_db);
+        add(_co_filelist);
+        add(_co_socket);
+        add(_co_parameters);
+        add(_co_threads);
+        add(_co_cache);
+    }
+
+    bool run(const std::vector<std::string>& args)
+    {
+        warn_for_unknown_option(args);
+
+        std::string in_db;
+        std::string in_filelist;
+        std::string in_socket;
+        std::string in_parameters;
+        size_t in_threads = 0;
+        std::string in_cache = "none";
+
+        if (!_co_db.parse_single<std::string>(args, in_db)
+                || !_co_filelist.parse_single<std::string>(args, in_filelist)
+                || !_co_socket.parse_single<std::string>(args, in_socket))
+        {
+            print();
+            return false;
+        }
+
+        _co_parameters.parse_single<std::string>(args, in_parameters);
+        _co_threads.parse_single<size_t>(args, in_threads);
+        _co_cache.parse_single<std::string>(args, in_cache);
+
+        gist_server server(in_db, in_filelist, in_parameters, in_threads, in_cache);
+        server.serve(in_socket);
+        return true;
+    }
+
+private:
+
+    CmdOption _co_db;
+    CmdOption _co_filelist;
+    CmdOption _co_socket;
+    CmdOption _co_parameters;
+    CmdOption _co_threads;
+    CmdOption _co_cache;
+};
+
+class command_query : public Command
+{
+public:
+
+    command_query()
+        : Command("query [options]")
+        , _co_socket("socket", "s", "path of the socket the server listens on [required]")
+        , _co_image ("image" , "i", "query image [required]")
+        , _co_mask  ("mask"  , "m", "mask of the query image, white is the hole [required]")
+        , _co_num   ("num"   , "k", "number of results [default: 15]")
+    {
+        add(_co_socket);
+        add(_co_image);
+        add(_co_mask);
+        add(_co_num);
+    }
+
+    bool run(const std::vector<std::string>& args)
+    {
+        warn_for_unknown_option(args);
+
+        std::string in_socket;
+        std::string in_image;
+        std::string in_mask;
+        uint32_t in_num = 15;
+
+        if (!_co_socket.parse_single<std::string>(args, in_socket)
+                || !_co_image.parse_single<std::string>(args, in_image)
+                || !_co_mask.parse_single<std::string>(args, in_mask))
+        {
+            print();
+            return false;
+        }
+
+        _co_num.parse_single<uint32_t>(args, in_num);
+
+        local_socket s;
+        s.connect(in_socket);
+        std::vector<search_result> results = search_image(s, in_image, in_mask, in_num);
+
+        for (size_t i = 0; i < results.size(); i++)
+        {
+            std::cout << results[i].distance << "\t" << results[i].name << std::endl;
+        }
+        return true;
+    }
+
+private:
+
+    CmdOption _co_socket;
+    CmdOption _co_image;
+    CmdOption _co_mask;
+    CmdOption _co_num;
+};
+
+
+int main(int argc, char *argv[])
+{
+    typedef std::map<std::string, std::pair<boost::shared_ptr<Command>, std::string> > cmd_map_t;
+    cmd_map_t cmd_desc;
+    cmd_desc["serve"] = std::make_pair(boost::make_shared<command_serve>(), "keep a gist db mapped and answer queries on a local socket");
+    cmd_desc["query"] = std::make_pair(boost::make_shared<command_query>(), "send an image query to a running server");
+
+    if (argc <= 1 || !cmd_desc.count(argv[1]))
+    {
+        std::cout << "usage: " << (argc > 0 ? argv[0]:"gistserver") << " <command> ..." << std::endl;
+        std::cout << " commands:" << std::endl;
+
+        const int c0 = 20;
+        cmd_map_t::const_iterator it;
+        for (it = cmd_desc.begin(); it != cmd_desc.end(); ++it)
+        {
+            std::cout << " * " << it->first;
+            for (int k = 0; k < c0 - (int)it->first.length(); k++) std::cout << ' ';
+            std::cout << " : " << it->second.second << std::endl;
+        }
+
+        return 1;
+    }
+
+    try
+    {
+        return cmd_desc[argv[1]].first->run(argv_to_strings(argc-2, &argv[2])) ? 0:1;
+    }
+    catch (std::exception& e)
+    {
+        std::cerr << "gistserver: " << e.what() << std::endl;
+        return 1;
+    }
+}
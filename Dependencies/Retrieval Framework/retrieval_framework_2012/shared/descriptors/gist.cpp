@@ -34,13 +34,36 @@ gist_generator::gist_generator(const ptree& params)
 
  , _width(_realwidth + _padding)
  , _height(_realheight + _padding)
+ , _filter_cache_str(parse<string>   (_parameters, "params.filter_cache"  , ""             )) // directory of the cached filter bank (none: built in memory)
+ , _decimate      (parse<bool>       (_parameters, "params.decimate"      , false          )) // decimated inverse transforms of the low frequency filters
 {
     if (_prefilter_str == "torralba") _prefilter_ocv = torralba_prefilter(_width, _height, 4.0 * _width / _realwidth);
 
-    init_filter();
+    gist_params p;
+    p.realwidth      = _realwidth;
+    p.realheight     = _realheight;
+    p.padding        = _padding;
+    p.num_x_tiles    = _num_x_tiles;
+    p.num_y_tiles    = _num_y_tiles;
+    p.num_freqs      = _num_freqs;
+    p.num_orients    = _num_orients;
+    p.max_peak_freq  = _max_peak_freq;
+    p.delta_freq_oct = _delta_freq_oct;
+    p.bandwidth_oct  = _bandwidth_oct;
+    p.angle_factor   = _angle_factor;
+    p.polar          = _polar;
+    p.decimate       = _decimate;
+    _engine = gist_engine(p, _filter_cache_str);
+
+    // the parameters are stored with the descriptors, so are the error bounds of decimated ones
+    if (_decimate)
+    {
+        _parameters.put("params.decimate_mean_tolerance", gist_decimation_mean_tolerance);
+        _parameters.put("params.decimate_variance_tolerance", gist_decimation_variance_tolerance);
+    }
 }
 
-void gist_generator::compute(anymap_t& data)
+void gist_generator::prepare(const anymap_t& data, cv::Mat_<unsigned char>& padded, int& tilewidth, int& tileheight)
 {
 
     // ------------------------------------------------------------------------
@@ -64,108 +87,44 @@ void gist_generator::compute(anymap_t& data)
     cv::Mat scaled;
     cv::resize(image, scaled, cv::Size(), scaling_factor, scaling_factor, cv::INTER_AREA);
 
-    cv::Mat_<unsigned char> padded(_height, _width);
+    padded.create(_height, _width);
     symmetric_pad(cv::Mat_<unsigned char>(scaled), padded);
 
     // if exists, apply prefilter on image buffer
     // for example the torralba prefilter
     if (_prefilter_ocv) _prefilter_ocv(padded);
 
-    cv::Mat_<complex_t> src(_height, _width);
-    cv::MatConstIterator_<unsigned char> sit = padded.begin();
-    cv::MatIterator_<complex_t> dit = src.begin();
-    while (sit != padded.end())
-    {
-        *dit++ = (float_t) *sit++ * (1.0/255.0);
-    }
-
-    // transform image into fourier space
-    cv::Mat_<complex_t> fts;
-    cv::dft(src, fts);
-
-    vec_f32_t means;
-    vec_f32_t sdevs;
-
     // shouldn't we better use scaled.width and scaled.height?
-    int tilewidth = scaling_factor * image.size().width / _num_x_tiles;
-    int tileheight = scaling_factor * image.size().height / _num_y_tiles;
+    tilewidth = scaling_factor * image.size().width / _num_x_tiles;
+    tileheight = scaling_factor * image.size().height / _num_y_tiles;
+}
 
-    // convolve image with each filter in fourier space
-    for (size_t i = 0; i < _filters.size(); i++)
-    {
-        // multiply sprectrums == convolve
-        cv::Mat_<complex_t> ftd;
-        cv::mulSpectrums(fts, _filters[i], ftd, 0);
-
-        // transform back to image space
-        cv::Mat_<complex_t> dst;
-        cv::idft(ftd, dst, cv::DFT_SCALE);
-
-        // compute the response magnitude
-        cv::Mat_<float_t> mag(_height, _width);
-        for (int r = 0; r < dst.rows; r++)
-        for (int c = 0; c < dst.cols; c++)
-        {
-            float_t real = dst(r, c).real();
-            float_t imag = dst(r, c).imag();
-            mag(r, c) = std::sqrt(real*real + imag*imag);
-        }
-
-        // get mean and standard deviation of tile contents
-        for (size_t y = 0; y < _num_y_tiles; y++)
-        for (size_t x = 0; x < _num_x_tiles; x++)
-        {
-            cv::Mat tile = mag(cv::Rect(x * tilewidth, y * tileheight, tilewidth, tileheight));
-            cv::Scalar m, d;
-            cv::meanStdDev(tile, m, d);
-
-            means.push_back(m[0]);
-
-            // TODO: is it better to use the standard deviation or the variance?
-            // (w.r.t. optional normalization or distance measures in general)
-            sdevs.push_back(d[0]*d[0]);
-        }
-    }
+void gist_generator::compute(anymap_t& data)
+{
+    cv::Mat_<unsigned char> padded;
+    int tilewidth, tileheight;
+    prepare(data, padded, tilewidth, tileheight);
+
+    vec_f32_t means(_engine.params().num_features());
+    vec_f32_t sdevs(_engine.params().num_features());
+    _engine.compute(padded, tilewidth, tileheight, &means[0], &sdevs[0], _scratch);
 
     data["features_mean"] = means;
     data["features_variance"] = sdevs;
 }
 
-void gist_generator::init_filter()
+void gist_generator::compute_reference(anymap_t& data)
 {
-    const double delta_freq = std::pow(2.0, _delta_freq_oct);
-    const double bandwidth = std::pow(2.0, _bandwidth_oct);
-    const double delta_omega = (M_PI / static_cast<double>(_num_orients));
-    const double max_extend = std::max(_width, _height);
-    const double pad_max_peak_freq = max_extend * _max_peak_freq / (max_extend + static_cast<double>(_padding));
-
-    // compute gabor filter in regular formation
-    for (size_t i = 0; i < _num_freqs; i++)
-    {
-        for (size_t k = 0; k < _num_orients; k++)
-        {
-            // compute params
-            const double curPeak = pad_max_peak_freq / std::pow(delta_freq, static_cast<double>(i));
-            const double curOmega = k * delta_omega;
-
-            // generate filter
-            cv::Mat_<complex_t> filter(_width, _height);
-            if (_polar)
-            {
-                generate_polargabor_filter(filter, curPeak, bandwidth, curOmega, delta_omega * _angle_factor);
-            }
-            else
-            {
-                generate_gabor_filter(filter, curPeak, bandwidth, curOmega, delta_omega * _angle_factor);
-            }
-
-            // kill dc
-            filter(0, 0) = 0;
-
-            // add
-            _filters.push_back(filter);
-        }
-    }
+    cv::Mat_<unsigned char> padded;
+    int tilewidth, tileheight;
+    prepare(data, padded, tilewidth, tileheight);
+
+    vec_f32_t means(_engine.params().num_features());
+    vec_f32_t sdevs(_engine.params().num_features());
+    _engine.compute_reference(padded, tilewidth, tileheight, &means[0], &sdevs[0]);
+
+    data["features_mean"] = means;
+    data["features_variance"] = sdevs;
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////
@@ -2,30 +2,31 @@
 #define DESCRIPTORS__GIST_HPP
 
 #include <string>
-#include <complex>
 
 #include <boost/function.hpp>
 
 #include "../types.hpp"
 #include "../generator.hpp"
+#include "gist_engine.hpp"
 
 namespace imdb
 {
 
 class gist_generator : public GeneratorWithCopyClone<gist_generator>
 {
-    typedef float                 float_t;
-    typedef std::complex<float_t> complex_t;
-
     public:
 
     gist_generator(const ptree& params);
 
     void compute(anymap_t& data);
 
+    // compute() with gist_engine::compute_reference, in double precision, to check the engine against
+    void compute_reference(anymap_t& data);
+
     private:
 
-    void init_filter();
+    // the gray image of data scaled and padded for the engine, and the tile size
+    void prepare(const anymap_t& data, cv::Mat_<unsigned char>& padded, int& tilewidth, int& tileheight);
 
     const size_t _padding;
 
@@ -50,8 +51,17 @@ class gist_generator : public GeneratorWithCopyClone<gist_generator>
     const size_t _width;
     const size_t _height;
 
+    // directory the filter bank is cached in (none: built by every process)
+    const std::string _filter_cache_str;
+
+    // decimated inverse transforms for the low frequency filters, see gist_engine
+    const bool _decimate;
+
     boost::function<void (cv::Mat&)> _prefilter_ocv;
-    std::vector<cv::Mat_<complex_t> > _filters;
+
+    // filter bank and transforms, shared with the query of PDCI
+    gist_engine _engine;
+    gist_engine_scratch _scratch;
 };
 
 } // namespace imdb
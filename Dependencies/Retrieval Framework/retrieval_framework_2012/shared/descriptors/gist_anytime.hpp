@@ -0,0 +1,211 @@
+#ifndef DESCRIPTORS__GIST_ANYTIME_HPP
+#define DESCRIPTORS__GIST_ANYTIME_HPP
+
+#include <vector>
+#include <algorithm>
+#include <limits>
+
+#include <stdint.h>
+
+#include "../top_k.hpp"
+#include "../worker_threads.hpp"
+#include "gist_pq.hpp"
+
+#ifndef _WIN32
+#include <sys/time.h>
+#endif
+
+// ----------------------------------------------------------------------------
+// Anytime scan of a gist db: the best records found so far, in a bounded
+// time, instead of the exact result after a full scan.
+//
+// The records are scored a block at a time, the blocks in a random
+// permutation drawn when the scan starts. Every prefix of that order is a
+// uniform sample of the db, so after a fraction f of the db the expected
+// share of the true k nearest records found is f, wherever they are
+// stored. Records stay sequential within a block, which keeps the reads
+// as fast as those of the scan in order.
+//
+// run() stops at a wall-clock deadline or a record budget and returns the
+// progress. A later run() continues where the last one stopped, with the
+// records kept so far; once every block was visited the result is that of
+// the exact scan.
+//
+// The blocks are handed to the worker threads in rounds of a few
+// milliseconds, the deadline is checked between rounds.
+// ----------------------------------------------------------------------------
+
+namespace imdb {
+
+// blocks every thread scores per round
+static const size_t gist_anytime_round_blocks = 32;
+
+struct gist_anytime_progress
+{
+    size_t records_scanned;
+    size_t num_records;
+    double seconds;         // wall clock spent in run(), all calls together
+    float  kth_distance;    // distance of the worst record kept, infinity while fewer than k are kept
+
+    double fraction() const { return num_records > 0 ? double(records_scanned) / num_records : 1.0; }
+
+    bool complete() const { return records_scanned >= num_records; }
+};
+
+namespace detail {
+
+// wall clock in seconds, from an arbitrary start
+inline double wall_seconds()
+{
+#ifdef _WIN32
+    LARGE_INTEGER frequency, counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return double(counter.QuadPart) / double(frequency.QuadPart);
+#else
+    timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+#endif
+}
+
+// one round: the blocks [begin, end) of the order, split evenly over the threads
+template <class Score>
+struct anytime_round
+{
+    Score* score;
+    const std::vector<size_t>* order;
+    size_t num_records;
+    size_t block_size;
+    size_t begin;
+    size_t end;
+    float bound;    // worst distance kept before the round
+    std::vector<top_k<float, size_t> > results;
+
+    anytime_round(Score* s, const std::vector<size_t>* o, size_t n, size_t b, size_t first, size_t last, float worst, size_t num_threads, size_t k)
+        : score(s), order(o), num_records(n), block_size(b), begin(first), end(last), bound(worst)
+        , results(num_threads, top_k<float, size_t>(k))
+    {}
+
+    void operator()(size_t shard)
+    {
+        const size_t from = begin + (end - begin) * shard / results.size();
+        const size_t to = begin + (end - begin) * (shard + 1) / results.size();
+
+        top_k<float, size_t>& result = results[shard];
+        std::vector<float> distances(block_size);
+        for (size_t p = from; p < to; p++)
+        {
+            const size_t first = (*order)[p] * block_size;
+            const size_t count = std::min(block_size, num_records - first);
+
+            const float cutoff = result.full() ? std::min(bound, result.worst()) : bound;
+            (*score)(shard, first, count, cutoff, &distances[0]);
+
+            // records that are not better than those kept before the round stay out,
+            // they would only be dropped again by the merge
+            for (size_t j = 0; j < count; j++)
+            {
+                if (distances[j] < bound) result.push(distances[j], first + j);
+            }
+        }
+    }
+};
+
+} // namespace detail
+
+class gist_anytime_scan
+{
+    public:
+
+    gist_anytime_scan() : _num_records(0), _block_size(1), _next(0), _records_scanned(0), _seconds(0) {}
+
+    // Starts over: num_records records for the k best, in blocks of
+    // block_size records visited in an order drawn from seed.
+    void reset(size_t num_records, size_t block_size, size_t k, uint32_t seed)
+    {
+        _num_records = num_records;
+        _block_size = std::max<size_t>(1, block_size);
+        _next = 0;
+        _records_scanned = 0;
+        _seconds = 0;
+        _best = top_k<float, size_t>(k);
+
+        _order.resize((num_records + _block_size - 1) / _block_size);
+        for (size_t i = 0; i < _order.size(); i++) _order[i] = i;
+
+        detail::xorshift32 rng(seed);
+        for (size_t i = _order.size(); i > 1; i--) std::swap(_order[i - 1], _order[rng() % i]);
+    }
+
+    // true after reset(), until the next reset()
+    bool started() const { return _best.capacity() > 0; }
+
+    bool complete() const { return _next >= _order.size(); }
+
+    size_t size() const { return _num_records; }
+
+    size_t k() const { return _best.capacity(); }
+
+    // Scores further blocks until seconds of wall clock have passed (<= 0:
+    // no deadline), at least max_records more records were scored (0: no
+    // budget) or the scan is complete. At least one round is scored.
+    //
+    // score(thread, first, count, cutoff, out) writes the distances of the
+    // records [first, first + count) to out; records that cannot be kept
+    // may get any distance >= cutoff (early abandoning). It is called from
+    // num_threads threads at once, with thread in [0, num_threads).
+    template <class Score>
+    gist_anytime_progress run(Score& score, size_t num_threads, double seconds, size_t max_records)
+    {
+        const double start = detail::wall_seconds();
+        const size_t budget_end = max_records > 0 ? std::min(_order.size(), _next + (max_records + _block_size - 1) / _block_size) : _order.size();
+        num_threads = std::max<size_t>(1, num_threads);
+
+        while (_next < budget_end)
+        {
+            const size_t end = std::min(budget_end, _next + num_threads * gist_anytime_round_blocks);
+            const size_t threads = std::min(num_threads, end - _next);
+            const float bound = _best.full() ? _best.worst() : std::numeric_limits<float>::infinity();
+
+            detail::anytime_round<Score> round(&score, &_order, _num_records, _block_size, _next, end, bound, threads, _best.capacity());
+            run_worker_threads(threads, round);
+
+            for (size_t i = 0; i < round.results.size(); i++) _best.merge(round.results[i]);
+            for (size_t p = _next; p < end; p++) _records_scanned += std::min(_block_size, _num_records - _order[p] * _block_size);
+            _next = end;
+
+            if (seconds > 0 && detail::wall_seconds() - start >= seconds) break;
+        }
+
+        _seconds += detail::wall_seconds() - start;
+        return progress();
+    }
+
+    gist_anytime_progress progress() const
+    {
+        gist_anytime_progress p;
+        p.records_scanned = _records_scanned;
+        p.num_records = _num_records;
+        p.seconds = _seconds;
+        p.kth_distance = _best.full() ? _best.worst() : std::numeric_limits<float>::infinity();
+        return p;
+    }
+
+    // the best records so far, nearest first
+    std::vector<std::pair<float, size_t> > sorted() const { return _best.sorted(); }
+
+    private:
+
+    size_t               _num_records;
+    size_t               _block_size;
+    std::vector<size_t>  _order;            // block indices in the order they are visited
+    size_t               _next;             // blocks of _order visited so far
+    size_t               _records_scanned;
+    double               _seconds;
+    top_k<float, size_t> _best;
+};
+
+} // namespace imdb
+
+#endif // DESCRIPTORS__GIST_ANYTIME_HPP
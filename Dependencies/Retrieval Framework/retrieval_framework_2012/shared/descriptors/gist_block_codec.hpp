@@ -0,0 +1,411 @@
+#ifndef DESCRIPTORS__GIST_BLOCK_CODEC_HPP
+#define DESCRIPTORS__GIST_BLOCK_CODEC_HPP
+
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <stdexcept>
+
+#include <stdint.h>
+
+#include "../property_file.hpp"
+
+// ----------------------------------------------------------------------------
+// Lossless block compression of descriptor files (vec_f32_t properties).
+//
+// A compressed file is an ordinary PropertyT<vec_u8_t> file, with the same
+// footer, offset table and map, but each element is a block of
+// block_records consecutive descriptors. So the offset table still gives
+// random access, at block granularity, and every block can be decoded on
+// its own, by any number of scan threads at once.
+//
+// Within a block the floats are stored dimension-major and split into four
+// byte planes (byte shuffle). Gist values of one dimension are positive and
+// of a similar magnitude, so in the plane of the sign and exponent bytes the
+// values of one dimension lie in a narrow range, while the low mantissa
+// bytes are close to noise. A plane is either stored raw or, if that is
+// smaller, coded per dimension, with whichever of two codes is smaller:
+//
+// - frame of reference: the smallest byte of the dimension and the others
+//   as offsets from it, packed at the bit width of the largest offset,
+// - delta: the first byte and the difference of every byte to the one of
+//   the record before (modulo 256, zigzag coded), packed at the bit width
+//   of the largest difference. This wins where consecutive records are
+//   alike, descriptors of neighbouring frames or of near duplicates.
+//
+// There is no LZ stage: the planes are coded per dimension, a few dozen
+// bytes at a time, and a match of several bytes that repeats within a block
+// is next to absent in gist values. gistdb compressstats measures the share
+// of every plane and code and the decode speed against the read speed of
+// the descriptor file, for a db at hand. Decoding is a bit unpack, a prefix
+// sum for delta coded dimensions and a transpose.
+//
+// Block layout:
+//
+//   uint8    mode[4]      plane k holds byte k of every float, 0 raw, 1 packed
+//   uint32   bytes[4]     encoded size of every plane
+//   planes                plane k is count * floats bytes when decoded
+//
+// A packed plane holds, for every dimension, uint8 code, uint8 base and the
+// values, least significant bit first. The low bits of code are the bit
+// width (0 to 8), bit 7 is set for delta coding. For frame of reference
+// base is the smallest byte and there are count offsets, for delta base is
+// the first byte and there are count - 1 differences.
+//
+// The map of the file holds "gist_block_records" (records per block),
+// "gist_block_floats" (floats per record) and "gist_block_count" (records).
+// ----------------------------------------------------------------------------
+
+namespace imdb {
+
+static const size_t gist_block_header_bytes = 4 + 4 * sizeof(uint32_t);
+static const size_t gist_block_default_records = 64;
+
+// codes a packed plane may use, gist_block_encode picks the smaller one per dimension
+enum gist_block_coder
+{
+    gist_block_frame = 1,   // frame of reference
+    gist_block_delta = 2,   // differences to the record before
+    gist_block_all   = 3
+};
+
+// what gist_block_encode did, added up over the blocks it is handed to
+struct gist_block_stats
+{
+    uint64_t raw_bytes[4];      // bytes of plane k before coding
+    uint64_t coded_bytes[4];    // and as stored
+    uint64_t raw_planes[4];     // blocks that store plane k raw
+    uint64_t frame_dims[4];     // dimensions of plane k coded by frame of reference
+    uint64_t delta_dims[4];     // and by delta
+
+    gist_block_stats()
+    {
+        std::memset(this, 0, sizeof(*this));
+    }
+};
+
+namespace detail {
+
+static const uint8_t block_delta_flag = 0x80;
+
+inline unsigned bit_width(unsigned range)
+{
+    unsigned width = 0;
+    while (range >> width) width++;
+    return width;
+}
+
+// appends n values of width bits, least significant bit first
+inline void put_bits(const uint8_t* values, size_t n, unsigned width, std::vector<uint8_t>& out)
+{
+    uint32_t acc = 0;
+    unsigned have = 0;
+    for (size_t i = 0; i < n && width > 0; i++)
+    {
+        acc |= uint32_t(values[i]) << have;
+        have += width;
+        while (have >= 8)
+        {
+            out.push_back(static_cast<uint8_t>(acc));
+            acc >>= 8;
+            have -= 8;
+        }
+    }
+    if (have > 0) out.push_back(static_cast<uint8_t>(acc));
+}
+
+// n values of width bits, returns the end of the code or 0 if it runs past end
+inline const uint8_t* get_bits(const uint8_t* in, const uint8_t* end, size_t n, unsigned width, uint8_t* values)
+{
+    if (in + (n * width + 7) / 8 > end) return 0;
+
+    const uint32_t mask = (1u << width) - 1;
+    uint32_t acc = 0;
+    unsigned have = 0;
+    for (size_t i = 0; i < n && width > 0; i++)
+    {
+        if (have < width)
+        {
+            acc |= uint32_t(*in++) << have;
+            have += 8;
+        }
+        values[i] = static_cast<uint8_t>(acc & mask);
+        acc >>= width;
+        have -= width;
+    }
+    return in;
+}
+
+// code of n bytes, appended to out, values is scratch space
+inline void pack_bytes(const uint8_t* in, size_t n, unsigned coders, std::vector<uint8_t>& values, std::vector<uint8_t>& out,
+                       bool* delta_coded = 0)
+{
+    if (delta_coded) *delta_coded = false;
+    if (n == 0)
+    {
+        out.push_back(0);
+        out.push_back(0);
+        return;
+    }
+
+    uint8_t lo = 255, hi = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        lo = std::min(lo, in[i]);
+        hi = std::max(hi, in[i]);
+    }
+    const unsigned frame_width = bit_width(hi - lo);
+
+    // zigzag coded differences modulo 256: 0, -1, 1, -2, ... become 0, 1, 2, 3, ...
+    uint8_t largest = 0;
+    values.resize(n);
+    for (size_t i = 1; i < n; i++)
+    {
+        const int d = static_cast<int8_t>(static_cast<uint8_t>(in[i] - in[i - 1]));
+        values[i - 1] = static_cast<uint8_t>(d < 0 ? -2 * d - 1 : 2 * d);
+        largest = std::max(largest, values[i - 1]);
+    }
+    const unsigned delta_width = bit_width(largest);
+
+    // (n - 1) * delta_width < n * frame_width
+    const bool delta = (coders & gist_block_delta) && (!(coders & gist_block_frame) || (n - 1) * delta_width < n * frame_width);
+    if (delta)
+    {
+        out.push_back(static_cast<uint8_t>(block_delta_flag | delta_width));
+        out.push_back(in[0]);
+        put_bits(&values[0], n - 1, delta_width, out);
+        if (delta_coded) *delta_coded = true;
+        return;
+    }
+
+    for (size_t i = 0; i < n; i++) values[i] = static_cast<uint8_t>(in[i] - lo);
+    out.push_back(static_cast<uint8_t>(frame_width));
+    out.push_back(lo);
+    put_bits(&values[0], n, frame_width, out);
+}
+
+// decodes n bytes, returns the end of the code or 0 if it runs past end
+inline const uint8_t* unpack_bytes(const uint8_t* in, const uint8_t* end, uint8_t* out, size_t n)
+{
+    if (in + 2 > end) return 0;
+    const bool delta = (in[0] & block_delta_flag) != 0;
+    const unsigned width = in[0] & ~block_delta_flag & 0xff;
+    const uint8_t base = in[1];
+    in += 2;
+
+    if (width > 8) return 0;
+    if (width == 0)
+    {
+        std::memset(out, base, n);
+        return in;
+    }
+    if (n == 0) return in;
+
+    if (delta)
+    {
+        in = get_bits(in, end, n - 1, width, out + 1);
+        if (in == 0) return 0;
+
+        out[0] = base;
+        for (size_t i = 1; i < n; i++)
+        {
+            const uint8_t z = out[i];
+            out[i] = static_cast<uint8_t>(out[i - 1] + ((z & 1) ? -(z >> 1) - 1 : (z >> 1)));
+        }
+        return in;
+    }
+
+    in = get_bits(in, end, n, width, out);
+    if (in == 0) return 0;
+    for (size_t i = 0; i < n; i++) out[i] = static_cast<uint8_t>(out[i] + base);
+    return in;
+}
+
+} // namespace detail
+
+// Appends the code of count records of the given number of floats to out,
+// packed planes use the codes of coders (gist_block_coder flags). stats,
+// if given, gets what was done added to it.
+inline void gist_block_encode(const float* records, size_t count, size_t floats, std::vector<uint8_t>& out,
+                              unsigned coders = gist_block_all, gist_block_stats* stats = 0)
+{
+    const size_t n = count * floats;
+
+    // byte k of float d of record r goes to planes[k][d * count + r]
+    std::vector<uint8_t> planes(4 * n);
+    for (size_t r = 0; r < count; r++)
+    {
+        for (size_t d = 0; d < floats; d++)
+        {
+            uint32_t bits;
+            std::memcpy(&bits, &records[r * floats + d], sizeof(bits));
+            for (size_t k = 0; k < 4; k++) planes[k * n + d * count + r] = static_cast<uint8_t>(bits >> (8 * k));
+        }
+    }
+
+    const size_t header = out.size();
+    out.resize(header + gist_block_header_bytes);
+
+    std::vector<uint8_t> code, values;
+    for (size_t k = 0; k < 4; k++)
+    {
+        size_t delta_dims = 0;
+        code.clear();
+        for (size_t d = 0; d < floats; d++)
+        {
+            bool delta;
+            detail::pack_bytes(&planes[k * n + d * count], count, coders, values, code, &delta);
+            if (delta) delta_dims++;
+        }
+
+        uint8_t mode = 1;
+        if (code.size() >= n)
+        {
+            mode = 0;
+            code.assign(planes.begin() + k * n, planes.begin() + (k + 1) * n);
+        }
+
+        const uint32_t bytes = static_cast<uint32_t>(code.size());
+        out[header + k] = mode;
+        std::memcpy(&out[header + 4 + k * sizeof(uint32_t)], &bytes, sizeof(bytes));
+        out.insert(out.end(), code.begin(), code.end());
+
+        if (stats)
+        {
+            stats->raw_bytes[k] += n;
+            stats->coded_bytes[k] += bytes;
+            if (mode == 0)
+            {
+                stats->raw_planes[k]++;
+            }
+            else
+            {
+                stats->delta_dims[k] += delta_dims;
+                stats->frame_dims[k] += floats - delta_dims;
+            }
+        }
+    }
+}
+
+// Decodes a block of count records into out (count * floats floats),
+// planes is scratch space. Returns false if the block is corrupt.
+inline bool gist_block_decode(const uint8_t* in, size_t bytes, size_t count, size_t floats, float* out, std::vector<uint8_t>& planes)
+{
+    const size_t n = count * floats;
+    if (bytes < gist_block_header_bytes) return false;
+
+    planes.resize(4 * n);
+    const uint8_t* p = in + gist_block_header_bytes;
+    const uint8_t* end = in + bytes;
+    for (size_t k = 0; k < 4; k++)
+    {
+        uint32_t size;
+        std::memcpy(&size, in + 4 + k * sizeof(uint32_t), sizeof(size));
+        if (p + size > end) return false;
+
+        if (in[k] == 0)
+        {
+            if (size != n) return false;
+            std::memcpy(&planes[k * n], p, n);
+        }
+        else
+        {
+            const uint8_t* q = p;
+            for (size_t d = 0; d < floats && q != 0; d++) q = detail::unpack_bytes(q, p + size, &planes[k * n + d * count], count);
+            if (q != p + size) return false;
+        }
+        p += size;
+    }
+
+    const uint8_t* b0 = &planes[0];
+    const uint8_t* b1 = b0 + n;
+    const uint8_t* b2 = b1 + n;
+    const uint8_t* b3 = b2 + n;
+    for (size_t d = 0; d < floats; d++)
+    {
+        for (size_t r = 0; r < count; r++)
+        {
+            const size_t i = d * count + r;
+            const uint32_t bits = uint32_t(b0[i]) | (uint32_t(b1[i]) << 8) | (uint32_t(b2[i]) << 16) | (uint32_t(b3[i]) << 24);
+            std::memcpy(&out[r * floats + d], &bits, sizeof(bits));
+        }
+    }
+    return true;
+}
+
+// Read-only access to a block compressed descriptor file. All members are
+// const and the file is memory mapped, so one instance can be shared by the
+// scan threads, each with its own scratch vector.
+class gist_block_file
+{
+    public:
+
+    gist_block_file() : _count(0), _floats(0), _block_records(0) {}
+
+    explicit gist_block_file(const std::string& filename) : _count(0), _floats(0), _block_records(0)
+    {
+        open(filename);
+    }
+
+    void open(const std::string& filename)
+    {
+        _file.open(filename);
+
+        const std::map<std::string, std::string>& m = _file.map();
+        if (!m.count("gist_block_records") || !m.count("gist_block_floats") || !m.count("gist_block_count"))
+        {
+            throw std::runtime_error("not a block compressed descriptor file: " + filename);
+        }
+
+        _block_records = static_cast<size_t>(std::strtoul(m.find("gist_block_records")->second.c_str(), 0, 10));
+        _floats = static_cast<size_t>(std::strtoul(m.find("gist_block_floats")->second.c_str(), 0, 10));
+        _count = static_cast<size_t>(std::strtoul(m.find("gist_block_count")->second.c_str(), 0, 10));
+
+        if (_block_records == 0 || _file.size() != (_count + _block_records - 1) / _block_records)
+        {
+            throw std::runtime_error("block compressed descriptor file is corrupt: " + filename);
+        }
+    }
+
+    bool is_open() const { return _file.is_open(); }
+
+    // number of records
+    size_t size() const { return _count; }
+
+    size_t floats() const { return _floats; }
+
+    size_t block_records() const { return _block_records; }
+
+    size_t num_blocks() const { return _file.size(); }
+
+    // records of block b
+    size_t block_count(size_t b) const { return std::min(_block_records, _count - b * _block_records); }
+
+    // Decodes block b, records b * block_records() on, into out
+    // (block_count(b) * floats() floats). Throws if the block is corrupt.
+    void decode(size_t b, float* out, std::vector<uint8_t>& planes) const
+    {
+        const char* p = _file.element(b);
+        int64_t bytes;
+        std::memcpy(&bytes, p, sizeof(bytes));
+
+        if (!gist_block_decode(reinterpret_cast<const uint8_t*>(p + sizeof(int64_t)), static_cast<size_t>(bytes), block_count(b), _floats, out, planes))
+        {
+            throw std::runtime_error("block compressed descriptor file has a corrupt block");
+        }
+    }
+
+    private:
+
+    property_file _file;
+    size_t        _count;
+    size_t        _floats;
+    size_t        _block_records;
+};
+
+} // namespace imdb
+
+#endif // DESCRIPTORS__GIST_BLOCK_CODEC_HPP
@@ -0,0 +1,443 @@
+#ifndef DESCRIPTORS__GIST_DB_HPP
+#define DESCRIPTORS__GIST_DB_HPP
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#include <stdint.h>
+
+#include "../mapped_file.hpp"
+
+// ----------------------------------------------------------------------------
+// Packed, fixed-stride store for GIST descriptors.
+//
+// The gist generator writes means and variances into two separate
+// PropertyT<vec_f32_t> files, each element prefixed by its length and
+// ordered filter-major, i.e. [freq][orient][y][x]. Scanning those means
+// walking two files in lockstep and copying every single float.
+//
+// A gist db holds the same data in one file that is meant to be mapped
+// into memory and scanned in place:
+//
+//   header     gist_db_header, padded to gist_db_alignment bytes
+//   records    num_records * record_stride bytes. A record stores for each
+//              tile (row-major) and each filter (freq-major) the
+//              interleaved pair (mean, variance), i.e. it is a
+//              float[num_tiles][num_filters][2].
+//   ids        num_records * int64, index of the record in the filelist
+//              the descriptors have been computed from
+//
+// Alternatively (version 2) the records are stored tile-major: for every
+// tile there is one block, aligned to gist_db_alignment, that holds the
+// float[num_filters][2] of that tile for all records one after another.
+// A query whose mask gives some tiles no weight then never touches the
+// pages of those tiles.
+//
+// Version 3 adds scalar quantized records (see gist_quantizer.hpp): every
+// value is stored as a uint8 code or as an IEEE half float instead of a
+// float. For uint8 codes the file holds a quantizer table, for each value
+// of a record the pair (offset, scale) with value ~ offset + scale * code.
+//
+// All values are stored in the byte order of the machine that wrote them,
+// which is what PropertyT does as well.
+// ----------------------------------------------------------------------------
+
+namespace imdb {
+
+static const char     gist_db_magic[8]  = { 'G', 'I', 'S', 'T', 'D', 'B', '\0', '\0' };
+static const uint32_t gist_db_version   = 3;
+static const uint64_t gist_db_alignment = 4096;
+
+struct gist_geometry
+{
+    uint32_t num_x_tiles;
+    uint32_t num_y_tiles;
+    uint32_t num_freqs;
+    uint32_t num_orients;
+
+    gist_geometry(uint32_t x_tiles = 4, uint32_t y_tiles = 4, uint32_t freqs = 4, uint32_t orients = 6)
+        : num_x_tiles(x_tiles), num_y_tiles(y_tiles), num_freqs(freqs), num_orients(orients)
+    {}
+
+    size_t num_tiles() const { return num_x_tiles * num_y_tiles; }
+    size_t num_filters() const { return num_freqs * num_orients; }
+
+    // floats of one tile in a packed record: (mean, variance) per filter
+    size_t tile_floats() const { return 2 * num_filters(); }
+
+    // floats of a whole packed record
+    size_t record_floats() const { return num_tiles() * tile_floats(); }
+
+    // number of values in a features_mean (or features_variance) element
+    size_t feature_size() const { return num_tiles() * num_filters(); }
+
+    bool operator==(const gist_geometry& o) const
+    {
+        return num_x_tiles == o.num_x_tiles && num_y_tiles == o.num_y_tiles
+            && num_freqs == o.num_freqs && num_orients == o.num_orients;
+    }
+    bool operator!=(const gist_geometry& o) const { return !(*this == o); }
+};
+
+enum gist_db_layout
+{
+    gist_db_record_major = 0,
+    gist_db_tile_major   = 1
+};
+
+enum gist_db_encoding
+{
+    gist_db_float32 = 0,
+    gist_db_uint8   = 1,
+    gist_db_float16 = 2
+};
+
+// bytes of one value of a record
+inline size_t gist_db_value_size(gist_db_encoding encoding)
+{
+    switch (encoding)
+    {
+        case gist_db_uint8:   return 1;
+        case gist_db_float16: return 2;
+        default:              return 4;
+    }
+}
+
+inline uint64_t gist_db_align(uint64_t offset)
+{
+    return (offset + gist_db_alignment - 1) / gist_db_alignment * gist_db_alignment;
+}
+
+struct gist_db_header
+{
+    char          magic[8];
+    uint32_t      version;
+    uint32_t      layout;           // gist_db_layout, 0 in version 1
+    uint32_t      num_x_tiles;
+    uint32_t      num_y_tiles;
+    uint32_t      num_freqs;
+    uint32_t      num_orients;
+    uint64_t      num_records;
+    uint64_t      record_stride;    // bytes between two consecutive records
+    uint64_t      records_offset;   // byte offset of the first record
+    uint64_t      ids_offset;       // byte offset of the id table
+    uint64_t      tile_stride;      // tile-major: bytes between two records in a tile block
+    uint64_t      tile_block_size;  // tile-major: bytes between two tile blocks
+    uint32_t      encoding;         // gist_db_encoding, 0 before version 3
+    uint32_t      reserved;
+    uint64_t      quantizer_offset; // uint8: byte offset of float[record_floats][2] (offset, scale)
+};
+
+// Converts the descriptor of one image from generator order
+// (separate mean and variance arrays, [filter][y][x]) into a packed record.
+inline void gist_pack_record(const gist_geometry& g, const float* means, const float* variances, float* record)
+{
+    const size_t num_tiles = g.num_tiles();
+    const size_t num_filters = g.num_filters();
+
+    for (size_t t = 0; t < num_tiles; t++)
+    for (size_t f = 0; f < num_filters; f++)
+    {
+        *record++ = means[f * num_tiles + t];
+        *record++ = variances[f * num_tiles + t];
+    }
+}
+
+// Tile of the horizontally mirrored image that tile t ends up in.
+inline size_t gist_mirror_tile(const gist_geometry& g, size_t t)
+{
+    const size_t y = t / g.num_x_tiles;
+    const size_t x = t % g.num_x_tiles;
+    return y * g.num_x_tiles + (g.num_x_tiles - 1 - x);
+}
+
+// Packed record of the horizontally mirrored image, computed from the record
+// of the image itself. Mirroring moves tile column x to num_x_tiles - 1 - x
+// and turns the filter of orientation k (angle k * pi / num_orients) into the
+// one of orientation (num_orients - k) % num_orients, the frequencies stay.
+// The magnitude of a filter response does not change under this, except near
+// the padded image border, so the result is close to the gist of the flipped
+// image. Mirroring twice gives the record back.
+inline void gist_mirror_record(const gist_geometry& g, const float* record, float* mirrored)
+{
+    const size_t n = g.tile_floats();
+    for (size_t t = 0; t < g.num_tiles(); t++)
+    {
+        const float* src = record + t * n;
+        float* dst = mirrored + gist_mirror_tile(g, t) * n;
+        for (size_t freq = 0; freq < g.num_freqs; freq++)
+        for (size_t k = 0; k < g.num_orients; k++)
+        {
+            const size_t f = freq * g.num_orients + k;
+            const size_t m = freq * g.num_orients + (g.num_orients - k) % g.num_orients;
+            dst[2 * m]     = src[2 * f];
+            dst[2 * m + 1] = src[2 * f + 1];
+        }
+    }
+}
+
+class gist_db_writer
+{
+    public:
+
+    gist_db_writer(const std::string& filename, const gist_geometry& geometry)
+        : _ofs(filename.c_str(), std::ofstream::binary | std::ofstream::trunc)
+        , _geometry(geometry)
+        , _record(geometry.record_floats())
+    {
+        if (!_ofs.is_open()) throw std::runtime_error("could not open file " + filename);
+
+        // reserve space for the header, it is written on close
+        std::vector<char> pad(static_cast<size_t>(gist_db_alignment), 0);
+        _ofs.write(&pad[0], pad.size());
+    }
+
+    // Closes the file if close() was not called. A write error cannot be
+    // thrown from here and is lost, call close() to see it.
+    ~gist_db_writer()
+    {
+        try
+        {
+            if (_ofs.is_open()) close();
+        }
+        catch (const std::exception&)
+        {
+        }
+    }
+
+    // means and variances in generator order, id is the index in the filelist
+    void push_back(const float* means, const float* variances, int64_t id)
+    {
+        gist_pack_record(_geometry, means, variances, &_record[0]);
+        _ofs.write(reinterpret_cast<const char*>(&_record[0]), _record.size() * sizeof(float));
+        _ids.push_back(id);
+    }
+
+    size_t size() const { return _ids.size(); }
+
+    // writes the header and closes the file, throws on a write error
+    void close()
+    {
+        gist_db_header header;
+        std::memset(&header, 0, sizeof(header));
+        std::memcpy(header.magic, gist_db_magic, sizeof(header.magic));
+        header.version        = gist_db_version;
+        header.num_x_tiles    = _geometry.num_x_tiles;
+        header.num_y_tiles    = _geometry.num_y_tiles;
+        header.num_freqs      = _geometry.num_freqs;
+        header.num_orients    = _geometry.num_orients;
+        header.num_records    = _ids.size();
+        header.record_stride  = _record.size() * sizeof(float);
+        header.records_offset = gist_db_alignment;
+        header.ids_offset     = static_cast<uint64_t>(_ofs.tellp());
+
+        if (!_ids.empty()) _ofs.write(reinterpret_cast<const char*>(&_ids[0]), _ids.size() * sizeof(int64_t));
+
+        _ofs.seekp(0);
+        _ofs.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+        if (!_ofs.good()) throw std::runtime_error("error while writing gist db");
+        _ofs.close();
+    }
+
+    private:
+
+    std::ofstream        _ofs;
+    gist_geometry        _geometry;
+    std::vector<float>   _record;
+    std::vector<int64_t> _ids;
+};
+
+class gist_db
+{
+    public:
+
+    gist_db() { std::memset(&_header, 0, sizeof(_header)); }
+
+    explicit gist_db(const std::string& filename)
+    {
+        open(filename);
+    }
+
+    void open(const std::string& filename)
+    {
+        _file.open(filename);
+
+        if (_file.size() < sizeof(gist_db_header)) throw std::runtime_error("not a gist db: " + filename);
+        std::memcpy(&_header, _file.data(), sizeof(_header));
+
+        if (std::memcmp(_header.magic, gist_db_magic, sizeof(gist_db_magic)) != 0) throw std::runtime_error("not a gist db: " + filename);
+        if (_header.version > gist_db_version) throw std::runtime_error("version of file " + filename + " is higher than program version");
+
+        _geometry = gist_geometry(_header.num_x_tiles, _header.num_y_tiles, _header.num_freqs, _header.num_orients);
+
+        uint64_t records_end = _header.records_offset + _header.num_records * _header.record_stride;
+        if (_header.layout == gist_db_tile_major)
+        {
+            records_end = _header.records_offset + _geometry.num_tiles() * _header.tile_block_size;
+            if (_header.tile_stride < _geometry.tile_floats() * sizeof(float)
+             || _header.tile_block_size < _header.num_records * _header.tile_stride)
+            {
+                throw std::runtime_error("gist db is truncated or corrupt: " + filename);
+            }
+        }
+        else if (_header.layout != gist_db_record_major)
+        {
+            throw std::runtime_error("unknown layout of gist db " + filename);
+        }
+
+        if (_header.encoding > gist_db_float16) throw std::runtime_error("unknown encoding of gist db " + filename);
+        if (_header.encoding != gist_db_float32 && _header.layout != gist_db_record_major)
+        {
+            throw std::runtime_error("quantized gist db must be record-major: " + filename);
+        }
+        if (_header.encoding == gist_db_uint8
+         && _header.quantizer_offset + _geometry.record_floats() * 2 * sizeof(float) > _file.size())
+        {
+            throw std::runtime_error("gist db is truncated or corrupt: " + filename);
+        }
+
+        if (_header.record_stride < _geometry.record_floats() * gist_db_value_size(encoding())
+         || records_end > _header.ids_offset
+         || _header.ids_offset + _header.num_records * sizeof(int64_t) > _file.size())
+        {
+            throw std::runtime_error("gist db is truncated or corrupt: " + filename);
+        }
+    }
+
+    bool is_open() const { return _file.is_open(); }
+
+    void prefault() const { _file.prefault(); }
+
+    size_t size() const { return static_cast<size_t>(_header.num_records); }
+
+    const gist_geometry& geometry() const { return _geometry; }
+
+    // bytes between two consecutive records
+    size_t stride() const { return static_cast<size_t>(_header.record_stride); }
+
+    // record-major layout and float32 encoding only
+    const float* record(size_t index) const
+    {
+        return reinterpret_cast<const float*>(_file.data() + _header.records_offset + index * _header.record_stride);
+    }
+
+    gist_db_layout layout() const { return static_cast<gist_db_layout>(_header.layout); }
+
+    gist_db_encoding encoding() const { return static_cast<gist_db_encoding>(_header.encoding); }
+
+    // the record as stored, for quantized dbs
+    const unsigned char* codes(size_t index) const
+    {
+        return reinterpret_cast<const unsigned char*>(_file.data() + _header.records_offset + index * _header.record_stride);
+    }
+
+    // uint8 encoding only: (offset, scale) for every value of a record
+    const float* quantizer() const
+    {
+        return reinterpret_cast<const float*>(_file.data() + _header.quantizer_offset);
+    }
+
+    // bytes between the data of two consecutive records in a tile block
+    size_t tile_stride() const { return static_cast<size_t>(_header.tile_stride); }
+
+    // tile-major layout only: the data of tile t of record index,
+    // i.e. float[num_filters][2]
+    const float* tile(size_t t, size_t index) const
+    {
+        return reinterpret_cast<const float*>(_file.data() + _header.records_offset + t * _header.tile_block_size + index * _header.tile_stride);
+    }
+
+    // index of the record in the filelist
+    int64_t id(size_t index) const
+    {
+        int64_t v;
+        std::memcpy(&v, _file.data() + _header.ids_offset + index * sizeof(int64_t), sizeof(v));
+        return v;
+    }
+
+    // FNV-1a hash of the file size, the header and the first and last 64 KB
+    // of the file, tells files derived from this db apart from those of
+    // another (or a rewritten) db without reading all of it
+    uint64_t identity() const
+    {
+        const size_t block = 64 * 1024;
+        const size_t size = _file.size();
+        const unsigned char* data = reinterpret_cast<const unsigned char*>(_file.data());
+
+        uint64_t h = 14695981039346656037ULL;
+        for (size_t i = 0; i < sizeof(uint64_t); i++)
+        {
+            h = (h ^ ((static_cast<uint64_t>(size) >> (8 * i)) & 0xff)) * 1099511628211ULL;
+        }
+        for (size_t i = 0; i < std::min(size, block); i++) h = (h ^ data[i]) * 1099511628211ULL;
+        for (size_t i = std::max(size, 2 * block) - block; i < size; i++) h = (h ^ data[i]) * 1099511628211ULL;
+        return h;
+    }
+
+    private:
+
+    mapped_file    _file;
+    gist_db_header _header;
+    gist_geometry  _geometry;
+};
+
+// Writes the records of a (record-major) gist db into a new gist db
+// with tile-major layout, one tile block after the other.
+inline void gist_db_write_tile_major(const gist_db& db, const std::string& filename)
+{
+    if (db.encoding() != gist_db_float32) throw std::runtime_error("only float gist dbs can be stored tile-major");
+
+    const gist_geometry& g = db.geometry();
+    const size_t num_records = db.size();
+    const size_t tile_bytes = g.tile_floats() * sizeof(float);
+
+    gist_db_header header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, gist_db_magic, sizeof(header.magic));
+    header.version         = gist_db_version;
+    header.layout          = gist_db_tile_major;
+    header.num_x_tiles     = g.num_x_tiles;
+    header.num_y_tiles     = g.num_y_tiles;
+    header.num_freqs       = g.num_freqs;
+    header.num_orients     = g.num_orients;
+    header.num_records     = num_records;
+    header.record_stride   = g.record_floats() * sizeof(float);
+    header.records_offset  = gist_db_alignment;
+    header.tile_stride     = tile_bytes;
+    header.tile_block_size = gist_db_align(num_records * tile_bytes);
+    header.ids_offset      = header.records_offset + g.num_tiles() * header.tile_block_size;
+
+    std::ofstream ofs(filename.c_str(), std::ofstream::binary | std::ofstream::trunc);
+    if (!ofs.is_open()) throw std::runtime_error("could not open file " + filename);
+
+    std::vector<char> pad(static_cast<size_t>(gist_db_alignment), 0);
+    std::memcpy(&pad[0], &header, sizeof(header));
+    ofs.write(&pad[0], pad.size());
+    std::memset(&pad[0], 0, sizeof(header));
+
+    for (size_t t = 0; t < g.num_tiles(); t++)
+    {
+        for (size_t i = 0; i < num_records; i++)
+        {
+            ofs.write(reinterpret_cast<const char*>(db.record(i) + t * g.tile_floats()), tile_bytes);
+        }
+        ofs.write(&pad[0], header.tile_block_size - num_records * tile_bytes);
+    }
+
+    for (size_t i = 0; i < num_records; i++)
+    {
+        int64_t id = db.id(i);
+        ofs.write(reinterpret_cast<const char*>(&id), sizeof(id));
+    }
+
+    if (!ofs.good()) throw std::runtime_error("error while writing gist db");
+}
+
+} // namespace imdb
+
+#endif // DESCRIPTORS__GIST_DB_HPP
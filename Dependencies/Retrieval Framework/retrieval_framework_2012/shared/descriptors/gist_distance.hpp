@@ -0,0 +1,744 @@
+#ifndef DESCRIPTORS__GIST_DISTANCE_HPP
+#define DESCRIPTORS__GIST_DISTANCE_HPP
+
+#include <cstddef>
+#include <cmath>
+
+#include <stdint.h>
+
+// ----------------------------------------------------------------------------
+// Weighted L1 distance between one query and many packed gist records,
+//
+//   out[j] = sum_i weights[i] * |query[i] - records[j*stride + i]|
+//
+// This is the inner loop of the large db scan. The mask weights of the
+// query are expected to be expanded to one weight per float beforehand,
+// so the kernel is a plain multiply-accumulate over contiguous memory.
+//
+// There are scalar, SSE2, AVX2 and AVX-512 versions of it. The best one
+// the cpu supports is picked once at runtime, so a binary built for a
+// generic x86 target still runs at memory bandwidth on newer machines.
+//
+// gist_weighted_l1_u8 is the same for the uint8 codes of a quantized db
+// (see gist_quantizer.hpp) with 16 bit integer weights, computed in
+// integer arithmetic: |q - c| is widened to 16 bit and multiplied and
+// summed pairwise with the weights (pmaddwd) into 32 bit accumulators.
+//
+// gist_weighted_l2_u8 is the weighted squared L2 distance of byte vectors,
+// used for the tiny images of the cascade search (see tiny_db.hpp).
+// gist_weighted_l2 is the same for floats, used for the pca reduced
+// descriptors (see gist_pca.hpp).
+//
+// gist_weighted_l1_batch scores several queries, each with its own weights,
+// against the same records. The records are taken in blocks that stay in
+// the cache while all queries are scored against them, so a batch of
+// queries streams the db from memory once instead of once per query.
+// ----------------------------------------------------------------------------
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define GIST_DISTANCE_X86 1
+#endif
+
+#ifdef GIST_DISTANCE_X86
+#include <emmintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#include <immintrin.h>
+#if _MSC_VER >= 1700
+#define GIST_DISTANCE_AVX2 1
+#endif
+#if _MSC_VER >= 1910
+#define GIST_DISTANCE_AVX512 1
+#endif
+#define GIST_TARGET(t)
+#elif defined(__GNUC__)
+#include <immintrin.h>
+#define GIST_DISTANCE_AVX2 1
+#if (defined(__clang__) && __clang_major__ >= 4) || (!defined(__clang__) && __GNUC__ >= 5)
+#define GIST_DISTANCE_AVX512 1
+#endif
+#define GIST_TARGET(t) __attribute__((target(t)))
+#endif
+#endif
+
+namespace imdb {
+
+// stride is the distance between two records in floats
+typedef void (*weighted_l1_fn)(const float* query, const float* weights, const float* records,
+                               size_t stride, size_t dim, size_t count, float* out);
+
+// stride is the distance between two records in bytes
+typedef void (*weighted_l1_u8_fn)(const unsigned char* query, const int16_t* weights, const unsigned char* codes,
+                                  size_t stride, size_t dim, size_t count, uint32_t* out);
+
+namespace detail {
+
+inline void weighted_l1_scalar(const float* query, const float* weights, const float* records,
+                               size_t stride, size_t dim, size_t count, float* out)
+{
+    for (size_t j = 0; j < count; j++, records += stride)
+    {
+        float s = 0;
+        for (size_t i = 0; i < dim; i++) s += weights[i] * std::fabs(query[i] - records[i]);
+        out[j] = s;
+    }
+}
+
+inline void weighted_l2_scalar(const float* query, const float* weights, const float* records,
+                               size_t stride, size_t dim, size_t count, float* out)
+{
+    for (size_t j = 0; j < count; j++, records += stride)
+    {
+        float s = 0;
+        for (size_t i = 0; i < dim; i++)
+        {
+            const float d = query[i] - records[i];
+            s += weights[i] * d * d;
+        }
+        out[j] = s;
+    }
+}
+
+inline void weighted_l1_u8_scalar(const unsigned char* query, const int16_t* weights, const unsigned char* codes,
+                                  size_t stride, size_t dim, size_t count, uint32_t* out)
+{
+    for (size_t j = 0; j < count; j++, codes += stride)
+    {
+        uint32_t s = 0;
+        for (size_t i = 0; i < dim; i++)
+        {
+            const int d = static_cast<int>(query[i]) - static_cast<int>(codes[i]);
+            s += static_cast<uint32_t>(weights[i] * (d < 0 ? -d : d));
+        }
+        out[j] = s;
+    }
+}
+
+inline void weighted_l2_u8_scalar(const unsigned char* query, const int16_t* weights, const unsigned char* codes,
+                                  size_t stride, size_t dim, size_t count, uint32_t* out)
+{
+    for (size_t j = 0; j < count; j++, codes += stride)
+    {
+        uint32_t s = 0;
+        for (size_t i = 0; i < dim; i++)
+        {
+            const int d = static_cast<int>(query[i]) - static_cast<int>(codes[i]);
+            s += static_cast<uint32_t>(weights[i] * d * d);
+        }
+        out[j] = s;
+    }
+}
+
+#ifdef GIST_DISTANCE_X86
+
+inline float hsum(__m128 v)
+{
+    __m128 h = _mm_add_ps(v, _mm_movehl_ps(v, v));
+    h = _mm_add_ss(h, _mm_shuffle_ps(h, h, 1));
+    return _mm_cvtss_f32(h);
+}
+
+// four records per iteration share the loads of query and weights
+inline void weighted_l1_sse2(const float* query, const float* weights, const float* records,
+                             size_t stride, size_t dim, size_t count, float* out)
+{
+    const __m128 absmask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    const size_t simd_dim = dim & ~size_t(3);
+
+    size_t j = 0;
+    for (; j + 4 <= count; j += 4, records += 4 * stride)
+    {
+        const float* r0 = records;
+        const float* r1 = records + stride;
+        const float* r2 = records + 2 * stride;
+        const float* r3 = records + 3 * stride;
+
+        __m128 a0 = _mm_setzero_ps(), a1 = _mm_setzero_ps(), a2 = _mm_setzero_ps(), a3 = _mm_setzero_ps();
+        for (size_t i = 0; i < simd_dim; i += 4)
+        {
+            const __m128 q = _mm_loadu_ps(query + i);
+            const __m128 w = _mm_loadu_ps(weights + i);
+            a0 = _mm_add_ps(a0, _mm_mul_ps(w, _mm_and_ps(absmask, _mm_sub_ps(q, _mm_loadu_ps(r0 + i)))));
+            a1 = _mm_add_ps(a1, _mm_mul_ps(w, _mm_and_ps(absmask, _mm_sub_ps(q, _mm_loadu_ps(r1 + i)))));
+            a2 = _mm_add_ps(a2, _mm_mul_ps(w, _mm_and_ps(absmask, _mm_sub_ps(q, _mm_loadu_ps(r2 + i)))));
+            a3 = _mm_add_ps(a3, _mm_mul_ps(w, _mm_and_ps(absmask, _mm_sub_ps(q, _mm_loadu_ps(r3 + i)))));
+        }
+
+        out[j]     = hsum(a0);
+        out[j + 1] = hsum(a1);
+        out[j + 2] = hsum(a2);
+        out[j + 3] = hsum(a3);
+
+        for (size_t i = simd_dim; i < dim; i++)
+        {
+            out[j]     += weights[i] * std::fabs(query[i] - r0[i]);
+            out[j + 1] += weights[i] * std::fabs(query[i] - r1[i]);
+            out[j + 2] += weights[i] * std::fabs(query[i] - r2[i]);
+            out[j + 3] += weights[i] * std::fabs(query[i] - r3[i]);
+        }
+    }
+
+    weighted_l1_scalar(query, weights, records, stride, dim, count - j, out + j);
+}
+
+inline void weighted_l2_sse2(const float* query, const float* weights, const float* records,
+                             size_t stride, size_t dim, size_t count, float* out)
+{
+    const size_t simd_dim = dim & ~size_t(3);
+
+    size_t j = 0;
+    for (; j + 4 <= count; j += 4, records += 4 * stride)
+    {
+        const float* r0 = records;
+        const float* r1 = records + stride;
+        const float* r2 = records + 2 * stride;
+        const float* r3 = records + 3 * stride;
+
+        __m128 a0 = _mm_setzero_ps(), a1 = _mm_setzero_ps(), a2 = _mm_setzero_ps(), a3 = _mm_setzero_ps();
+        for (size_t i = 0; i < simd_dim; i += 4)
+        {
+            const __m128 q = _mm_loadu_ps(query + i);
+            const __m128 w = _mm_loadu_ps(weights + i);
+            const __m128 d0 = _mm_sub_ps(q, _mm_loadu_ps(r0 + i));
+            const __m128 d1 = _mm_sub_ps(q, _mm_loadu_ps(r1 + i));
+            const __m128 d2 = _mm_sub_ps(q, _mm_loadu_ps(r2 + i));
+            const __m128 d3 = _mm_sub_ps(q, _mm_loadu_ps(r3 + i));
+            a0 = _mm_add_ps(a0, _mm_mul_ps(w, _mm_mul_ps(d0, d0)));
+            a1 = _mm_add_ps(a1, _mm_mul_ps(w, _mm_mul_ps(d1, d1)));
+            a2 = _mm_add_ps(a2, _mm_mul_ps(w, _mm_mul_ps(d2, d2)));
+            a3 = _mm_add_ps(a3, _mm_mul_ps(w, _mm_mul_ps(d3, d3)));
+        }
+
+        out[j]     = hsum(a0);
+        out[j + 1] = hsum(a1);
+        out[j + 2] = hsum(a2);
+        out[j + 3] = hsum(a3);
+
+        if (simd_dim < dim)
+        {
+            float tail[4];
+            weighted_l2_scalar(query + simd_dim, weights + simd_dim, r0 + simd_dim, stride, dim - simd_dim, 4, tail);
+            for (int k = 0; k < 4; k++) out[j + k] += tail[k];
+        }
+    }
+
+    weighted_l2_scalar(query, weights, records, stride, dim, count - j, out + j);
+}
+
+inline uint32_t hsum_epi32(__m128i v)
+{
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+    return static_cast<uint32_t>(_mm_cvtsi128_si32(v));
+}
+
+// weighted |q - c| of 16 codes, as four 32 bit partial sums
+inline __m128i weighted_absdiff_u8(__m128i q, __m128i c, __m128i w_lo, __m128i w_hi)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i d = _mm_or_si128(_mm_subs_epu8(q, c), _mm_subs_epu8(c, q));
+    return _mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi8(d, zero), w_lo),
+                         _mm_madd_epi16(_mm_unpackhi_epi8(d, zero), w_hi));
+}
+
+// weighted (q - c)^2 of 16 bytes, as four 32 bit partial sums;
+// (q - c) * w stays within 16 bit for weights up to 127
+inline __m128i weighted_sqdiff_u8(__m128i q, __m128i c, __m128i w_lo, __m128i w_hi)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i d_lo = _mm_sub_epi16(_mm_unpacklo_epi8(q, zero), _mm_unpacklo_epi8(c, zero));
+    const __m128i d_hi = _mm_sub_epi16(_mm_unpackhi_epi8(q, zero), _mm_unpackhi_epi8(c, zero));
+    return _mm_add_epi32(_mm_madd_epi16(d_lo, _mm_mullo_epi16(d_lo, w_lo)),
+                         _mm_madd_epi16(d_hi, _mm_mullo_epi16(d_hi, w_hi)));
+}
+
+inline void weighted_l2_u8_sse2(const unsigned char* query, const int16_t* weights, const unsigned char* codes,
+                                size_t stride, size_t dim, size_t count, uint32_t* out)
+{
+    const size_t simd_dim = dim & ~size_t(15);
+
+    for (size_t j = 0; j < count; j++, codes += stride)
+    {
+        __m128i a = _mm_setzero_si128();
+        for (size_t i = 0; i < simd_dim; i += 16)
+        {
+            const __m128i q = _mm_loadu_si128(reinterpret_cast<const __m128i*>(query + i));
+            const __m128i w_lo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(weights + i));
+            const __m128i w_hi = _mm_loadu_si128(reinterpret_cast<const __m128i*>(weights + i + 8));
+            a = _mm_add_epi32(a, weighted_sqdiff_u8(q, _mm_loadu_si128(reinterpret_cast<const __m128i*>(codes + i)), w_lo, w_hi));
+        }
+
+        uint32_t tail = 0;
+        weighted_l2_u8_scalar(query + simd_dim, weights + simd_dim, codes + simd_dim, stride, dim - simd_dim, 1, &tail);
+        out[j] = hsum_epi32(a) + tail;
+    }
+}
+
+inline void weighted_l1_u8_sse2(const unsigned char* query, const int16_t* weights, const unsigned char* codes,
+                                size_t stride, size_t dim, size_t count, uint32_t* out)
+{
+    const size_t simd_dim = dim & ~size_t(15);
+
+    size_t j = 0;
+    for (; j + 4 <= count; j += 4, codes += 4 * stride)
+    {
+        const unsigned char* r0 = codes;
+        const unsigned char* r1 = codes + stride;
+        const unsigned char* r2 = codes + 2 * stride;
+        const unsigned char* r3 = codes + 3 * stride;
+
+        __m128i a0 = _mm_setzero_si128(), a1 = _mm_setzero_si128(), a2 = _mm_setzero_si128(), a3 = _mm_setzero_si128();
+        for (size_t i = 0; i < simd_dim; i += 16)
+        {
+            const __m128i q = _mm_loadu_si128(reinterpret_cast<const __m128i*>(query + i));
+            const __m128i w_lo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(weights + i));
+            const __m128i w_hi = _mm_loadu_si128(reinterpret_cast<const __m128i*>(weights + i + 8));
+            a0 = _mm_add_epi32(a0, weighted_absdiff_u8(q, _mm_loadu_si128(reinterpret_cast<const __m128i*>(r0 + i)), w_lo, w_hi));
+            a1 = _mm_add_epi32(a1, weighted_absdiff_u8(q, _mm_loadu_si128(reinterpret_cast<const __m128i*>(r1 + i)), w_lo, w_hi));
+            a2 = _mm_add_epi32(a2, weighted_absdiff_u8(q, _mm_loadu_si128(reinterpret_cast<const __m128i*>(r2 + i)), w_lo, w_hi));
+            a3 = _mm_add_epi32(a3, weighted_absdiff_u8(q, _mm_loadu_si128(reinterpret_cast<const __m128i*>(r3 + i)), w_lo, w_hi));
+        }
+
+        out[j]     = hsum_epi32(a0);
+        out[j + 1] = hsum_epi32(a1);
+        out[j + 2] = hsum_epi32(a2);
+        out[j + 3] = hsum_epi32(a3);
+
+        if (simd_dim < dim)
+        {
+            uint32_t tail[4];
+            weighted_l1_u8_scalar(query + simd_dim, weights + simd_dim, r0 + simd_dim, stride, dim - simd_dim, 4, tail);
+            for (int k = 0; k < 4; k++) out[j + k] += tail[k];
+        }
+    }
+
+    weighted_l1_u8_scalar(query, weights, codes, stride, dim, count - j, out + j);
+}
+
+#ifdef GIST_DISTANCE_AVX2
+
+GIST_TARGET("avx2")
+inline float hsum256(__m256 v)
+{
+    return hsum(_mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1)));
+}
+
+GIST_TARGET("avx2")
+inline void weighted_l1_avx2(const float* query, const float* weights, const float* records,
+                             size_t stride, size_t dim, size_t count, float* out)
+{
+    const __m256 absmask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+    const size_t simd_dim = dim & ~size_t(7);
+
+    size_t j = 0;
+    for (; j + 4 <= count; j += 4, records += 4 * stride)
+    {
+        const float* r0 = records;
+        const float* r1 = records + stride;
+        const float* r2 = records + 2 * stride;
+        const float* r3 = records + 3 * stride;
+
+        __m256 a0 = _mm256_setzero_ps(), a1 = _mm256_setzero_ps(), a2 = _mm256_setzero_ps(), a3 = _mm256_setzero_ps();
+        for (size_t i = 0; i < simd_dim; i += 8)
+        {
+            const __m256 q = _mm256_loadu_ps(query + i);
+            const __m256 w = _mm256_loadu_ps(weights + i);
+            a0 = _mm256_add_ps(a0, _mm256_mul_ps(w, _mm256_and_ps(absmask, _mm256_sub_ps(q, _mm256_loadu_ps(r0 + i)))));
+            a1 = _mm256_add_ps(a1, _mm256_mul_ps(w, _mm256_and_ps(absmask, _mm256_sub_ps(q, _mm256_loadu_ps(r1 + i)))));
+            a2 = _mm256_add_ps(a2, _mm256_mul_ps(w, _mm256_and_ps(absmask, _mm256_sub_ps(q, _mm256_loadu_ps(r2 + i)))));
+            a3 = _mm256_add_ps(a3, _mm256_mul_ps(w, _mm256_and_ps(absmask, _mm256_sub_ps(q, _mm256_loadu_ps(r3 + i)))));
+        }
+
+        out[j]     = hsum256(a0);
+        out[j + 1] = hsum256(a1);
+        out[j + 2] = hsum256(a2);
+        out[j + 3] = hsum256(a3);
+
+        for (size_t i = simd_dim; i < dim; i++)
+        {
+            out[j]     += weights[i] * std::fabs(query[i] - r0[i]);
+            out[j + 1] += weights[i] * std::fabs(query[i] - r1[i]);
+            out[j + 2] += weights[i] * std::fabs(query[i] - r2[i]);
+            out[j + 3] += weights[i] * std::fabs(query[i] - r3[i]);
+        }
+    }
+
+    weighted_l1_scalar(query, weights, records, stride, dim, count - j, out + j);
+}
+
+GIST_TARGET("avx2")
+inline void weighted_l2_avx2(const float* query, const float* weights, const float* records,
+                             size_t stride, size_t dim, size_t count, float* out)
+{
+    const size_t simd_dim = dim & ~size_t(7);
+
+    size_t j = 0;
+    for (; j + 4 <= count; j += 4, records += 4 * stride)
+    {
+        const float* r0 = records;
+        const float* r1 = records + stride;
+        const float* r2 = records + 2 * stride;
+        const float* r3 = records + 3 * stride;
+
+        __m256 a0 = _mm256_setzero_ps(), a1 = _mm256_setzero_ps(), a2 = _mm256_setzero_ps(), a3 = _mm256_setzero_ps();
+        for (size_t i = 0; i < simd_dim; i += 8)
+        {
+            const __m256 q = _mm256_loadu_ps(query + i);
+            const __m256 w = _mm256_loadu_ps(weights + i);
+            const __m256 d0 = _mm256_sub_ps(q, _mm256_loadu_ps(r0 + i));
+            const __m256 d1 = _mm256_sub_ps(q, _mm256_loadu_ps(r1 + i));
+            const __m256 d2 = _mm256_sub_ps(q, _mm256_loadu_ps(r2 + i));
+            const __m256 d3 = _mm256_sub_ps(q, _mm256_loadu_ps(r3 + i));
+            a0 = _mm256_add_ps(a0, _mm256_mul_ps(w, _mm256_mul_ps(d0, d0)));
+            a1 = _mm256_add_ps(a1, _mm256_mul_ps(w, _mm256_mul_ps(d1, d1)));
+            a2 = _mm256_add_ps(a2, _mm256_mul_ps(w, _mm256_mul_ps(d2, d2)));
+            a3 = _mm256_add_ps(a3, _mm256_mul_ps(w, _mm256_mul_ps(d3, d3)));
+        }
+
+        out[j]     = hsum256(a0);
+        out[j + 1] = hsum256(a1);
+        out[j + 2] = hsum256(a2);
+        out[j + 3] = hsum256(a3);
+
+        if (simd_dim < dim)
+        {
+            float tail[4];
+            weighted_l2_scalar(query + simd_dim, weights + simd_dim, r0 + simd_dim, stride, dim - simd_dim, 4, tail);
+            for (int k = 0; k < 4; k++) out[j + k] += tail[k];
+        }
+    }
+
+    weighted_l2_scalar(query, weights, records, stride, dim, count - j, out + j);
+}
+
+// weighted |q - c| of 32 codes, as eight 32 bit partial sums
+GIST_TARGET("avx2")
+inline __m256i weighted_absdiff_u8_avx2(__m256i q, __m256i c, __m256i w_lo, __m256i w_hi)
+{
+    const __m256i d = _mm256_or_si256(_mm256_subs_epu8(q, c), _mm256_subs_epu8(c, q));
+    return _mm256_add_epi32(_mm256_madd_epi16(_mm256_cvtepu8_epi16(_mm256_castsi256_si128(d)), w_lo),
+                            _mm256_madd_epi16(_mm256_cvtepu8_epi16(_mm256_extracti128_si256(d, 1)), w_hi));
+}
+
+GIST_TARGET("avx2")
+inline void weighted_l2_u8_avx2(const unsigned char* query, const int16_t* weights, const unsigned char* codes,
+                                size_t stride, size_t dim, size_t count, uint32_t* out)
+{
+    const size_t simd_dim = dim & ~size_t(15);
+
+    for (size_t j = 0; j < count; j++, codes += stride)
+    {
+        __m256i a = _mm256_setzero_si256();
+        for (size_t i = 0; i < simd_dim; i += 16)
+        {
+            const __m256i q = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(query + i)));
+            const __m256i c = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(codes + i)));
+            const __m256i w = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(weights + i));
+            const __m256i d = _mm256_sub_epi16(q, c);
+            a = _mm256_add_epi32(a, _mm256_madd_epi16(d, _mm256_mullo_epi16(d, w)));
+        }
+
+        uint32_t tail = 0;
+        weighted_l2_u8_scalar(query + simd_dim, weights + simd_dim, codes + simd_dim, stride, dim - simd_dim, 1, &tail);
+        out[j] = hsum_epi32(_mm_add_epi32(_mm256_castsi256_si128(a), _mm256_extracti128_si256(a, 1))) + tail;
+    }
+}
+
+GIST_TARGET("avx2")
+inline void weighted_l1_u8_avx2(const unsigned char* query, const int16_t* weights, const unsigned char* codes,
+                                size_t stride, size_t dim, size_t count, uint32_t* out)
+{
+    const size_t simd_dim = dim & ~size_t(31);
+
+    size_t j = 0;
+    for (; j + 4 <= count; j += 4, codes += 4 * stride)
+    {
+        const unsigned char* r0 = codes;
+        const unsigned char* r1 = codes + stride;
+        const unsigned char* r2 = codes + 2 * stride;
+        const unsigned char* r3 = codes + 3 * stride;
+
+        __m256i a0 = _mm256_setzero_si256(), a1 = _mm256_setzero_si256(), a2 = _mm256_setzero_si256(), a3 = _mm256_setzero_si256();
+        for (size_t i = 0; i < simd_dim; i += 32)
+        {
+            const __m256i q = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(query + i));
+            const __m256i w_lo = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(weights + i));
+            const __m256i w_hi = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(weights + i + 16));
+            a0 = _mm256_add_epi32(a0, weighted_absdiff_u8_avx2(q, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(r0 + i)), w_lo, w_hi));
+            a1 = _mm256_add_epi32(a1, weighted_absdiff_u8_avx2(q, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(r1 + i)), w_lo, w_hi));
+            a2 = _mm256_add_epi32(a2, weighted_absdiff_u8_avx2(q, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(r2 + i)), w_lo, w_hi));
+            a3 = _mm256_add_epi32(a3, weighted_absdiff_u8_avx2(q, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(r3 + i)), w_lo, w_hi));
+        }
+
+        out[j]     = hsum_epi32(_mm_add_epi32(_mm256_castsi256_si128(a0), _mm256_extracti128_si256(a0, 1)));
+        out[j + 1] = hsum_epi32(_mm_add_epi32(_mm256_castsi256_si128(a1), _mm256_extracti128_si256(a1, 1)));
+        out[j + 2] = hsum_epi32(_mm_add_epi32(_mm256_castsi256_si128(a2), _mm256_extracti128_si256(a2, 1)));
+        out[j + 3] = hsum_epi32(_mm_add_epi32(_mm256_castsi256_si128(a3), _mm256_extracti128_si256(a3, 1)));
+
+        if (simd_dim < dim)
+        {
+            uint32_t tail[4];
+            weighted_l1_u8_scalar(query + simd_dim, weights + simd_dim, r0 + simd_dim, stride, dim - simd_dim, 4, tail);
+            for (int k = 0; k < 4; k++) out[j + k] += tail[k];
+        }
+    }
+
+    weighted_l1_u8_scalar(query, weights, codes, stride, dim, count - j, out + j);
+}
+
+#endif // GIST_DISTANCE_AVX2
+
+#ifdef GIST_DISTANCE_AVX512
+
+GIST_TARGET("avx512f")
+inline float hsum512(__m512 v)
+{
+    float lanes[16];
+    _mm512_storeu_ps(lanes, v);
+
+    float s = 0;
+    for (int i = 0; i < 16; i++) s += lanes[i];
+    return s;
+}
+
+GIST_TARGET("avx512f")
+inline __m512 abs512(__m512 v)
+{
+    return _mm512_castsi512_ps(_mm512_and_epi32(_mm512_castps_si512(v), _mm512_set1_epi32(0x7fffffff)));
+}
+
+GIST_TARGET("avx512f")
+inline void weighted_l1_avx512(const float* query, const float* weights, const float* records,
+                               size_t stride, size_t dim, size_t count, float* out)
+{
+    const size_t simd_dim = dim & ~size_t(15);
+
+    size_t j = 0;
+    for (; j + 4 <= count; j += 4, records += 4 * stride)
+    {
+        const float* r0 = records;
+        const float* r1 = records + stride;
+        const float* r2 = records + 2 * stride;
+        const float* r3 = records + 3 * stride;
+
+        __m512 a0 = _mm512_setzero_ps(), a1 = _mm512_setzero_ps(), a2 = _mm512_setzero_ps(), a3 = _mm512_setzero_ps();
+        for (size_t i = 0; i < simd_dim; i += 16)
+        {
+            const __m512 q = _mm512_loadu_ps(query + i);
+            const __m512 w = _mm512_loadu_ps(weights + i);
+            a0 = _mm512_fmadd_ps(w, abs512(_mm512_sub_ps(q, _mm512_loadu_ps(r0 + i))), a0);
+            a1 = _mm512_fmadd_ps(w, abs512(_mm512_sub_ps(q, _mm512_loadu_ps(r1 + i))), a1);
+            a2 = _mm512_fmadd_ps(w, abs512(_mm512_sub_ps(q, _mm512_loadu_ps(r2 + i))), a2);
+            a3 = _mm512_fmadd_ps(w, abs512(_mm512_sub_ps(q, _mm512_loadu_ps(r3 + i))), a3);
+        }
+
+        out[j]     = hsum512(a0);
+        out[j + 1] = hsum512(a1);
+        out[j + 2] = hsum512(a2);
+        out[j + 3] = hsum512(a3);
+
+        for (size_t i = simd_dim; i < dim; i++)
+        {
+            out[j]     += weights[i] * std::fabs(query[i] - r0[i]);
+            out[j + 1] += weights[i] * std::fabs(query[i] - r1[i]);
+            out[j + 2] += weights[i] * std::fabs(query[i] - r2[i]);
+            out[j + 3] += weights[i] * std::fabs(query[i] - r3[i]);
+        }
+    }
+
+    weighted_l1_scalar(query, weights, records, stride, dim, count - j, out + j);
+}
+
+#endif // GIST_DISTANCE_AVX512
+
+// Instruction sets the cpu *and* the operating system support.
+// For AVX the os has to save the ymm/zmm registers, which is what xgetbv tells.
+enum simd_level { simd_scalar = 0, simd_sse2 = 1, simd_avx2 = 2, simd_avx512 = 3 };
+
+inline simd_level detect_simd_level()
+{
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    const int max_leaf = info[0];
+
+    __cpuid(info, 1);
+    const bool sse2 = (info[3] & (1 << 26)) != 0;
+    const bool osxsave = (info[2] & (1 << 27)) != 0;
+    const bool avx = (info[2] & (1 << 28)) != 0;
+    if (!sse2) return simd_scalar;
+    if (!osxsave || !avx || max_leaf < 7) return simd_sse2;
+
+    const unsigned long long xcr0 = _xgetbv(0);
+    if ((xcr0 & 0x6) != 0x6) return simd_sse2;
+
+    __cpuidex(info, 7, 0);
+    const bool avx2 = (info[1] & (1 << 5)) != 0;
+    const bool avx512f = (info[1] & (1 << 16)) != 0;
+    if (avx512f && (xcr0 & 0xe6) == 0xe6) return simd_avx512;
+    if (avx2) return simd_avx2;
+    return simd_sse2;
+#else
+    // gcc and clang check the os support (xgetbv) themselves
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) return simd_avx512;
+    if (__builtin_cpu_supports("avx2")) return simd_avx2;
+    if (__builtin_cpu_supports("sse2")) return simd_sse2;
+    return simd_scalar;
+#endif
+}
+
+#endif // GIST_DISTANCE_X86
+
+inline weighted_l1_fn select_weighted_l1(int& level)
+{
+    level = 0;
+#ifdef GIST_DISTANCE_X86
+    level = detect_simd_level();
+#ifdef GIST_DISTANCE_AVX512
+    if (level >= simd_avx512) return weighted_l1_avx512;
+#endif
+#ifdef GIST_DISTANCE_AVX2
+    if (level >= simd_avx2) { level = simd_avx2; return weighted_l1_avx2; }
+#endif
+    if (level >= simd_sse2) { level = simd_sse2; return weighted_l1_sse2; }
+#endif
+    level = 0;
+    return weighted_l1_scalar;
+}
+
+// there is no AVX-512 version of the integer kernel, avx2 is used there
+inline weighted_l1_u8_fn select_weighted_l1_u8(int level)
+{
+#ifdef GIST_DISTANCE_X86
+#ifdef GIST_DISTANCE_AVX2
+    if (level >= simd_avx2) return weighted_l1_u8_avx2;
+#endif
+    if (level >= simd_sse2) return weighted_l1_u8_sse2;
+#endif
+    (void)level;
+    return weighted_l1_u8_scalar;
+}
+
+inline weighted_l1_u8_fn select_weighted_l2_u8(int level)
+{
+#ifdef GIST_DISTANCE_X86
+#ifdef GIST_DISTANCE_AVX2
+    if (level >= simd_avx2) return weighted_l2_u8_avx2;
+#endif
+    if (level >= simd_sse2) return weighted_l2_u8_sse2;
+#endif
+    (void)level;
+    return weighted_l2_u8_scalar;
+}
+
+// the float L2 kernel is memory bound on the small pca records, avx2 is used for AVX-512 as well
+inline weighted_l1_fn select_weighted_l2(int level)
+{
+#ifdef GIST_DISTANCE_X86
+#ifdef GIST_DISTANCE_AVX2
+    if (level >= simd_avx2) return weighted_l2_avx2;
+#endif
+    if (level >= simd_sse2) return weighted_l2_sse2;
+#endif
+    (void)level;
+    return weighted_l2_scalar;
+}
+
+struct weighted_l1_dispatch
+{
+    weighted_l1_fn    fn;
+    weighted_l1_fn    fn_l2;
+    weighted_l1_u8_fn fn_u8;
+    weighted_l1_u8_fn fn_l2_u8;
+    int               level;
+
+    weighted_l1_dispatch()
+    {
+        fn = select_weighted_l1(level);
+        fn_l2 = select_weighted_l2(level);
+        fn_u8 = select_weighted_l1_u8(level);
+        fn_l2_u8 = select_weighted_l2_u8(level);
+    }
+
+    static const weighted_l1_dispatch& instance()
+    {
+        static const weighted_l1_dispatch d;
+        return d;
+    }
+};
+
+} // namespace detail
+
+// out[j] = sum_i weights[i] * |query[i] - records[j*stride + i]| for j < count
+inline void gist_weighted_l1(const float* query, const float* weights, const float* records,
+                             size_t stride, size_t dim, size_t count, float* out)
+{
+    detail::weighted_l1_dispatch::instance().fn(query, weights, records, stride, dim, count, out);
+}
+
+// out[j] = sum_i weights[i] * (query[i] - records[j*stride + i])^2 for j < count
+inline void gist_weighted_l2(const float* query, const float* weights, const float* records,
+                             size_t stride, size_t dim, size_t count, float* out)
+{
+    detail::weighted_l1_dispatch::instance().fn_l2(query, weights, records, stride, dim, count, out);
+}
+
+// out[j] = sum_i weights[i] * |query[i] - codes[j*stride + i]| for j < count
+// weights must not exceed 16383 and dim not 1024, or the sums may overflow
+inline void gist_weighted_l1_u8(const unsigned char* query, const int16_t* weights, const unsigned char* codes,
+                                size_t stride, size_t dim, size_t count, uint32_t* out)
+{
+    detail::weighted_l1_dispatch::instance().fn_u8(query, weights, codes, stride, dim, count, out);
+}
+
+// out[j] = sum_i weights[i] * (query[i] - codes[j*stride + i])^2 for j < count
+// weights must not exceed 127 nor dim * 255^2 * max(weights) 2^31
+inline void gist_weighted_l2_u8(const unsigned char* query, const int16_t* weights, const unsigned char* codes,
+                                size_t stride, size_t dim, size_t count, uint32_t* out)
+{
+    detail::weighted_l1_dispatch::instance().fn_l2_u8(query, weights, codes, stride, dim, count, out);
+}
+
+// L2 cache the queries and weights of a batch share with the block of
+// records they all score before moving on; 256 KB, the smallest L2 of the
+// cpus the scan runs on
+static const size_t gist_batch_cache_bytes = 256 * 1024;
+
+// smallest block of records, when the queries and weights alone fill the cache
+static const size_t gist_batch_min_block_bytes = 16 * 1024;
+
+// out[q*count + j] = sum_i weights[q*dim + i] * |queries[q*dim + i] - records[j*stride + i]|
+// for q < num_queries and j < count
+inline void gist_weighted_l1_batch(const float* queries, const float* weights, size_t num_queries,
+                                   const float* records, size_t stride, size_t dim, size_t count, float* out)
+{
+    // the records take what the queries and weights leave of the cache,
+    // in whole groups of 4 records, the unit the kernels work in
+    const size_t batch_bytes = 2 * num_queries * dim * sizeof(float);
+    const size_t block_bytes = batch_bytes + gist_batch_min_block_bytes < gist_batch_cache_bytes
+                             ? gist_batch_cache_bytes - batch_bytes : gist_batch_min_block_bytes;
+    size_t block = block_bytes / (stride * sizeof(float)) / 4 * 4;
+    if (block < 4) block = 4;
+
+    const weighted_l1_fn fn = detail::weighted_l1_dispatch::instance().fn;
+    for (size_t first = 0; first < count; first += block)
+    {
+        const size_t n = count - first < block ? count - first : block;
+        for (size_t q = 0; q < num_queries; q++)
+        {
+            fn(queries + q * dim, weights + q * dim, records + first * stride, stride, dim, n, out + q * count + first);
+        }
+    }
+}
+
+// name of the kernel gist_weighted_l1 dispatches to, for diagnostic output
+inline const char* gist_simd_name()
+{
+    static const char* names[] = { "scalar", "sse2", "avx2", "avx512" };
+    return names[detail::weighted_l1_dispatch::instance().level];
+}
+
+} // namespace imdb
+
+#endif // DESCRIPTORS__GIST_DISTANCE_HPP
@@ -0,0 +1,736 @@
+#ifndef DESCRIPTORS__GIST_ENGINE_HPP
+#define DESCRIPTORS__GIST_ENGINE_HPP
+
+#include <string>
+#include <vector>
+#include <complex>
+#include <cmath>
+#include <cstddef>
+#include <algorithm>
+
+#include <opencv2/core/core.hpp>
+
+#include "../worker_threads.hpp"
+#include "gist_distance.hpp"
+#include "gist_filter_bank.hpp"
+
+// ----------------------------------------------------------------------------
+// Gist of a padded gray image, in single precision. gist_generator (the
+// descriptor files of compute_descriptors) and the query of PDCI both
+// compute it with this code, so the descriptors of the db and of the
+// query come from the same arithmetic.
+//
+// The image is real, so its forward transform is a real-to-complex one:
+// cv::dft of a CV_32F image transforms it with a real FFT into the half
+// spectrum, and DFT_COMPLEX_OUTPUT fills in the other half as its complex
+// conjugate. The Gabor filters are real too, but not symmetric, so the
+// filtered spectrum has no symmetry left and every response is a complex
+// inverse transform.
+//
+// The filters are real float planes of a shared gist_filter_bank.
+// Filtering is then a multiply of both halves of a complex value by the
+// same float, not the complex product of mulSpectrums. The magnitude of
+// the response is summed up per tile as it is computed, with no magnitude
+// image in between (gist_tile_statistics). Both have SSE2 and AVX2
+// kernels, picked at runtime like those of gist_distance.hpp, and the
+// buffers of the transforms are kept between calls (gist_engine_scratch).
+//
+// Compatibility with the existing descriptor files: gist_generator used to
+// compute them in float with a complex forward transform, PDCI computed
+// the query in double. Only the rounding differs. A mean of the engine and
+// the one of either old computation differ by at most
+// gist_engine_tolerance times the largest mean of the same filter, a
+// variance by that times the largest variance of the filter.
+// compute_reference() is the double precision computation, and
+// compute_descriptors gistcheck -c reference prints the largest difference
+// of the engine to it on a sample of images.
+//
+// Decimated inverse transforms (gist_params::decimate): the lower
+// frequency filters are nonzero in a small part of the spectrum only, their
+// band (gist_band), yet a full size inverse transform computes their
+// response at every pixel. The response sampled at every fy-th row and
+// fx-th column is the inverse transform of a spectrum a fy-th of the height
+// and a fx-th of the width, the filtered spectrum folded onto it: frequency
+// (ky, kx) adds to (ky mod h / fy, kx mod w / fx). With the band at most
+// half as large as the folded spectrum no two frequencies of the band meet,
+// the fold is a copy of the band, and the small transform gives the exact
+// samples of the response. The tile statistics are then those of the
+// samples, with tiles of tilewidth / fx x tileheight / fy of them, and the
+// factors are powers of two that divide the tile size. The samples are
+// taken at the centre of their fy x fx block, a phase of the band, so the
+// sums of a tile are midpoint sums.
+//
+// The error against the full transform comes from that sampling of the
+// magnitude, the filter values below gist_band_threshold left out add next
+// to nothing. gist_decimation_mean_tolerance bounds the error of a mean
+// relative to the largest mean of its filter, and
+// gist_decimation_variance_tolerance the one of a variance relative to the
+// largest variance, and gist_generator stores them with the parameters of
+// decimated descriptors. compute_descriptors gistcheck computes the gist
+// of a sample of images both ways and prints the largest errors against
+// the tolerances.
+// With the default parameters and 64 x 64 tiles the six lowest frequency
+// filters are decimated 4 x 4 and the next six 2 x 2, which leaves 58% of
+// the points of the 24 inverse transforms. The other filters keep the full
+// transform and the same results as without decimation.
+//
+// A query needs a single gist as soon as possible. compute_parallel()
+// splits the filters of one image over threads: the forward transform is
+// computed once and then only read, every thread has scratch of its own.
+// gist_engine_timing adds up the wall clock of the steps.
+//
+// Output order is that of features_mean and features_variance: filter
+// (frequency, then orientation), then tile row, then tile column.
+// ----------------------------------------------------------------------------
+
+namespace imdb {
+
+static const double gist_engine_tolerance = 1e-5;
+
+// filter values below this times the largest value of the filter are not in its band
+static const float gist_band_threshold = 1e-4f;
+
+// the folded spectrum is at least this many times the size of the band
+static const size_t gist_decimation_oversampling = 2;
+
+// error of a decimated mean or variance, relative to the largest one of the filter
+static const double gist_decimation_mean_tolerance = 5e-3;
+static const double gist_decimation_variance_tolerance = 2e-2;
+
+// spectrum and out are n interleaved complex values, filter n floats
+typedef void (*spectrum_multiply_fn)(const float* spectrum, const float* filter, size_t n, float* out);
+
+// response is n interleaved complex values, sum gets the sum of their
+// magnitudes and sqsum the sum of the squared magnitudes
+typedef void (*magnitude_sums_fn)(const float* response, size_t n, float* sum, float* sqsum);
+
+namespace detail {
+
+inline void spectrum_multiply_scalar(const float* spectrum, const float* filter, size_t n, float* out)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        out[2 * i] = spectrum[2 * i] * filter[i];
+        out[2 * i + 1] = spectrum[2 * i + 1] * filter[i];
+    }
+}
+
+inline void magnitude_sums_scalar(const float* response, size_t n, float* sum, float* sqsum)
+{
+    float s = 0, q = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        const float re = response[2 * i];
+        const float im = response[2 * i + 1];
+        const float m2 = re * re + im * im;
+        s += std::sqrt(m2);
+        q += m2;
+    }
+    *sum = s;
+    *sqsum = q;
+}
+
+#ifdef GIST_DISTANCE_X86
+
+inline void spectrum_multiply_sse2(const float* spectrum, const float* filter, size_t n, float* out)
+{
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        const __m128 f = _mm_loadu_ps(filter + i);
+        const __m128 lo = _mm_unpacklo_ps(f, f);    // f0 f0 f1 f1
+        const __m128 hi = _mm_unpackhi_ps(f, f);    // f2 f2 f3 f3
+        _mm_storeu_ps(out + 2 * i, _mm_mul_ps(_mm_loadu_ps(spectrum + 2 * i), lo));
+        _mm_storeu_ps(out + 2 * i + 4, _mm_mul_ps(_mm_loadu_ps(spectrum + 2 * i + 4), hi));
+    }
+    spectrum_multiply_scalar(spectrum + 2 * i, filter + i, n - i, out + 2 * i);
+}
+
+inline void magnitude_sums_sse2(const float* response, size_t n, float* sum, float* sqsum)
+{
+    __m128 s = _mm_setzero_ps();
+    __m128 q = _mm_setzero_ps();
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        const __m128 a = _mm_loadu_ps(response + 2 * i);
+        const __m128 b = _mm_loadu_ps(response + 2 * i + 4);
+        const __m128 re = _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+        const __m128 im = _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+        const __m128 m2 = _mm_add_ps(_mm_mul_ps(re, re), _mm_mul_ps(im, im));
+        s = _mm_add_ps(s, _mm_sqrt_ps(m2));
+        q = _mm_add_ps(q, m2);
+    }
+
+    float ts, tq;
+    magnitude_sums_scalar(response + 2 * i, n - i, &ts, &tq);
+    *sum = hsum(s) + ts;
+    *sqsum = hsum(q) + tq;
+}
+
+#ifdef GIST_DISTANCE_AVX2
+
+GIST_TARGET("avx2")
+inline void spectrum_multiply_avx2(const float* spectrum, const float* filter, size_t n, float* out)
+{
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        // unpack works within the 128 bit lanes, the permutes put the pairs in order
+        const __m256 f = _mm256_loadu_ps(filter + i);
+        const __m256 lo = _mm256_unpacklo_ps(f, f);    // f0 f0 f1 f1 | f4 f4 f5 f5
+        const __m256 hi = _mm256_unpackhi_ps(f, f);    // f2 f2 f3 f3 | f6 f6 f7 f7
+        _mm256_storeu_ps(out + 2 * i, _mm256_mul_ps(_mm256_loadu_ps(spectrum + 2 * i), _mm256_permute2f128_ps(lo, hi, 0x20)));
+        _mm256_storeu_ps(out + 2 * i + 8, _mm256_mul_ps(_mm256_loadu_ps(spectrum + 2 * i + 8), _mm256_permute2f128_ps(lo, hi, 0x31)));
+    }
+    spectrum_multiply_sse2(spectrum + 2 * i, filter + i, n - i, out + 2 * i);
+}
+
+// the shuffles leave the values out of order, which does not matter to a sum
+GIST_TARGET("avx2")
+inline void magnitude_sums_avx2(const float* response, size_t n, float* sum, float* sqsum)
+{
+    __m256 s = _mm256_setzero_ps();
+    __m256 q = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        const __m256 a = _mm256_loadu_ps(response + 2 * i);
+        const __m256 b = _mm256_loadu_ps(response + 2 * i + 8);
+        const __m256 re = _mm256_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+        const __m256 im = _mm256_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+        const __m256 m2 = _mm256_add_ps(_mm256_mul_ps(re, re), _mm256_mul_ps(im, im));
+        s = _mm256_add_ps(s, _mm256_sqrt_ps(m2));
+        q = _mm256_add_ps(q, m2);
+    }
+
+    float ts, tq;
+    magnitude_sums_sse2(response + 2 * i, n - i, &ts, &tq);
+    *sum = hsum256(s) + ts;
+    *sqsum = hsum256(q) + tq;
+}
+
+#endif // GIST_DISTANCE_AVX2
+
+#endif // GIST_DISTANCE_X86
+
+struct gist_engine_dispatch
+{
+    spectrum_multiply_fn multiply;
+    magnitude_sums_fn    magnitude_sums;
+
+    gist_engine_dispatch() : multiply(spectrum_multiply_scalar), magnitude_sums(magnitude_sums_scalar)
+    {
+#ifdef GIST_DISTANCE_X86
+        const simd_level level = detect_simd_level();
+        if (level >= simd_sse2)
+        {
+            multiply = spectrum_multiply_sse2;
+            magnitude_sums = magnitude_sums_sse2;
+        }
+#ifdef GIST_DISTANCE_AVX2
+        if (level >= simd_avx2)
+        {
+            multiply = spectrum_multiply_avx2;
+            magnitude_sums = magnitude_sums_avx2;
+        }
+#endif
+#endif
+    }
+
+    static const gist_engine_dispatch& instance()
+    {
+        static const gist_engine_dispatch d;
+        return d;
+    }
+};
+
+} // namespace detail
+
+// out = spectrum * filter, element by element
+inline void gist_spectrum_multiply(const float* spectrum, const float* filter, size_t n, float* out)
+{
+    detail::gist_engine_dispatch::instance().multiply(spectrum, filter, n, out);
+}
+
+// Mean and variance of the magnitude of a complex response over tiles of
+// tilewidth x tileheight values from its top left corner, stride complex
+// values apart from one row to the next. Tile (x, y) goes to index
+// y * num_x_tiles + x of means and variances. The magnitudes are summed up
+// as they are computed, a row of a tile at a time in float and the rows in
+// double; no magnitude image is stored and the padding around the tiles is
+// not looked at.
+inline void gist_tile_statistics(const float* response, size_t stride, int tilewidth, int tileheight,
+                                 size_t num_x_tiles, size_t num_y_tiles, float* means, float* variances)
+{
+    const magnitude_sums_fn sums = detail::gist_engine_dispatch::instance().magnitude_sums;
+    const double count = static_cast<double>(tilewidth) * tileheight;
+
+    for (size_t y = 0; y < num_y_tiles; y++)
+    for (size_t x = 0; x < num_x_tiles; x++)
+    {
+        const float* row = response + 2 * (y * tileheight * stride + x * tilewidth);
+        double s = 0, q = 0;
+        for (int r = 0; r < tileheight; r++, row += 2 * stride)
+        {
+            float rs, rq;
+            sums(row, tilewidth, &rs, &rq);
+            s += rs;
+            q += rq;
+        }
+
+        // as cv::meanStdDev computes them
+        const double mean = s / count;
+        means[y * num_x_tiles + x] = static_cast<float>(mean);
+        variances[y * num_x_tiles + x] = static_cast<float>(std::max(q / count - mean * mean, 0.0));
+    }
+}
+
+// The band of a filter: the shortest circular interval of rows and the
+// one of columns that hold all its values of at least gist_band_threshold
+// times its largest value, and the filter values in there.
+struct gist_band
+{
+    size_t             row_begin;
+    size_t             num_rows;
+    size_t             col_begin;
+    size_t             num_cols;
+    size_t             max_y_factor;    // largest decimation the band allows, a power of two
+    size_t             max_x_factor;
+    std::vector<float> values;          // num_rows x num_cols, from row_begin and col_begin on
+
+    gist_band() : row_begin(0), num_rows(0), col_begin(0), num_cols(0), max_y_factor(1), max_x_factor(1) {}
+};
+
+namespace detail {
+
+// Shortest circular interval of [0, flagged.size()) that holds every
+// flagged index: all but the longest circular run of unflagged ones.
+inline void circular_support(const std::vector<char>& flagged, size_t& begin, size_t& count)
+{
+    const size_t n = flagged.size();
+    const size_t first = std::find(flagged.begin(), flagged.end(), 1) - flagged.begin();
+    if (first == n)
+    {
+        begin = count = 0;
+        return;
+    }
+
+    size_t gap_begin = first, gap = 0, run = 0;
+    for (size_t k = 1; k <= n; k++)
+    {
+        const size_t i = (first + k) % n;
+        if (!flagged[i])
+        {
+            run++;
+        }
+        else
+        {
+            if (run > gap)
+            {
+                gap = run;
+                gap_begin = (i + n - run) % n;
+            }
+            run = 0;
+        }
+    }
+    begin = (gap_begin + gap) % n;
+    count = n - gap;
+}
+
+// largest power of two that divides size and leaves gist_decimation_oversampling times band
+inline size_t max_decimation(size_t size, size_t band)
+{
+    size_t f = 1;
+    while (size % (2 * f) == 0 && size / (2 * f) >= gist_decimation_oversampling * band) f *= 2;
+    return f;
+}
+
+inline gist_band filter_band(const float* filter, size_t height, size_t width)
+{
+    float largest = 0;
+    for (size_t i = 0; i < height * width; i++) largest = std::max(largest, std::fabs(filter[i]));
+
+    std::vector<char> rows(height, 0), cols(width, 0);
+    for (size_t r = 0; r < height; r++)
+    for (size_t c = 0; c < width; c++)
+    {
+        if (std::fabs(filter[r * width + c]) >= gist_band_threshold * largest) rows[r] = cols[c] = 1;
+    }
+
+    gist_band band;
+    circular_support(rows, band.row_begin, band.num_rows);
+    circular_support(cols, band.col_begin, band.num_cols);
+    band.max_y_factor = max_decimation(height, band.num_rows);
+    band.max_x_factor = max_decimation(width, band.num_cols);
+
+    band.values.resize(band.num_rows * band.num_cols);
+    for (size_t j = 0; j < band.num_rows; j++)
+    for (size_t k = 0; k < band.num_cols; k++)
+    {
+        band.values[j * band.num_cols + k] = filter[((band.row_begin + j) % height) * width + (band.col_begin + k) % width];
+    }
+    return band;
+}
+
+// largest factor of max_factor (a power of two) that divides tile
+inline int decimation_factor(size_t max_factor, int tile)
+{
+    int f = static_cast<int>(max_factor);
+    while (tile % f != 0) f /= 2;
+    return f;
+}
+
+} // namespace detail
+
+// Buffers of gist_engine::compute, kept from one call to the next so the
+// transforms do not allocate. A copy starts out empty: a copied generator
+// must not write to the buffers of the original.
+struct gist_engine_scratch
+{
+    cv::Mat_<float>                image;
+    cv::Mat_<std::complex<float> > spectrum;
+    cv::Mat_<std::complex<float> > filtered;
+    cv::Mat_<std::complex<float> > response;
+
+    // folded spectrum and response of the decimated transforms, one pair per size
+    struct decimated_buffers
+    {
+        cv::Mat_<std::complex<float> > folded;
+        cv::Mat_<std::complex<float> > response;
+    };
+    std::vector<decimated_buffers> decimated;
+    std::vector<std::complex<float> > phase;
+
+    decimated_buffers& decimated_size(int rows, int cols)
+    {
+        for (size_t i = 0; i < decimated.size(); i++)
+        {
+            if (decimated[i].folded.rows == rows && decimated[i].folded.cols == cols) return decimated[i];
+        }
+        decimated.push_back(decimated_buffers());
+        decimated.back().folded.create(rows, cols);
+        return decimated.back();
+    }
+
+    gist_engine_scratch() {}
+    gist_engine_scratch(const gist_engine_scratch&) {}
+    gist_engine_scratch& operator=(const gist_engine_scratch&) { return *this; }
+};
+
+// Wall clock of the steps of gist_engine in seconds, added up over the
+// calls it is handed to. inverse is the filtering and inverse transform,
+// statistics the tile statistics of the responses; with several threads
+// they are the sums over the threads.
+struct gist_engine_timing
+{
+    double forward;
+    double inverse;
+    double statistics;
+
+    gist_engine_timing() : forward(0), inverse(0), statistics(0) {}
+
+    gist_engine_timing& operator+=(const gist_engine_timing& t)
+    {
+        forward += t.forward;
+        inverse += t.inverse;
+        statistics += t.statistics;
+        return *this;
+    }
+};
+
+// The transforms of one parameter set. compute() is const, one engine can
+// be used by several threads at once, and copies share the filter bank.
+class gist_engine
+{
+    public:
+
+    typedef std::complex<float> complex_t;
+
+    gist_engine() : _bank(0) {}
+
+    // filter_cache is a directory for the filter bank, see gist_filter_bank::shared
+    explicit gist_engine(const gist_params& params, const std::string& filter_cache = "")
+        : _params(params)
+        , _bank(&gist_filter_bank::shared(params, filter_cache))
+    {
+        if (_params.decimate)
+        {
+            _bands.resize(_bank->num_filters());
+            for (size_t i = 0; i < _bands.size(); i++) _bands[i] = detail::filter_band(_bank->filter(i), _bank->height(), _bank->width());
+        }
+    }
+
+    const gist_params& params() const { return _params; }
+
+    // true until constructed from parameters
+    bool empty() const { return _bank == 0; }
+
+    // The gist of a gray image padded to params().height() x params().width()
+    // (see symmetric_pad), of tiles of tilewidth x tileheight pixels from the
+    // top left corner. means and variances get params().num_features() floats.
+    // Several threads may call it at once, each with scratch of its own.
+    // With params().decimate the filters whose band allows it, for these
+    // tiles, are computed from a decimated transform.
+    void compute(const cv::Mat_<unsigned char>& padded, int tilewidth, int tileheight, float* means, float* variances,
+                 gist_engine_scratch& scratch, gist_engine_timing* timing = 0) const
+    {
+        transform(padded, scratch, timing);
+        for (size_t i = 0; i < _bank->num_filters(); i++)
+        {
+            filter(i, scratch.spectrum, tilewidth, tileheight, means, variances, scratch, timing);
+        }
+    }
+
+    // the same with scratch of its own
+    void compute(const cv::Mat_<unsigned char>& padded, int tilewidth, int tileheight, float* means, float* variances) const
+    {
+        gist_engine_scratch scratch;
+        compute(padded, tilewidth, tileheight, means, variances, scratch);
+    }
+
+    // compute() with the filters split over num_threads threads (at most
+    // one per filter), scratch holds the buffers of every thread
+    void compute_parallel(const cv::Mat_<unsigned char>& padded, int tilewidth, int tileheight, float* means, float* variances,
+                          size_t num_threads, std::vector<gist_engine_scratch>& scratch, gist_engine_timing* timing = 0) const
+    {
+        num_threads = std::max<size_t>(1, std::min(num_threads, _bank->num_filters()));
+        if (scratch.size() < num_threads) scratch.resize(num_threads);
+
+        transform(padded, scratch[0], timing);
+
+        filter_task task(*this, scratch[0].spectrum, tilewidth, tileheight, means, variances, num_threads, scratch);
+        run_worker_threads(num_threads, task);
+
+        if (timing)
+        {
+            for (size_t t = 0; t < num_threads; t++) *timing += task.timing[t];
+        }
+    }
+
+    // compute() in double precision with complex transforms and a magnitude
+    // image, as PDCI computed the query before this engine. It is slow and
+    // there to check compute() against (compute_descriptors gistcheck).
+    void compute_reference(const cv::Mat_<unsigned char>& padded, int tilewidth, int tileheight, float* means, float* variances) const
+    {
+        typedef std::complex<double> complexd_t;
+
+        const int h = static_cast<int>(_params.height());
+        const int w = static_cast<int>(_params.width());
+        CV_Assert(padded.rows == h && padded.cols == w);
+
+        cv::Mat_<complexd_t> image(h, w);
+        for (int r = 0; r < h; r++)
+        for (int c = 0; c < w; c++)
+        {
+            image(r, c) = complexd_t(padded(r, c) * (1.0 / 255.0), 0.0);
+        }
+
+        cv::Mat_<complexd_t> spectrum;
+        cv::dft(image, spectrum);
+
+        cv::Mat_<complexd_t> filtered(h, w);
+        cv::Mat_<complexd_t> response;
+        cv::Mat_<double> magnitude(h, w);
+        const size_t num_tiles = _params.num_tiles();
+        for (size_t i = 0; i < _bank->num_filters(); i++)
+        {
+            const float* f = _bank->filter(i);
+            for (int r = 0; r < h; r++)
+            for (int c = 0; c < w; c++)
+            {
+                filtered(r, c) = spectrum(r, c) * static_cast<double>(f[r * w + c]);
+            }
+
+            cv::idft(filtered, response, cv::DFT_SCALE);
+
+            for (int r = 0; r < h; r++)
+            for (int c = 0; c < w; c++)
+            {
+                magnitude(r, c) = std::abs(response(r, c));
+            }
+
+            for (size_t y = 0; y < _params.num_y_tiles; y++)
+            for (size_t x = 0; x < _params.num_x_tiles; x++)
+            {
+                cv::Scalar m, d;
+                cv::meanStdDev(magnitude(cv::Rect(x * tilewidth, y * tileheight, tilewidth, tileheight)), m, d);
+
+                const size_t t = i * num_tiles + y * _params.num_x_tiles + x;
+                means[t] = static_cast<float>(m[0]);
+                variances[t] = static_cast<float>(d[0] * d[0]);
+            }
+        }
+    }
+
+    // The first step of compute(): the spectrum of padded into scratch.spectrum.
+    void transform(const cv::Mat_<unsigned char>& padded, gist_engine_scratch& scratch, gist_engine_timing* timing = 0) const
+    {
+        const int64 start = timing ? cv::getTickCount() : 0;
+
+        const int h = static_cast<int>(_params.height());
+        const int w = static_cast<int>(_params.width());
+        CV_Assert(padded.rows == h && padded.cols == w);
+
+        scratch.image.create(h, w);
+        for (int r = 0; r < h; r++)
+        {
+            const unsigned char* src = padded[r];
+            float* dst = scratch.image[r];
+            for (int c = 0; c < w; c++) dst[c] = static_cast<float>(src[c] * (1.0 / 255.0));
+        }
+
+        // transform image into fourier space, real to complex
+        cv::dft(scratch.image, scratch.spectrum, cv::DFT_COMPLEX_OUTPUT);
+
+        if (timing) timing->forward += static_cast<double>(cv::getTickCount() - start) / cv::getTickFrequency();
+    }
+
+    // The other step of compute(), for filter i: its tile statistics from
+    // spectrum, the one of transform(), into means and variances (of
+    // params().num_features() floats). spectrum is only read, so threads
+    // can share it while each uses scratch of its own.
+    void filter(size_t i, const cv::Mat_<complex_t>& spectrum, int tilewidth, int tileheight, float* means, float* variances,
+                gist_engine_scratch& scratch, gist_engine_timing* timing = 0) const
+    {
+        const int64 start = timing ? cv::getTickCount() : 0;
+
+        const int h = static_cast<int>(_params.height());
+        const int w = static_cast<int>(_params.width());
+        CV_Assert(spectrum.rows == h && spectrum.cols == w);
+        CV_Assert(tilewidth * _params.num_x_tiles <= static_cast<size_t>(w) && tileheight * _params.num_y_tiles <= static_cast<size_t>(h));
+
+        int fy = 1, fx = 1;
+        if (!_bands.empty())
+        {
+            fy = detail::decimation_factor(_bands[i].max_y_factor, tileheight);
+            fx = detail::decimation_factor(_bands[i].max_x_factor, tilewidth);
+        }
+
+        const cv::Mat_<complex_t>* response = &scratch.response;
+        if (fy * fx > 1)
+        {
+            response = &inverse_decimated(_bands[i], fy, fx, spectrum, scratch);
+        }
+        else
+        {
+            // multiply spectrums == convolve
+            scratch.filtered.create(h, w);
+            gist_spectrum_multiply(reinterpret_cast<const float*>(spectrum[0]), _bank->filter(i), static_cast<size_t>(h) * w,
+                                   reinterpret_cast<float*>(scratch.filtered[0]));
+
+            // transform back to image space
+            cv::idft(scratch.filtered, scratch.response, cv::DFT_SCALE);
+        }
+
+        const int64 inverse = timing ? cv::getTickCount() : 0;
+
+        // mean and variance of the response magnitude in every tile
+        const size_t num_tiles = _params.num_tiles();
+        means += i * num_tiles;
+        variances += i * num_tiles;
+        gist_tile_statistics(reinterpret_cast<const float*>((*response)[0]), response->cols, tilewidth / fx, tileheight / fy,
+                             _params.num_x_tiles, _params.num_y_tiles, means, variances);
+
+        // DFT_SCALE divided by the size of the small transform, the response by that of the full one
+        if (fy * fx > 1)
+        {
+            const float scale = 1.0f / static_cast<float>(fy * fx);
+            for (size_t t = 0; t < num_tiles; t++)
+            {
+                means[t] *= scale;
+                variances[t] *= scale * scale;
+            }
+        }
+
+        if (timing)
+        {
+            const double frequency = cv::getTickFrequency();
+            timing->inverse += static_cast<double>(inverse - start) / frequency;
+            timing->statistics += static_cast<double>(cv::getTickCount() - inverse) / frequency;
+        }
+    }
+
+    // the band of filter i, empty without params().decimate
+    const std::vector<gist_band>& bands() const { return _bands; }
+
+    private:
+
+    // the filters shard, shard + num_threads, ... on every thread
+    struct filter_task
+    {
+        const gist_engine&                engine;
+        const cv::Mat_<complex_t>&        spectrum;
+        int                               tilewidth;
+        int                               tileheight;
+        float*                            means;
+        float*                            variances;
+        size_t                            num_threads;
+        std::vector<gist_engine_scratch>& scratch;
+        std::vector<gist_engine_timing>   timing;     // of every thread
+
+        filter_task(const gist_engine& e, const cv::Mat_<complex_t>& s, int tw, int th, float* m, float* v, size_t threads,
+                    std::vector<gist_engine_scratch>& buffers)
+            : engine(e), spectrum(s), tilewidth(tw), tileheight(th), means(m), variances(v), num_threads(threads)
+            , scratch(buffers), timing(threads)
+        {}
+
+        void operator()(size_t shard)
+        {
+            for (size_t i = shard; i < engine.params().num_filters(); i += num_threads)
+            {
+                engine.filter(i, spectrum, tilewidth, tileheight, means, variances, scratch[shard], &timing[shard]);
+            }
+        }
+    };
+
+    // the response of a band decimated by fy x fx, times fy * fx
+    const cv::Mat_<complex_t>& inverse_decimated(const gist_band& band, int fy, int fx, const cv::Mat_<complex_t>& spectrum,
+                                                 gist_engine_scratch& scratch) const
+    {
+        const size_t h = _params.height();
+        const size_t w = _params.width();
+        const size_t dh = h / fy;
+        const size_t dw = w / fx;
+
+        gist_engine_scratch::decimated_buffers& buffers = scratch.decimated_size(static_cast<int>(dh), static_cast<int>(dw));
+        std::fill(reinterpret_cast<float*>(buffers.folded[0]), reinterpret_cast<float*>(buffers.folded[0]) + 2 * dh * dw, 0.0f);
+
+        // Sample the response at the centre of every fy x fx block of the
+        // tile, not at its top left pixel, so the sums are midpoint sums.
+        // The shift of (fy - 1) / 2 rows and (fx - 1) / 2 columns is a phase
+        // of the band, the same multiple of h and w for all its frequencies
+        // leaves the magnitude alone.
+        const double shift_y = 2 * M_PI * (fy - 1) / (2.0 * h);
+        const double shift_x = 2 * M_PI * (fx - 1) / (2.0 * w);
+        scratch.phase.resize(band.num_cols);
+        for (size_t k = 0; k < band.num_cols; k++) scratch.phase[k] = std::polar(1.0f, static_cast<float>(shift_x * (band.col_begin + k)));
+
+        // fold the filtered band
+        for (size_t j = 0; j < band.num_rows; j++)
+        {
+            const size_t ky = (band.row_begin + j) % h;
+            const complex_t* src = spectrum[static_cast<int>(ky)];
+            complex_t* dst = buffers.folded[static_cast<int>(ky % dh)];
+            const float* values = &band.values[j * band.num_cols];
+            const complex_t row_phase = std::polar(1.0f, static_cast<float>(shift_y * (band.row_begin + j)));
+
+            for (size_t k = 0; k < band.num_cols; k++)
+            {
+                const size_t kx = (band.col_begin + k) % w;
+                dst[kx % dw] = src[kx] * (values[k] * row_phase * scratch.phase[k]);
+            }
+        }
+
+        cv::idft(buffers.folded, buffers.response, cv::DFT_SCALE);
+        return buffers.response;
+    }
+
+    gist_params             _params;
+    const gist_filter_bank* _bank;
+    std::vector<gist_band>  _bands;
+};
+
+} // namespace imdb
+
+#endif // DESCRIPTORS__GIST_ENGINE_HPP
@@ -0,0 +1,374 @@
+#ifndef DESCRIPTORS__GIST_FILTER_BANK_HPP
+#define DESCRIPTORS__GIST_FILTER_BANK_HPP
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+
+#include <stdint.h>
+
+#include <opencv2/core/core.hpp>
+
+#include "../mapped_file.hpp"
+#include "gist_db.hpp"
+#include "gist_helper.hpp"
+
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
+// ----------------------------------------------------------------------------
+// The Gabor filters of the gist, real, in float, for one set of parameters.
+//
+// Generating them takes an atan2 and an exp per pixel of every filter,
+// 24 planes of 320 x 320 for the default parameters. So a bank is built
+// once per process and parameter set (gist_filter_bank::shared) and then
+// used read-only by every thread, generator copy and query. With a cache
+// directory it is also kept on disk and memory mapped by later processes,
+// which share the pages of the file.
+//
+// A bank is keyed by all parameters that change the filters: the image
+// size, padding, numbers of frequencies and orientations, the frequency
+// and bandwidth parameters and the construction. The tiles of the
+// descriptor do not change them. The file name of a cached bank is a hash
+// of that key, the header holds the key itself and is compared in full,
+// so a bank of other parameters or of an older filter construction
+// (gist_filter_bank_version) is built again and replaces the file.
+//
+// File layout:
+//
+//   header       gist_filter_bank_header, padded to gist_db_alignment bytes
+//   filters      float[num_filters][height][width], dc at (0, 0)
+// ----------------------------------------------------------------------------
+
+namespace imdb {
+
+static const char     gist_filter_bank_magic[8] = { 'G', 'I', 'S', 'T', 'F', 'L', 'T', '\0' };
+static const uint32_t gist_filter_bank_version  = 1;
+
+// The parameters of gist_generator (params.* in its config) that define
+// the descriptor, with the same defaults.
+struct gist_params
+{
+    size_t realwidth;
+    size_t realheight;
+    size_t padding;         // adds to width and height
+    size_t num_x_tiles;
+    size_t num_y_tiles;
+    size_t num_freqs;
+    size_t num_orients;     // distributed over the half circle
+    double max_peak_freq;
+    double delta_freq_oct;  // frequency step size in octaves
+    double bandwidth_oct;
+    double angle_factor;    // circular width factor
+    bool   polar;           // polar Gabor filter construction
+    bool   decimate;        // decimated inverse transforms, see gist_engine (not part of the filters)
+
+    gist_params()
+        : realwidth(256), realheight(256), padding(64)
+        , num_x_tiles(4), num_y_tiles(4), num_freqs(4), num_orients(6)
+        , max_peak_freq(0.3), delta_freq_oct(0.88752527), bandwidth_oct(0.88752527), angle_factor(1.0)
+        , polar(true), decimate(false)
+    {}
+
+    // size of the padded image and of the filters
+    size_t width() const { return realwidth + padding; }
+    size_t height() const { return realheight + padding; }
+
+    size_t num_filters() const { return num_freqs * num_orients; }
+    size_t num_tiles() const { return num_x_tiles * num_y_tiles; }
+
+    // floats of features_mean (and of features_variance)
+    size_t num_features() const { return num_filters() * num_tiles(); }
+};
+
+struct gist_filter_bank_header
+{
+    char          magic[8];
+    uint32_t      version;
+    uint32_t      num_filters;
+    uint32_t      width;
+    uint32_t      height;
+    uint32_t      realwidth;
+    uint32_t      realheight;
+    uint32_t      padding;
+    uint32_t      num_freqs;
+    uint32_t      num_orients;
+    uint32_t      polar;
+    double        max_peak_freq;
+    double        delta_freq_oct;
+    double        bandwidth_oct;
+    double        angle_factor;
+    uint64_t      filters_offset;
+};
+
+namespace detail {
+
+// the header of the bank of p, all bytes defined so it can be hashed and compared
+inline gist_filter_bank_header filter_bank_key(const gist_params& p)
+{
+    gist_filter_bank_header h;
+    std::memset(&h, 0, sizeof(h));
+    std::memcpy(h.magic, gist_filter_bank_magic, sizeof(h.magic));
+    h.version        = gist_filter_bank_version;
+    h.num_filters    = static_cast<uint32_t>(p.num_filters());
+    h.width          = static_cast<uint32_t>(p.width());
+    h.height         = static_cast<uint32_t>(p.height());
+    h.realwidth      = static_cast<uint32_t>(p.realwidth);
+    h.realheight     = static_cast<uint32_t>(p.realheight);
+    h.padding        = static_cast<uint32_t>(p.padding);
+    h.num_freqs      = static_cast<uint32_t>(p.num_freqs);
+    h.num_orients    = static_cast<uint32_t>(p.num_orients);
+    h.polar          = p.polar ? 1 : 0;
+    h.max_peak_freq  = p.max_peak_freq;
+    h.delta_freq_oct = p.delta_freq_oct;
+    h.bandwidth_oct  = p.bandwidth_oct;
+    h.angle_factor   = p.angle_factor;
+    h.filters_offset = gist_db_alignment;
+    return h;
+}
+
+// FNV-1a
+inline uint64_t filter_bank_hash(const gist_filter_bank_header& h)
+{
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(&h);
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < sizeof(h); i++)
+    {
+        hash ^= p[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// guards the banks of gist_filter_bank::shared, statically initialized
+class filter_bank_lock
+{
+    public:
+
+#ifdef _WIN32
+    filter_bank_lock() { ::AcquireSRWLockExclusive(mutex()); }
+    ~filter_bank_lock() { ::ReleaseSRWLockExclusive(mutex()); }
+
+    private:
+
+    static SRWLOCK* mutex()
+    {
+        static SRWLOCK m = SRWLOCK_INIT;
+        return &m;
+    }
+#else
+    filter_bank_lock() { pthread_mutex_lock(mutex()); }
+    ~filter_bank_lock() { pthread_mutex_unlock(mutex()); }
+
+    private:
+
+    static pthread_mutex_t* mutex()
+    {
+        static pthread_mutex_t m = PTHREAD_MUTEX_INITIALIZER;
+        return &m;
+    }
+#endif
+};
+
+} // namespace detail
+
+class gist_filter_bank
+{
+    public:
+
+    gist_filter_bank() : _data(0) { std::memset(&_header, 0, sizeof(_header)); }
+
+    // builds the filters of p in memory
+    explicit gist_filter_bank(const gist_params& p) : _data(0)
+    {
+        build(p);
+    }
+
+    // Builds the filters of p in memory. Every filter is height() x
+    // width() with the dc term at (0, 0), set to 0.
+    void build(const gist_params& p)
+    {
+        _file.close();
+        _header = detail::filter_bank_key(p);
+
+        const double delta_freq = std::pow(2.0, p.delta_freq_oct);
+        const double bandwidth = std::pow(2.0, p.bandwidth_oct);
+        const double delta_omega = M_PI / static_cast<double>(p.num_orients);
+        const double max_extend = static_cast<double>(std::max(p.width(), p.height()));
+        const double pad_max_peak_freq = max_extend * p.max_peak_freq / (max_extend + static_cast<double>(p.padding));
+
+        _storage.assign(num_filters() * filter_floats(), 0.0f);
+        _data = _storage.empty() ? 0 : &_storage[0];
+
+        for (size_t i = 0; i < p.num_freqs; i++)
+        {
+            for (size_t k = 0; k < p.num_orients; k++)
+            {
+                const double peak = pad_max_peak_freq / std::pow(delta_freq, static_cast<double>(i));
+                const double omega = k * delta_omega;
+
+                cv::Mat_<float> filter(static_cast<int>(height()), static_cast<int>(width()), storage_filter(i * p.num_orients + k));
+                if (p.polar) generate_polargabor_filter(filter, peak, bandwidth, omega, delta_omega * p.angle_factor);
+                else generate_gabor_filter(filter, peak, bandwidth, omega, delta_omega * p.angle_factor);
+
+                // kill dc
+                filter(0, 0) = 0;
+            }
+        }
+    }
+
+    // maps a bank written by write()
+    void open(const std::string& filename)
+    {
+        _storage.clear();
+        _data = 0;
+        _file.open(filename);
+
+        if (_file.size() < sizeof(gist_filter_bank_header)) throw std::runtime_error("not a gist filter bank: " + filename);
+        std::memcpy(&_header, _file.data(), sizeof(_header));
+
+        if (std::memcmp(_header.magic, gist_filter_bank_magic, sizeof(gist_filter_bank_magic)) != 0) throw std::runtime_error("not a gist filter bank: " + filename);
+        if (_header.filters_offset % sizeof(float) != 0
+         || _header.filters_offset + num_filters() * filter_floats() * sizeof(float) > _file.size())
+        {
+            throw std::runtime_error("gist filter bank is truncated or corrupt: " + filename);
+        }
+
+        _data = reinterpret_cast<const float*>(_file.data() + _header.filters_offset);
+    }
+
+    void write(const std::string& filename) const
+    {
+        std::ofstream ofs(filename.c_str(), std::ofstream::binary | std::ofstream::trunc);
+        if (!ofs.is_open()) throw std::runtime_error("could not open file " + filename);
+
+        std::vector<char> pad(static_cast<size_t>(_header.filters_offset), 0);
+        std::memcpy(&pad[0], &_header, sizeof(_header));
+        ofs.write(&pad[0], pad.size());
+        ofs.write(reinterpret_cast<const char*>(_data), num_filters() * filter_floats() * sizeof(float));
+
+        if (!ofs.good()) throw std::runtime_error("error while writing gist filter bank " + filename);
+    }
+
+    bool empty() const { return _data == 0; }
+
+    // true if the bank holds the filters of p
+    bool matches(const gist_params& p) const
+    {
+        gist_filter_bank_header key = detail::filter_bank_key(p);
+        key.filters_offset = _header.filters_offset;
+        return !empty() && std::memcmp(&key, &_header, sizeof(key)) == 0;
+    }
+
+    size_t num_filters() const { return _header.num_filters; }
+
+    size_t width() const { return _header.width; }
+
+    size_t height() const { return _header.height; }
+
+    size_t filter_floats() const { return width() * height(); }
+
+    // filter i (frequency i / num_orients, orientation i % num_orients), row by row
+    const float* filter(size_t i) const { return _data + i * filter_floats(); }
+
+    // name of the cached bank of p in a directory
+    static std::string cache_filename(const std::string& directory, const gist_params& p)
+    {
+        std::ostringstream name;
+        if (!directory.empty())
+        {
+            name << directory;
+            const char last = directory[directory.size() - 1];
+            if (last != '/' && last != '\\') name << '/';
+        }
+        name << "gist_filters_" << std::hex << std::setw(16) << std::setfill('0') << detail::filter_bank_hash(detail::filter_bank_key(p)) << ".bin";
+        return name.str();
+    }
+
+    // The bank of p, built once per process and never freed, so the
+    // reference stays valid and can be used by any thread. With a cache
+    // directory the bank is mapped from there, or built and written there
+    // if the file is missing or holds other filters. A cache that cannot be
+    // written is not an error, the bank is then kept in memory only.
+    static const gist_filter_bank& shared(const gist_params& p, const std::string& cache_directory = "")
+    {
+        detail::filter_bank_lock lock;
+
+        static std::vector<gist_filter_bank*> banks;
+        for (size_t i = 0; i < banks.size(); i++)
+        {
+            if (banks[i]->matches(p)) return *banks[i];
+        }
+
+        gist_filter_bank* bank = new gist_filter_bank();
+        if (!cache_directory.empty())
+        {
+            const std::string filename = cache_filename(cache_directory, p);
+            try
+            {
+                bank->open(filename);
+            }
+            catch (const std::exception&)
+            {
+            }
+
+            if (!bank->matches(p))
+            {
+                bank->build(p);
+
+                // written under another name first, a process mapping it never sees a partial file
+                std::ostringstream temp;
+#ifdef _WIN32
+                temp << filename << "." << ::GetCurrentProcessId() << ".tmp";
+#else
+                temp << filename << "." << ::getpid() << ".tmp";
+#endif
+                try
+                {
+                    bank->write(temp.str());
+#ifdef _WIN32
+                    ::MoveFileExA(temp.str().c_str(), filename.c_str(), MOVEFILE_REPLACE_EXISTING);
+#else
+                    std::rename(temp.str().c_str(), filename.c_str());
+#endif
+                }
+                catch (const std::exception&)
+                {
+                }
+                std::remove(temp.str().c_str());
+            }
+        }
+        else
+        {
+            bank->build(p);
+        }
+
+        banks.push_back(bank);
+        return *bank;
+    }
+
+    private:
+
+    // not copyable, _data may point into _storage
+    gist_filter_bank(const gist_filter_bank&);
+    gist_filter_bank& operator=(const gist_filter_bank&);
+
+    float* storage_filter(size_t i) { return &_storage[0] + i * filter_floats(); }
+
+    gist_filter_bank_header _header;
+    mapped_file             _file;
+    std::vector<float>      _storage;   // filters built in memory
+    const float*            _data;      // into _storage or _file
+};
+
+} // namespace imdb
+
+#endif // DESCRIPTORS__GIST_FILTER_BANK_HPP
@@ -0,0 +1,463 @@
+#ifndef DESCRIPTORS__GIST_HASH_HPP
+#define DESCRIPTORS__GIST_HASH_HPP
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+
+#include <stdint.h>
+
+#include "../mapped_file.hpp"
+#include "gist_db.hpp"
+#include "gist_distance.hpp"
+#include "gist_pq.hpp"
+
+// ----------------------------------------------------------------------------
+// Binary codes of gist descriptors, scanned by Hamming distance.
+//
+// Every tile of a packed record is projected onto bits_per_tile random
+// directions (gaussian, drawn from a seed), and each bit of the code is
+// the sign of one projection after subtracting its median over a sample
+// of the db, so that every bit is set for half of the records. With 16
+// tiles and 16 bits per tile a descriptor becomes a 32 byte code, small
+// enough to keep the codes of tens of millions of images in memory.
+//
+// The bits of a tile only depend on that tile, so the mask weight of a
+// tile still applies: the scan computes the weighted Hamming distance
+//
+//   sum_t w[t] * popcount(code_q[t] ^ code_r[t])
+//
+// with the hardware popcount instruction where the cpu has it. The codes
+// only pick a candidate pool, which is re-ranked with the exact weighted
+// L1 distance of the float descriptors.
+//
+// A query is encoded with the planes and thresholds stored in the hash
+// file (gist_hash::encode), so its code matches the stored codes.
+//
+// File layout:
+//
+//   header       gist_hash_header, padded to gist_db_alignment bytes
+//   planes       float[num_tiles][bits_per_tile][tile_floats]
+//   thresholds   float[num_tiles][bits_per_tile], median projections
+//   codes        uint8[num_records][code_bytes]
+//   ids          int64[num_records], index of the record in the filelist
+//
+// A code is a sequence of little endian 64 bit words, tile t in bits
+// [t * bits_per_tile, (t + 1) * bits_per_tile). code_bytes is rounded up
+// to whole words, the bits after the last tile are zero.
+// ----------------------------------------------------------------------------
+
+namespace imdb {
+
+static const char     gist_hash_magic[8] = { 'G', 'I', 'S', 'T', 'H', 'S', 'H', '\0' };
+static const uint32_t gist_hash_version  = 1;
+
+struct gist_hash_header
+{
+    char          magic[8];
+    uint32_t      version;
+    uint32_t      bits_per_tile;
+    uint32_t      num_x_tiles;
+    uint32_t      num_y_tiles;
+    uint32_t      num_freqs;
+    uint32_t      num_orients;
+    uint64_t      num_records;
+    uint64_t      code_bytes;
+    uint64_t      planes_offset;
+    uint64_t      thresholds_offset;
+    uint64_t      codes_offset;
+    uint64_t      ids_offset;
+};
+
+// hash function learned by gist_hash_train
+struct gist_hash_planes
+{
+    size_t             bits_per_tile;
+    std::vector<float> planes;      // [num_tiles][bits_per_tile][tile_floats]
+    std::vector<float> thresholds;  // [num_tiles][bits_per_tile]
+
+    gist_hash_planes() : bits_per_tile(0) {}
+};
+
+// a tile has to fit into a 64 bit word without straddling two of them
+inline bool gist_hash_valid_bits(size_t bits_per_tile)
+{
+    return bits_per_tile == 8 || bits_per_tile == 16 || bits_per_tile == 32 || bits_per_tile == 64;
+}
+
+// bytes of a code, whole 64 bit words
+inline size_t gist_hash_code_bytes(const gist_geometry& g, size_t bits_per_tile)
+{
+    return (g.num_tiles() * bits_per_tile + 63) / 64 * 8;
+}
+
+// Writes the code of a packed record, code is uint8[gist_hash_code_bytes].
+inline void gist_hash_encode(const gist_geometry& g, size_t bits_per_tile, const float* planes, const float* thresholds,
+                             const float* record, unsigned char* code)
+{
+    const size_t n = g.tile_floats();
+    std::memset(code, 0, gist_hash_code_bytes(g, bits_per_tile));
+
+    for (size_t t = 0; t < g.num_tiles(); t++)
+    {
+        for (size_t b = 0; b < bits_per_tile; b++)
+        {
+            const float* plane = planes + (t * bits_per_tile + b) * n;
+            float s = 0;
+            for (size_t d = 0; d < n; d++) s += plane[d] * record[t * n + d];
+
+            const size_t bit = t * bits_per_tile + b;
+            if (s > thresholds[t * bits_per_tile + b]) code[bit / 8] |= static_cast<unsigned char>(1u << (bit % 8));
+        }
+    }
+}
+
+namespace detail {
+
+// standard normal numbers (Box-Muller)
+inline float gaussian(xorshift32& rng)
+{
+    const double u = (rng() + 1.0) / 4294967297.0;
+    const double v = rng() / 4294967296.0;
+    return static_cast<float>(std::sqrt(-2.0 * std::log(u)) * std::cos(2.0 * 3.14159265358979323846 * v));
+}
+
+} // namespace detail
+
+// Draws the random planes of every tile and sets their thresholds to the
+// median projection of num_samples randomly drawn records of a float,
+// record-major gist db.
+inline gist_hash_planes gist_hash_train(const gist_db& db, size_t bits_per_tile, size_t num_samples, uint32_t seed)
+{
+    if (db.encoding() != gist_db_float32 || db.layout() != gist_db_record_major)
+    {
+        throw std::runtime_error("hash planes can only be learned from a float, record-major gist db");
+    }
+
+    if (!gist_hash_valid_bits(bits_per_tile)) throw std::runtime_error("bits per tile must be 8, 16, 32 or 64");
+    if (db.size() == 0) throw std::runtime_error("gist db is empty");
+
+    const gist_geometry& g = db.geometry();
+    const size_t n = g.tile_floats();
+
+    detail::xorshift32 rng(seed);
+    num_samples = std::max<size_t>(std::min(num_samples, db.size()), 1);
+
+    std::vector<size_t> samples(num_samples);
+    for (size_t i = 0; i < num_samples; i++) samples[i] = rng() % db.size();
+
+    gist_hash_planes hash;
+    hash.bits_per_tile = bits_per_tile;
+    hash.planes.resize(g.num_tiles() * bits_per_tile * n);
+    hash.thresholds.resize(g.num_tiles() * bits_per_tile);
+
+    for (size_t i = 0; i < hash.planes.size(); i++) hash.planes[i] = detail::gaussian(rng);
+
+    std::vector<float> projections(num_samples);
+    for (size_t t = 0; t < g.num_tiles(); t++)
+    {
+        for (size_t b = 0; b < bits_per_tile; b++)
+        {
+            const float* plane = &hash.planes[(t * bits_per_tile + b) * n];
+            for (size_t i = 0; i < num_samples; i++)
+            {
+                const float* x = db.record(samples[i]) + t * n;
+                float s = 0;
+                for (size_t d = 0; d < n; d++) s += plane[d] * x[d];
+                projections[i] = s;
+            }
+
+            std::nth_element(projections.begin(), projections.begin() + num_samples / 2, projections.end());
+            hash.thresholds[t * bits_per_tile + b] = projections[num_samples / 2];
+        }
+    }
+
+    return hash;
+}
+
+// Encodes all records of a float gist db and writes the hash file.
+inline void gist_hash_write(const gist_db& db, const gist_hash_planes& hash, const std::string& filename)
+{
+    const gist_geometry& g = db.geometry();
+    const size_t bits = g.num_tiles() * hash.bits_per_tile;
+    const size_t code_bytes = gist_hash_code_bytes(g, hash.bits_per_tile);
+
+    if (hash.planes.size() != bits * g.tile_floats() || hash.thresholds.size() != bits) throw std::runtime_error("hash planes do not match the gist db");
+
+    gist_hash_header header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, gist_hash_magic, sizeof(header.magic));
+    header.version           = gist_hash_version;
+    header.bits_per_tile     = static_cast<uint32_t>(hash.bits_per_tile);
+    header.num_x_tiles       = g.num_x_tiles;
+    header.num_y_tiles       = g.num_y_tiles;
+    header.num_freqs         = g.num_freqs;
+    header.num_orients       = g.num_orients;
+    header.num_records       = db.size();
+    header.code_bytes        = code_bytes;
+    header.planes_offset     = gist_db_alignment;
+    header.thresholds_offset = gist_db_align(header.planes_offset + hash.planes.size() * sizeof(float));
+    header.codes_offset      = gist_db_align(header.thresholds_offset + hash.thresholds.size() * sizeof(float));
+    header.ids_offset        = gist_db_align(header.codes_offset + db.size() * code_bytes);
+
+    std::ofstream ofs(filename.c_str(), std::ofstream::binary | std::ofstream::trunc);
+    if (!ofs.is_open()) throw std::runtime_error("could not open file " + filename);
+
+    std::vector<char> pad(static_cast<size_t>(gist_db_alignment), 0);
+    std::memcpy(&pad[0], &header, sizeof(header));
+    ofs.write(&pad[0], pad.size());
+    std::memset(&pad[0], 0, sizeof(header));
+
+    ofs.write(reinterpret_cast<const char*>(&hash.planes[0]), hash.planes.size() * sizeof(float));
+    ofs.write(&pad[0], header.thresholds_offset - header.planes_offset - hash.planes.size() * sizeof(float));
+
+    ofs.write(reinterpret_cast<const char*>(&hash.thresholds[0]), hash.thresholds.size() * sizeof(float));
+    ofs.write(&pad[0], header.codes_offset - header.thresholds_offset - hash.thresholds.size() * sizeof(float));
+
+    std::vector<unsigned char> code(code_bytes);
+    for (size_t i = 0; i < db.size(); i++)
+    {
+        gist_hash_encode(g, hash.bits_per_tile, &hash.planes[0], &hash.thresholds[0], db.record(i), &code[0]);
+        ofs.write(reinterpret_cast<const char*>(&code[0]), code_bytes);
+    }
+    ofs.write(&pad[0], header.ids_offset - header.codes_offset - db.size() * code_bytes);
+
+    for (size_t i = 0; i < db.size(); i++)
+    {
+        int64_t id = db.id(i);
+        ofs.write(reinterpret_cast<const char*>(&id), sizeof(id));
+    }
+
+    if (!ofs.good()) throw std::runtime_error("error while writing gist hash file");
+}
+
+class gist_hash
+{
+    public:
+
+    gist_hash() { std::memset(&_header, 0, sizeof(_header)); }
+
+    explicit gist_hash(const std::string& filename)
+    {
+        open(filename);
+    }
+
+    void open(const std::string& filename)
+    {
+        _file.open(filename);
+
+        if (_file.size() < sizeof(gist_hash_header)) throw std::runtime_error("not a gist hash file: " + filename);
+        std::memcpy(&_header, _file.data(), sizeof(_header));
+
+        if (std::memcmp(_header.magic, gist_hash_magic, sizeof(gist_hash_magic)) != 0) throw std::runtime_error("not a gist hash file: " + filename);
+        if (_header.version > gist_hash_version) throw std::runtime_error("version of file " + filename + " is higher than program version");
+
+        _geometry = gist_geometry(_header.num_x_tiles, _header.num_y_tiles, _header.num_freqs, _header.num_orients);
+
+        const uint64_t bits = _geometry.num_tiles() * _header.bits_per_tile;
+        if (!gist_hash_valid_bits(_header.bits_per_tile)
+         || _header.code_bytes != gist_hash_code_bytes(_geometry, _header.bits_per_tile)
+         || _header.planes_offset + bits * _geometry.tile_floats() * sizeof(float) > _header.thresholds_offset
+         || _header.thresholds_offset + bits * sizeof(float) > _header.codes_offset
+         || _header.codes_offset + _header.num_records * _header.code_bytes > _header.ids_offset
+         || _header.ids_offset + _header.num_records * sizeof(int64_t) > _file.size())
+        {
+            throw std::runtime_error("gist hash file is truncated or corrupt: " + filename);
+        }
+    }
+
+    bool is_open() const { return _file.is_open(); }
+
+    // touches all pages, so that the first scan does not wait for the disk
+    void prefault() const { _file.prefault(); }
+
+    size_t size() const { return static_cast<size_t>(_header.num_records); }
+
+    const gist_geometry& geometry() const { return _geometry; }
+
+    size_t bits_per_tile() const { return _header.bits_per_tile; }
+
+    size_t code_bytes() const { return static_cast<size_t>(_header.code_bytes); }
+
+    const float* planes() const { return reinterpret_cast<const float*>(_file.data() + _header.planes_offset); }
+
+    const float* thresholds() const { return reinterpret_cast<const float*>(_file.data() + _header.thresholds_offset); }
+
+    // consecutive codes follow with a stride of code_bytes()
+    const unsigned char* code(size_t index) const
+    {
+        return reinterpret_cast<const unsigned char*>(_file.data() + _header.codes_offset) + index * code_bytes();
+    }
+
+    // index of the record in the filelist
+    int64_t id(size_t index) const
+    {
+        int64_t v;
+        std::memcpy(&v, _file.data() + _header.ids_offset + index * sizeof(int64_t), sizeof(v));
+        return v;
+    }
+
+    // encodes a packed record, code is uint8[code_bytes()]
+    void encode(const float* record, unsigned char* code) const
+    {
+        gist_hash_encode(_geometry, bits_per_tile(), planes(), thresholds(), record, code);
+    }
+
+    private:
+
+    mapped_file      _file;
+    gist_hash_header _header;
+    gist_geometry    _geometry;
+};
+
+// Expands one weight per tile to one weight per bits_per_tile field of a
+// code, code_bytes * 8 / bits_per_tile of them. The fields after the last
+// tile get weight 0.
+inline void gist_hash_weights(const gist_hash& hash, const float* tile_weights, float* weights)
+{
+    const size_t num_fields = hash.code_bytes() * 8 / hash.bits_per_tile();
+    for (size_t f = 0; f < num_fields; f++) weights[f] = f < hash.geometry().num_tiles() ? tile_weights[f] : 0.0f;
+}
+
+// stride is the distance between two codes in bytes, code_bytes a multiple of 8
+typedef void (*weighted_hamming_fn)(const unsigned char* query, const float* weights, const unsigned char* codes,
+                                    size_t stride, size_t code_bytes, size_t bits_per_tile, size_t count, float* out);
+
+namespace detail {
+
+inline uint64_t load_u64(const unsigned char* p)
+{
+    uint64_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+inline uint32_t popcount64_scalar(uint64_t x)
+{
+    x = x - ((x >> 1) & 0x5555555555555555ull);
+    x = (x & 0x3333333333333333ull) + ((x >> 2) & 0x3333333333333333ull);
+    x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0full;
+    return static_cast<uint32_t>((x * 0x0101010101010101ull) >> 56);
+}
+
+inline void weighted_hamming_scalar(const unsigned char* query, const float* weights, const unsigned char* codes,
+                                    size_t stride, size_t code_bytes, size_t bits_per_tile, size_t count, float* out)
+{
+    const size_t fields_per_word = 64 / bits_per_tile;
+    const uint64_t field_mask = bits_per_tile == 64 ? ~0ull : (1ull << bits_per_tile) - 1;
+
+    for (size_t j = 0; j < count; j++)
+    {
+        const unsigned char* c = codes + j * stride;
+        const float* w = weights;
+        float s = 0;
+        for (size_t b = 0; b < code_bytes; b += 8)
+        {
+            uint64_t x = load_u64(query + b) ^ load_u64(c + b);
+            for (size_t f = 0; f < fields_per_word; f++, x >>= bits_per_tile % 64)
+            {
+                s += *w++ * popcount64_scalar(x & field_mask);
+            }
+        }
+        out[j] = s;
+    }
+}
+
+#ifdef GIST_DISTANCE_X86
+
+GIST_TARGET("popcnt")
+inline uint32_t popcount64_hw(uint64_t x)
+{
+#if defined(_MSC_VER) && defined(_M_X64)
+    return static_cast<uint32_t>(__popcnt64(x));
+#elif defined(_MSC_VER)
+    return __popcnt(static_cast<uint32_t>(x)) + __popcnt(static_cast<uint32_t>(x >> 32));
+#else
+    return static_cast<uint32_t>(__builtin_popcountll(x));
+#endif
+}
+
+GIST_TARGET("popcnt")
+inline void weighted_hamming_popcnt(const unsigned char* query, const float* weights, const unsigned char* codes,
+                                    size_t stride, size_t code_bytes, size_t bits_per_tile, size_t count, float* out)
+{
+    const size_t fields_per_word = 64 / bits_per_tile;
+    const uint64_t field_mask = bits_per_tile == 64 ? ~0ull : (1ull << bits_per_tile) - 1;
+
+    for (size_t j = 0; j < count; j++)
+    {
+        const unsigned char* c = codes + j * stride;
+        const float* w = weights;
+        float s = 0;
+        for (size_t b = 0; b < code_bytes; b += 8)
+        {
+            uint64_t x = load_u64(query + b) ^ load_u64(c + b);
+            for (size_t f = 0; f < fields_per_word; f++, x >>= bits_per_tile % 64)
+            {
+                s += *w++ * popcount64_hw(x & field_mask);
+            }
+        }
+        out[j] = s;
+    }
+}
+
+inline bool detect_popcnt()
+{
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    return (info[2] & (1 << 23)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("popcnt") != 0;
+#endif
+}
+
+#endif // GIST_DISTANCE_X86
+
+struct weighted_hamming_dispatch
+{
+    weighted_hamming_fn fn;
+    bool                hardware;
+
+    weighted_hamming_dispatch() : fn(weighted_hamming_scalar), hardware(false)
+    {
+#ifdef GIST_DISTANCE_X86
+        if (detect_popcnt())
+        {
+            fn = weighted_hamming_popcnt;
+            hardware = true;
+        }
+#endif
+    }
+
+    static const weighted_hamming_dispatch& instance()
+    {
+        static const weighted_hamming_dispatch d;
+        return d;
+    }
+};
+
+} // namespace detail
+
+// out[j] = sum_f weights[f] * popcount(field f of query ^ codes[j*stride]) for j < count,
+// with the fields of bits_per_tile bits and the weights of gist_hash_weights
+inline void gist_weighted_hamming(const unsigned char* query, const float* weights, const unsigned char* codes,
+                                  size_t stride, size_t code_bytes, size_t bits_per_tile, size_t count, float* out)
+{
+    detail::weighted_hamming_dispatch::instance().fn(query, weights, codes, stride, code_bytes, bits_per_tile, count, out);
+}
+
+// name of the popcount gist_weighted_hamming uses, for diagnostic output
+inline const char* gist_popcount_name()
+{
+    return detail::weighted_hamming_dispatch::instance().hardware ? "popcnt" : "scalar";
+}
+
+} // namespace imdb
+
+#endif // DESCRIPTORS__GIST_HASH_HPP
@@ -0,0 +1,368 @@
+#ifndef DESCRIPTORS__GIST_IVF_HPP
+#define DESCRIPTORS__GIST_IVF_HPP
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <algorithm>
+#include <map>
+#include <cstring>
+#include <stdexcept>
+
+#include <stdint.h>
+
+#include "../mapped_file.hpp"
+#include "../top_k.hpp"
+#include "../worker_threads.hpp"
+#include "gist_db.hpp"
+#include "gist_distance.hpp"
+#include "gist_pq.hpp"
+
+// ----------------------------------------------------------------------------
+// Inverted file (IVF) index for gist descriptors.
+//
+// The records of a float gist db are clustered into num_lists lists around
+// coarse centroids (whole packed records). The centroids are trained with
+// k-medians (L1 assignment, per value median) like the pq codebooks, as the
+// scene completion ranks by L1 distance. The records of each list are stored
+// contiguously, so a list is scanned with the same kernel as the gist db.
+//
+// A query scores the centroids with its mask weighted L1 distance, probes
+// the nprobe nearest lists and computes the exact distance of their records
+// (gist_ivf_probe). nprobe = num_lists is the exact search, small values
+// trade recall for latency.
+//
+// File layout:
+//
+//   header     gist_ivf_header, padded to gist_db_alignment bytes
+//   centroids  float[num_lists][record_floats]
+//   lists      uint64[num_lists + 1], list l holds the records
+//              [lists[l], lists[l + 1])
+//   records    float[num_records][record_floats], packed as in gist_db.hpp,
+//              grouped by list
+//   ids        int64[num_records], index of the record in the filelist
+// ----------------------------------------------------------------------------
+
+namespace imdb {
+
+static const char     gist_ivf_magic[8] = { 'G', 'I', 'S', 'T', 'I', 'V', 'F', '\0' };
+static const uint32_t gist_ivf_version  = 1;
+
+struct gist_ivf_header
+{
+    char          magic[8];
+    uint32_t      version;
+    uint32_t      num_lists;
+    uint32_t      num_x_tiles;
+    uint32_t      num_y_tiles;
+    uint32_t      num_freqs;
+    uint32_t      num_orients;
+    uint64_t      num_records;
+    uint64_t      centroids_offset;
+    uint64_t      lists_offset;
+    uint64_t      records_offset;
+    uint64_t      ids_offset;
+};
+
+namespace detail {
+
+// assigns the records of a float gist db to their nearest (L1) centroid,
+// one contiguous range of records per thread
+struct ivf_assign
+{
+    const gist_db&      db;
+    const float*        centroids;
+    size_t              num_lists;
+    const size_t*       indices;    // records to assign, 0 for all of db
+    size_t              count;
+    size_t              num_threads;
+    std::vector<size_t> assignment;
+
+    ivf_assign(const gist_db& gdb, const float* c, size_t k, const size_t* idx, size_t n, size_t threads)
+        : db(gdb), centroids(c), num_lists(k), indices(idx), count(n), num_threads(threads), assignment(n)
+    {}
+
+    void operator()(size_t shard)
+    {
+        const size_t dim = db.geometry().record_floats();
+        const size_t begin = count * shard / num_threads;
+        const size_t end = count * (shard + 1) / num_threads;
+
+        std::vector<float> ones(dim, 1.0f);
+        std::vector<float> distances(num_lists);
+        for (size_t i = begin; i < end; i++)
+        {
+            const float* x = db.record(indices ? indices[i] : i);
+            gist_weighted_l1(x, &ones[0], centroids, dim, dim, num_lists, &distances[0]);
+            assignment[i] = std::min_element(distances.begin(), distances.end()) - distances.begin();
+        }
+    }
+};
+
+inline std::vector<size_t> ivf_assign_all(const gist_db& db, const std::vector<float>& centroids, size_t num_lists,
+                                          const size_t* indices, size_t count)
+{
+    const size_t num_threads = std::max<size_t>(1, std::min(hardware_threads(), count / 1024));
+    ivf_assign task(db, &centroids[0], num_lists, indices, count, num_threads);
+    run_worker_threads(num_threads, task);
+    return task.assignment;
+}
+
+// num_samples different indices of [0, n), the first num_samples steps of a
+// Fisher-Yates shuffle; the swapped positions are kept in a map, so the
+// memory does not grow with n
+inline std::vector<size_t> ivf_sample(size_t n, size_t num_samples, xorshift32& rng)
+{
+    std::map<size_t, size_t> swapped;
+    std::vector<size_t> samples(num_samples);
+    for (size_t i = 0; i < num_samples; i++)
+    {
+        const size_t j = i + rng() % (n - i);
+        std::map<size_t, size_t>::iterator at_j = swapped.find(j);
+        std::map<size_t, size_t>::iterator at_i = swapped.find(i);
+        samples[i] = at_j == swapped.end() ? j : at_j->second;
+        swapped[j] = at_i == swapped.end() ? i : at_i->second;
+    }
+    return samples;
+}
+
+} // namespace detail
+
+// Trains num_lists coarse centroids, float[num_lists][record_floats], with
+// k-medians on num_samples different, randomly drawn records of a float
+// gist db.
+inline std::vector<float> gist_ivf_train(const gist_db& db, size_t num_lists, size_t num_samples, size_t iterations, uint32_t seed)
+{
+    if (db.encoding() != gist_db_float32 || db.layout() != gist_db_record_major)
+    {
+        throw std::runtime_error("ivf index can only be trained on a float, record-major gist db");
+    }
+    if (num_lists == 0 || db.size() < num_lists) throw std::runtime_error("gist db has fewer records than lists");
+
+    const size_t dim = db.geometry().record_floats();
+
+    detail::xorshift32 rng(seed);
+    num_samples = std::max(std::min(num_samples, db.size()), num_lists);
+
+    std::vector<size_t> samples = detail::ivf_sample(db.size(), num_samples, rng);
+
+    // initialize with num_lists of the samples, spread over the draw
+    std::vector<float> centroids(num_lists * dim);
+    for (size_t c = 0; c < num_lists; c++)
+    {
+        const float* x = db.record(samples[(c * num_samples) / num_lists]);
+        std::copy(x, x + dim, &centroids[c * dim]);
+    }
+
+    std::vector<float> values;
+    for (size_t it = 0; it < iterations; it++)
+    {
+        std::vector<size_t> assignment = detail::ivf_assign_all(db, centroids, num_lists, &samples[0], num_samples);
+
+        // members of each cluster
+        std::vector<std::vector<size_t> > members(num_lists);
+        for (size_t i = 0; i < num_samples; i++) members[assignment[i]].push_back(samples[i]);
+
+        for (size_t c = 0; c < num_lists; c++)
+        {
+            float* centroid = &centroids[c * dim];
+
+            if (members[c].empty())
+            {
+                // restart an empty cluster at a random sample
+                const float* x = db.record(samples[rng() % num_samples]);
+                std::copy(x, x + dim, centroid);
+                continue;
+            }
+
+            values.resize(members[c].size());
+            for (size_t d = 0; d < dim; d++)
+            {
+                for (size_t m = 0; m < members[c].size(); m++) values[m] = db.record(members[c][m])[d];
+                std::nth_element(values.begin(), values.begin() + values.size() / 2, values.end());
+                centroid[d] = values[values.size() / 2];
+            }
+        }
+    }
+
+    return centroids;
+}
+
+// Assigns all records of a float gist db to the given centroids and writes
+// the index, the records of every list one after another.
+inline void gist_ivf_write(const gist_db& db, const std::vector<float>& centroids, const std::string& filename)
+{
+    const gist_geometry& g = db.geometry();
+    const size_t dim = g.record_floats();
+    const size_t num_lists = centroids.size() / dim;
+
+    if (num_lists == 0 || centroids.size() != num_lists * dim) throw std::runtime_error("centroids do not match the gist db");
+
+    std::vector<size_t> assignment = detail::ivf_assign_all(db, centroids, num_lists, 0, db.size());
+
+    // counting sort of the records by list
+    std::vector<uint64_t> lists(num_lists + 1, 0);
+    for (size_t i = 0; i < assignment.size(); i++) lists[assignment[i] + 1]++;
+    for (size_t l = 0; l < num_lists; l++) lists[l + 1] += lists[l];
+
+    std::vector<size_t> order(db.size());
+    std::vector<uint64_t> next(lists.begin(), lists.end() - 1);
+    for (size_t i = 0; i < assignment.size(); i++) order[static_cast<size_t>(next[assignment[i]]++)] = i;
+
+    gist_ivf_header header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, gist_ivf_magic, sizeof(header.magic));
+    header.version          = gist_ivf_version;
+    header.num_lists        = static_cast<uint32_t>(num_lists);
+    header.num_x_tiles      = g.num_x_tiles;
+    header.num_y_tiles      = g.num_y_tiles;
+    header.num_freqs        = g.num_freqs;
+    header.num_orients      = g.num_orients;
+    header.num_records      = db.size();
+    header.centroids_offset = gist_db_alignment;
+    header.lists_offset     = gist_db_align(header.centroids_offset + centroids.size() * sizeof(float));
+    header.records_offset   = gist_db_align(header.lists_offset + lists.size() * sizeof(uint64_t));
+    header.ids_offset       = gist_db_align(header.records_offset + db.size() * dim * sizeof(float));
+
+    std::ofstream ofs(filename.c_str(), std::ofstream::binary | std::ofstream::trunc);
+    if (!ofs.is_open()) throw std::runtime_error("could not open file " + filename);
+
+    std::vector<char> pad(static_cast<size_t>(gist_db_alignment), 0);
+    std::memcpy(&pad[0], &header, sizeof(header));
+    ofs.write(&pad[0], pad.size());
+    std::memset(&pad[0], 0, sizeof(header));
+
+    ofs.write(reinterpret_cast<const char*>(&centroids[0]), centroids.size() * sizeof(float));
+    ofs.write(&pad[0], header.lists_offset - header.centroids_offset - centroids.size() * sizeof(float));
+
+    ofs.write(reinterpret_cast<const char*>(&lists[0]), lists.size() * sizeof(uint64_t));
+    ofs.write(&pad[0], header.records_offset - header.lists_offset - lists.size() * sizeof(uint64_t));
+
+    for (size_t i = 0; i < order.size(); i++)
+    {
+        ofs.write(reinterpret_cast<const char*>(db.record(order[i])), dim * sizeof(float));
+    }
+    ofs.write(&pad[0], header.ids_offset - header.records_offset - db.size() * dim * sizeof(float));
+
+    for (size_t i = 0; i < order.size(); i++)
+    {
+        int64_t id = db.id(order[i]);
+        ofs.write(reinterpret_cast<const char*>(&id), sizeof(id));
+    }
+
+    if (!ofs.good()) throw std::runtime_error("error while writing gist ivf index");
+}
+
+class gist_ivf
+{
+    public:
+
+    gist_ivf() { std::memset(&_header, 0, sizeof(_header)); }
+
+    explicit gist_ivf(const std::string& filename)
+    {
+        open(filename);
+    }
+
+    void open(const std::string& filename)
+    {
+        _file.open(filename);
+
+        if (_file.size() < sizeof(gist_ivf_header)) throw std::runtime_error("not a gist ivf index: " + filename);
+        std::memcpy(&_header, _file.data(), sizeof(_header));
+
+        if (std::memcmp(_header.magic, gist_ivf_magic, sizeof(gist_ivf_magic)) != 0) throw std::runtime_error("not a gist ivf index: " + filename);
+        if (_header.version > gist_ivf_version) throw std::runtime_error("version of file " + filename + " is higher than program version");
+
+        _geometry = gist_geometry(_header.num_x_tiles, _header.num_y_tiles, _header.num_freqs, _header.num_orients);
+
+        const uint64_t record_bytes = _geometry.record_floats() * sizeof(float);
+        if (_header.num_lists == 0
+         || _header.centroids_offset + _header.num_lists * record_bytes > _header.lists_offset
+         || _header.lists_offset + (_header.num_lists + 1) * sizeof(uint64_t) > _header.records_offset
+         || _header.records_offset + _header.num_records * record_bytes > _header.ids_offset
+         || _header.ids_offset + _header.num_records * sizeof(int64_t) > _file.size()
+         || list_begin(0) != 0 || list_end(num_lists() - 1) != _header.num_records)
+        {
+            throw std::runtime_error("gist ivf index is truncated or corrupt: " + filename);
+        }
+
+        // the lists must not overlap or reach past the records
+        for (size_t l = 0; l < num_lists(); l++)
+        {
+            if (list_begin(l) > list_end(l) || list_end(l) > _header.num_records)
+            {
+                throw std::runtime_error("gist ivf index has corrupt list offsets: " + filename);
+            }
+        }
+    }
+
+    bool is_open() const { return _file.is_open(); }
+
+    size_t size() const { return static_cast<size_t>(_header.num_records); }
+
+    const gist_geometry& geometry() const { return _geometry; }
+
+    size_t num_lists() const { return _header.num_lists; }
+
+    // float[num_lists][record_floats]
+    const float* centroids() const
+    {
+        return reinterpret_cast<const float*>(_file.data() + _header.centroids_offset);
+    }
+
+    // the records of list l are [list_begin(l), list_end(l))
+    size_t list_begin(size_t l) const { return list_offset(l); }
+    size_t list_end(size_t l) const { return list_offset(l + 1); }
+
+    // consecutive records follow with a stride of record_floats
+    const float* record(size_t index) const
+    {
+        return reinterpret_cast<const float*>(_file.data() + _header.records_offset) + index * _geometry.record_floats();
+    }
+
+    // index of the record in the filelist
+    int64_t id(size_t index) const
+    {
+        int64_t v;
+        std::memcpy(&v, _file.data() + _header.ids_offset + index * sizeof(int64_t), sizeof(v));
+        return v;
+    }
+
+    private:
+
+    size_t list_offset(size_t l) const
+    {
+        uint64_t v;
+        std::memcpy(&v, _file.data() + _header.lists_offset + l * sizeof(uint64_t), sizeof(v));
+        return static_cast<size_t>(v);
+    }
+
+    mapped_file     _file;
+    gist_ivf_header _header;
+    gist_geometry   _geometry;
+};
+
+// The nprobe lists whose centroids are nearest to the (packed) query under
+// the weighted L1 distance, nearest first. weights holds one weight per
+// float of a record, as for gist_weighted_l1.
+inline std::vector<size_t> gist_ivf_probe(const gist_ivf& ivf, const float* query, const float* weights, size_t nprobe)
+{
+    const size_t dim = ivf.geometry().record_floats();
+    const size_t num_lists = ivf.num_lists();
+
+    std::vector<float> distances(num_lists);
+    gist_weighted_l1(query, weights, ivf.centroids(), dim, dim, num_lists, &distances[0]);
+
+    top_k<float, size_t> nearest(std::min(nprobe, num_lists));
+    for (size_t l = 0; l < num_lists; l++) nearest.push(distances[l], l);
+
+    std::vector<std::pair<float, size_t> > sorted = nearest.sorted();
+    std::vector<size_t> lists(sorted.size());
+    for (size_t i = 0; i < sorted.size(); i++) lists[i] = sorted[i].second;
+    return lists;
+}
+
+} // namespace imdb
+
+#endif // DESCRIPTORS__GIST_IVF_HPP
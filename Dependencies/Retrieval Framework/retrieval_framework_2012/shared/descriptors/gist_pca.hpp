@@ -0,0 +1,385 @@
+#ifndef DESCRIPTORS__GIST_PCA_HPP
+#define DESCRIPTORS__GIST_PCA_HPP
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+
+#include <stdint.h>
+
+#include "../mapped_file.hpp"
+#include "gist_db.hpp"
+#include "gist_distance.hpp"
+#include "gist_pq.hpp"
+
+// ----------------------------------------------------------------------------
+// PCA reduced store of gist descriptors.
+//
+// The values of a tile, the (mean, variance) of all its filters, are
+// strongly correlated across frequencies and orientations. Every tile of a
+// packed record is projected onto the dims_per_tile principal components of
+// that tile, learned from a sample of the db. With 16 tiles and 6 components
+// a record shrinks from 768 to 96 floats.
+//
+// The projection is done per tile, like the pq sub-quantizers, so that the
+// mask weight of a tile stays a common factor of its components: the
+// weighted squared L2 distance of two records,
+//
+//   sum_t w[t] * |x[t] - y[t]|^2  ~  sum_t w[t] * |P[t] (x[t] - y[t])|^2,
+//
+// is approximated by a weighted L2 distance of the reduced records with the
+// weight of each tile repeated for its components (gist_pca_weights). The
+// reduced scan only ranks candidates, a shortlist of them is re-ranked with
+// the exact weighted L1 distance of the full descriptors.
+//
+// File layout:
+//
+//   header       gist_pca_header, padded to gist_db_alignment bytes
+//   means        float[num_tiles][tile_floats], mean of each tile
+//   components   float[num_tiles][dims_per_tile][tile_floats]
+//   variances    float[num_tiles][dims_per_tile], explained per component
+//   records      float[num_records][num_tiles][dims_per_tile]
+//   ids          int64[num_records], index of the record in the filelist
+// ----------------------------------------------------------------------------
+
+namespace imdb {
+
+static const char     gist_pca_magic[8] = { 'G', 'I', 'S', 'T', 'P', 'C', 'A', '\0' };
+static const uint32_t gist_pca_version  = 1;
+
+struct gist_pca_header
+{
+    char          magic[8];
+    uint32_t      version;
+    uint32_t      dims_per_tile;
+    uint32_t      num_x_tiles;
+    uint32_t      num_y_tiles;
+    uint32_t      num_freqs;
+    uint32_t      num_orients;
+    uint64_t      num_records;
+    uint64_t      means_offset;
+    uint64_t      components_offset;
+    uint64_t      variances_offset;
+    uint64_t      records_offset;
+    uint64_t      ids_offset;
+};
+
+// projection learned by gist_pca_train
+struct gist_pca_basis
+{
+    size_t             dims_per_tile;
+    std::vector<float> means;           // [num_tiles][tile_floats]
+    std::vector<float> components;      // [num_tiles][dims_per_tile][tile_floats]
+    std::vector<float> variances;       // [num_tiles][dims_per_tile]
+    std::vector<float> total_variances; // [num_tiles], of all values of the tile
+};
+
+namespace detail {
+
+// Eigen decomposition of the symmetric n x n matrix a (cyclic Jacobi
+// rotations, plenty for the 48 x 48 covariance of a tile). On return the
+// diagonal of a holds the eigenvalues and the columns of v the eigenvectors.
+inline void symmetric_eigen(std::vector<double>& a, size_t n, std::vector<double>& v)
+{
+    v.assign(n * n, 0.0);
+    for (size_t i = 0; i < n; i++) v[i * n + i] = 1.0;
+
+    for (int sweep = 0; sweep < 100; sweep++)
+    {
+        double off = 0;
+        for (size_t p = 0; p < n; p++)
+        for (size_t q = p + 1; q < n; q++) off += a[p * n + q] * a[p * n + q];
+        if (off < 1e-22) break;
+
+        for (size_t p = 0; p < n; p++)
+        for (size_t q = p + 1; q < n; q++)
+        {
+            const double apq = a[p * n + q];
+            if (std::fabs(apq) < 1e-30) continue;
+
+            const double theta = (a[q * n + q] - a[p * n + p]) / (2 * apq);
+            const double t = (theta >= 0 ? 1.0 : -1.0) / (std::fabs(theta) + std::sqrt(theta * theta + 1));
+            const double c = 1 / std::sqrt(t * t + 1);
+            const double s = t * c;
+
+            for (size_t k = 0; k < n; k++)
+            {
+                const double akp = a[k * n + p];
+                const double akq = a[k * n + q];
+                a[k * n + p] = c * akp - s * akq;
+                a[k * n + q] = s * akp + c * akq;
+            }
+            for (size_t k = 0; k < n; k++)
+            {
+                const double apk = a[p * n + k];
+                const double aqk = a[q * n + k];
+                a[p * n + k] = c * apk - s * aqk;
+                a[q * n + k] = s * apk + c * aqk;
+            }
+            for (size_t k = 0; k < n; k++)
+            {
+                const double vkp = v[k * n + p];
+                const double vkq = v[k * n + q];
+                v[k * n + p] = c * vkp - s * vkq;
+                v[k * n + q] = s * vkp + c * vkq;
+            }
+        }
+    }
+}
+
+// orders eigenvalue indices by descending eigenvalue
+struct eigenvalue_greater
+{
+    const std::vector<double>* a;
+    size_t n;
+
+    eigenvalue_greater(const std::vector<double>* m, size_t size) : a(m), n(size) {}
+
+    bool operator()(size_t i, size_t j) const { return (*a)[i * n + i] > (*a)[j * n + j]; }
+};
+
+} // namespace detail
+
+// Learns the dims_per_tile principal components of every tile from
+// num_samples randomly drawn records of a float, record-major gist db.
+inline gist_pca_basis gist_pca_train(const gist_db& db, size_t dims_per_tile, size_t num_samples, uint32_t seed)
+{
+    if (db.encoding() != gist_db_float32 || db.layout() != gist_db_record_major)
+    {
+        throw std::runtime_error("pca can only be learned from a float, record-major gist db");
+    }
+
+    const gist_geometry& g = db.geometry();
+    const size_t n = g.tile_floats();
+    if (dims_per_tile == 0 || dims_per_tile > n) throw std::runtime_error("dims per tile must be between 1 and the floats of a tile");
+    if (db.size() < 2) throw std::runtime_error("gist db has too few records for a pca");
+
+    detail::xorshift32 rng(seed);
+    num_samples = std::max<size_t>(std::min(num_samples, db.size()), 2);
+
+    std::vector<size_t> samples(num_samples);
+    for (size_t i = 0; i < num_samples; i++) samples[i] = rng() % db.size();
+
+    gist_pca_basis basis;
+    basis.dims_per_tile = dims_per_tile;
+    basis.means.resize(g.num_tiles() * n);
+    basis.components.resize(g.num_tiles() * dims_per_tile * n);
+    basis.variances.resize(g.num_tiles() * dims_per_tile);
+    basis.total_variances.resize(g.num_tiles());
+
+    std::vector<double> mean(n);
+    std::vector<double> cov(n * n);
+    std::vector<double> vectors;
+    std::vector<size_t> order(n);
+
+    for (size_t t = 0; t < g.num_tiles(); t++)
+    {
+        std::fill(mean.begin(), mean.end(), 0.0);
+        for (size_t i = 0; i < num_samples; i++)
+        {
+            const float* x = db.record(samples[i]) + t * n;
+            for (size_t d = 0; d < n; d++) mean[d] += x[d];
+        }
+        for (size_t d = 0; d < n; d++) mean[d] /= num_samples;
+
+        std::fill(cov.begin(), cov.end(), 0.0);
+        for (size_t i = 0; i < num_samples; i++)
+        {
+            const float* x = db.record(samples[i]) + t * n;
+            for (size_t a = 0; a < n; a++)
+            for (size_t b = a; b < n; b++) cov[a * n + b] += (x[a] - mean[a]) * (x[b] - mean[b]);
+        }
+        for (size_t a = 0; a < n; a++)
+        for (size_t b = a; b < n; b++) cov[b * n + a] = cov[a * n + b] /= (num_samples - 1);
+
+        detail::symmetric_eigen(cov, n, vectors);
+
+        for (size_t d = 0; d < n; d++) order[d] = d;
+        std::sort(order.begin(), order.end(), detail::eigenvalue_greater(&cov, n));
+
+        double total = 0;
+        for (size_t d = 0; d < n; d++) total += cov[d * n + d];
+        basis.total_variances[t] = static_cast<float>(total);
+
+        for (size_t d = 0; d < n; d++) basis.means[t * n + d] = static_cast<float>(mean[d]);
+        for (size_t c = 0; c < dims_per_tile; c++)
+        {
+            float* component = &basis.components[(t * dims_per_tile + c) * n];
+            for (size_t d = 0; d < n; d++) component[d] = static_cast<float>(vectors[d * n + order[c]]);
+            basis.variances[t * dims_per_tile + c] = static_cast<float>(cov[order[c] * n + order[c]]);
+        }
+    }
+
+    return basis;
+}
+
+// Projects a packed record onto the basis, out is float[num_tiles][dims_per_tile].
+inline void gist_pca_project(const gist_geometry& g, size_t dims_per_tile, const float* means, const float* components,
+                             const float* record, float* out)
+{
+    const size_t n = g.tile_floats();
+    for (size_t t = 0; t < g.num_tiles(); t++)
+    {
+        for (size_t c = 0; c < dims_per_tile; c++)
+        {
+            const float* component = components + (t * dims_per_tile + c) * n;
+            float s = 0;
+            for (size_t d = 0; d < n; d++) s += component[d] * (record[t * n + d] - means[t * n + d]);
+            out[t * dims_per_tile + c] = s;
+        }
+    }
+}
+
+// Projects all records of a float gist db and writes the reduced store.
+inline void gist_pca_write(const gist_db& db, const gist_pca_basis& basis, const std::string& filename)
+{
+    const gist_geometry& g = db.geometry();
+    const size_t n = g.tile_floats();
+    const size_t dims = g.num_tiles() * basis.dims_per_tile;
+
+    if (basis.means.size() != g.num_tiles() * n || basis.components.size() != dims * n) throw std::runtime_error("pca basis does not match the gist db");
+
+    gist_pca_header header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, gist_pca_magic, sizeof(header.magic));
+    header.version           = gist_pca_version;
+    header.dims_per_tile     = static_cast<uint32_t>(basis.dims_per_tile);
+    header.num_x_tiles       = g.num_x_tiles;
+    header.num_y_tiles       = g.num_y_tiles;
+    header.num_freqs         = g.num_freqs;
+    header.num_orients       = g.num_orients;
+    header.num_records       = db.size();
+    header.means_offset      = gist_db_alignment;
+    header.components_offset = gist_db_align(header.means_offset + basis.means.size() * sizeof(float));
+    header.variances_offset  = gist_db_align(header.components_offset + basis.components.size() * sizeof(float));
+    header.records_offset    = gist_db_align(header.variances_offset + basis.variances.size() * sizeof(float));
+    header.ids_offset        = gist_db_align(header.records_offset + db.size() * dims * sizeof(float));
+
+    std::ofstream ofs(filename.c_str(), std::ofstream::binary | std::ofstream::trunc);
+    if (!ofs.is_open()) throw std::runtime_error("could not open file " + filename);
+
+    std::vector<char> pad(static_cast<size_t>(gist_db_alignment), 0);
+    std::memcpy(&pad[0], &header, sizeof(header));
+    ofs.write(&pad[0], pad.size());
+    std::memset(&pad[0], 0, sizeof(header));
+
+    ofs.write(reinterpret_cast<const char*>(&basis.means[0]), basis.means.size() * sizeof(float));
+    ofs.write(&pad[0], header.components_offset - header.means_offset - basis.means.size() * sizeof(float));
+
+    ofs.write(reinterpret_cast<const char*>(&basis.components[0]), basis.components.size() * sizeof(float));
+    ofs.write(&pad[0], header.variances_offset - header.components_offset - basis.components.size() * sizeof(float));
+
+    ofs.write(reinterpret_cast<const char*>(&basis.variances[0]), basis.variances.size() * sizeof(float));
+    ofs.write(&pad[0], header.records_offset - header.variances_offset - basis.variances.size() * sizeof(float));
+
+    std::vector<float> reduced(dims);
+    for (size_t i = 0; i < db.size(); i++)
+    {
+        gist_pca_project(g, basis.dims_per_tile, &basis.means[0], &basis.components[0], db.record(i), &reduced[0]);
+        ofs.write(reinterpret_cast<const char*>(&reduced[0]), dims * sizeof(float));
+    }
+    ofs.write(&pad[0], header.ids_offset - header.records_offset - db.size() * dims * sizeof(float));
+
+    for (size_t i = 0; i < db.size(); i++)
+    {
+        int64_t id = db.id(i);
+        ofs.write(reinterpret_cast<const char*>(&id), sizeof(id));
+    }
+
+    if (!ofs.good()) throw std::runtime_error("error while writing gist pca store");
+}
+
+class gist_pca
+{
+    public:
+
+    gist_pca() { std::memset(&_header, 0, sizeof(_header)); }
+
+    explicit gist_pca(const std::string& filename)
+    {
+        open(filename);
+    }
+
+    void open(const std::string& filename)
+    {
+        _file.open(filename);
+
+        if (_file.size() < sizeof(gist_pca_header)) throw std::runtime_error("not a gist pca store: " + filename);
+        std::memcpy(&_header, _file.data(), sizeof(_header));
+
+        if (std::memcmp(_header.magic, gist_pca_magic, sizeof(gist_pca_magic)) != 0) throw std::runtime_error("not a gist pca store: " + filename);
+        if (_header.version > gist_pca_version) throw std::runtime_error("version of file " + filename + " is higher than program version");
+
+        _geometry = gist_geometry(_header.num_x_tiles, _header.num_y_tiles, _header.num_freqs, _header.num_orients);
+
+        const uint64_t n = _geometry.tile_floats();
+        if (_header.dims_per_tile == 0 || _header.dims_per_tile > n
+         || _header.means_offset + _geometry.num_tiles() * n * sizeof(float) > _header.components_offset
+         || _header.components_offset + dims() * n * sizeof(float) > _header.variances_offset
+         || _header.variances_offset + dims() * sizeof(float) > _header.records_offset
+         || _header.records_offset + _header.num_records * dims() * sizeof(float) > _header.ids_offset
+         || _header.ids_offset + _header.num_records * sizeof(int64_t) > _file.size())
+        {
+            throw std::runtime_error("gist pca store is truncated or corrupt: " + filename);
+        }
+    }
+
+    bool is_open() const { return _file.is_open(); }
+
+    size_t size() const { return static_cast<size_t>(_header.num_records); }
+
+    const gist_geometry& geometry() const { return _geometry; }
+
+    size_t dims_per_tile() const { return _header.dims_per_tile; }
+
+    // floats of a reduced record
+    size_t dims() const { return _geometry.num_tiles() * _header.dims_per_tile; }
+
+    const float* means() const { return floats_at(_header.means_offset); }
+
+    const float* components() const { return floats_at(_header.components_offset); }
+
+    const float* variances() const { return floats_at(_header.variances_offset); }
+
+    // consecutive reduced records follow with a stride of dims()
+    const float* record(size_t index) const { return floats_at(_header.records_offset) + index * dims(); }
+
+    // index of the record in the filelist
+    int64_t id(size_t index) const
+    {
+        int64_t v;
+        std::memcpy(&v, _file.data() + _header.ids_offset + index * sizeof(int64_t), sizeof(v));
+        return v;
+    }
+
+    // projects a packed record, out is float[dims()]
+    void project(const float* record, float* out) const
+    {
+        gist_pca_project(_geometry, dims_per_tile(), means(), components(), record, out);
+    }
+
+    private:
+
+    const float* floats_at(uint64_t offset) const { return reinterpret_cast<const float*>(_file.data() + offset); }
+
+    mapped_file     _file;
+    gist_pca_header _header;
+    gist_geometry   _geometry;
+};
+
+// Expands one weight per tile to the float[dims()] weights of a reduced record.
+inline void gist_pca_weights(const gist_pca& pca, const float* tile_weights, float* weights)
+{
+    for (size_t t = 0; t < pca.geometry().num_tiles(); t++)
+    {
+        std::fill(weights + t * pca.dims_per_tile(), weights + (t + 1) * pca.dims_per_tile(), tile_weights[t]);
+    }
+}
+
+} // namespace imdb
+
+#endif // DESCRIPTORS__GIST_PCA_HPP
@@ -0,0 +1,293 @@
+#ifndef DESCRIPTORS__GIST_PIVOT_HPP
+#define DESCRIPTORS__GIST_PIVOT_HPP
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+
+#include <stdint.h>
+
+#include "../mapped_file.hpp"
+#include "gist_db.hpp"
+#include "gist_pq.hpp"
+
+// ----------------------------------------------------------------------------
+// Per-tile distance tables to a few pivot descriptors, for an exact scan
+// that skips most of the records.
+//
+// The mask weights change with every query, so a metric tree built on the
+// weighted distance does not apply. But the weighted L1 distance is a sum
+// of per-tile L1 distances, and the triangle inequality holds for each of
+// them. For a pivot p and the L1 distance d_t of tile t,
+//
+//   d_t(q, r) >= |d_t(q, p) - d_t(r, p)|,
+//
+// so for any non-negative tile weights w
+//
+//   sum_t w[t] * d_t(q, r) >= sum_t w[t] * max_p |d_t(q, p) - d_t(r, p)|.
+//
+// The table holds d_t(r, p) of every record r for num_pivots pivots. The
+// scan computes the bound from the table and only reads the descriptor of
+// records whose bound is below the worst distance kept so far. The result
+// is the same as that of the full scan.
+//
+// The table, the query distances and the scan all sum rounded floats, so
+// the bound is lowered by the worst case error of a float sum of n terms,
+// gamma(n) = n * u / (1 - n * u) with u = eps / 2: every tile term by
+// gamma(tile_floats + 4) of the two distances it subtracts, the weighted
+// sum by gamma(num_tiles + 3), and the result by gamma(record_floats + 1),
+// the error of the scan's own distance. The bound then stays below the
+// distance the scan computes, whatever order the scan sums in.
+//
+// The pivots are picked farthest-first from a sample of the db, so they
+// lie spread over the data.
+//
+// File layout:
+//
+//   header       gist_pivot_header, padded to gist_db_alignment bytes
+//   pivots       float[num_pivots][record_floats], packed records
+//   table        float[num_records][num_pivots][num_tiles]
+//
+// Record i of the table is record i of the gist db it was built from.
+// ----------------------------------------------------------------------------
+
+namespace imdb {
+
+static const char     gist_pivot_magic[8] = { 'G', 'I', 'S', 'T', 'P', 'V', 'T', '\0' };
+static const uint32_t gist_pivot_version  = 1;
+
+struct gist_pivot_header
+{
+    char          magic[8];
+    uint32_t      version;
+    uint32_t      num_pivots;
+    uint32_t      num_x_tiles;
+    uint32_t      num_y_tiles;
+    uint32_t      num_freqs;
+    uint32_t      num_orients;
+    uint64_t      num_records;
+    uint64_t      pivots_offset;
+    uint64_t      table_offset;
+};
+
+// worst case relative error of a float sum of n non-negative terms
+inline double gist_pivot_rounding(size_t n)
+{
+    const double u = std::numeric_limits<float>::epsilon() / 2.0;
+    return n * u / (1.0 - n * u);
+}
+
+// per-tile L1 distances of a packed record to the pivots, out is float[num_pivots][num_tiles]
+inline void gist_pivot_distances(const gist_geometry& g, const float* pivots, size_t num_pivots, const float* record, float* out)
+{
+    const size_t n = g.tile_floats();
+    for (size_t p = 0; p < num_pivots; p++)
+    {
+        const float* pivot = pivots + p * g.record_floats();
+        for (size_t t = 0; t < g.num_tiles(); t++)
+        {
+            float s = 0;
+            for (size_t d = 0; d < n; d++) s += std::fabs(record[t * n + d] - pivot[t * n + d]);
+            out[p * g.num_tiles() + t] = s;
+        }
+    }
+}
+
+// Picks num_pivots records farthest-first (by unweighted L1 distance) from
+// num_samples randomly drawn records of a float, record-major gist db.
+// Returns the pivots as packed records.
+inline std::vector<float> gist_pivot_select(const gist_db& db, size_t num_pivots, size_t num_samples, uint32_t seed)
+{
+    if (db.encoding() != gist_db_float32 || db.layout() != gist_db_record_major)
+    {
+        throw std::runtime_error("pivots can only be picked from a float, record-major gist db");
+    }
+
+    if (num_pivots == 0) throw std::runtime_error("at least one pivot is needed");
+    if (db.size() < num_pivots) throw std::runtime_error("gist db has fewer records than pivots");
+
+    const gist_geometry& g = db.geometry();
+    const size_t dim = g.record_floats();
+
+    detail::xorshift32 rng(seed);
+    num_samples = std::max(std::min(num_samples, db.size()), num_pivots);
+
+    std::vector<size_t> samples(num_samples);
+    for (size_t i = 0; i < num_samples; i++) samples[i] = rng() % db.size();
+
+    std::vector<float> pivots;
+    pivots.reserve(num_pivots * dim);
+
+    // distance of every sample to the nearest pivot so far
+    std::vector<float> nearest(num_samples, std::numeric_limits<float>::max());
+    size_t next = samples[0];
+
+    for (size_t p = 0; p < num_pivots; p++)
+    {
+        const float* pivot = db.record(next);
+        pivots.insert(pivots.end(), pivot, pivot + dim);
+
+        size_t farthest = 0;
+        for (size_t i = 0; i < num_samples; i++)
+        {
+            const float* x = db.record(samples[i]);
+            float s = 0;
+            for (size_t d = 0; d < dim; d++) s += std::fabs(x[d] - pivot[d]);
+
+            nearest[i] = std::min(nearest[i], s);
+            if (nearest[i] > nearest[farthest]) farthest = i;
+        }
+        next = samples[farthest];
+    }
+
+    return pivots;
+}
+
+// Writes the pivots and the distance table of all records of a float,
+// record-major gist db.
+inline void gist_pivot_write(const gist_db& db, const std::vector<float>& pivots, const std::string& filename)
+{
+    const gist_geometry& g = db.geometry();
+    const size_t num_pivots = pivots.size() / g.record_floats();
+    const size_t row = num_pivots * g.num_tiles();
+
+    if (num_pivots == 0 || pivots.size() != num_pivots * g.record_floats()) throw std::runtime_error("pivots do not match the gist db");
+
+    gist_pivot_header header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, gist_pivot_magic, sizeof(header.magic));
+    header.version       = gist_pivot_version;
+    header.num_pivots    = static_cast<uint32_t>(num_pivots);
+    header.num_x_tiles   = g.num_x_tiles;
+    header.num_y_tiles   = g.num_y_tiles;
+    header.num_freqs     = g.num_freqs;
+    header.num_orients   = g.num_orients;
+    header.num_records   = db.size();
+    header.pivots_offset = gist_db_alignment;
+    header.table_offset  = gist_db_align(header.pivots_offset + pivots.size() * sizeof(float));
+
+    std::ofstream ofs(filename.c_str(), std::ofstream::binary | std::ofstream::trunc);
+    if (!ofs.is_open()) throw std::runtime_error("could not open file " + filename);
+
+    std::vector<char> pad(static_cast<size_t>(gist_db_alignment), 0);
+    std::memcpy(&pad[0], &header, sizeof(header));
+    ofs.write(&pad[0], pad.size());
+    std::memset(&pad[0], 0, sizeof(header));
+
+    ofs.write(reinterpret_cast<const char*>(&pivots[0]), pivots.size() * sizeof(float));
+    ofs.write(&pad[0], header.table_offset - header.pivots_offset - pivots.size() * sizeof(float));
+
+    std::vector<float> distances(row);
+    for (size_t i = 0; i < db.size(); i++)
+    {
+        gist_pivot_distances(g, &pivots[0], num_pivots, db.record(i), &distances[0]);
+        ofs.write(reinterpret_cast<const char*>(&distances[0]), row * sizeof(float));
+    }
+
+    if (!ofs.good()) throw std::runtime_error("error while writing gist pivot table");
+}
+
+class gist_pivot_table
+{
+    public:
+
+    gist_pivot_table() { std::memset(&_header, 0, sizeof(_header)); }
+
+    explicit gist_pivot_table(const std::string& filename)
+    {
+        open(filename);
+    }
+
+    void open(const std::string& filename)
+    {
+        _file.open(filename);
+
+        if (_file.size() < sizeof(gist_pivot_header)) throw std::runtime_error("not a gist pivot table: " + filename);
+        std::memcpy(&_header, _file.data(), sizeof(_header));
+
+        if (std::memcmp(_header.magic, gist_pivot_magic, sizeof(gist_pivot_magic)) != 0) throw std::runtime_error("not a gist pivot table: " + filename);
+        if (_header.version > gist_pivot_version) throw std::runtime_error("version of file " + filename + " is higher than program version");
+
+        _geometry = gist_geometry(_header.num_x_tiles, _header.num_y_tiles, _header.num_freqs, _header.num_orients);
+
+        if (_header.num_pivots == 0
+         || _header.pivots_offset + _header.num_pivots * _geometry.record_floats() * sizeof(float) > _header.table_offset
+         || _header.table_offset + _header.num_records * row_floats() * sizeof(float) > _file.size())
+        {
+            throw std::runtime_error("gist pivot table is truncated or corrupt: " + filename);
+        }
+    }
+
+    bool is_open() const { return _file.is_open(); }
+
+    size_t size() const { return static_cast<size_t>(_header.num_records); }
+
+    const gist_geometry& geometry() const { return _geometry; }
+
+    size_t num_pivots() const { return _header.num_pivots; }
+
+    // floats of the table per record
+    size_t row_floats() const { return num_pivots() * _geometry.num_tiles(); }
+
+    const float* pivots() const { return reinterpret_cast<const float*>(_file.data() + _header.pivots_offset); }
+
+    // consecutive rows follow with a stride of row_floats()
+    const float* row(size_t index) const
+    {
+        return reinterpret_cast<const float*>(_file.data() + _header.table_offset) + index * row_floats();
+    }
+
+    // distances of a packed record to the pivots, out is float[row_floats()]
+    void distances(const float* record, float* out) const
+    {
+        gist_pivot_distances(_geometry, pivots(), num_pivots(), record, out);
+    }
+
+    private:
+
+    mapped_file       _file;
+    gist_pivot_header _header;
+    gist_geometry     _geometry;
+};
+
+// Lower bounds of the weighted L1 distance of the query to the records
+// [first, first + count), from the distances of the query to the pivots
+// (see gist_pivot_table::distances) and one weight per tile. bound is
+// float[num_tiles] of scratch space the caller reuses between calls.
+inline void gist_pivot_lower_bounds(const gist_pivot_table& table, const float* query_distances, const float* tile_weights,
+                                    size_t first, size_t count, float* out, float* bound)
+{
+    const gist_geometry& g = table.geometry();
+    const size_t num_tiles = g.num_tiles();
+    const size_t num_pivots = table.num_pivots();
+
+    // see the rounding above
+    const float tile_error = static_cast<float>(gist_pivot_rounding(g.tile_floats() + 4));
+    const float sum_slack = static_cast<float>((1.0 - gist_pivot_rounding(num_tiles + 3)) * (1.0 - gist_pivot_rounding(g.record_floats() + 1)));
+
+    for (size_t j = 0; j < count; j++)
+    {
+        const float* r = table.row(first + j);
+
+        std::fill(bound, bound + num_tiles, 0.0f);
+        for (size_t p = 0; p < num_pivots; p++)
+        {
+            const float* q = query_distances + p * num_tiles;
+            const float* rp = r + p * num_tiles;
+            for (size_t t = 0; t < num_tiles; t++) bound[t] = std::max(bound[t], std::fabs(q[t] - rp[t]) - tile_error * (q[t] + rp[t]));
+        }
+
+        float s = 0;
+        for (size_t t = 0; t < num_tiles; t++) s += tile_weights[t] * bound[t];
+        out[j] = s * sum_slack;
+    }
+}
+
+} // namespace imdb
+
+#endif // DESCRIPTORS__GIST_PIVOT_HPP
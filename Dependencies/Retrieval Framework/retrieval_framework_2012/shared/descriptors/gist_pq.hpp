@@ -0,0 +1,320 @@
+#ifndef DESCRIPTORS__GIST_PQ_HPP
+#define DESCRIPTORS__GIST_PQ_HPP
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#include <stdint.h>
+
+#include "../mapped_file.hpp"
+#include "gist_db.hpp"
+#include "gist_distance.hpp"
+
+// ----------------------------------------------------------------------------
+// Product quantization index for gist descriptors.
+//
+// Every sub-quantizer covers exactly one tile of a packed record, i.e. the
+// (mean, variance) of all filters of that tile, and has 256 centroids. A
+// descriptor is thus encoded in num_tiles bytes. The centroids are trained
+// with k-medians (L1 assignment, per value median), which fits the L1
+// distance the scene completion uses.
+//
+// At query time the weighted L1 distance of every centroid to the query's
+// tile is tabulated once (gist_pq_tables). As the weight of a tile is a
+// common factor of all its values, the mask weights of the query fold into
+// these tables, and the distance of a record is the sum of num_tiles table
+// lookups (gist_pq_scan).
+//
+// File layout:
+//
+//   header     gist_pq_header, padded to gist_db_alignment bytes
+//   codebooks  float[num_tiles][num_centroids][tile_floats]
+//   codes      uint8[num_records][num_tiles]
+//   ids        int64[num_records], index of the record in the filelist
+// ----------------------------------------------------------------------------
+
+namespace imdb {
+
+static const char     gist_pq_magic[8]  = { 'G', 'I', 'S', 'T', 'P', 'Q', '\0', '\0' };
+static const uint32_t gist_pq_version   = 1;
+static const uint32_t gist_pq_centroids = 256;
+
+struct gist_pq_header
+{
+    char          magic[8];
+    uint32_t      version;
+    uint32_t      num_centroids;
+    uint32_t      num_x_tiles;
+    uint32_t      num_y_tiles;
+    uint32_t      num_freqs;
+    uint32_t      num_orients;
+    uint64_t      num_records;
+    uint64_t      codebooks_offset;
+    uint64_t      codes_offset;
+    uint64_t      ids_offset;
+};
+
+namespace detail {
+
+// small deterministic generator, so that training is reproducible
+struct xorshift32
+{
+    uint32_t state;
+
+    explicit xorshift32(uint32_t seed) : state(seed ? seed : 2463534242u) {}
+
+    uint32_t operator()()
+    {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return state;
+    }
+};
+
+} // namespace detail
+
+// index of the centroid nearest (L1) to the tile values x
+inline size_t gist_pq_nearest(const float* centroids, size_t num_centroids, size_t tile_floats,
+                              const float* ones, const float* x, float* distances)
+{
+    gist_weighted_l1(x, ones, centroids, tile_floats, tile_floats, num_centroids, distances);
+    return std::min_element(distances, distances + num_centroids) - distances;
+}
+
+// Trains the codebooks, float[num_tiles][gist_pq_centroids][tile_floats],
+// with k-medians on num_samples randomly drawn records of a float gist db.
+inline std::vector<float> gist_pq_train(const gist_db& db, size_t num_samples, size_t iterations, uint32_t seed)
+{
+    if (db.encoding() != gist_db_float32 || db.layout() != gist_db_record_major)
+    {
+        throw std::runtime_error("product quantizer can only be trained on a float, record-major gist db");
+    }
+    if (db.size() < gist_pq_centroids) throw std::runtime_error("gist db has fewer records than centroids");
+
+    const gist_geometry& g = db.geometry();
+    const size_t tile_floats = g.tile_floats();
+    const size_t k = gist_pq_centroids;
+
+    detail::xorshift32 rng(seed);
+    num_samples = std::max(std::min(num_samples, db.size()), k);
+
+    std::vector<size_t> samples(num_samples);
+    for (size_t i = 0; i < num_samples; i++) samples[i] = rng() % db.size();
+
+    std::vector<float> codebooks(g.num_tiles() * k * tile_floats);
+    std::vector<float> ones(tile_floats, 1.0f);
+    std::vector<float> distances(k);
+    std::vector<size_t> assignment(num_samples);
+    std::vector<float> values;
+
+    for (size_t t = 0; t < g.num_tiles(); t++)
+    {
+        float* centroids = &codebooks[t * k * tile_floats];
+
+        // initialize with k (different) samples
+        for (size_t c = 0; c < k; c++)
+        {
+            const float* x = db.record(samples[(c * num_samples) / k]) + t * tile_floats;
+            std::copy(x, x + tile_floats, centroids + c * tile_floats);
+        }
+
+        for (size_t it = 0; it < iterations; it++)
+        {
+            for (size_t i = 0; i < num_samples; i++)
+            {
+                assignment[i] = gist_pq_nearest(centroids, k, tile_floats, &ones[0], db.record(samples[i]) + t * tile_floats, &distances[0]);
+            }
+
+            // members of each cluster
+            std::vector<std::vector<size_t> > members(k);
+            for (size_t i = 0; i < num_samples; i++) members[assignment[i]].push_back(samples[i]);
+
+            for (size_t c = 0; c < k; c++)
+            {
+                float* centroid = centroids + c * tile_floats;
+
+                if (members[c].empty())
+                {
+                    // restart an empty cluster at a random sample
+                    const float* x = db.record(samples[rng() % num_samples]) + t * tile_floats;
+                    std::copy(x, x + tile_floats, centroid);
+                    continue;
+                }
+
+                values.resize(members[c].size());
+                for (size_t d = 0; d < tile_floats; d++)
+                {
+                    for (size_t m = 0; m < members[c].size(); m++) values[m] = db.record(members[c][m])[t * tile_floats + d];
+                    std::nth_element(values.begin(), values.begin() + values.size() / 2, values.end());
+                    centroid[d] = values[values.size() / 2];
+                }
+            }
+        }
+    }
+
+    return codebooks;
+}
+
+// Encodes all records of a float gist db with the given codebooks and
+// writes the index.
+inline void gist_pq_write(const gist_db& db, const std::vector<float>& codebooks, const std::string& filename)
+{
+    const gist_geometry& g = db.geometry();
+    const size_t tile_floats = g.tile_floats();
+    const size_t num_tiles = g.num_tiles();
+    const size_t k = gist_pq_centroids;
+
+    if (codebooks.size() != num_tiles * k * tile_floats) throw std::runtime_error("codebooks do not match the gist db");
+
+    gist_pq_header header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, gist_pq_magic, sizeof(header.magic));
+    header.version          = gist_pq_version;
+    header.num_centroids    = gist_pq_centroids;
+    header.num_x_tiles      = g.num_x_tiles;
+    header.num_y_tiles      = g.num_y_tiles;
+    header.num_freqs        = g.num_freqs;
+    header.num_orients      = g.num_orients;
+    header.num_records      = db.size();
+    header.codebooks_offset = gist_db_alignment;
+    header.codes_offset     = gist_db_align(header.codebooks_offset + codebooks.size() * sizeof(float));
+    header.ids_offset       = gist_db_align(header.codes_offset + db.size() * num_tiles);
+
+    std::ofstream ofs(filename.c_str(), std::ofstream::binary | std::ofstream::trunc);
+    if (!ofs.is_open()) throw std::runtime_error("could not open file " + filename);
+
+    std::vector<char> pad(static_cast<size_t>(gist_db_alignment), 0);
+    std::memcpy(&pad[0], &header, sizeof(header));
+    ofs.write(&pad[0], pad.size());
+    std::memset(&pad[0], 0, sizeof(header));
+
+    ofs.write(reinterpret_cast<const char*>(&codebooks[0]), codebooks.size() * sizeof(float));
+    ofs.write(&pad[0], header.codes_offset - header.codebooks_offset - codebooks.size() * sizeof(float));
+
+    std::vector<float> ones(tile_floats, 1.0f);
+    std::vector<float> distances(k);
+    std::vector<unsigned char> code(num_tiles);
+    for (size_t i = 0; i < db.size(); i++)
+    {
+        const float* r = db.record(i);
+        for (size_t t = 0; t < num_tiles; t++)
+        {
+            code[t] = static_cast<unsigned char>(gist_pq_nearest(&codebooks[t * k * tile_floats], k, tile_floats, &ones[0], r + t * tile_floats, &distances[0]));
+        }
+        ofs.write(reinterpret_cast<const char*>(&code[0]), code.size());
+    }
+    ofs.write(&pad[0], header.ids_offset - header.codes_offset - db.size() * num_tiles);
+
+    for (size_t i = 0; i < db.size(); i++)
+    {
+        int64_t id = db.id(i);
+        ofs.write(reinterpret_cast<const char*>(&id), sizeof(id));
+    }
+
+    if (!ofs.good()) throw std::runtime_error("error while writing gist pq index");
+}
+
+class gist_pq
+{
+    public:
+
+    gist_pq() { std::memset(&_header, 0, sizeof(_header)); }
+
+    explicit gist_pq(const std::string& filename)
+    {
+        open(filename);
+    }
+
+    void open(const std::string& filename)
+    {
+        _file.open(filename);
+
+        if (_file.size() < sizeof(gist_pq_header)) throw std::runtime_error("not a gist pq index: " + filename);
+        std::memcpy(&_header, _file.data(), sizeof(_header));
+
+        if (std::memcmp(_header.magic, gist_pq_magic, sizeof(gist_pq_magic)) != 0) throw std::runtime_error("not a gist pq index: " + filename);
+        if (_header.version > gist_pq_version) throw std::runtime_error("version of file " + filename + " is higher than program version");
+
+        _geometry = gist_geometry(_header.num_x_tiles, _header.num_y_tiles, _header.num_freqs, _header.num_orients);
+
+        if (_header.num_centroids != gist_pq_centroids
+         || _header.codebooks_offset + _geometry.num_tiles() * _header.num_centroids * _geometry.tile_floats() * sizeof(float) > _header.codes_offset
+         || _header.codes_offset + _header.num_records * _geometry.num_tiles() > _header.ids_offset
+         || _header.ids_offset + _header.num_records * sizeof(int64_t) > _file.size())
+        {
+            throw std::runtime_error("gist pq index is truncated or corrupt: " + filename);
+        }
+    }
+
+    bool is_open() const { return _file.is_open(); }
+
+    size_t size() const { return static_cast<size_t>(_header.num_records); }
+
+    const gist_geometry& geometry() const { return _geometry; }
+
+    size_t num_centroids() const { return _header.num_centroids; }
+
+    // float[num_centroids][tile_floats] of tile t
+    const float* codebook(size_t t) const
+    {
+        return reinterpret_cast<const float*>(_file.data() + _header.codebooks_offset) + t * _header.num_centroids * _geometry.tile_floats();
+    }
+
+    // uint8[num_tiles] of record index, the codes of consecutive records follow
+    const unsigned char* codes(size_t index) const
+    {
+        return reinterpret_cast<const unsigned char*>(_file.data() + _header.codes_offset + index * _geometry.num_tiles());
+    }
+
+    // index of the record in the filelist
+    int64_t id(size_t index) const
+    {
+        int64_t v;
+        std::memcpy(&v, _file.data() + _header.ids_offset + index * sizeof(int64_t), sizeof(v));
+        return v;
+    }
+
+    private:
+
+    mapped_file    _file;
+    gist_pq_header _header;
+    gist_geometry  _geometry;
+};
+
+// Fills tables, float[num_tiles][num_centroids], with the L1 distances of
+// the centroids to the tiles of the (packed) query times tile_weights[t].
+inline void gist_pq_tables(const gist_pq& pq, const float* query, const float* tile_weights, float* tables)
+{
+    const gist_geometry& g = pq.geometry();
+    const size_t tile_floats = g.tile_floats();
+    const size_t k = pq.num_centroids();
+
+    std::vector<float> weights(tile_floats);
+    for (size_t t = 0; t < g.num_tiles(); t++)
+    {
+        std::fill(weights.begin(), weights.end(), tile_weights[t]);
+        gist_weighted_l1(query + t * tile_floats, &weights[0], pq.codebook(t), tile_floats, tile_floats, k, tables + t * k);
+    }
+}
+
+// out[j] = sum_t tables[t][codes[j*num_tiles + t]] for j < count
+inline void gist_pq_scan(const float* tables, size_t num_tiles, size_t num_centroids,
+                         const unsigned char* codes, size_t count, float* out)
+{
+    for (size_t j = 0; j < count; j++, codes += num_tiles)
+    {
+        float s = 0;
+        const float* table = tables;
+        for (size_t t = 0; t < num_tiles; t++, table += num_centroids) s += table[codes[t]];
+        out[j] = s;
+    }
+}
+
+} // namespace imdb
+
+#endif // DESCRIPTORS__GIST_PQ_HPP
@@ -0,0 +1,251 @@
+#ifndef DESCRIPTORS__GIST_QUANTIZER_HPP
+#define DESCRIPTORS__GIST_QUANTIZER_HPP
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <cstring>
+#include <cmath>
+#include <stdexcept>
+
+#include <stdint.h>
+
+#include "gist_db.hpp"
+
+// ----------------------------------------------------------------------------
+// Scalar quantization of a gist db.
+//
+// uint8:   every value of a record is mapped affinely onto [0, 255] using
+//          the minimum and maximum of that value over the whole db. The
+//          weighted L1 distance of two code vectors, with the weights
+//          multiplied by the quantizer scales, approximates the float
+//          distance, see gist_quantize_query.
+// float16: every value is stored as IEEE 754 half float.
+//
+// Both are meant to find a shortlist that is re-ranked with the exact
+// float descriptors.
+// ----------------------------------------------------------------------------
+
+namespace imdb {
+
+// IEEE 754 float -> half, rounding to nearest even
+inline uint16_t float_to_half(float value)
+{
+    uint32_t f;
+    std::memcpy(&f, &value, sizeof(f));
+
+    const uint32_t sign = (f >> 16) & 0x8000;
+    const uint32_t exponent = (f >> 23) & 0xff;
+    uint32_t mantissa = f & 0x7fffff;
+
+    if (exponent == 0xff) return static_cast<uint16_t>(sign | 0x7c00 | (mantissa ? 0x200 : 0));
+
+    const int e = static_cast<int>(exponent) - 127 + 15;
+    if (e >= 31) return static_cast<uint16_t>(sign | 0x7c00);
+
+    uint32_t h;
+    uint32_t rest;
+    uint32_t half_way;
+    if (e <= 0)
+    {
+        // subnormal half
+        if (e < -10) return static_cast<uint16_t>(sign);
+        mantissa |= 0x800000;
+        const uint32_t shift = 14 - e;
+        h = mantissa >> shift;
+        rest = mantissa & ((1u << shift) - 1);
+        half_way = 1u << (shift - 1);
+    }
+    else
+    {
+        h = (static_cast<uint32_t>(e) << 10) | (mantissa >> 13);
+        rest = mantissa & 0x1fff;
+        half_way = 0x1000;
+    }
+
+    // a carry out of the mantissa correctly increments the exponent
+    if (rest > half_way || (rest == half_way && (h & 1))) h++;
+    return static_cast<uint16_t>(sign | h);
+}
+
+inline float half_to_float(uint16_t value)
+{
+    const uint32_t sign = static_cast<uint32_t>(value & 0x8000) << 16;
+    uint32_t exponent = (value >> 10) & 0x1f;
+    uint32_t mantissa = value & 0x3ff;
+
+    uint32_t f;
+    if (exponent == 0x1f)
+    {
+        f = sign | 0x7f800000 | (mantissa << 13);
+    }
+    else if (exponent == 0)
+    {
+        if (mantissa == 0)
+        {
+            f = sign;
+        }
+        else
+        {
+            // subnormal half, normalize it
+            exponent = 1;
+            while (!(mantissa & 0x400))
+            {
+                mantissa <<= 1;
+                exponent--;
+            }
+            f = sign | ((exponent + 112) << 23) | ((mantissa & 0x3ff) << 13);
+        }
+    }
+    else
+    {
+        f = sign | ((exponent + 112) << 23) | (mantissa << 13);
+    }
+
+    float result;
+    std::memcpy(&result, &f, sizeof(result));
+    return result;
+}
+
+// decodes n half floats (as stored in a float16 gist db)
+inline void gist_decode_half(const unsigned char* codes, size_t n, float* values)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        uint16_t h;
+        std::memcpy(&h, codes + i * sizeof(h), sizeof(h));
+        values[i] = half_to_float(h);
+    }
+}
+
+// Writes a quantized copy of a float32, record-major gist db.
+inline void gist_db_write_quantized(const gist_db& db, const std::string& filename, gist_db_encoding encoding)
+{
+    if (db.encoding() != gist_db_float32 || db.layout() != gist_db_record_major)
+    {
+        throw std::runtime_error("only float, record-major gist dbs can be quantized");
+    }
+    if (encoding != gist_db_uint8 && encoding != gist_db_float16)
+    {
+        throw std::runtime_error("unsupported gist db encoding");
+    }
+
+    const gist_geometry& g = db.geometry();
+    const size_t num_records = db.size();
+    const size_t dim = g.record_floats();
+
+    // (offset, scale) of each value, from its range over the db
+    std::vector<float> quantizer;
+    if (encoding == gist_db_uint8)
+    {
+        std::vector<float> lo(dim, 0.0f);
+        std::vector<float> hi(dim, 0.0f);
+        for (size_t i = 0; i < num_records; i++)
+        {
+            const float* r = db.record(i);
+            for (size_t k = 0; k < dim; k++)
+            {
+                if (i == 0 || r[k] < lo[k]) lo[k] = r[k];
+                if (i == 0 || r[k] > hi[k]) hi[k] = r[k];
+            }
+        }
+
+        quantizer.resize(2 * dim);
+        for (size_t k = 0; k < dim; k++)
+        {
+            quantizer[2 * k]     = lo[k];
+            quantizer[2 * k + 1] = (hi[k] - lo[k]) / 255.0f;
+        }
+    }
+
+    gist_db_header header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, gist_db_magic, sizeof(header.magic));
+    header.version          = gist_db_version;
+    header.layout           = gist_db_record_major;
+    header.encoding         = encoding;
+    header.num_x_tiles      = g.num_x_tiles;
+    header.num_y_tiles      = g.num_y_tiles;
+    header.num_freqs        = g.num_freqs;
+    header.num_orients      = g.num_orients;
+    header.num_records      = num_records;
+    header.record_stride    = dim * gist_db_value_size(encoding);
+    header.quantizer_offset = gist_db_alignment;
+    header.records_offset   = gist_db_align(header.quantizer_offset + quantizer.size() * sizeof(float));
+    header.ids_offset       = header.records_offset + num_records * header.record_stride;
+
+    std::ofstream ofs(filename.c_str(), std::ofstream::binary | std::ofstream::trunc);
+    if (!ofs.is_open()) throw std::runtime_error("could not open file " + filename);
+
+    std::vector<char> pad(static_cast<size_t>(header.records_offset), 0);
+    std::memcpy(&pad[0], &header, sizeof(header));
+    if (!quantizer.empty()) std::memcpy(&pad[header.quantizer_offset], &quantizer[0], quantizer.size() * sizeof(float));
+    ofs.write(&pad[0], pad.size());
+
+    std::vector<unsigned char> codes(static_cast<size_t>(header.record_stride));
+    for (size_t i = 0; i < num_records; i++)
+    {
+        const float* r = db.record(i);
+        for (size_t k = 0; k < dim; k++)
+        {
+            if (encoding == gist_db_uint8)
+            {
+                const float scale = quantizer[2 * k + 1];
+                const float c = scale > 0 ? std::floor((r[k] - quantizer[2 * k]) / scale + 0.5f) : 0.0f;
+                codes[k] = static_cast<unsigned char>(c < 0 ? 0 : (c > 255 ? 255 : c));
+            }
+            else
+            {
+                const uint16_t h = float_to_half(r[k]);
+                std::memcpy(&codes[k * sizeof(h)], &h, sizeof(h));
+            }
+        }
+        ofs.write(reinterpret_cast<const char*>(&codes[0]), codes.size());
+    }
+
+    for (size_t i = 0; i < num_records; i++)
+    {
+        int64_t id = db.id(i);
+        ofs.write(reinterpret_cast<const char*>(&id), sizeof(id));
+    }
+
+    if (!ofs.good()) throw std::runtime_error("error while writing gist db");
+}
+
+// Prepares a query (packed record and one weight per value) for the
+// integer scan of a uint8 gist db:
+//
+//   sum_k weights[k] * |query[k] - value[k]|
+//     ~ sum_k weights[k] * scale[k] * |query_code[k] - code[k]|
+//     = gist_weighted_l1_u8(query_codes, code_weights, ...) / factor
+//
+// The weights are scaled to at most 16383 so that the 32 bit sums of the
+// integer kernel cannot overflow. Returns factor.
+inline float gist_quantize_query(const gist_db& db, const float* query, const float* weights,
+                                 unsigned char* query_codes, int16_t* code_weights)
+{
+    const size_t dim = db.geometry().record_floats();
+    const float* quantizer = db.quantizer();
+
+    float max_weight = 0;
+    for (size_t k = 0; k < dim; k++)
+    {
+        const float w = weights[k] * quantizer[2 * k + 1];
+        if (w > max_weight) max_weight = w;
+    }
+    const float factor = max_weight > 0 ? 16383.0f / max_weight : 1.0f;
+
+    for (size_t k = 0; k < dim; k++)
+    {
+        const float scale = quantizer[2 * k + 1];
+        const float c = scale > 0 ? std::floor((query[k] - quantizer[2 * k]) / scale + 0.5f) : 0.0f;
+        query_codes[k] = static_cast<unsigned char>(c < 0 ? 0 : (c > 255 ? 255 : c));
+        code_weights[k] = static_cast<int16_t>(std::floor(weights[k] * scale * factor + 0.5f));
+    }
+
+    return factor;
+}
+
+} // namespace imdb
+
+#endif // DESCRIPTORS__GIST_QUANTIZER_HPP
@@ -0,0 +1,311 @@
+#ifndef DESCRIPTORS__GIST_TILE_DISTANCES_HPP
+#define DESCRIPTORS__GIST_TILE_DISTANCES_HPP
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#include <stdint.h>
+
+#include "../top_k.hpp"
+#include "../worker_threads.hpp"
+#include "gist_db.hpp"
+#include "gist_distance.hpp"
+#include "gist_quantizer.hpp"
+
+// ----------------------------------------------------------------------------
+// Per-tile L1 distances of one query to every record of a float gist db.
+//
+// The weighted distance of the scan is a sum of per-tile L1 distances,
+//
+//   d(q, r) = sum_t w[t] * d_t(q, r),
+//
+// and only the weights w depend on the mask, not the gist of the input.
+// Keeping d_t(q, r) of every record (16 values, float or half float) lets
+// a changed mask, or another hole in the same image, be ranked with one
+// 16-wide dot product per record, in memory, instead of another scan of
+// the db.
+//
+// The table can be saved and loaded again, so a later run with the same
+// input and another mask starts from it. It keeps gist_db::identity of the
+// db it was computed from and only matches that db. File layout:
+//
+//   header       gist_tile_distances_header, padded to gist_db_alignment bytes
+//   query        float[record_floats], the packed record the table is for
+//   distances    float or half[num_records][num_tiles]
+// ----------------------------------------------------------------------------
+
+namespace imdb {
+
+static const char     gist_tile_distances_magic[8] = { 'G', 'I', 'S', 'T', 'T', 'D', 'C', '\0' };
+static const uint32_t gist_tile_distances_version  = 2;
+
+struct gist_tile_distances_header
+{
+    char          magic[8];
+    uint32_t      version;
+    uint32_t      encoding;         // gist_db_float32 or gist_db_float16
+    uint32_t      num_x_tiles;
+    uint32_t      num_y_tiles;
+    uint32_t      num_freqs;
+    uint32_t      num_orients;
+    uint64_t      num_records;
+    uint64_t      query_offset;
+    uint64_t      distances_offset;
+    uint64_t      db_identity;      // gist_db::identity, 0 in version 1
+};
+
+namespace detail {
+
+// records scored per call of the distance kernel
+static const size_t tile_distances_block = 256;
+
+struct tile_distances_compute;
+struct tile_distances_rank;
+
+} // namespace detail
+
+class gist_tile_distances
+{
+    public:
+
+    gist_tile_distances() : _encoding(gist_db_float32), _num_records(0), _db_identity(0) {}
+
+    bool empty() const { return _num_records == 0; }
+
+    size_t size() const { return _num_records; }
+
+    const gist_geometry& geometry() const { return _geometry; }
+
+    gist_db_encoding encoding() const { return _encoding; }
+
+    // bytes of the table
+    size_t bytes() const { return _floats.size() * sizeof(float) + _halves.size() * sizeof(uint16_t); }
+
+    // true if the table was computed from this db for this packed record
+    bool matches(const gist_db& db, const float* query) const
+    {
+        return !empty() && db.geometry() == _geometry && db.size() == _num_records && db.identity() == _db_identity
+            && std::memcmp(&_query[0], query, _query.size() * sizeof(float)) == 0;
+    }
+
+    // Computes the table of a packed record for all records of a float gist
+    // db (either layout), encoding is gist_db_float32 or gist_db_float16.
+    inline void compute(const gist_db& db, const float* query, gist_db_encoding encoding, size_t num_threads);
+
+    // The k records of least weighted distance, nearest first, with one
+    // non-negative weight per tile.
+    inline std::vector<std::pair<float, size_t> > rank(const float* tile_weights, size_t k, size_t num_threads) const;
+
+    // sum_t tile_weights[t] * d_t(query, record index)
+    float distance(size_t index, const float* tile_weights) const
+    {
+        const size_t n = _geometry.num_tiles();
+        float s = 0;
+        if (_encoding == gist_db_float16)
+        {
+            const uint16_t* d = &_halves[index * n];
+            for (size_t t = 0; t < n; t++) s += tile_weights[t] * half_to_float(d[t]);
+        }
+        else
+        {
+            const float* d = &_floats[index * n];
+            for (size_t t = 0; t < n; t++) s += tile_weights[t] * d[t];
+        }
+        return s;
+    }
+
+    void save(const std::string& filename) const
+    {
+        gist_tile_distances_header header;
+        std::memset(&header, 0, sizeof(header));
+        std::memcpy(header.magic, gist_tile_distances_magic, sizeof(header.magic));
+        header.version          = gist_tile_distances_version;
+        header.encoding         = _encoding;
+        header.num_x_tiles      = _geometry.num_x_tiles;
+        header.num_y_tiles      = _geometry.num_y_tiles;
+        header.num_freqs        = _geometry.num_freqs;
+        header.num_orients      = _geometry.num_orients;
+        header.num_records      = _num_records;
+        header.query_offset     = gist_db_alignment;
+        header.distances_offset = gist_db_align(header.query_offset + _query.size() * sizeof(float));
+        header.db_identity      = _db_identity;
+
+        std::ofstream ofs(filename.c_str(), std::ofstream::binary | std::ofstream::trunc);
+        if (!ofs.is_open()) throw std::runtime_error("could not open file " + filename);
+
+        std::vector<char> pad(static_cast<size_t>(gist_db_alignment), 0);
+        std::memcpy(&pad[0], &header, sizeof(header));
+        ofs.write(&pad[0], pad.size());
+        std::memset(&pad[0], 0, sizeof(header));
+
+        ofs.write(reinterpret_cast<const char*>(&_query[0]), _query.size() * sizeof(float));
+        ofs.write(&pad[0], header.distances_offset - header.query_offset - _query.size() * sizeof(float));
+
+        if (!_floats.empty()) ofs.write(reinterpret_cast<const char*>(&_floats[0]), _floats.size() * sizeof(float));
+        if (!_halves.empty()) ofs.write(reinterpret_cast<const char*>(&_halves[0]), _halves.size() * sizeof(uint16_t));
+
+        if (!ofs.good()) throw std::runtime_error("error while writing tile distances " + filename);
+    }
+
+    void load(const std::string& filename)
+    {
+        std::ifstream ifs(filename.c_str(), std::ifstream::binary);
+        if (!ifs.is_open()) throw std::runtime_error("could not open file " + filename);
+
+        gist_tile_distances_header header;
+        if (!ifs.read(reinterpret_cast<char*>(&header), sizeof(header))
+         || std::memcmp(header.magic, gist_tile_distances_magic, sizeof(gist_tile_distances_magic)) != 0)
+        {
+            throw std::runtime_error("not a tile distances file: " + filename);
+        }
+        if (header.version > gist_tile_distances_version) throw std::runtime_error("version of file " + filename + " is higher than program version");
+        if (header.encoding != gist_db_float32 && header.encoding != gist_db_float16) throw std::runtime_error("tile distances file is corrupt: " + filename);
+
+        _geometry = gist_geometry(header.num_x_tiles, header.num_y_tiles, header.num_freqs, header.num_orients);
+        _encoding = static_cast<gist_db_encoding>(header.encoding);
+        _num_records = static_cast<size_t>(header.num_records);
+        _db_identity = header.db_identity;
+
+        _query.resize(_geometry.record_floats());
+        ifs.seekg(header.query_offset);
+        ifs.read(reinterpret_cast<char*>(&_query[0]), _query.size() * sizeof(float));
+
+        ifs.seekg(header.distances_offset);
+        _floats.clear();
+        _halves.clear();
+        if (_encoding == gist_db_float16)
+        {
+            _halves.resize(_num_records * _geometry.num_tiles());
+            if (!_halves.empty()) ifs.read(reinterpret_cast<char*>(&_halves[0]), _halves.size() * sizeof(uint16_t));
+        }
+        else
+        {
+            _floats.resize(_num_records * _geometry.num_tiles());
+            if (!_floats.empty()) ifs.read(reinterpret_cast<char*>(&_floats[0]), _floats.size() * sizeof(float));
+        }
+
+        if (!ifs.good())
+        {
+            _num_records = 0;
+            throw std::runtime_error("tile distances file is truncated: " + filename);
+        }
+    }
+
+    private:
+
+    friend struct detail::tile_distances_compute;
+    friend struct detail::tile_distances_rank;
+
+    gist_geometry         _geometry;
+    gist_db_encoding      _encoding;
+    size_t                _num_records;
+    uint64_t              _db_identity;
+    std::vector<float>    _query;
+    std::vector<float>    _floats;   // [num_records][num_tiles], float32
+    std::vector<uint16_t> _halves;   // [num_records][num_tiles], float16
+};
+
+namespace detail {
+
+// one contiguous shard of the db per worker thread
+struct tile_distances_compute
+{
+    const gist_db* db;
+    const float* query;
+    gist_tile_distances* table;
+    size_t num_shards;
+
+    void operator()(size_t shard)
+    {
+        const gist_geometry& g = db->geometry();
+        const size_t n = g.tile_floats();
+        const size_t num_tiles = g.num_tiles();
+        const bool tile_major = db->layout() == gist_db_tile_major;
+        const size_t stride = (tile_major ? db->tile_stride() : db->stride()) / sizeof(float);
+
+        const size_t begin = db->size() * shard / num_shards;
+        const size_t end = db->size() * (shard + 1) / num_shards;
+
+        const std::vector<float> ones(n, 1.0f);
+        float distances[tile_distances_block];
+        for (size_t first = begin; first < end; first += tile_distances_block)
+        {
+            const size_t count = std::min(tile_distances_block, end - first);
+            for (size_t t = 0; t < num_tiles; t++)
+            {
+                const float* records = tile_major ? db->tile(t, first) : db->record(first) + t * n;
+                gist_weighted_l1(query + t * n, &ones[0], records, stride, n, count, distances);
+
+                if (table->_encoding == gist_db_float16)
+                {
+                    for (size_t j = 0; j < count; j++) table->_halves[(first + j) * num_tiles + t] = float_to_half(distances[j]);
+                }
+                else
+                {
+                    for (size_t j = 0; j < count; j++) table->_floats[(first + j) * num_tiles + t] = distances[j];
+                }
+            }
+        }
+    }
+};
+
+struct tile_distances_rank
+{
+    const gist_tile_distances* table;
+    const float* tile_weights;
+    std::vector<top_k<float, size_t> > results;
+
+    tile_distances_rank(const gist_tile_distances* t, const float* w, size_t num_shards, size_t k)
+        : table(t), tile_weights(w), results(num_shards, top_k<float, size_t>(k))
+    {}
+
+    void operator()(size_t shard)
+    {
+        const size_t begin = table->size() * shard / results.size();
+        const size_t end = table->size() * (shard + 1) / results.size();
+        for (size_t i = begin; i < end; i++) results[shard].push(table->distance(i, tile_weights), i);
+    }
+};
+
+} // namespace detail
+
+inline void gist_tile_distances::compute(const gist_db& db, const float* query, gist_db_encoding encoding, size_t num_threads)
+{
+    if (db.encoding() != gist_db_float32) throw std::runtime_error("tile distances need a float gist db");
+    if (encoding != gist_db_float32 && encoding != gist_db_float16) throw std::runtime_error("tile distances are stored as float or half float");
+
+    _geometry = db.geometry();
+    _encoding = encoding;
+    _num_records = 0;
+    _db_identity = db.identity();
+    _query.assign(query, query + _geometry.record_floats());
+    _floats.clear();
+    _halves.clear();
+    if (encoding == gist_db_float16) _halves.resize(db.size() * _geometry.num_tiles());
+    else _floats.resize(db.size() * _geometry.num_tiles());
+
+    num_threads = std::max<size_t>(1, std::min(num_threads, db.size() / detail::tile_distances_block));
+    detail::tile_distances_compute task = { &db, &_query[0], this, num_threads };
+    run_worker_threads(num_threads, task);
+
+    _num_records = db.size();
+}
+
+inline std::vector<std::pair<float, size_t> > gist_tile_distances::rank(const float* tile_weights, size_t k, size_t num_threads) const
+{
+    num_threads = std::max<size_t>(1, std::min(num_threads, _num_records / detail::tile_distances_block));
+    detail::tile_distances_rank task(this, tile_weights, num_threads, k);
+    run_worker_threads(num_threads, task);
+
+    top_k<float, size_t> best(k);
+    for (size_t i = 0; i < task.results.size(); i++) best.merge(task.results[i]);
+    return best.sorted();
+}
+
+} // namespace imdb
+
+#endif // DESCRIPTORS__GIST_TILE_DISTANCES_HPP
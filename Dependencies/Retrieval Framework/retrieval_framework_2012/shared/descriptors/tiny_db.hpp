@@ -0,0 +1,230 @@
+#ifndef DESCRIPTORS__TINY_DB_HPP
+#define DESCRIPTORS__TINY_DB_HPP
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <cstring>
+#include <cmath>
+#include <stdexcept>
+
+#include <stdint.h>
+
+#include "../mapped_file.hpp"
+#include "gist_db.hpp"
+
+// ----------------------------------------------------------------------------
+// Packed store for tiny images, the cheap first stage of a cascade search.
+//
+// The tinylab generator writes a width x height thumbnail per image as
+// floats in [0, 1], row-major with interleaved channels. Note that it
+// copies the scaled BGR image, whatever the colorspace parameter says, so
+// a query has to be computed the same way (see tiny_from_thumbnail).
+//
+// A tiny db stores these thumbnails box-filtered down to a smaller size and
+// quantized to one byte per channel:
+//
+//   header     tiny_db_header, padded to gist_db_alignment bytes
+//   records    num_records * record_stride bytes, uint8[height][width][channels]
+//   ids        num_records * int64, index of the record in the filelist
+// ----------------------------------------------------------------------------
+
+namespace imdb {
+
+static const char     tiny_db_magic[8] = { 'T', 'I', 'N', 'Y', 'D', 'B', '\0', '\0' };
+static const uint32_t tiny_db_version  = 1;
+
+struct tiny_db_header
+{
+    char          magic[8];
+    uint32_t      version;
+    uint32_t      width;
+    uint32_t      height;
+    uint32_t      channels;
+    uint32_t      thumbnail_width;  // size of the tinylab thumbnails the records were made of
+    uint32_t      thumbnail_height;
+    uint64_t      num_records;
+    uint64_t      record_stride;
+    uint64_t      records_offset;
+    uint64_t      ids_offset;
+};
+
+// Box-filters a thumbnail of floats in [0, 1] (width x height x channels,
+// both dimensions multiples of the result's) down to size x size and
+// quantizes it to bytes.
+inline void tiny_from_thumbnail(const float* thumbnail, size_t width, size_t height, size_t channels,
+                                size_t size, unsigned char* tiny)
+{
+    const size_t fx = width / size;
+    const size_t fy = height / size;
+
+    for (size_t y = 0; y < size; y++)
+    for (size_t x = 0; x < size; x++)
+    for (size_t c = 0; c < channels; c++)
+    {
+        float s = 0;
+        for (size_t v = 0; v < fy; v++)
+        for (size_t u = 0; u < fx; u++)
+        {
+            s += thumbnail[((y * fy + v) * width + x * fx + u) * channels + c];
+        }
+
+        const float q = std::floor(s / (fx * fy) * 255.0f + 0.5f);
+        tiny[(y * size + x) * channels + c] = static_cast<unsigned char>(q < 0 ? 0 : (q > 255 ? 255 : q));
+    }
+}
+
+class tiny_db_writer
+{
+    public:
+
+    tiny_db_writer(const std::string& filename, size_t thumbnail_width, size_t thumbnail_height, size_t size, size_t channels)
+        : _ofs(filename.c_str(), std::ofstream::binary | std::ofstream::trunc)
+        , _thumbnail_width(thumbnail_width)
+        , _thumbnail_height(thumbnail_height)
+        , _size(size)
+        , _channels(channels)
+        , _record(size * size * channels)
+    {
+        if (!_ofs.is_open()) throw std::runtime_error("could not open file " + filename);
+
+        std::vector<char> pad(static_cast<size_t>(gist_db_alignment), 0);
+        _ofs.write(&pad[0], pad.size());
+    }
+
+    // Closes the file if close() was not called. A write error cannot be
+    // thrown from here and is lost, call close() to see it.
+    ~tiny_db_writer()
+    {
+        try
+        {
+            if (_ofs.is_open()) close();
+        }
+        catch (const std::exception&)
+        {
+        }
+    }
+
+    // thumbnail as written by the tinylab generator, id is the index in the filelist
+    void push_back(const float* thumbnail, int64_t id)
+    {
+        tiny_from_thumbnail(thumbnail, _thumbnail_width, _thumbnail_height, _channels, _size, &_record[0]);
+        _ofs.write(reinterpret_cast<const char*>(&_record[0]), _record.size());
+        _ids.push_back(id);
+    }
+
+    size_t size() const { return _ids.size(); }
+
+    // writes the header and closes the file, throws on a write error
+    void close()
+    {
+        tiny_db_header header;
+        std::memset(&header, 0, sizeof(header));
+        std::memcpy(header.magic, tiny_db_magic, sizeof(header.magic));
+        header.version          = tiny_db_version;
+        header.width            = static_cast<uint32_t>(_size);
+        header.height           = static_cast<uint32_t>(_size);
+        header.channels         = static_cast<uint32_t>(_channels);
+        header.thumbnail_width  = static_cast<uint32_t>(_thumbnail_width);
+        header.thumbnail_height = static_cast<uint32_t>(_thumbnail_height);
+        header.num_records      = _ids.size();
+        header.record_stride    = _record.size();
+        header.records_offset   = gist_db_alignment;
+        header.ids_offset       = static_cast<uint64_t>(_ofs.tellp());
+
+        if (!_ids.empty()) _ofs.write(reinterpret_cast<const char*>(&_ids[0]), _ids.size() * sizeof(int64_t));
+
+        _ofs.seekp(0);
+        _ofs.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+        if (!_ofs.good()) throw std::runtime_error("error while writing tiny db");
+        _ofs.close();
+    }
+
+    private:
+
+    std::ofstream              _ofs;
+    size_t                     _thumbnail_width;
+    size_t                     _thumbnail_height;
+    size_t                     _size;
+    size_t                     _channels;
+    std::vector<unsigned char> _record;
+    std::vector<int64_t>       _ids;
+};
+
+class tiny_db
+{
+    public:
+
+    tiny_db() { std::memset(&_header, 0, sizeof(_header)); }
+
+    explicit tiny_db(const std::string& filename)
+    {
+        open(filename);
+    }
+
+    void open(const std::string& filename)
+    {
+        _file.open(filename);
+
+        if (_file.size() < sizeof(tiny_db_header)) throw std::runtime_error("not a tiny db: " + filename);
+        std::memcpy(&_header, _file.data(), sizeof(_header));
+
+        if (std::memcmp(_header.magic, tiny_db_magic, sizeof(tiny_db_magic)) != 0) throw std::runtime_error("not a tiny db: " + filename);
+        if (_header.version > tiny_db_version) throw std::runtime_error("version of file " + filename + " is higher than program version");
+
+        if (_header.record_stride < record_size()
+         || _header.width == 0 || _header.height == 0
+         || _header.thumbnail_width % _header.width != 0 || _header.thumbnail_height % _header.height != 0
+         || _header.records_offset + _header.num_records * _header.record_stride > _header.ids_offset
+         || _header.ids_offset + _header.num_records * sizeof(int64_t) > _file.size())
+        {
+            throw std::runtime_error("tiny db is truncated or corrupt: " + filename);
+        }
+    }
+
+    bool is_open() const { return _file.is_open(); }
+
+    size_t size() const { return static_cast<size_t>(_header.num_records); }
+
+    size_t width() const { return _header.width; }
+    size_t height() const { return _header.height; }
+    size_t channels() const { return _header.channels; }
+    size_t thumbnail_width() const { return _header.thumbnail_width; }
+    size_t thumbnail_height() const { return _header.thumbnail_height; }
+
+    // bytes of one record
+    size_t record_size() const { return static_cast<size_t>(_header.width * _header.height * _header.channels); }
+
+    // bytes between two consecutive records
+    size_t stride() const { return static_cast<size_t>(_header.record_stride); }
+
+    const unsigned char* record(size_t index) const
+    {
+        return reinterpret_cast<const unsigned char*>(_file.data() + _header.records_offset + index * _header.record_stride);
+    }
+
+    // index of the record in the filelist
+    int64_t id(size_t index) const
+    {
+        int64_t v;
+        std::memcpy(&v, _file.data() + _header.ids_offset + index * sizeof(int64_t), sizeof(v));
+        return v;
+    }
+
+    private:
+
+    mapped_file    _file;
+    tiny_db_header _header;
+};
+
+// largest weight for which weighted_l2_u8 cannot overflow over dim values
+inline int16_t tiny_max_weight(size_t dim)
+{
+    const double w = 2147483647.0 / (double(dim) * 255.0 * 255.0);
+    return static_cast<int16_t>(w > 127 ? 127 : (w < 1 ? 1 : w));
+}
+
+} // namespace imdb
+
+#endif // DESCRIPTORS__TINY_DB_HPP
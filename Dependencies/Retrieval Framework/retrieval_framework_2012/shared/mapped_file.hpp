@@ -0,0 +1,152 @@
+#ifndef MAPPED_FILE_HPP
+#define MAPPED_FILE_HPP
+
+#include <string>
+#include <stdexcept>
+
+#include <stdint.h>
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// ----------------------------------------------------------------------------
+// Read-only memory mapping of a whole file.
+//
+// This header deliberately does not depend on boost so that it can be
+// included from the scene completion project (PDCI) as well, which only
+// links against OpenCV.
+// ----------------------------------------------------------------------------
+
+namespace imdb {
+
+class mapped_file
+{
+    public:
+
+    mapped_file()
+        : _data(0)
+        , _size(0)
+#ifdef _WIN32
+        , _file(INVALID_HANDLE_VALUE)
+        , _mapping(0)
+#endif
+    {}
+
+    explicit mapped_file(const std::string& filename)
+        : _data(0)
+        , _size(0)
+#ifdef _WIN32
+        , _file(INVALID_HANDLE_VALUE)
+        , _mapping(0)
+#endif
+    {
+        open(filename);
+    }
+
+    ~mapped_file()
+    {
+        close();
+    }
+
+    void open(const std::string& filename)
+    {
+        close();
+
+#ifdef _WIN32
+        _file = ::CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, 0);
+        if (_file == INVALID_HANDLE_VALUE) throw std::runtime_error("could not open file " + filename);
+
+        LARGE_INTEGER size;
+        if (!::GetFileSizeEx(_file, &size)) { close(); throw std::runtime_error("could not stat file " + filename); }
+        _size = static_cast<uint64_t>(size.QuadPart);
+
+        if (_size == 0) return;
+
+        _mapping = ::CreateFileMappingA(_file, 0, PAGE_READONLY, 0, 0, 0);
+        if (_mapping == 0) { close(); throw std::runtime_error("could not map file " + filename); }
+
+        _data = static_cast<const char*>(::MapViewOfFile(_mapping, FILE_MAP_READ, 0, 0, 0));
+        if (_data == 0) { close(); throw std::runtime_error("could not map file " + filename); }
+#else
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0) throw std::runtime_error("could not open file " + filename);
+
+        struct stat st;
+        if (::fstat(fd, &st) != 0) { ::close(fd); throw std::runtime_error("could not stat file " + filename); }
+        _size = static_cast<uint64_t>(st.st_size);
+
+        if (_size == 0) { ::close(fd); return; }
+
+        void* p = ::mmap(0, _size, PROT_READ, MAP_SHARED, fd, 0);
+
+        // the mapping keeps its own reference to the file
+        ::close(fd);
+
+        if (p == MAP_FAILED) { _size = 0; throw std::runtime_error("could not map file " + filename); }
+        _data = static_cast<const char*>(p);
+#endif
+    }
+
+    void close()
+    {
+#ifdef _WIN32
+        if (_data) ::UnmapViewOfFile(_data);
+        if (_mapping) ::CloseHandle(_mapping);
+        if (_file != INVALID_HANDLE_VALUE) ::CloseHandle(_file);
+        _mapping = 0;
+        _file = INVALID_HANDLE_VALUE;
+#else
+        if (_data) ::munmap(const_cast<char*>(_data), _size);
+#endif
+        _data = 0;
+        _size = 0;
+    }
+
+    bool is_open() const { return _data != 0; }
+
+    // touches every page, so that a process that keeps the file mapped
+    // (gistserver) does not pay for page faults in its first scans
+    void prefault() const
+    {
+#ifndef _WIN32
+        if (_data) ::madvise(const_cast<char*>(_data), _size, MADV_WILLNEED);
+#endif
+        volatile char touched = 0;
+        for (uint64_t i = 0; i < _size; i += 4096) touched = _data[i];
+        (void)touched;
+    }
+
+    const char* data() const { return _data; }
+
+    uint64_t size() const { return _size; }
+
+    private:
+
+    // not copyable, the mapping is owned
+    mapped_file(const mapped_file&);
+    mapped_file& operator=(const mapped_file&);
+
+    const char* _data;
+    uint64_t    _size;
+
+#ifdef _WIN32
+    HANDLE _file;
+    HANDLE _mapping;
+#endif
+};
+
+} // namespace imdb
+
+#endif // MAPPED_FILE_HPP
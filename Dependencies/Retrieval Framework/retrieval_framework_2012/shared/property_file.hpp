@@ -0,0 +1,145 @@
+#ifndef PROPERTY_FILE_HPP
+#define PROPERTY_FILE_HPP
+
+#include <string>
+#include <vector>
+#include <map>
+#include <cstring>
+#include <cstdlib>
+#include <stdexcept>
+
+#include <stdint.h>
+
+#include "mapped_file.hpp"
+
+// ----------------------------------------------------------------------------
+// Random access to files written by PropertyT<T>::writer without going
+// through boost and std::ifstream.
+//
+// The file is mapped into memory and the footer (offset table and map) is
+// parsed once. Elements are handed out as pointers into the mapping, so
+// looking up e.g. a few filenames out of a list of millions only touches
+// the pages that hold them.
+//
+// Supported element types are the ones we actually store:
+//   std::string  -> int32 length + characters
+//   vec_f32_t    -> int64 length + floats
+// ----------------------------------------------------------------------------
+
+namespace imdb {
+
+class property_file
+{
+    public:
+
+    property_file() : _features(0) {}
+
+    explicit property_file(const std::string& filename) : _features(0)
+    {
+        open(filename);
+    }
+
+    void open(const std::string& filename)
+    {
+        _file.open(filename);
+        _offsets.clear();
+        _map.clear();
+
+        if (_file.size() < sizeof(int64_t)) throw std::runtime_error("error while reading file " + filename);
+
+        const char* end = _file.data() + _file.size();
+
+        int64_t p_map = read<int64_t>(end - sizeof(int64_t));
+        if (p_map < 0 || static_cast<uint64_t>(p_map) >= _file.size()) throw std::runtime_error("error while reading map in file " + filename);
+
+        const char* p = _file.data() + p_map;
+        int64_t num_entries = read<int64_t>(p); p += sizeof(int64_t);
+        for (int64_t i = 0; i < num_entries; i++)
+        {
+            std::string key = read_string(p, end);
+            std::string value = read_string(p, end);
+            _map[key] = value;
+        }
+
+        if (!_map.count("__features") || !_map.count("__offsets") || !_map.count("__version"))
+        {
+            throw std::runtime_error("error while reading map in file " + filename);
+        }
+
+        _features = to_int64(_map["__features"]);
+        int64_t p_offsets = to_int64(_map["__offsets"]);
+
+        p = _file.data() + p_offsets;
+        int64_t num_offsets = read<int64_t>(p); p += sizeof(int64_t);
+        if (p + num_offsets * sizeof(int64_t) > end) throw std::runtime_error("error while reading offsets in file " + filename);
+
+        _offsets.resize(static_cast<size_t>(num_offsets));
+        if (num_offsets > 0) std::memcpy(&_offsets[0], p, static_cast<size_t>(num_offsets) * sizeof(int64_t));
+    }
+
+    bool is_open() const { return _file.is_open(); }
+
+    size_t size() const { return _offsets.size(); }
+
+    const std::map<std::string, std::string>& map() const { return _map; }
+
+    // pointer to the serialized element with the given index
+    const char* element(size_t index) const
+    {
+        return _file.data() + _features + _offsets[index];
+    }
+
+    std::string string_at(size_t index) const
+    {
+        const char* p = element(index);
+        int32_t length = read<int32_t>(p);
+        return std::string(p + sizeof(int32_t), length);
+    }
+
+    // returns a pointer to the floats of element index, their number in n
+    const float* floats_at(size_t index, size_t& n) const
+    {
+        const char* p = element(index);
+        n = static_cast<size_t>(read<int64_t>(p));
+        return reinterpret_cast<const float*>(p + sizeof(int64_t));
+    }
+
+    private:
+
+    template <class T>
+    static T read(const char* p)
+    {
+        T v;
+        std::memcpy(&v, p, sizeof(T));
+        return v;
+    }
+
+    static std::string read_string(const char*& p, const char* end)
+    {
+        if (p + sizeof(int32_t) > end) throw std::runtime_error("unexpected end of property file");
+        int32_t length = read<int32_t>(p);
+        p += sizeof(int32_t);
+        if (length < 0 || p + length > end) throw std::runtime_error("unexpected end of property file");
+        std::string s(p, length);
+        p += length;
+        return s;
+    }
+
+    static int64_t to_int64(const std::string& s)
+    {
+#ifdef _MSC_VER
+        return _strtoi64(s.c_str(), 0, 10);
+#else
+        return std::strtoll(s.c_str(), 0, 10);
+#endif
+    }
+
+    mapped_file                        _file;
+    std::vector<int64_t>               _offsets;
+    std::map<std::string, std::string> _map;
+    int64_t                            _features;
+};
+
+} // namespace imdb
+
+#endif // PROPERTY_FILE_HPP
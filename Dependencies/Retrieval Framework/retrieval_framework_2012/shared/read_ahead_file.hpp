@@ -0,0 +1,356 @@
+#ifndef READ_AHEAD_FILE_HPP
+#define READ_AHEAD_FILE_HPP
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#include <stdint.h>
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <process.h>
+#else
+#include <pthread.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// ----------------------------------------------------------------------------
+// Sequential reader of a file that keeps several large block reads in
+// flight.
+//
+// The descriptor files of compute_descriptors are read front to back a few
+// bytes at a time. Through an ifstream on a spinning disk or NFS that is a
+// series of small synchronous requests, and the device idles while the
+// distances are computed. This reader splits the file into blocks of
+// block_size bytes, which queue_depth I/O threads read ahead with
+// positional reads (pread, ReadFile at an offset): thread t reads blocks
+// t, t + queue_depth, t + 2 * queue_depth, ... into a buffer of its own
+// and waits until the caller has consumed it before reading the next one.
+// While the caller works on block n, blocks n + 1 to n + queue_depth - 1
+// are read, so with a depth of 2 or more the computation on one block
+// overlaps the reading of the next.
+//
+// Like mapped_file.hpp this header does not depend on boost, PDCI
+// includes it too.
+// ----------------------------------------------------------------------------
+
+namespace imdb {
+
+static const size_t read_ahead_default_block_size  = 4 << 20;
+static const size_t read_ahead_default_queue_depth = 4;
+
+class read_ahead_file
+{
+    public:
+
+    read_ahead_file()
+        : _size(0)
+        , _block_size(0)
+        , _stop(false)
+        , _current(0)
+        , _position(0)
+        , _next_block(0)
+        , _holding(false)
+#ifdef _WIN32
+        , _file(INVALID_HANDLE_VALUE)
+#else
+        , _fd(-1)
+#endif
+    {}
+
+    ~read_ahead_file()
+    {
+        close();
+    }
+
+    // block_size is rounded up to whole pages, queue_depth is at least 1
+    void open(const std::string& filename, size_t block_size = read_ahead_default_block_size, size_t queue_depth = read_ahead_default_queue_depth)
+    {
+        close();
+
+#ifdef _WIN32
+        _file = ::CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, 0);
+        if (_file == INVALID_HANDLE_VALUE) throw std::runtime_error("could not open file " + filename);
+
+        LARGE_INTEGER size;
+        if (!::GetFileSizeEx(_file, &size)) { close(); throw std::runtime_error("could not stat file " + filename); }
+        _size = static_cast<uint64_t>(size.QuadPart);
+
+        ::InitializeCriticalSection(&_lock);
+        ::InitializeConditionVariable(&_changed);
+#else
+        _fd = ::open(filename.c_str(), O_RDONLY);
+        if (_fd < 0) throw std::runtime_error("could not open file " + filename);
+
+        struct stat st;
+        if (::fstat(_fd, &st) != 0) { close(); throw std::runtime_error("could not stat file " + filename); }
+        _size = static_cast<uint64_t>(st.st_size);
+
+#ifdef POSIX_FADV_SEQUENTIAL
+        ::posix_fadvise(_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+        pthread_mutex_init(&_lock, 0);
+        pthread_cond_init(&_changed, 0);
+#endif
+
+        _block_size = (std::max<size_t>(block_size, 1) + 4095) / 4096 * 4096;
+        _stop = false;
+        _current = 0;
+        _position = 0;
+        _next_block = 0;
+        _holding = false;
+
+        _slots.resize(std::max<size_t>(queue_depth, 1));
+        for (size_t i = 0; i < _slots.size(); i++)
+        {
+            _slots[i].owner = this;
+            _slots[i].first_block = i;
+            _slots[i].data.resize(_block_size);
+            _slots[i].bytes = 0;
+            _slots[i].ready = false;
+            _slots[i].failed = false;
+        }
+
+        // threads for blocks past the end of the file are not needed
+        const uint64_t num_blocks = (_size + _block_size - 1) / _block_size;
+        for (size_t i = 0; i < _slots.size() && i < num_blocks; i++)
+        {
+#ifdef _WIN32
+            uintptr_t h = _beginthreadex(0, 0, io_main, &_slots[i], 0, 0);
+            if (h == 0) { close(); throw std::runtime_error("could not start the read-ahead of " + filename); }
+            _threads.push_back(reinterpret_cast<HANDLE>(h));
+#else
+            pthread_t t;
+            if (pthread_create(&t, 0, io_main, &_slots[i]) != 0) { close(); throw std::runtime_error("could not start the read-ahead of " + filename); }
+            _threads.push_back(t);
+#endif
+        }
+    }
+
+    void close()
+    {
+        if (is_open())
+        {
+            lock();
+            _stop = true;
+            notify_all();
+            unlock();
+
+            for (size_t i = 0; i < _threads.size(); i++)
+            {
+#ifdef _WIN32
+                ::WaitForSingleObject(_threads[i], INFINITE);
+                ::CloseHandle(_threads[i]);
+#else
+                pthread_join(_threads[i], 0);
+#endif
+            }
+            _threads.clear();
+
+#ifdef _WIN32
+            ::DeleteCriticalSection(&_lock);
+#else
+            pthread_cond_destroy(&_changed);
+            pthread_mutex_destroy(&_lock);
+#endif
+        }
+
+#ifdef _WIN32
+        if (_file != INVALID_HANDLE_VALUE) ::CloseHandle(_file);
+        _file = INVALID_HANDLE_VALUE;
+#else
+        if (_fd >= 0) ::close(_fd);
+        _fd = -1;
+#endif
+        _slots.clear();
+        _size = 0;
+        _holding = false;
+    }
+
+    bool is_open() const { return !_slots.empty(); }
+
+    uint64_t size() const { return _size; }
+
+    size_t block_size() const { return _block_size; }
+
+    size_t queue_depth() const { return _slots.size(); }
+
+    // Copies the next bytes of the file to dst, returns how many there
+    // were (fewer than bytes only at the end of the file).
+    size_t read(void* dst, size_t bytes)
+    {
+        char* out = static_cast<char*>(dst);
+        size_t done = 0;
+        while (done < bytes && available())
+        {
+            const slot& s = _slots[_current];
+            const size_t n = std::min(bytes - done, s.bytes - _position);
+            std::memcpy(out + done, &s.data[_position], n);
+            _position += n;
+            done += n;
+        }
+        return done;
+    }
+
+    // the next byte without consuming it, -1 at the end of the file
+    int peek()
+    {
+        if (!available()) return -1;
+        return static_cast<unsigned char>(_slots[_current].data[_position]);
+    }
+
+    private:
+
+    struct slot
+    {
+        read_ahead_file*  owner;
+        uint64_t          first_block;  // the slot holds the blocks first_block + i * queue_depth
+        std::vector<char> data;
+        size_t            bytes;
+        bool              ready;        // data holds the next of its blocks, not consumed yet
+        bool              failed;
+    };
+
+    // not copyable, the threads point to it
+    read_ahead_file(const read_ahead_file&);
+    read_ahead_file& operator=(const read_ahead_file&);
+
+    // true if the current block has unread bytes, waits for the next block if needed
+    bool available()
+    {
+        if (_holding && _position < _slots[_current].bytes) return true;
+
+        if (_holding)
+        {
+            // hand the consumed buffer back to its thread for the block after the next queue_depth - 1
+            lock();
+            _slots[_current].ready = false;
+            notify_all();
+            unlock();
+            _holding = false;
+        }
+
+        if (!is_open() || _next_block * _block_size >= _size) return false;
+
+        _current = static_cast<size_t>(_next_block % _slots.size());
+        lock();
+        while (!_slots[_current].ready) wait();
+        unlock();
+
+        if (_slots[_current].failed) throw std::runtime_error("could not read ahead, error reading the file");
+
+        _holding = true;
+        _position = 0;
+        _next_block++;
+        return _slots[_current].bytes > 0;
+    }
+
+    // reads bytes at offset into dst, returns false on an error or a short file
+    bool read_at(uint64_t offset, char* dst, size_t bytes)
+    {
+        while (bytes > 0)
+        {
+#ifdef _WIN32
+            OVERLAPPED at;
+            std::memset(&at, 0, sizeof(at));
+            at.Offset = static_cast<DWORD>(offset);
+            at.OffsetHigh = static_cast<DWORD>(offset >> 32);
+            DWORD n = 0;
+            if (!::ReadFile(_file, dst, static_cast<DWORD>(bytes), &n, &at) || n == 0) return false;
+#else
+            ssize_t n = ::pread(_fd, dst, bytes, static_cast<off_t>(offset));
+            if (n <= 0) return false;
+#endif
+            offset += n;
+            dst += n;
+            bytes -= n;
+        }
+        return true;
+    }
+
+    void io(slot& s)
+    {
+        for (uint64_t block = s.first_block; block * _block_size < _size; block += _slots.size())
+        {
+            lock();
+            while (!_stop && s.ready) wait();
+            const bool stop = _stop;
+            unlock();
+            if (stop) return;
+
+            const uint64_t offset = block * _block_size;
+            const size_t bytes = static_cast<size_t>(std::min<uint64_t>(_block_size, _size - offset));
+            const bool ok = read_at(offset, &s.data[0], bytes);
+
+            lock();
+            s.bytes = ok ? bytes : 0;
+            s.failed = !ok;
+            s.ready = true;
+            notify_all();
+            unlock();
+
+            if (!ok) return;
+        }
+    }
+
+#ifdef _WIN32
+    static unsigned __stdcall io_main(void* p)
+#else
+    static void* io_main(void* p)
+#endif
+    {
+        slot* s = static_cast<slot*>(p);
+        s->owner->io(*s);
+        return 0;
+    }
+
+#ifdef _WIN32
+    void lock() { ::EnterCriticalSection(&_lock); }
+    void unlock() { ::LeaveCriticalSection(&_lock); }
+    void wait() { ::SleepConditionVariableCS(&_changed, &_lock, INFINITE); }
+    void notify_all() { ::WakeAllConditionVariable(&_changed); }
+#else
+    void lock() { pthread_mutex_lock(&_lock); }
+    void unlock() { pthread_mutex_unlock(&_lock); }
+    void wait() { pthread_cond_wait(&_changed, &_lock); }
+    void notify_all() { pthread_cond_broadcast(&_changed); }
+#endif
+
+    uint64_t          _size;
+    size_t            _block_size;
+    std::vector<slot> _slots;
+    bool              _stop;
+
+    // consumer side
+    size_t            _current;     // slot of the block being consumed
+    size_t            _position;    // in that block
+    uint64_t          _next_block;
+    bool              _holding;     // the caller holds _slots[_current]
+
+#ifdef _WIN32
+    HANDLE             _file;
+    CRITICAL_SECTION   _lock;
+    CONDITION_VARIABLE _changed;
+    std::vector<HANDLE> _threads;
+#else
+    int                _fd;
+    pthread_mutex_t    _lock;
+    pthread_cond_t     _changed;
+    std::vector<pthread_t> _threads;
+#endif
+};
+
+} // namespace imdb
+
+#endif // READ_AHEAD_FILE_HPP
@@ -0,0 +1,355 @@
+#ifndef SEARCH_PROTOCOL_HPP
+#define SEARCH_PROTOCOL_HPP
+
+#include <string>
+#include <vector>
+#include <cstring>
+#include <stdexcept>
+
+#include <stdint.h>
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <winsock2.h>
+#ifdef _MSC_VER
+#pragma comment(lib, "ws2_32.lib")
+#endif
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+// ----------------------------------------------------------------------------
+// Protocol between the resident gist search server (gistserver) and its
+// clients (PDCI), over a local (unix domain) stream socket.
+//
+// A client connects, sends one request and reads the response:
+//
+//   request    search_request_header
+//              gist query:  float[record_floats] packed query record (see
+//                           gist_db.hpp), float[num_tiles] weight per tile
+//              image query: image path, mask path (image_path_bytes and
+//                           mask_path_bytes chars, not terminated), read by
+//                           the server, so they have to be valid there
+//   response   search_response_header
+//              status ok:   count times search_result_entry followed by
+//                           name_bytes chars of the filename (as stored in
+//                           the filelist), nearest first
+//              otherwise:   message_bytes chars of an error message
+//
+// All values are in host byte order, client and server run on the same
+// machine. On Windows this needs AF_UNIX support (Windows 10 1803 or later).
+// ----------------------------------------------------------------------------
+
+namespace imdb {
+
+static const char     search_request_magic[4]  = { 'G', 'S', 'R', 'Q' };
+static const char     search_response_magic[4] = { 'G', 'S', 'R', 'S' };
+static const uint32_t search_protocol_version  = 1;
+
+enum search_query_type
+{
+    search_query_gist  = 0,
+    search_query_image = 1
+};
+
+enum search_status
+{
+    search_ok    = 0,
+    search_error = 1
+};
+
+struct search_request_header
+{
+    char     magic[4];
+    uint32_t version;
+    uint32_t type;
+    uint32_t k;                 // number of results wanted
+    uint32_t record_floats;     // gist query
+    uint32_t num_tiles;
+    uint32_t image_path_bytes;  // image query
+    uint32_t mask_path_bytes;
+};
+
+struct search_response_header
+{
+    char     magic[4];
+    uint32_t version;
+    uint32_t status;
+    uint32_t count;
+    uint32_t message_bytes;
+};
+
+struct search_result_entry
+{
+    float    distance;
+    uint32_t name_bytes;
+    int64_t  id;                // index of the image in the filelist
+};
+
+struct search_result
+{
+    float       distance;
+    int64_t     id;
+    std::string name;
+};
+
+namespace detail {
+
+#ifdef _WIN32
+typedef SOCKET socket_handle;
+static const socket_handle invalid_socket_handle = INVALID_SOCKET;
+
+// as in afunix.h, which older SDKs do not have
+struct sockaddr_local
+{
+    ADDRESS_FAMILY sun_family;
+    char           sun_path[108];
+};
+
+inline void close_socket_handle(socket_handle s) { closesocket(s); }
+
+inline void init_sockets()
+{
+    struct wsa_init
+    {
+        wsa_init() { WSADATA data; WSAStartup(MAKEWORD(2, 2), &data); }
+        ~wsa_init() { WSACleanup(); }
+    };
+    static wsa_init init;
+}
+#else
+typedef int socket_handle;
+static const socket_handle invalid_socket_handle = -1;
+typedef sockaddr_un sockaddr_local;
+
+inline void close_socket_handle(socket_handle s) { ::close(s); }
+
+inline void init_sockets() {}
+#endif
+
+inline sockaddr_local local_address(const std::string& path)
+{
+    sockaddr_local address;
+    std::memset(&address, 0, sizeof(address));
+    if (path.size() >= sizeof(address.sun_path)) throw std::runtime_error("socket path too long: " + path);
+
+    address.sun_family = AF_UNIX;
+    std::memcpy(address.sun_path, path.c_str(), path.size());
+    return address;
+}
+
+} // namespace detail
+
+// Blocking local stream socket, owned (closed on destruction).
+class local_socket
+{
+    public:
+
+    local_socket() : _handle(detail::invalid_socket_handle) {}
+
+    ~local_socket() { close(); }
+
+    bool is_open() const { return _handle != detail::invalid_socket_handle; }
+
+    void close()
+    {
+        if (is_open()) detail::close_socket_handle(_handle);
+        _handle = detail::invalid_socket_handle;
+    }
+
+    void connect(const std::string& path)
+    {
+        open();
+        detail::sockaddr_local address = detail::local_address(path);
+        if (::connect(_handle, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0)
+        {
+            close();
+            throw std::runtime_error("could not connect to " + path);
+        }
+    }
+
+    // binds to path (replacing a stale socket file) and listens on it
+    void listen(const std::string& path)
+    {
+        open();
+#ifdef _WIN32
+        DeleteFileA(path.c_str());
+#else
+        unlink(path.c_str());
+#endif
+        detail::sockaddr_local address = detail::local_address(path);
+        if (::bind(_handle, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0
+         || ::listen(_handle, 16) != 0)
+        {
+            close();
+            throw std::runtime_error("could not listen on " + path);
+        }
+    }
+
+    // waits for the next connection of a listening socket
+    void accept(local_socket& client)
+    {
+        client.close();
+        client._handle = ::accept(_handle, 0, 0);
+        if (!client.is_open()) throw std::runtime_error("accept failed");
+    }
+
+    void write_all(const void* data, size_t size)
+    {
+        const char* p = static_cast<const char*>(data);
+        while (size > 0)
+        {
+            int flags = 0;
+#ifdef MSG_NOSIGNAL
+            flags = MSG_NOSIGNAL;
+#endif
+            const int n = static_cast<int>(::send(_handle, p, static_cast<int>(size < 65536 ? size : 65536), flags));
+            if (n <= 0) throw std::runtime_error("connection lost while writing");
+            p += n;
+            size -= n;
+        }
+    }
+
+    void read_all(void* data, size_t size)
+    {
+        char* p = static_cast<char*>(data);
+        while (size > 0)
+        {
+            const int n = static_cast<int>(::recv(_handle, p, static_cast<int>(size < 65536 ? size : 65536), 0));
+            if (n <= 0) throw std::runtime_error("connection lost while reading");
+            p += n;
+            size -= n;
+        }
+    }
+
+    private:
+
+    void open()
+    {
+        detail::init_sockets();
+        close();
+        _handle = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        if (!is_open()) throw std::runtime_error("could not create a local socket");
+    }
+
+    local_socket(const local_socket&);
+    local_socket& operator=(const local_socket&);
+
+    detail::socket_handle _handle;
+};
+
+inline search_request_header make_search_request(search_query_type type, uint32_t k)
+{
+    search_request_header header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, search_request_magic, sizeof(header.magic));
+    header.version = search_protocol_version;
+    header.type = type;
+    header.k = k;
+    return header;
+}
+
+// reads the response to a request, throws with the server's message on errors
+inline std::vector<search_result> read_search_response(local_socket& s)
+{
+    search_response_header header;
+    s.read_all(&header, sizeof(header));
+    if (std::memcmp(header.magic, search_response_magic, sizeof(header.magic)) != 0 || header.version != search_protocol_version)
+    {
+        throw std::runtime_error("unexpected response of the search server");
+    }
+
+    if (header.status != search_ok)
+    {
+        std::string message(header.message_bytes, '\0');
+        if (!message.empty()) s.read_all(&message[0], message.size());
+        throw std::runtime_error("search server: " + message);
+    }
+
+    std::vector<search_result> results(header.count);
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        search_result_entry entry;
+        s.read_all(&entry, sizeof(entry));
+        results[i].distance = entry.distance;
+        results[i].id = entry.id;
+        results[i].name.resize(entry.name_bytes);
+        if (entry.name_bytes > 0) s.read_all(&results[i].name[0], entry.name_bytes);
+    }
+    return results;
+}
+
+// client side: sends a gist query and reads the ranked results
+inline std::vector<search_result> search_gist(local_socket& s, const float* record, uint32_t record_floats,
+                                              const float* tile_weights, uint32_t num_tiles, uint32_t k)
+{
+    search_request_header header = make_search_request(search_query_gist, k);
+    header.record_floats = record_floats;
+    header.num_tiles = num_tiles;
+
+    s.write_all(&header, sizeof(header));
+    s.write_all(record, record_floats * sizeof(float));
+    s.write_all(tile_weights, num_tiles * sizeof(float));
+    return read_search_response(s);
+}
+
+// client side: sends an image query and reads the ranked results
+inline std::vector<search_result> search_image(local_socket& s, const std::string& image, const std::string& mask, uint32_t k)
+{
+    search_request_header header = make_search_request(search_query_image, k);
+    header.image_path_bytes = static_cast<uint32_t>(image.size());
+    header.mask_path_bytes = static_cast<uint32_t>(mask.size());
+
+    s.write_all(&header, sizeof(header));
+    s.write_all(image.data(), image.size());
+    s.write_all(mask.data(), mask.size());
+    return read_search_response(s);
+}
+
+// server side: writes the results of a request
+inline void write_search_response(local_socket& s, const std::vector<search_result>& results)
+{
+    search_response_header header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, search_response_magic, sizeof(header.magic));
+    header.version = search_protocol_version;
+    header.status = search_ok;
+    header.count = static_cast<uint32_t>(results.size());
+    s.write_all(&header, sizeof(header));
+
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        search_result_entry entry;
+        std::memset(&entry, 0, sizeof(entry));
+        entry.distance = results[i].distance;
+        entry.name_bytes = static_cast<uint32_t>(results[i].name.size());
+        entry.id = results[i].id;
+        s.write_all(&entry, sizeof(entry));
+        s.write_all(results[i].name.data(), results[i].name.size());
+    }
+}
+
+// server side: reports a failed request
+inline void write_search_error(local_socket& s, const std::string& message)
+{
+    search_response_header header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, search_response_magic, sizeof(header.magic));
+    header.version = search_protocol_version;
+    header.status = search_error;
+    header.message_bytes = static_cast<uint32_t>(message.size());
+    s.write_all(&header, sizeof(header));
+    s.write_all(message.data(), message.size());
+}
+
+} // namespace imdb
+
+#endif // SEARCH_PROTOCOL_HPP
@@ -0,0 +1,78 @@
+#ifndef STRING_TABLE_HPP
+#define STRING_TABLE_HPP
+
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+// ----------------------------------------------------------------------------
+// Append-only list of strings, stored as one blob of characters and an
+// offset per string.
+//
+// Scans that read a filelist sequentially keep the filenames here and
+// refer to them by index. Adding a name costs no allocation of its own
+// (the two vectors grow geometrically), and a std::string is only built
+// for the few names that are looked up at the end.
+// ----------------------------------------------------------------------------
+
+namespace imdb {
+
+class string_table
+{
+    public:
+
+    string_table()
+    {
+        _offsets.push_back(0);
+    }
+
+    size_t size() const { return _offsets.size() - 1; }
+
+    bool empty() const { return size() == 0; }
+
+    // characters of all strings together
+    size_t bytes() const { return _blob.size(); }
+
+    void reserve(size_t num_strings, size_t num_bytes)
+    {
+        _offsets.reserve(num_strings + 1);
+        _blob.reserve(num_bytes);
+    }
+
+    // returns the index of the new string
+    size_t push_back(const char* s, size_t length)
+    {
+        _blob.insert(_blob.end(), s, s + length);
+        _offsets.push_back(_blob.size());
+        return size() - 1;
+    }
+
+    size_t push_back(const std::string& s) { return push_back(s.data(), s.size()); }
+
+    size_t length(size_t index) const { return static_cast<size_t>(_offsets[index + 1] - _offsets[index]); }
+
+    // not terminated, see length()
+    const char* data(size_t index) const { return _blob.empty() ? 0 : &_blob[0] + _offsets[index]; }
+
+    std::string string_at(size_t index) const
+    {
+        const size_t n = length(index);
+        return n > 0 ? std::string(data(index), n) : std::string();
+    }
+
+    void clear()
+    {
+        _blob.clear();
+        _offsets.resize(1);
+    }
+
+    private:
+
+    std::vector<char>     _blob;
+    std::vector<uint64_t> _offsets;   // size() + 1, string i is [_offsets[i], _offsets[i + 1])
+};
+
+} // namespace imdb
+
+#endif // STRING_TABLE_HPP
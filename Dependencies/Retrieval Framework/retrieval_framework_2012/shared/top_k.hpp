@@ -0,0 +1,79 @@
+#ifndef TOP_K_HPP
+#define TOP_K_HPP
+
+#include <vector>
+#include <utility>
+#include <algorithm>
+
+// ----------------------------------------------------------------------------
+// Keeps the k smallest (distance, id) pairs pushed into it.
+//
+// A max-heap of fixed capacity: the root is the worst of the current
+// candidates, so rejecting a candidate costs a single compare and
+// accepting one O(log k). Scans keep one per thread and merge them.
+// ----------------------------------------------------------------------------
+
+namespace imdb {
+
+template <class Dist, class Id>
+class top_k
+{
+    public:
+
+    typedef std::pair<Dist, Id> value_type;
+
+    explicit top_k(size_t k = 0) : _k(k)
+    {
+        _heap.reserve(k);
+    }
+
+    size_t capacity() const { return _k; }
+    size_t size() const { return _heap.size(); }
+    bool full() const { return _heap.size() >= _k; }
+
+    // largest distance that is kept, only meaningful if full()
+    Dist worst() const { return _heap.front().first; }
+
+    // true if a candidate at this distance would be kept
+    bool accepts(Dist d) const { return _k > 0 && (!full() || d < worst()); }
+
+    void push(Dist d, Id id)
+    {
+        if (!accepts(d)) return;
+
+        if (full())
+        {
+            std::pop_heap(_heap.begin(), _heap.end());
+            _heap.back() = value_type(d, id);
+        }
+        else
+        {
+            _heap.push_back(value_type(d, id));
+        }
+        std::push_heap(_heap.begin(), _heap.end());
+    }
+
+    void merge(const top_k& other)
+    {
+        for (size_t i = 0; i < other._heap.size(); i++) push(other._heap[i].first, other._heap[i].second);
+    }
+
+    void clear() { _heap.clear(); }
+
+    // the kept pairs, nearest first
+    std::vector<value_type> sorted() const
+    {
+        std::vector<value_type> result(_heap);
+        std::sort_heap(result.begin(), result.end());
+        return result;
+    }
+
+    private:
+
+    size_t                  _k;
+    std::vector<value_type> _heap;
+};
+
+} // namespace imdb
+
+#endif // TOP_K_HPP
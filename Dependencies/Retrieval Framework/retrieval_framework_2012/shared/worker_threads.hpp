@@ -0,0 +1,121 @@
+#ifndef WORKER_THREADS_HPP
+#define WORKER_THREADS_HPP
+
+#include <vector>
+#include <stdexcept>
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN // no winsock.h, it clashes with winsock2.h (search_protocol.hpp)
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <process.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+// ----------------------------------------------------------------------------
+// Minimal fork/join helper on native threads.
+//
+// The retrieval framework tools use boost::thread; this header is for the
+// scene completion project (PDCI), which is built with Visual Studio 2010
+// (no std::thread) and does not link boost.
+// ----------------------------------------------------------------------------
+
+namespace imdb {
+
+// number of logical processors, at least 1
+inline size_t hardware_threads()
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors > 0 ? info.dwNumberOfProcessors : 1;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? static_cast<size_t>(n) : 1;
+#endif
+}
+
+namespace detail {
+
+template <class Task>
+struct worker_arg
+{
+    Task*  task;
+    size_t index;
+};
+
+template <class Task>
+#ifdef _WIN32
+unsigned __stdcall worker_main(void* p)
+#else
+void* worker_main(void* p)
+#endif
+{
+    worker_arg<Task>* arg = static_cast<worker_arg<Task>*>(p);
+    (*arg->task)(arg->index);
+    return 0;
+}
+
+} // namespace detail
+
+// Calls task(i) for i in [0, num_threads), each on a thread of its own,
+// and returns when all of them have finished. task(0) runs on the calling
+// thread. The task must not throw.
+template <class Task>
+void run_worker_threads(size_t num_threads, Task& task)
+{
+    if (num_threads <= 1)
+    {
+        task(0);
+        return;
+    }
+
+    std::vector<detail::worker_arg<Task> > args(num_threads);
+    for (size_t i = 0; i < num_threads; i++)
+    {
+        args[i].task = &task;
+        args[i].index = i;
+    }
+
+#ifdef _WIN32
+    std::vector<HANDLE> threads;
+    for (size_t i = 1; i < num_threads; i++)
+    {
+        uintptr_t h = _beginthreadex(0, 0, detail::worker_main<Task>, &args[i], 0, 0);
+        if (h == 0) break;
+        threads.push_back(reinterpret_cast<HANDLE>(h));
+    }
+#else
+    std::vector<pthread_t> threads;
+    for (size_t i = 1; i < num_threads; i++)
+    {
+        pthread_t t;
+        if (pthread_create(&t, 0, detail::worker_main<Task>, &args[i]) != 0) break;
+        threads.push_back(t);
+    }
+#endif
+
+    // threads that could not be started are run here
+    for (size_t i = threads.size() + 1; i < num_threads; i++) task(i);
+    task(0);
+
+    for (size_t i = 0; i < threads.size(); i++)
+    {
+#ifdef _WIN32
+        WaitForSingleObject(threads[i], INFINITE);
+        CloseHandle(threads[i]);
+#else
+        pthread_join(threads[i], 0);
+#endif
+    }
+}
+
+} // namespace imdb
+
+#endif // WORKER_THREADS_HPP